@@ -0,0 +1,272 @@
+#pragma once
+
+/* Minimal HTTP/1.1 server on the loopback interface, for the benchmarks.
+ *
+ * It runs inside the benchmark process, so the results don't depend on an
+ * external server. Each server thread has its own listening socket
+ * (SO_REUSEPORT) and epoll instance, and serves its connections with
+ * non-blocking I/O and keep-alive.
+ *
+ * Every request is answered with "200 OK" and a fixed body. Request bodies
+ * are read and discarded. Linux only.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class LoopbackServer {
+public:
+    explicit LoopbackServer(const size_t bodySize = 128,
+                            const unsigned threads = 2)
+    : response_{MakeResponse(bodySize)}
+    {
+        stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (stop_fd_ < 0) {
+            throw std::runtime_error("eventfd failed");
+        }
+
+        for(unsigned i = 0; i < std::max(1u, threads); ++i) {
+            auto worker = std::make_unique<Worker>();
+            worker->listen_fd = Listen();
+            worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            Add(worker->epoll_fd, worker->listen_fd, EPOLLIN);
+            Add(worker->epoll_fd, stop_fd_, EPOLLIN);
+            workers_.push_back(std::move(worker));
+        }
+
+        for(auto& worker : workers_) {
+            auto w = worker.get();
+            worker->thread = std::thread([this, w] { Serve(*w); });
+        }
+    }
+
+    ~LoopbackServer() {
+        const uint64_t one = 1;
+        if (write(stop_fd_, &one, sizeof(one)) != sizeof(one)) {
+            std::abort();
+        }
+        for(auto& worker : workers_) {
+            worker->thread.join();
+            for(auto& it : worker->connections) {
+                close(it.first);
+            }
+            close(worker->epoll_fd);
+            close(worker->listen_fd);
+        }
+        close(stop_fd_);
+    }
+
+    uint16_t Port() const noexcept { return port_; }
+
+    std::string Url(const std::string& path = "/") const {
+        return "http://127.0.0.1:" + std::to_string(port_) + path;
+    }
+
+    /* Number of requests answered */
+    uint64_t GetRequests() const noexcept {
+        uint64_t total = 0;
+        for(const auto& worker : workers_) {
+            total += worker->requests.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /* CPU time used by the server threads */
+    std::chrono::nanoseconds GetCpuTime() const {
+        std::chrono::nanoseconds total{0};
+        for(const auto& worker : workers_) {
+            clockid_t clock = {};
+            timespec ts = {};
+            if (!pthread_getcpuclockid(worker->thread.native_handle(), &clock)
+                && !clock_gettime(clock, &ts)) {
+                total += std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+            }
+        }
+        return total;
+    }
+
+private:
+    struct Connection {
+        std::string in;
+        std::string out;
+        size_t out_pos = 0;
+    };
+
+    struct Worker {
+        int listen_fd = -1;
+        int epoll_fd = -1;
+        std::thread thread;
+        std::unordered_map<int, Connection> connections;
+        std::atomic<uint64_t> requests{0};
+    };
+
+    static std::string MakeResponse(const size_t bodySize) {
+        std::string body(bodySize, 'x');
+        return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: "
+            + std::to_string(body.size()) + "\r\n\r\n" + body;
+    }
+
+    static void Add(const int epfd, const int fd, const uint32_t events) {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            throw std::runtime_error(std::string{"epoll_ctl: "} + strerror(errno));
+        }
+    }
+
+    int Listen() {
+        const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("socket failed");
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port_);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))
+            || listen(fd, 4096)) {
+            throw std::runtime_error(std::string{"bind/listen: "} + strerror(errno));
+        }
+        if (!port_) {
+            socklen_t len = sizeof(addr);
+            getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len);
+            port_ = ntohs(addr.sin_port);
+        }
+        return fd;
+    }
+
+    void Serve(Worker& w) {
+        std::vector<epoll_event> events(256);
+        while(true) {
+            const auto num = epoll_wait(w.epoll_fd, events.data(), static_cast<int>(events.size()), -1);
+            if (num < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            for(int i = 0; i < num; ++i) {
+                const auto fd = events[static_cast<size_t>(i)].data.fd;
+                if (fd == stop_fd_) {
+                    return;
+                }
+                if (fd == w.listen_fd) {
+                    Accept(w);
+                    continue;
+                }
+                if (!Handle(w, fd)) {
+                    w.connections.erase(fd);
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    void Accept(Worker& w) {
+        while(true) {
+            const int fd = accept4(w.listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            w.connections[fd];
+            Add(w.epoll_fd, fd, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP);
+        }
+    }
+
+    // Returns false when the connection must be closed
+    bool Handle(Worker& w, const int fd) {
+        auto& conn = w.connections[fd];
+        char buffer[16 * 1024];
+        while(true) {
+            const auto bytes = read(fd, buffer, sizeof(buffer));
+            if (bytes == 0) {
+                return false;
+            }
+            if (bytes < 0) {
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                    break;
+                }
+                return false;
+            }
+            conn.in.append(buffer, static_cast<size_t>(bytes));
+        }
+
+        // Answer all the complete requests in the buffer
+        size_t pos = 0;
+        while(true) {
+            const auto end = conn.in.find("\r\n\r\n", pos);
+            if (end == std::string::npos) {
+                break;
+            }
+            size_t length = 0;
+            const auto cl = FindHeader(conn.in, pos, end, "content-length:");
+            if (cl != std::string::npos) {
+                length = strtoul(conn.in.c_str() + cl, nullptr, 10);
+            }
+            if (conn.in.size() < end + 4 + length) {
+                break;
+            }
+            pos = end + 4 + length;
+            conn.out += response_;
+            w.requests.fetch_add(1, std::memory_order_relaxed);
+        }
+        conn.in.erase(0, pos);
+
+        while(conn.out_pos < conn.out.size()) {
+            const auto bytes = write(fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos);
+            if (bytes < 0) {
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                    return true;
+                }
+                return false;
+            }
+            conn.out_pos += static_cast<size_t>(bytes);
+        }
+        conn.out.clear();
+        conn.out_pos = 0;
+        return true;
+    }
+
+    // Case-insensitive search for a header. Returns the position of the value.
+    static size_t FindHeader(const std::string& data, const size_t begin, const size_t end, const char *name) {
+        const auto len = strlen(name);
+        for(auto pos = data.find("\r\n", begin); (pos != std::string::npos) && (pos < end);
+            pos = data.find("\r\n", pos + 2)) {
+            if (strncasecmp(data.c_str() + pos + 2, name, len) == 0) {
+                return pos + 2 + len;
+            }
+        }
+        return std::string::npos;
+    }
+
+    const std::string response_;
+    uint16_t port_ = 0;
+    int stop_fd_ = -1;
+    std::vector<std::unique_ptr<Worker>> workers_;
+};
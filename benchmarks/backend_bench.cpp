@@ -0,0 +1,182 @@
+/* Benchmark for the worker-thread backends.
+ *
+ * Sends small GET requests to a loopback HTTP server with a fixed
+ * number of requests in flight, and compares how the select(), epoll
+ * and io_uring backends cope as the concurrency grows. The server runs
+ * in a child process, so the CPU time reported is the client's own.
+ *
+ * The select() backend can't watch sockets above FD_SETSIZE, so it is
+ * skipped at the concurrency levels where that would happen.
+ *
+ * Usage: backend_bench [requests-per-level]
+ */
+
+#define RESTINCURL_ENABLE_ASYNC 1
+#define RESTINCURL_MAX_CONNECTIONS 1024L
+#ifdef __linux__
+#   define RESTINCURL_WITH_IO_URING 1
+#endif
+
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iomanip>
+
+#include "restincurl/restincurl.h"
+
+#include "LoopbackServer.h"
+
+using namespace std;
+using namespace restincurl;
+
+namespace {
+
+const char *name(const WorkerBackend backend) {
+    switch(backend) {
+        case WorkerBackend::SELECT:
+            return "select";
+        case WorkerBackend::EPOLL:
+            return "epoll";
+        case WorkerBackend::IO_URING:
+            return "io_uring";
+    }
+    return "?";
+}
+
+double cpuSeconds() {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+// Keeps `concurrency` requests in flight until `total` are done
+class Load {
+public:
+    Load(Client& client, string url, const size_t total)
+    : client_{client}, url_{move(url)}, total_{total} {}
+
+    void Run(const size_t concurrency) {
+        started_ = min(concurrency, total_);
+        for(size_t i = 0; i < started_; ++i) {
+            Send();
+        }
+        done_.get_future().wait();
+    }
+
+    size_t GetErrors() const noexcept { return errors_; }
+
+private:
+    void Send() {
+        client_.Build()->Get(url_)
+            .WithCompletion([this](const Result& result) {
+                if (result.http_response_code != 200) {
+                    ++errors_;
+                }
+                // Called from the worker-thread only
+                if (++completed_ == total_) {
+                    done_.set_value();
+                } else if (started_ < total_) {
+                    ++started_;
+                    Send();
+                }
+            })
+            .Execute();
+    }
+
+    Client& client_;
+    const string url_;
+    const size_t total_;
+    size_t started_ = 0;
+    size_t completed_ = 0;
+    atomic<size_t> errors_{0};
+    promise<void> done_;
+};
+
+void run(const WorkerBackend backend, const string& url, const size_t concurrency, const size_t requests) {
+    cout << left << setw(10) << name(backend) << right << setw(6) << concurrency;
+
+    // Each request needs a socket in the client
+    if ((backend == WorkerBackend::SELECT) && (concurrency + 64 > FD_SETSIZE)) {
+        cout << setw(14) << "n/a" << endl;
+        return;
+    }
+
+    Client client;
+    client.SetWorkerBackend(backend);
+
+    // Open the connections first, so that the measurement is about steady-state traffic
+    Load warmup{client, url, concurrency};
+    warmup.Run(concurrency);
+
+    Load load{client, url, requests};
+    const auto cpu = cpuSeconds();
+    const auto start = chrono::steady_clock::now();
+    load.Run(concurrency);
+    const auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    const auto used = cpuSeconds() - cpu;
+
+    cout << setw(14) << fixed << setprecision(0) << (requests / elapsed) << " req/s"
+         << setw(10) << setprecision(1) << (used * 1000000.0 / requests) << " us cpu/req";
+    if (client.GetWorkerBackend() != backend) {
+        cout << "  (fell back to " << name(client.GetWorkerBackend()) << ")";
+    }
+    if (load.GetErrors()) {
+        cout << "  " << load.GetErrors() << " errors";
+    }
+    cout << endl;
+
+    // The last completion may still be returning
+    client.Close();
+    client.WaitForFinish();
+}
+
+} // anon ns
+
+int main(int argc, char *argv[]) {
+    const size_t requests = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 20000;
+
+    rlimit limit = {};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    // Start the server in a child process, before any threads exist
+    int fds[2] = {};
+    if (pipe(fds)) {
+        return 1;
+    }
+    const auto child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        LoopbackServer server{128, 2};
+        const auto port = server.Port();
+        if (write(fds[1], &port, sizeof(port)) != sizeof(port)) {
+            _exit(1);
+        }
+        pause();
+        _exit(0);
+    }
+    close(fds[1]);
+    uint16_t port = 0;
+    if (read(fds[0], &port, sizeof(port)) != sizeof(port)) {
+        return 1;
+    }
+    const auto url = "http://127.0.0.1:" + to_string(port) + "/";
+
+    for(const size_t concurrency : {16, 128, 512, 1000}) {
+        for(const auto backend : {WorkerBackend::SELECT, WorkerBackend::EPOLL, WorkerBackend::IO_URING}) {
+            run(backend, url, concurrency, requests);
+        }
+    }
+
+    kill(child, SIGTERM);
+    waitpid(child, nullptr, 0);
+    return 0;
+}
@@ -0,0 +1,107 @@
+
+/* Benchmark for request-body compression.
+ *
+ * Drives BodyCompressor the same way libcurl does when it sends a
+ * request body, and reports the bytes that would go on the wire, and
+ * the CPU time spent, for each encoding and compression level.
+ *
+ * No network traffic is involved.
+ *
+ * Usage: compression_bench [payload-size-in-mb]
+ */
+
+#include <time.h>
+
+#include <cstdlib>
+#include <iomanip>
+
+#include "restincurl/restincurl.h"
+
+using namespace std;
+using namespace restincurl;
+
+namespace {
+
+// Something that looks like a batch of JSON records
+string makePayload(const size_t size) {
+    static const char *names[] = {"alpha", "bravo", "charlie", "delta", "echo", "foxtrot"};
+    string payload = "[";
+    payload.reserve(size + 256);
+    for(size_t i = 0; payload.size() < size; ++i) {
+        payload += "{\"id\":" + to_string(i)
+            + ",\"name\":\"" + names[i % 6] + "\""
+            + ",\"value\":" + to_string((i * 7919) % 100003)
+            + ",\"tags\":[\"" + names[(i / 6) % 6] + "\",\"" + names[(i / 36) % 6] + "\"]},";
+    }
+    payload.back() = ']';
+    return payload;
+}
+
+double cpuSeconds() {
+    timespec ts = {};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+void run(const string& payload, const Encoding encoding, const int level) {
+    OutDataHandler<string> source(payload);
+    BodyCompressor compressor(encoding, level, source.read_callback, &source);
+
+    // libcurl's default upload buffer size
+    std::vector<char> buffer(64 * 1024);
+
+    const auto start = cpuSeconds();
+    size_t bytes = {};
+    do {
+        bytes = BodyCompressor::read_callback(buffer.data(), 1, buffer.size(), &compressor);
+        if (bytes == CURL_READFUNC_ABORT) {
+            throw runtime_error("Compression failed");
+        }
+    } while (bytes);
+    const auto elapsed = cpuSeconds() - start;
+
+    const auto mb = payload.size() / (1024.0 * 1024.0);
+    cout << left << setw(8) << BodyCompressor::GetName(encoding)
+         << right << setw(6) << level
+         << setw(14) << compressor.GetBytesIn()
+         << setw(14) << compressor.GetBytesOut()
+         << setw(10) << fixed << setprecision(2)
+         << (static_cast<double>(compressor.GetBytesIn()) / compressor.GetBytesOut())
+         << setw(12) << setprecision(1) << (elapsed * 1000.0)
+         << setw(12) << (mb / elapsed)
+         << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    const size_t mb = argc > 1 ? strtoul(argv[1], nullptr, 10) : 16;
+    const auto payload = makePayload(mb * 1024 * 1024);
+
+    cout << left << setw(8) << "encoding"
+         << right << setw(6) << "level"
+         << setw(14) << "bytes-in"
+         << setw(14) << "wire-bytes"
+         << setw(10) << "ratio"
+         << setw(12) << "cpu-ms"
+         << setw(12) << "MB/s"
+         << endl;
+
+    if (BodyCompressor::IsSupported(Encoding::GZIP)) {
+        for(int level = 1; level <= 9; ++level) {
+            run(payload, Encoding::GZIP, level);
+        }
+    } else {
+        cout << "gzip: not enabled (define RESTINCURL_WITH_ZLIB)" << endl;
+    }
+
+    if (BodyCompressor::IsSupported(Encoding::ZSTD)) {
+        for(const auto level : {1, 3, 6, 9, 12, 15, 19}) {
+            run(payload, Encoding::ZSTD, level);
+        }
+    } else {
+        cout << "zstd: not enabled (define RESTINCURL_WITH_ZSTD)" << endl;
+    }
+
+    return 0;
+}
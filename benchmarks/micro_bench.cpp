@@ -0,0 +1,226 @@
+/* Microbenchmarks for the per-byte and per-request hot paths.
+ *
+ * Measures the data handlers that libcurl calls for each chunk of a body,
+ * building requests, and delivering the Result to the completion. Reports
+ * the time and the number of heap allocations per operation: ours, with
+ * operator new, and libcurl's, with malloc() (counted through
+ * curl_global_init_mem()).
+ *
+ * The data handler benchmarks receive or send a 1 MiB body in chunks, and
+ * start on a new container for each body, as a new request would. One
+ * operation is one call to the handler.
+ *
+ * No network traffic is involved. Logging is disabled, as it allocates.
+ *
+ * Usage: micro_bench [iterations]
+ */
+
+#define RESTINCURL_ENABLE_ASYNC 1
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <new>
+#include <vector>
+
+#include "restincurl/restincurl.h"
+
+using namespace std;
+using namespace restincurl;
+
+namespace {
+atomic<size_t> num_allocations{0};
+atomic<size_t> num_curl_allocations{0};
+
+void *curlMalloc(size_t size) {
+    num_curl_allocations.fetch_add(1, memory_order_relaxed);
+    return malloc(size);
+}
+
+void *curlRealloc(void *ptr, size_t size) {
+    num_curl_allocations.fetch_add(1, memory_order_relaxed);
+    return realloc(ptr, size);
+}
+
+char *curlStrdup(const char *str) {
+    num_curl_allocations.fetch_add(1, memory_order_relaxed);
+    return strdup(str);
+}
+
+void *curlCalloc(size_t nmemb, size_t size) {
+    num_curl_allocations.fetch_add(1, memory_order_relaxed);
+    return calloc(nmemb, size);
+}
+}
+
+void *operator new(size_t size) {
+    num_allocations.fetch_add(1, memory_order_relaxed);
+    if (auto ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw bad_alloc{};
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+namespace {
+
+constexpr size_t body_size = 1024 * 1024;
+
+// Keeps the compiler from optimizing away the work
+volatile size_t sink = 0;
+
+template <typename T>
+void run(const string& name, const size_t iterations, const size_t bytesPerOp, const T& fn) {
+    // Warm up
+    for(size_t i = 0; i < min<size_t>(iterations, 1000); ++i) {
+        fn(i);
+    }
+
+    const auto allocations = num_allocations.load();
+    const auto curl_allocations = num_curl_allocations.load();
+    const auto start = chrono::steady_clock::now();
+    for(size_t i = 0; i < iterations; ++i) {
+        fn(i);
+    }
+    const auto elapsed = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - start).count();
+    const auto allocated = num_allocations.load() - allocations;
+    const auto curl_allocated = num_curl_allocations.load() - curl_allocations;
+
+    const auto ns = static_cast<double>(elapsed) / iterations;
+    cout << left << setw(34) << name
+         << right << setw(12) << fixed << setprecision(1) << ns << " ns/op"
+         << setw(10) << setprecision(3) << (static_cast<double>(allocated) / iterations) << " new/op"
+         << setw(10) << setprecision(3) << (static_cast<double>(curl_allocated) / iterations) << " malloc/op";
+    if (bytesPerOp) {
+        cout << setw(10) << setprecision(0) << (bytesPerOp * 1000.0 / ns) << " MB/s";
+    }
+    cout << endl;
+}
+
+template <typename T>
+void runWrite(const char *container, const size_t iterations, const size_t chunk) {
+    vector<char> data(chunk, 'x');
+    const auto chunks_per_body = body_size / chunk;
+    T body;
+    InDataHandler<T> handler{body};
+
+    run(string{"InDataHandler<"} + container + "> " + to_string(chunk), iterations, chunk, [&](size_t i) {
+        if (i % chunks_per_body == 0) {
+            sink = sink + body.size();
+            T{}.swap(body);
+        }
+        sink = sink + InDataHandler<T>::write_callback(data.data(), 1, data.size(), &handler);
+    });
+}
+
+void runRead(const size_t iterations, const size_t chunk) {
+    vector<char> buffer(chunk);
+    OutDataHandler<string> handler{string(body_size, 'x')};
+
+    run("OutDataHandler<string> " + to_string(chunk), iterations, chunk, [&](size_t) {
+        auto bytes = OutDataHandler<string>::read_callback(buffer.data(), 1, buffer.size(), &handler);
+        if (!bytes) {
+            // Start over, as for a retry
+            OutDataHandler<string>::seek_callback(&handler, 0, SEEK_SET);
+            bytes = OutDataHandler<string>::read_callback(buffer.data(), 1, buffer.size(), &handler);
+        }
+        sink = sink + bytes;
+    });
+}
+
+} // anon ns
+
+int main(int argc, char *argv[]) {
+    const size_t iterations = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 100000;
+
+    // Before the client initializes libcurl
+    curl_global_init_mem(CURL_GLOBAL_DEFAULT, curlMalloc, free, curlRealloc, curlStrdup, curlCalloc);
+
+    // libcurl's largest chunk, and a small one, to show the cost per call
+    for(const size_t chunk : {static_cast<size_t>(CURL_MAX_WRITE_SIZE), static_cast<size_t>(256)}) {
+        runWrite<string>("string", iterations, chunk);
+        runWrite<vector<char>>("vector", iterations, chunk);
+        runWrite<deque<char>>("deque", iterations, chunk);
+        runRead(iterations, chunk);
+    }
+
+    Client client;
+    const string url = "http://localhost:3001/normal/manyposts";
+
+    run("Build() GET", iterations, 0, [&](size_t) {
+        client.Build()->Get(url).Build();
+    });
+
+    run("Build() GET + 10 Header()", iterations, 0, [&](size_t) {
+        auto builder = client.Build();
+        builder->Get(url)
+            .Header("Accept: application/json")
+            .Header("Accept-Language: en-US")
+            .Header("Cache-Control: no-cache")
+            .Header("User-Agent: restincurl-bench/1.0")
+            .Header("X-Api-Version: 2024-06-01")
+            .Header("X-Client-Id: 6f1c2a3b-7d4e-4f5a-9b8c-0d1e2f3a4b5c")
+            .Header("X-Correlation-Id: 0123456789abcdef")
+            .Header("X-Feature-Flags: a,b,c")
+            .Header("X-Region: eu-north-1")
+            .Header("X-Tenant: benchmark")
+            .Build();
+    });
+
+    run("Build() GET + 10 Option()", iterations, 0, [&](size_t) {
+        auto builder = client.Build();
+        builder->Get(url)
+            .Option(CURLOPT_FOLLOWLOCATION, 1L)
+            .Option(CURLOPT_MAXREDIRS, 5L)
+            .Option(CURLOPT_TIMEOUT_MS, 5000L)
+            .Option(CURLOPT_CONNECTTIMEOUT_MS, 1000L)
+            .Option(CURLOPT_TCP_KEEPALIVE, 1L)
+            .Option(CURLOPT_TCP_NODELAY, 1L)
+            .Option(CURLOPT_NOSIGNAL, 1L)
+            .Option(CURLOPT_SSL_VERIFYPEER, 1L)
+            .Option(CURLOPT_USERAGENT, "restincurl-bench/1.0")
+            .Option(CURLOPT_ACCEPT_ENCODING, "")
+            .Build();
+    });
+
+    run("Build() POST + SendData()", iterations, 0, [&](size_t) {
+        auto builder = client.Build();
+        builder->Post(url)
+            .Header("Content-Type: application/json")
+            .SendData(string{R"({"title":"A post that is too long for the small string optimization"})"})
+            .Build();
+    });
+
+    // Result delivery, as when a transfer is finished
+    size_t calls = 0;
+    Request request;
+    request.Prepare(RequestType::GET, [&calls](const Result& result) {
+        calls += result.body.size() + 1;
+    });
+    request.StoreInDefaultBuffer();
+
+    run("Result delivery, no body", iterations, 0, [&](size_t) {
+        request.Complete(CURLE_OK, CURLMSG_DONE);
+    });
+
+    const string body(1024, 'x');
+    run("Result delivery, 1 KiB body", iterations, 0, [&](size_t) {
+        request.getDefaultInBuffer().assign(body);
+        request.Complete(CURLE_OK, CURLMSG_DONE);
+    });
+
+    sink = sink + calls;
+    curl_global_cleanup();
+    return 0;
+}
@@ -0,0 +1,335 @@
+/* Throughput and latency benchmark.
+ *
+ * Sends GET and POST requests to an HTTP server that runs inside the
+ * benchmark process, on the loopback interface, with 1 to 1024 requests
+ * in flight. Each API is measured:
+ *
+ *   callback   Execute() with a completion callback
+ *   coexecute  co_await CoExecute()
+ *   asio       Client(io_context), when built with RESTINCURL_ENABLE_ASIO
+ *   sync       ExecuteSynchronous(), one thread per request in flight
+ *
+ * For each run it reports the requests per second, the 50th, 99th and
+ * 99.9th percentile latency, the CPU time the client used per request
+ * (the server threads are not counted) and the memory use. The results
+ * are written as JSON to stdout, and progress to stderr.
+ *
+ * Usage: restincurl_bench [requests-per-run] [max-concurrency]
+ */
+
+#define RESTINCURL_ENABLE_ASYNC 1
+#define RESTINCURL_MAX_CONNECTIONS 1024L
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <sstream>
+
+#include "restincurl/restincurl.h"
+
+#include "LoopbackServer.h"
+
+using namespace std;
+using namespace restincurl;
+
+namespace {
+
+using Clock = chrono::steady_clock;
+
+struct Target {
+    string url;
+    bool post = false;
+    string body;
+};
+
+struct Stats {
+    string api;
+    size_t concurrency = 0;
+    size_t requests = 0;
+    size_t errors = 0;
+    double rps = 0;
+    double p50 = 0;
+    double p99 = 0;
+    double p999 = 0;
+    double cpu_us = 0;
+    long rss_kb = 0;
+    long peak_rss_kb = 0;
+};
+
+// The state of one run. Shared with the completions, that may outlive the caller's wait.
+class Run {
+public:
+    explicit Run(const size_t total)
+    : latencies_(total) {}
+
+    // Claims the next request. Returns false when all have been started.
+    bool Next() noexcept {
+        return started_.fetch_add(1, memory_order_relaxed) < latencies_.size();
+    }
+
+    void Record(const Clock::time_point start, const Result& result) {
+        if ((result.error != Error::NONE) || (result.http_response_code != 200)) {
+            errors_.fetch_add(1, memory_order_relaxed);
+        }
+        const auto i = completed_.fetch_add(1);
+        latencies_[i] = chrono::duration<double, micro>(Clock::now() - start).count();
+        if (i + 1 == latencies_.size()) {
+            done_.set_value();
+        }
+    }
+
+    void Wait() {
+        done_.get_future().wait();
+    }
+
+    size_t GetErrors() const noexcept { return errors_; }
+    vector<double>& GetLatencies() noexcept { return latencies_; }
+
+private:
+    vector<double> latencies_;
+    atomic<size_t> started_{0};
+    atomic<size_t> completed_{0};
+    atomic<size_t> errors_{0};
+    promise<void> done_;
+};
+
+unique_ptr<RequestBuilder> prepare(Client& client, const Target& target) {
+    auto builder = client.Build();
+    if (target.post) {
+        builder->Post(target.url).SendData(target.body);
+    } else {
+        builder->Get(target.url);
+    }
+    return builder;
+}
+
+void sendWithCallback(Client& client, const Target& target, const shared_ptr<Run>& run) {
+    const auto start = Clock::now();
+    prepare(client, target)->WithCompletion([&client, &target, run, start](const Result& result) {
+            const auto more = run->Next();
+            run->Record(start, result);
+            if (more) {
+                sendWithCallback(client, target, run);
+            }
+        })
+        .Execute();
+}
+
+void startWithCallback(Client& client, const Target& target, const shared_ptr<Run>& run,
+                       const size_t concurrency) {
+    for(size_t i = 0; i < concurrency; ++i) {
+        if (!run->Next()) {
+            break;
+        }
+        sendWithCallback(client, target, run);
+    }
+}
+
+// A coroutine that nobody waits for. It runs until the run has no more requests.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() noexcept { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+Detached coSend(Client& client, const Target& target, shared_ptr<Run> run) {
+    while(run->Next()) {
+        const auto start = Clock::now();
+        const auto result = co_await prepare(client, target)->CoExecute();
+        run->Record(start, result);
+    }
+}
+
+double cpuSeconds() {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+long rssKb() {
+    ifstream statm{"/proc/self/statm"};
+    long pages = 0;
+    statm >> pages >> pages;
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+double percentile(const vector<double>& sorted, const double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[min(sorted.size() - 1, static_cast<size_t>(p * static_cast<double>(sorted.size())))];
+}
+
+/* Runs `concurrency` requests to open the connections, and then measures
+ * `requests` requests. `fn(run, concurrency)` must return when the run is done.
+ */
+template <typename T>
+Stats measure(const LoopbackServer& server, const char *api, const size_t concurrency,
+              const size_t requests, const T& fn) {
+    fn(make_shared<Run>(concurrency), concurrency);
+
+    auto run = make_shared<Run>(requests);
+    const auto cpu = cpuSeconds() - chrono::duration<double>(server.GetCpuTime()).count();
+    const auto start = Clock::now();
+    fn(run, concurrency);
+    const auto elapsed = chrono::duration<double>(Clock::now() - start).count();
+    const auto used = cpuSeconds() - chrono::duration<double>(server.GetCpuTime()).count() - cpu;
+
+    auto& latencies = run->GetLatencies();
+    sort(latencies.begin(), latencies.end());
+
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+
+    Stats stats;
+    stats.api = api;
+    stats.concurrency = concurrency;
+    stats.requests = requests;
+    stats.errors = run->GetErrors();
+    stats.rps = requests / elapsed;
+    stats.p50 = percentile(latencies, 0.5);
+    stats.p99 = percentile(latencies, 0.99);
+    stats.p999 = percentile(latencies, 0.999);
+    stats.cpu_us = used * 1000000.0 / requests;
+    stats.rss_kb = rssKb();
+    stats.peak_rss_kb = max(usage.ru_maxrss, stats.rss_kb);
+    return stats;
+}
+
+vector<Stats> runApis(const LoopbackServer& server, const Target& target,
+                      const size_t concurrency, const size_t requests) {
+    vector<Stats> results;
+
+    {
+        Client client;
+        results.push_back(measure(server, "callback", concurrency, requests,
+            [&](const shared_ptr<Run>& run, const size_t concurrency) {
+                startWithCallback(client, target, run, concurrency);
+                run->Wait();
+        }));
+        client.CloseWhenFinished();
+        client.WaitForFinish();
+    }
+
+    {
+        Client client;
+        results.push_back(measure(server, "coexecute", concurrency, requests,
+            [&](const shared_ptr<Run>& run, const size_t concurrency) {
+                for(size_t i = 0; i < concurrency; ++i) {
+                    coSend(client, target, run);
+                }
+                run->Wait();
+        }));
+        client.CloseWhenFinished();
+        client.WaitForFinish();
+    }
+
+#if RESTINCURL_ENABLE_ASIO
+    {
+        boost::asio::io_context ioc;
+        Client client{ioc};
+        results.push_back(measure(server, "asio", concurrency, requests,
+            [&](const shared_ptr<Run>& run, const size_t concurrency) {
+                startWithCallback(client, target, run, concurrency);
+                ioc.run();
+                ioc.restart();
+        }));
+    }
+#endif
+
+    results.push_back(measure(server, "sync", concurrency, requests,
+        [&](const shared_ptr<Run>& run, const size_t concurrency) {
+            vector<thread> threads;
+            for(size_t i = 0; i < concurrency; ++i) {
+                threads.emplace_back([&] {
+                    Client client;
+                    while(run->Next()) {
+                        const auto start = Clock::now();
+                        prepare(client, target)->WithCompletion([&](const Result& result) {
+                                run->Record(start, result);
+                            })
+                            .ExecuteSynchronous();
+                    }
+                });
+            }
+            for(auto& t : threads) {
+                t.join();
+            }
+    }));
+
+    return results;
+}
+
+void writeJson(ostream& out, const Stats& s, const char *method) {
+    out << fixed << setprecision(1)
+        << "    {\"api\": \"" << s.api << "\", \"method\": \"" << method
+        << "\", \"concurrency\": " << s.concurrency
+        << ", \"requests\": " << s.requests
+        << ", \"errors\": " << s.errors
+        << ", \"rps\": " << s.rps
+        << ", \"latency_us\": {\"p50\": " << s.p50 << ", \"p99\": " << s.p99 << ", \"p999\": " << s.p999 << "}"
+        << ", \"cpu_us_per_request\": " << setprecision(2) << s.cpu_us
+        << ", \"rss_kb\": " << s.rss_kb
+        << ", \"peak_rss_kb\": " << s.peak_rss_kb << "}";
+}
+
+} // anon ns
+
+int main(int argc, char *argv[]) {
+    const size_t requests = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 10000;
+    const size_t max_concurrency = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 1024;
+
+    // Each request in flight uses a socket in the client and one in the server
+    rlimit limit = {};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    LoopbackServer server{128, 2};
+
+    ostringstream json;
+    json << "{\n  \"benchmark\": \"restincurl_bench\",\n"
+         << "  \"curl_version\": \"" << curl_version_info(CURLVERSION_NOW)->version << "\",\n"
+         << "  \"results\": [\n";
+
+    bool first = true;
+    for(const bool post : {false, true}) {
+        const char *method = post ? "POST" : "GET";
+        const Target target{server.Url(post ? "/post" : "/get"), post, string(256, 'p')};
+
+        for(size_t concurrency = 1; concurrency <= max_concurrency; concurrency *= 4) {
+            for(const auto& stats : runApis(server, target, concurrency, max(requests, concurrency))) {
+                cerr << left << setw(6) << method << setw(10) << stats.api
+                     << right << setw(6) << concurrency
+                     << setw(10) << fixed << setprecision(0) << stats.rps << " req/s"
+                     << setw(9) << stats.p50 << " us p50"
+                     << setw(9) << stats.p99 << " us p99"
+                     << setw(8) << setprecision(1) << stats.cpu_us << " us cpu/req";
+                if (stats.errors) {
+                    cerr << "  " << stats.errors << " errors";
+                }
+                cerr << endl;
+
+                json << (first ? "" : ",\n");
+                writeJson(json, stats, method);
+                first = false;
+            }
+        }
+    }
+
+    json << "\n  ]\n}\n";
+    cout << json.str();
+    return 0;
+}
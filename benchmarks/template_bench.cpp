@@ -0,0 +1,104 @@
+/* Benchmark for the per-request setup cost.
+ *
+ * Compares building each request from scratch with RequestBuilder,
+ * with using the client's shared default headers, and with stamping
+ * it out from a RequestTemplate. All prepare a GET request with ten
+ * headers, authentication and timeouts, ready to be sent.
+ *
+ * No network traffic is involved.
+ *
+ * Usage: template_bench [iterations]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+
+#include "restincurl/restincurl.h"
+
+using namespace std;
+using namespace restincurl;
+
+namespace {
+
+const char *headers[] = {
+    "Accept: application/json",
+    "Accept-Language: en-US",
+    "Cache-Control: no-cache",
+    "User-Agent: restincurl-bench/1.0",
+    "X-Api-Version: 2024-06-01",
+    "X-Client-Id: 6f1c2a3b-7d4e-4f5a-9b8c-0d1e2f3a4b5c",
+    "X-Correlation-Id: 0123456789abcdef",
+    "X-Feature-Flags: a,b,c",
+    "X-Region: eu-north-1",
+    "X-Tenant: benchmark",
+};
+
+RequestBuilder& addSettings(RequestBuilder& builder, const bool addHeaders = true) {
+    if (addHeaders) {
+        for(auto header : headers) {
+            builder.Header(header);
+        }
+    }
+    return builder.BasicAuthentication("alice", "12345")
+        .RequestTimeout(5000)
+        .ConnectTimeout(1000)
+        .Option(CURLOPT_FOLLOWLOCATION, 1L);
+}
+
+template <typename T>
+void run(const char *name, const size_t iterations, const T& fn) {
+    // Warm up
+    for(size_t i = 0; i < 1000; ++i) {
+        fn(i);
+    }
+
+    const auto start = chrono::steady_clock::now();
+    for(size_t i = 0; i < iterations; ++i) {
+        fn(i);
+    }
+    const auto elapsed = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - start).count();
+
+    cout << left << setw(10) << name
+         << right << setw(12) << fixed << setprecision(1)
+         << (static_cast<double>(elapsed) / iterations) << " ns/request" << endl;
+}
+
+} // anon ns
+
+int main(int argc, char *argv[]) {
+    const size_t iterations = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 100000;
+
+    Client client;
+    const string url = "http://localhost:3001/users/";
+
+    run("builder", iterations, [&](size_t i) {
+        auto builder = client.Build();
+        builder->Get(url + to_string(i));
+        addSettings(*builder).Build();
+    });
+
+    Client defaults_client;
+    curl_slist *list = {};
+    for(auto header : headers) {
+        list = curl_slist_append(list, header);
+    }
+    defaults_client.SetDefaultHeaders(make_shared<HeaderList>(list));
+
+    run("defaults", iterations, [&](size_t i) {
+        auto builder = defaults_client.Build();
+        builder->Get(url + to_string(i));
+        addSettings(*builder, false).Build();
+    });
+
+    auto builder = client.Build();
+    builder->Get(url);
+    auto tmpl = addSettings(*builder).MakeTemplate();
+
+    run("template", iterations, [&](size_t i) {
+        client.Build(*tmpl)->Url(url + to_string(i)).Build();
+    });
+
+    return 0;
+}
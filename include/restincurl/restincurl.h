@@ -32,28 +32,49 @@
 
 #include <algorithm>
 #include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <deque>
 #include <exception>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <random>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <array>
 
 #if __cplusplus >= 202002L
 #   include <coroutine>
 #   include <optional>
+#   include <stop_token>
 using thread_t = std::jthread;
 #else
 using thread_t = std::thread;
 #endif
 
 #ifdef RESTINCURL_ENABLE_ASIO
+// Older Boost (1.74) uses std::exchange in asio/awaitable.hpp without including <utility>
+#include <utility>
 #include <boost/asio.hpp>
 #include <boost/asio/use_awaitable.hpp>
 #endif
@@ -74,6 +95,49 @@ using thread_t = std::thread;
 #   include <openssl/crypto.h>
 #endif
 
+/*! \def RESTINCURL_WITH_ZLIB
+ * \brief Enable gzip and deflate compression of request bodies.
+ *
+ * See `RequestBuilder::CompressBody()`. Your application must link with zlib.
+ *
+ * Not defined by default.
+ */
+#ifdef RESTINCURL_WITH_ZLIB
+#   include <zlib.h>
+#endif
+
+/*! \def RESTINCURL_WITH_ZSTD
+ * \brief Enable zstd compression of request bodies.
+ *
+ * See `RequestBuilder::CompressBody()`. Your application must link with libzstd.
+ *
+ * Not defined by default.
+ */
+#ifdef RESTINCURL_WITH_ZSTD
+#   include <zstd.h>
+#endif
+
+#ifdef __linux__
+#   include <sys/epoll.h>
+#endif
+
+/*! \def RESTINCURL_WITH_IO_URING
+ * \brief Enable the io_uring backend for the worker-thread.
+ *
+ * See `WorkerBackend::IO_URING`. Requires Linux headers with io_uring
+ * support. liburing is not used.
+ *
+ * Not defined by default.
+ */
+#if defined(RESTINCURL_WITH_IO_URING) && defined(__linux__)
+#   include <linux/io_uring.h>
+#   include <poll.h>
+#   include <signal.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   define RESTINCURL_HAVE_IO_URING 1
+#endif
+
 /*! \def RESTINCURL_MAX_CONNECTIONS
  * \brief Max concurrent connections
  * 
@@ -90,6 +154,20 @@ using thread_t = std::thread;
 #   define RESTINCURL_MAX_CONNECTIONS 32L
 #endif
 
+/*! \def RESTINCURL_REQUEST_POOL_SIZE
+ * \brief Max number of recycled requests kept by a client
+ *
+ * Finished requests and their easy-handles are kept in a pool
+ * and reused for new requests, so that a typical request does
+ * not need to allocate memory or initialize a new easy-handle.
+ * See `RequestPool`. 0 disables the pool.
+ *
+ * The default value is 64
+ */
+#ifndef RESTINCURL_REQUEST_POOL_SIZE
+#   define RESTINCURL_REQUEST_POOL_SIZE 64
+#endif
+
 /*! \def RESTINCURL_ENABLE_ASYNC
  * \brief Enables or disables asynchronous mode.
  * 
@@ -119,6 +197,44 @@ using thread_t = std::thread;
 #   define RESTINCURL_IDLE_TIMEOUT_SEC 60
 #endif
 
+/*! \def RESTINCURL_SYNC_CACHE_SIZE
+ * \brief Max number of hosts with warm connections kept by each thread for synchronous requests
+ *
+ * Synchronous requests reuse connections, DNS lookups and TLS sessions
+ * from earlier requests to the same host on the same thread.
+ * See `SyncConnectionCache`. 0 disables the cache.
+ *
+ * The default value is 8
+ */
+#ifndef RESTINCURL_SYNC_CACHE_SIZE
+#   define RESTINCURL_SYNC_CACHE_SIZE 8
+#endif
+
+/*! \def RESTINCURL_SYNC_CACHE_IDLE_SEC
+ * \brief How long a host can be unused before its cached connections are closed.
+ *
+ * See `SyncConnectionCache`.
+ *
+ * Default is 60 seconds.
+ */
+#ifndef RESTINCURL_SYNC_CACHE_IDLE_SEC
+#   define RESTINCURL_SYNC_CACHE_IDLE_SEC 60
+#endif
+
+/*! \def RESTINCURL_WORKER_BACKEND
+ * \brief How the worker-threads wait for network events, by default.
+ *
+ * One of the names in `WorkerBackend`: SELECT, EPOLL or IO_URING.
+ * See `Client::SetWorkerBackend()`.
+ *
+ * Note that this option is only relevant in asynchronous mode.
+ *
+ * Default is SELECT.
+ */
+#ifndef RESTINCURL_WORKER_BACKEND
+#   define RESTINCURL_WORKER_BACKEND SELECT
+#endif
+
 /*! \def RESTINCURL_LOG_VERBOSE_ENABLE
  * \brief Enable very verbose logging
  * 
@@ -250,6 +366,30 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
 
     using lock_t = std::lock_guard<std::mutex>;
 
+    /*! Errors detected by RESTinCurl, rather than by libcurl
+     *
+     * See `Result::error`
+     */
+    enum class Error {
+        /*! No error, or an error reported by libcurl in `Result::curl_code` */
+        NONE,
+
+        /*! The request was not sent, because the circuit breaker for the host is open */
+        CIRCUIT_OPEN,
+
+        /*! The request was cancelled with `RequestHandle::Cancel()` */
+        CANCELLED,
+
+        /*! The request was not sent, because its deadline passed while it waited. See `RequestBuilder::Deadline()` */
+        DEADLINE_EXCEEDED,
+
+        /*! The request was not sent, because the queue was full. See `QueuePolicy` */
+        QUEUE_FULL,
+
+        /*! The request was not sent, because requests waited too long in the queue. See `LoadShedder` */
+        OVERLOADED
+    };
+
     /*! The Result from a request\
      */
     struct Result {
@@ -258,6 +398,9 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
             curl_code = code;
             msg = curl_easy_strerror(code);
         }
+
+        Result(const CURLcode& code, const Error err, const std::string& explanation)
+        : curl_code{code}, msg{explanation}, error{err} {}
         
         /*! Check if the reqtest appears to be successful */
         bool isOk() const noexcept {
@@ -285,829 +428,6744 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
         /*! The body of the request returned by the server.
          * 
          * Note that if you specified your own body handler or body variable, for the request, `body` will be empty.
+         *
+         * If the response cache shares its bodies (see `CacheOptions::share_bodies`), or
+         * the request was coalesced with others (see `RequestBuilder::Coalesce()`), the
+         * body is in `shared_body`, and `body` is empty. Use `GetBody()` if you want either.
          */
         std::string body;
-    };
 
-    enum class RequestType { GET, PUT, POST, HEAD, DELETE, PATCH, OPTIONS, POST_MIME, INVALID };
-    
-    /*! Completion debug_callback
-     * 
-     * This callback is called when a request completes, or fails.
-     * 
-     * \param result The result of the request.
-     */
-    using completion_fn_t = std::function<void (const Result& result)>;
+        /*! The body, when it is shared with the response cache.
+         *
+         * The buffer is immutable, and shared with the cache and any other
+         * requests that were served the same response.
+         */
+        std::shared_ptr<const std::string> shared_body;
 
-    /*! Base class for RESTinCurl exceptions */
-    class Exception : public std::runtime_error {
-    public:
-        Exception(const std::string& msg) : runtime_error(msg) {}
-    };
+        /*! Get the body, from `shared_body` if it is set, or else from `body` */
+        const std::string& GetBody() const noexcept {
+            return shared_body ? *shared_body : body;
+        }
 
-    /*! Exception thrown when some system function, like `pipe()` failed. */
-    class SystemException : public Exception {
-    public:
-        SystemException(const std::string& msg, const int e) : Exception(msg + " " + strerror(e)), err_{e} {}
+        /*! True if the response was served by the response cache, with or without revalidation. */
+        bool from_cache = false;
 
-        int getErrorCode() const noexcept { return err_; }
+        /*! Set if the request failed for a reason detected by RESTinCurl.
+         *
+         * In that case, `curl_code` is `CURLE_ABORTED_BY_CALLBACK` and `msg` explains what happened.
+         */
+        Error error = Error::NONE;
 
-    private:
-        const int err_;
+        /*! Number of attempts made for the request. See `RequestBuilder::Retry()` */
+        unsigned attempts = 1;
+
+        /*! Bytes of payload received, after decompression. */
+        curl_off_t bytes_received = {};
+
+        /*! Bytes of payload received on the wire.
+         *
+         * If the response was compressed (see `RequestBuilder::AcceptCompressed()`),
+         * this is the size of the compressed data.
+         */
+        curl_off_t wire_bytes_received = {};
+
+        /*! The HTTP headers returned by the server.
+         *
+         * The header names are converted to lower case. This is only filled in
+         * if you asked for it with `RequestBuilder::StoreHeaders()`.
+         */
+        std::map<std::string, std::string> headers;
     };
 
-    /*! Exception thrown when a curl library method failed. */
-    class CurlException : public Exception {
-    public:
-        CurlException(const std::string msg, const CURLcode err)
-            : Exception(msg + '(' + std::to_string(err) + "): " + curl_easy_strerror(err))
-            , err_{err}
-            {}
+    enum class RequestType { GET, PUT, POST, HEAD, DELETE, PATCH, OPTIONS, POST_MIME, INVALID };
 
-         CurlException(const std::string msg, const CURLMcode err)
-            : Exception(msg + '(' + std::to_string(err) + "): " + curl_multi_strerror(err))
-            , err_{err}
-            {}
+    /*! Options for downloading a resource to a local file.
+     *
+     * See `RequestBuilder::DownloadToFile()`
+     */
+    struct DownloadOptions {
+        /*! Max number of byte-ranges to fetch in parallel.
+         *
+         * The download is only split in segments if the server
+         * announces support for byte ranges. Set to 1 to always
+         * use a single stream.
+         */
+        size_t segments = 4;
 
-        int getErrorCode() const noexcept { return err_; }
+        /*! Don't make segments smaller than this (in bytes). */
+        size_t min_segment_size = 1024 * 1024;
 
-    private:
-        const int err_;
+        /*! How many times a failed segment (or single stream) is retried. */
+        unsigned max_retries = 3;
     };
+    
+    template <typename Signature, size_t Capacity = 64>
+    class UniqueFunction;
+
+    /*! A move-only function wrapper, with inline storage for small callables.
+     *
+     * Works like `std::function`, but the callable does not need to be copyable,
+     * so a lambda can own a `std::unique_ptr` or a `std::promise`. Callables of up
+     * to `Capacity` bytes, that can be moved without throwing, are stored inside
+     * the object, without allocating memory. Larger callables are stored on the heap.
+     *
+     * A `std::function` is a callable too, so it can be used where a
+     * `UniqueFunction` is expected.
+     */
+    template <typename R, typename... Args, size_t Capacity>
+    class UniqueFunction<R (Args...), Capacity> {
+        struct Ops {
+            R (*invoke)(void *target, Args&&... args);
+            void (*move)(void *from, void *to) noexcept; // Move-constructs to, and destroys from
+            void (*destroy)(void *target) noexcept;
+        };
 
-    class EasyHandle {
-    public:
-        using ptr_t = std::unique_ptr<EasyHandle>;
-        using handle_t = decltype(curl_easy_init());
+        template <typename F>
+        struct Inline {
+            static R Invoke(void *target, Args&&... args) {
+                return (*static_cast<F *>(target))(std::forward<Args>(args)...);
+            }
+            static void Move(void *from, void *to) noexcept {
+                new (to) F(std::move(*static_cast<F *>(from)));
+                static_cast<F *>(from)->~F();
+            }
+            static void Destroy(void *target) noexcept {
+                static_cast<F *>(target)->~F();
+            }
+            static const Ops *GetOps() noexcept {
+                static constexpr Ops ops = {Invoke, Move, Destroy};
+                return &ops;
+            }
+        };
 
-        EasyHandle() {
-            RESTINCURL_LOG("EasyHandle created: " << handle_);
+        template <typename F>
+        struct Heap {
+            static F *&Ptr(void *target) noexcept { return *static_cast<F **>(target); }
+            static R Invoke(void *target, Args&&... args) {
+                return (*Ptr(target))(std::forward<Args>(args)...);
+            }
+            static void Move(void *from, void *to) noexcept {
+                new (to) F*(Ptr(from));
+            }
+            static void Destroy(void *target) noexcept {
+                delete Ptr(target);
+            }
+            static const Ops *GetOps() noexcept {
+                static constexpr Ops ops = {Invoke, Move, Destroy};
+                return &ops;
+            }
+        };
+
+        template <typename F>
+        using IsInline = std::integral_constant<bool, (sizeof(F) <= Capacity)
+            && (alignof(F) <= alignof(std::max_align_t))
+            && std::is_nothrow_move_constructible<F>::value>;
+
+        template <typename F, typename = void>
+        struct IsCallable : std::false_type {};
+
+        template <typename F>
+        struct IsCallable<F, decltype(void(std::declval<F&>()(std::declval<Args>()...)))>
+            : std::true_type {};
+
+    public:
+        UniqueFunction() noexcept = default;
+        UniqueFunction(std::nullptr_t) noexcept {}
+
+        template <typename F, typename D = std::decay_t<F>,
+                  typename = std::enable_if_t<!std::is_same<D, UniqueFunction>::value
+                      && IsCallable<D>::value>>
+        UniqueFunction(F&& fn) {
+            Assign<D>(std::forward<F>(fn), IsInline<D>{});
         }
 
-        ~EasyHandle() {
-            Close();
+        UniqueFunction(UniqueFunction&& v) noexcept {
+            *this = std::move(v);
         }
 
-        void Close() {
-            if (handle_) {
-                RESTINCURL_LOG("Cleaning easy-handle " << handle_);
-                curl_easy_cleanup(handle_);
-                handle_ = nullptr;
+        UniqueFunction& operator = (UniqueFunction&& v) noexcept {
+            if (this != &v) {
+                Reset();
+                if (v.ops_) {
+                    v.ops_->move(v.storage_, storage_);
+                    ops_ = v.ops_;
+                    v.ops_ = nullptr;
+                }
             }
+            return *this;
         }
 
-        operator handle_t () const noexcept { return handle_; }
-
-    private:
-        handle_t handle_ = curl_easy_init();
-    };
+        UniqueFunction& operator = (std::nullptr_t) noexcept {
+            Reset();
+            return *this;
+        }
 
-    /*! Curl option wrapper class
-     * 
-     * This is just a thin C++ wrapper over Curl's `curl_easy_setopt()` method.
-     */
-    class Options {
-    public:
-        Options(EasyHandle& eh) : eh_{eh} {}
+        UniqueFunction(const UniqueFunction&) = delete;
+        UniqueFunction& operator = (const UniqueFunction&) = delete;
 
-        /*! Set an option 
-         * 
-         * \param opt CURLoption enum to change
-         * \param value Value to set
-         */
-        template <typename T>
-        Options& Set(const CURLoption& opt, const T& value) {
-            const auto ret = curl_easy_setopt(eh_, opt, value);
-            if (ret) {
-                throw CurlException(
-                    std::string("Setting option ") + std::to_string(opt), ret);
-            }
-            return *this;
+        ~UniqueFunction() {
+            Reset();
         }
 
-        /*! Set an option 
-         * 
-         * \param opt CURLoption enum to change
-         * \param value String value to set
-         */
-        Options& Set(const CURLoption& opt, const std::string& value) {
-            return Set(opt, value.c_str());
+        explicit operator bool () const noexcept { return ops_ != nullptr; }
+
+        R operator () (Args... args) const {
+            if (!ops_) {
+                throw std::bad_function_call{};
+            }
+            return ops_->invoke(storage_, std::forward<Args>(args)...);
         }
 
     private:
-        EasyHandle& eh_;
-    };
-
-    /*! Abstract base class for Data Handlers
-     * 
-     * Data handlers are used to handle libcurl's callback requirements
-     * for input and output data.
-     */
-    struct DataHandlerBase {
-        virtual ~DataHandlerBase() = default;
-    };
+        template <typename D, typename F>
+        void Assign(F&& fn, std::true_type) {
+            new (storage_) D(std::forward<F>(fn));
+            ops_ = Inline<D>::GetOps();
+        }
 
-    /*! Template implementation for input data to curl during a request.
-     * 
-     * This handler deals with the data received from the HTTP server
-     * during a request. This implementation will typically use
-     * T=std::string and just store the received data in a string. For 
-     * json/XML payloads that's probably all you need. But if you receive
-     * binary data, you may want to use a container like std::vector or std::deque in stead.
-     */
-    template <typename T>
-    struct InDataHandler : public DataHandlerBase{
-        InDataHandler(T& data) : data_{data} {
-            RESTINCURL_LOG_TRACE("InDataHandler address: " << this);
+        template <typename D, typename F>
+        void Assign(F&& fn, std::false_type) {
+            new (storage_) D*(new D(std::forward<F>(fn)));
+            ops_ = Heap<D>::GetOps();
         }
 
-        static size_t write_callback(char *ptr, size_t size, size_t nitems, void *userdata) {
-            assert(userdata);
-            auto self = reinterpret_cast<InDataHandler *>(userdata);
-            const auto bytes = size * nitems;
-            if (bytes > 0) {
-                std::copy(ptr, ptr + bytes, std::back_inserter(self->data_));
+        void Reset() noexcept {
+            if (ops_) {
+                ops_->destroy(storage_);
+                ops_ = nullptr;
             }
-            return bytes;
         }
 
-        T& data_;
+        const Ops *ops_ = {};
+        alignas(std::max_align_t) mutable unsigned char storage_[Capacity < sizeof(void *) ? sizeof(void *) : Capacity];
     };
 
-     /*! Template implementation for output data to curl during a request.
+    /*! Completion debug_callback
      * 
-     * This handler deals with the data sent to the HTTP server
-     * during a request (POST, PATCH etc). This implementation will typically use
-     * T=std::string and just store the data in a string. For 
-     * json/XML payloads that's probably all you need. But if you send
-     * binary data, you may want to use a container like std::vector or std::deque in stead.
+     * This callback is called when a request completes, or fails.
+     *
+     * It is move-only, and lambdas with up to 64 bytes of captures are
+     * stored without allocating memory. A `std::function` can be used as well.
+     * 
+     * \param result The result of the request.
      */
-    template <typename T>
-    struct OutDataHandler : public DataHandlerBase {
-        OutDataHandler() = default;
-        OutDataHandler(const T& v) : data_{v} {}
-        OutDataHandler(T&& v) : data_{std::move(v)} {}
+    using completion_fn_t = UniqueFunction<void (const Result& result)>;
 
-        static size_t read_callback(char *bufptr, size_t size, size_t nitems, void *userdata) {
-            assert(userdata);
-            OutDataHandler *self = reinterpret_cast<OutDataHandler *>(userdata);
-            const auto bytes = size * nitems;
-            auto out_bytes = std::min<size_t>(bytes, (self->data_.size() - self->sendt_bytes_));
-            std::copy(self->data_.cbegin() + self->sendt_bytes_,
-                      self->data_.cbegin() + (self->sendt_bytes_ + out_bytes),
-                      bufptr);
-            self->sendt_bytes_ += out_bytes;
+    /*! Statistics for a Client instance.
+     *
+     * This is a snapshot of the counters. See `Client::GetStats()`
+     */
+    struct Stats {
+        /*! Number of times a failed download was resumed, rather than restarted. */
+        uint64_t downloads_resumed = 0;
 
-            RESTINCURL_LOG_TRACE("Sent " << out_bytes << " of total " << self->data_.size() << " bytes.");
-            return out_bytes;
-        }
+        /*! Bytes that did not have to be downloaded again because a download was resumed. */
+        uint64_t download_bytes_saved = 0;
 
-        T data_;
-        size_t sendt_bytes_ = 0;
-    };
+        /*! Number of requests where at least one hedged copy was sent. */
+        uint64_t hedged_requests = 0;
 
-    class Request {
-    public:
-        using ptr_t = std::unique_ptr<Request>;
+        /*! Number of hedged copies sent. */
+        uint64_t hedges_sent = 0;
 
-        Request()
-        : eh_{std::make_unique<EasyHandle>()}
-        {
-        }
+        /*! Number of times a hedged copy completed before the original request. */
+        uint64_t hedges_won = 0;
 
-        Request(EasyHandle::ptr_t&& eh)
-        : eh_{std::move(eh)}
-        {
-        }
+        /*! Number of hedged copies that were not sent because the hedge budget was spent. */
+        uint64_t hedges_over_budget = 0;
 
-        ~Request() {
-            if (headers_) {
-                curl_slist_free_all(headers_);
-            }
-        }
+        /*! Number of times a circuit breaker opened. */
+        uint64_t circuits_opened = 0;
 
-        void Prepare(const RequestType rq, completion_fn_t completion) {
-            request_type_ = rq;
-            SetRequestType();
-            completion_ = std::move(completion);
-        }
+        /*! Number of requests that failed because a circuit breaker was open. */
+        uint64_t circuit_rejections = 0;
 
-        void OpenSourceFile(const std::string& path) {
-            assert(!fp_);
-            auto fp = fopen(path.c_str(), "rb");
-            if (!fp) {
-                const auto e = errno;
-                throw SystemException{std::string{"Unable to open file "} + path, e};
-            }
+        /*! Number of requests that had to wait for the rate limit. */
+        uint64_t rate_limited = 0;
 
-            fp_= std::shared_ptr<FILE>(fp, std::fclose);
-        }
+        /*! Number of requests served from the response cache without asking the server. */
+        uint64_t cache_hits = 0;
 
-        FILE *GetSourceFp() {
-            assert(fp_);
-            return fp_.get();
-        }
+        /*! Number of requests checked against the response cache that had to get the body from the server. */
+        uint64_t cache_misses = 0;
 
-        // Synchronous execution.
-        void Execute() {
-            const auto result = curl_easy_perform(*eh_);
-            CallCompletion(result);
-        }
+        /*! Number of requests served from the response cache after the server confirmed that it was current (304). */
+        uint64_t cache_revalidations = 0;
 
-        void Complete(CURLcode cc, const CURLMSG& /*msg*/) {
-            CallCompletion(cc);
-        }
+        /*! Number of requests that were attached to an identical request, rather than sent. */
+        uint64_t coalesced_requests = 0;
 
-        EasyHandle& GetEasyHandle() noexcept { assert(eh_); return *eh_; }
-        RequestType GetRequestType() noexcept { return request_type_; }
+        /*! Number of requests that were cancelled with `RequestHandle::Cancel()`. */
+        uint64_t cancelled_requests = 0;
 
-        void SetDefaultInHandler(std::unique_ptr<DataHandlerBase> ptr) {
-            default_in_handler_ = std::move(ptr);
-        }
+        /*! Number of requests that were not sent because their deadline passed while they waited. */
+        uint64_t deadlines_exceeded = 0;
 
-        void SetDefaultOutHandler(std::unique_ptr<DataHandlerBase> ptr) {
-            default_out_handler_ = std::move(ptr);
-        }
+        /*! Number of new requests that were rejected because the queue was full. */
+        uint64_t queue_rejections = 0;
 
-        using headers_t = curl_slist *;
-        headers_t& GetHeaders() {
-            return headers_;
-        }
+        /*! Number of queued requests that were dropped to make room for a new request. */
+        uint64_t queue_drops = 0;
 
-        std::string& getDefaultInBuffer() {
-            return default_data_buffer_;
-        }
+        /*! Number of queued requests that were dropped by the load shedder. */
+        uint64_t requests_shed = 0;
+    };
 
-        void InitMime() {
-            if (!mime_) {
-                mime_ = curl_mime_init(*eh_);
-            }
+    /*! Thread-safe counters behind `Stats` */
+    class Metrics {
+    public:
+        using counter_t = std::atomic<uint64_t>;
+
+        Stats GetStats() const noexcept {
+            Stats stats;
+            stats.downloads_resumed = downloads_resumed;
+            stats.download_bytes_saved = download_bytes_saved;
+            stats.hedged_requests = hedged_requests;
+            stats.hedges_sent = hedges_sent;
+            stats.hedges_won = hedges_won;
+            stats.hedges_over_budget = hedges_over_budget;
+            stats.circuits_opened = circuits_opened;
+            stats.circuit_rejections = circuit_rejections;
+            stats.rate_limited = rate_limited;
+            stats.cache_hits = cache_hits;
+            stats.cache_misses = cache_misses;
+            stats.cache_revalidations = cache_revalidations;
+            stats.coalesced_requests = coalesced_requests;
+            stats.cancelled_requests = cancelled_requests;
+            stats.deadlines_exceeded = deadlines_exceeded;
+            stats.queue_rejections = queue_rejections;
+            stats.queue_drops = queue_drops;
+            stats.requests_shed = requests_shed;
+            return stats;
         }
 
-        void AddFileAsMimeData(const std::string& path,
-                               const std::string& name,
-                               const std::string& remoteName,
-                               const std::string& mimeType) {
+        counter_t downloads_resumed{0};
+        counter_t download_bytes_saved{0};
+        counter_t hedged_requests{0};
+        counter_t hedges_sent{0};
+        counter_t hedges_won{0};
+        counter_t hedges_over_budget{0};
+        counter_t circuits_opened{0};
+        counter_t circuit_rejections{0};
+        counter_t rate_limited{0};
+        counter_t cache_hits{0};
+        counter_t cache_misses{0};
+        counter_t cache_revalidations{0};
+        counter_t coalesced_requests{0};
+        counter_t cancelled_requests{0};
+        counter_t deadlines_exceeded{0};
+        counter_t queue_rejections{0};
+        counter_t queue_drops{0};
+        counter_t requests_shed{0};
+    };
 
-            InitMime();
-            assert(mime_);
-            auto * part = curl_mime_addpart(mime_);
-            curl_mime_filedata(part, path.c_str());
-            curl_mime_name(part, name.empty() ? "file" :name.c_str());
+    /*! Retry policy for failed requests.
+     *
+     * See `RequestBuilder::Retry()`
+     */
+    struct RetryPolicy {
+        /*! Max number of attempts, including the first one. */
+        unsigned max_attempts = 3;
+
+        /*! libcurl errors that are worth retrying. */
+        std::vector<CURLcode> curl_codes = {
+            CURLE_COULDNT_CONNECT, CURLE_OPERATION_TIMEDOUT, CURLE_SEND_ERROR,
+            CURLE_RECV_ERROR, CURLE_GOT_NOTHING, CURLE_PARTIAL_FILE
+        };
 
-            if (!remoteName.empty()) {
-                curl_mime_filename(part, remoteName.c_str());
+        /*! HTTP status codes that are worth retrying. */
+        std::vector<long> http_codes = {408, 429, 502, 503, 504};
+
+        /*! Also retry requests that are not idempotent (POST and PATCH).
+         *
+         * The server may have acted on the failed attempt, so a retry can
+         * apply the request twice. When the connection could not be made,
+         * nothing was sent, and these requests are retried anyway.
+         */
+        bool retry_non_idempotent = false;
+
+        /*! Use the delay from the `Retry-After` header, if the server sends one.
+         *
+         * If the server asks us to wait longer than `max_delay`, the request
+         * is not retried.
+         *
+         * Requires libcurl 7.66.0 or newer.
+         */
+        bool honor_retry_after = true;
+
+        /*! Delay before the first retry. */
+        std::chrono::milliseconds initial_delay{100};
+
+        /*! The delay will never be longer than this. */
+        std::chrono::milliseconds max_delay{10000};
+
+        /*! The delay is multiplied with this for each attempt. */
+        double multiplier = 2.0;
+
+        /*! Random jitter, as a fraction of the delay (0.0 - 1.0).
+         *
+         * A delay of 1000 ms with jitter 0.5 gives a random delay between
+         * 500 and 1000 ms.
+         */
+        double jitter = 0.5;
+    };
+
+    /*! State of the circuit breaker for a host */
+    enum class CircuitState {
+        /*! Requests are sent normally */
+        CLOSED,
+
+        /*! Requests fail immediately with `Error::CIRCUIT_OPEN` */
+        OPEN,
+
+        /*! A few probe requests are sent to see if the host is back */
+        HALF_OPEN
+    };
+
+    /*! Called from the worker-thread when the circuit breaker for a host changes state.
+     *
+     * The host is in the format returned by `GetHostKey()`
+     */
+    using circuit_fn_t = std::function<void (const std::string& host, CircuitState from, CircuitState to)>;
+
+    /*! Settings for the per-host circuit breaker.
+     *
+     * See `Client::SetCircuitBreaker()`
+     */
+    struct CircuitBreakerPolicy {
+        /*! Open the circuit after this many failures in a row. 0 to disable. */
+        unsigned consecutive_failures = 5;
+
+        /*! Open the circuit if this fraction of the recent requests failed. 0 to disable. */
+        double failure_rate = 0.5;
+
+        /*! Number of recent requests that `failure_rate` is calculated over.
+         *
+         * The rate is not used until we have seen this many requests for the host.
+         */
+        unsigned window = 20;
+
+        /*! How long the circuit stays open before we send probe requests. */
+        std::chrono::milliseconds open_time{5000};
+
+        /*! Max number of probe requests in flight when the circuit is half-open. */
+        unsigned half_open_probes = 1;
+
+        /*! Optional callback for state changes. */
+        circuit_fn_t on_state_change;
+    };
+
+    /*! Client side rate limit for a host or URL prefix.
+     *
+     * See `Client::SetRateLimit()`
+     */
+    struct RateLimit {
+        /*! Max number of requests per second, over time. */
+        double requests_per_second = 10.0;
+
+        /*! Max number of requests that can be sent at once, after an idle period. */
+        double burst = 1.0;
+    };
+
+    /*! Settings for the response cache.
+     *
+     * See `Client::EnableCache()`
+     */
+    struct CacheOptions {
+        /*! Max size of the cached bodies, in bytes */
+        size_t max_bytes = 64 * 1024 * 1024;
+
+        /*! Number of independent shards (each with its own lock and LRU list) */
+        size_t shards = 8;
+
+        /*! Return cached bodies in `Result::shared_body`, without copying them.
+         *
+         * By default the body is copied to `Result::body`, as for any other response.
+         */
+        bool share_bodies = false;
+    };
+
+    /*! What to do with a new request when the queue is full. See `QueuePolicy` */
+    enum class QueueOverflow {
+        /*! Fail the new request with `Error::QUEUE_FULL` */
+        REJECT,
+
+        /*! Block in `Execute()` until there is room in the queue.
+         *
+         * If the time-out expires, the new request fails with `Error::QUEUE_FULL`.
+         * Requests executed from the worker-thread (for example from a completion
+         * callback) are never blocked, as that would be a dead-lock.
+         */
+        BLOCK,
+
+        /*! Fail the oldest request in the queue with `Error::QUEUE_FULL`, and queue the new one */
+        DROP_OLDEST,
+
+        /*! Fail the oldest of the queued requests with the lowest priority with `Error::QUEUE_FULL`.
+         *
+         * If no queued request has lower priority than the new one, the new
+         * request fails. See `RequestBuilder::Priority()`
+         */
+        DROP_LOWEST_PRIORITY
+    };
+
+    /*! Limit for the number of requests waiting for a connection.
+     *
+     * Requests that are coalesced with another request, or wait for a retry
+     * or for the rate limit, are not counted.
+     *
+     * The requests that fail because the queue is full are completed
+     * synchronously, inside `Execute()`, on the thread that calls it. With
+     * the `DROP_*` policies, that is the completion of the dropped request,
+     * which may belong to another part of the application. The completions
+     * must not block, and must not assume that they run on the worker-thread.
+     *
+     * See `Client::SetQueuePolicy()`
+     */
+    struct QueuePolicy {
+        /*! Max number of requests in the queue. 0 for no limit. */
+        size_t max_size = 0;
+
+        /*! What to do when the queue is full */
+        QueueOverflow overflow = QueueOverflow::REJECT;
+
+        /*! Max time to wait for room in the queue with `QueueOverflow::BLOCK` */
+        std::chrono::milliseconds block_timeout{1000};
+    };
+
+    /*! Settings for the load shedder. See `LoadShedder` and `Client::SetLoadShedding()` */
+    struct LoadSheddingPolicy {
+        /*! Acceptable time for a request to wait in the queue */
+        std::chrono::milliseconds target{50};
+
+        /*! How long requests must wait longer than `target` before any is shed.
+         *
+         * This should be around the normal response time for the requests.
+         */
+        std::chrono::milliseconds interval{500};
+    };
+
+    /*! How the worker-thread waits for network events. See `Client::SetWorkerBackend()` */
+    enum class WorkerBackend {
+        /*! `select()`, with `curl_multi_perform()`. The default, and available everywhere.
+         *
+         * The sockets must be below `FD_SETSIZE` (usually 1024).
+         */
+        SELECT,
+
+        /*! `epoll`, with libcurl's multi-socket API. Linux only.
+         *
+         * Only the sockets that libcurl asks for are watched, and they are
+         * registered once, so the cost of a wait does not grow with the
+         * number of transfers.
+         */
+        EPOLL,
+
+        /*! io_uring, with libcurl's multi-socket API. Linux 5.13 or newer.
+         *
+         * Sockets and the wake-up signal are watched with multishot polls, and
+         * changes to the set of sockets are batched with the next wait, so a
+         * loop iteration is usually one system call. Requires `RESTINCURL_WITH_IO_URING`.
+         */
+        IO_URING
+    };
+
+    /*! Load shedding based on how long requests wait in the queue.
+     *
+     * This is the CoDel algorithm ("Controlling Queue Delay", Nichols and Jacobson),
+     * applied to requests rather than packets. The time a request waited in the
+     * queue is checked when it is taken out. If that time stays above `target`
+     * for `interval`, requests are shed. The first one at once, then at shorter
+     * and shorter intervals (`interval / sqrt(count)`), until a request
+     * waited less than the target or the queue is empty.
+     *
+     * A burst that is served within the interval is not affected, but a standing
+     * queue is kept short, without a fixed limit for its size.
+     *
+     * Used by the worker-thread. Not thread-safe.
+     */
+    class LoadShedder {
+    public:
+        using clock_t = std::chrono::steady_clock;
+
+        explicit LoadShedder(const LoadSheddingPolicy& policy = {})
+        : policy_{policy} {}
+
+        /*! Check if a request that is taken out of the queue should be shed.
+         *
+         * \param now The time now
+         * \param sojourn How long the request waited in the queue
+         * \param queueEmpty True if no requests are left in the queue
+         */
+        bool ShouldShed(const clock_t::time_point now, const clock_t::duration sojourn, const bool queueEmpty) {
+            const auto ok_to_drop = IsAboveTarget(now, sojourn, queueEmpty);
+
+            if (dropping_) {
+                if (!ok_to_drop) {
+                    dropping_ = false;
+                    return false;
+                }
+                if (now >= drop_next_) {
+                    ++count_;
+                    drop_next_ = ControlLaw(drop_next_);
+                    return true;
+                }
+                return false;
             }
 
-            if (!mimeType.empty()) {
-                curl_mime_type(part, mimeType.c_str());
+            if (ok_to_drop) {
+                dropping_ = true;
+                // Start close to the old drop rate if we were dropping recently
+                count_ = ((count_ > 2) && (now - drop_next_ < policy_.interval * 16)) ? count_ - 2 : 1;
+                drop_next_ = ControlLaw(now);
+                return true;
             }
+            return false;
         }
 
-    private:
-        void CallCompletion(CURLcode cc) {
-            Result result(cc);
+        bool IsShedding() const noexcept { return dropping_; }
 
-            curl_easy_getinfo (*eh_, CURLINFO_RESPONSE_CODE,
-                               &result.http_response_code);
-            RESTINCURL_LOG("Complete: http code: " << result.http_response_code);
-            if (completion_) {
-                if (!default_data_buffer_.empty()) {
-                    result.body = std::move(default_data_buffer_);
-                }
-                completion_(result);
+    private:
+        bool IsAboveTarget(const clock_t::time_point now, const clock_t::duration sojourn, const bool queueEmpty) {
+            if ((sojourn < policy_.target) || queueEmpty) {
+                have_first_above_ = false;
+                return false;
+            }
+            if (!have_first_above_) {
+                first_above_ = now + policy_.interval;
+                have_first_above_ = true;
+                return false;
             }
+            return now >= first_above_;
         }
 
-        void SetRequestType() {
-            switch(request_type_) {
-                case RequestType::GET:
-                    curl_easy_setopt(*eh_, CURLOPT_HTTPGET, 1L);
-                    break;
-                case RequestType::PUT:
-                    headers_ = curl_slist_append(headers_, "Transfer-Encoding: chunked");
-                    curl_easy_setopt(*eh_, CURLOPT_UPLOAD, 1L);
-                    break;
-                case RequestType::POST:
-                    headers_ = curl_slist_append(headers_, "Transfer-Encoding: chunked");
-                    curl_easy_setopt(*eh_, CURLOPT_UPLOAD, 0L);
-                    curl_easy_setopt(*eh_, CURLOPT_POST, 1L);
-                    break;
-                case RequestType::HEAD:
-                    curl_easy_setopt(*eh_, CURLOPT_NOBODY, 1L);
-                    break;
-                case RequestType::OPTIONS:
-                    curl_easy_setopt(*eh_, CURLOPT_CUSTOMREQUEST, "OPTIONS");
+        clock_t::time_point ControlLaw(const clock_t::time_point when) const {
+            return when + std::chrono::duration_cast<clock_t::duration>(
+                std::chrono::duration<double, std::milli>(policy_.interval) / std::sqrt(static_cast<double>(count_)));
+        }
+
+        LoadSheddingPolicy policy_;
+        clock_t::time_point first_above_;
+        clock_t::time_point drop_next_;
+        unsigned count_ = 0;
+        bool have_first_above_ = false;
+        bool dropping_ = false;
+    };
+
+    /*! Content encodings (compression) for HTTP payloads */
+    enum class Encoding { GZIP, DEFLATE, BR, ZSTD };
+
+    /*! Get the value for `CURLOPT_ACCEPT_ENCODING` for a list of encodings.
+     *
+     * Encodings that the libcurl we use can not decode are left out. An empty
+     * list means all the encodings libcurl support.
+     *
+     * \param encodings Encodings we will accept
+     * \param value Receives the value for the option
+     * \returns false if none of the encodings are supported by libcurl
+     */
+    inline bool GetAcceptEncoding(std::initializer_list<Encoding> encodings, std::string& value) {
+        value.clear();
+        if (encodings.size() == 0) {
+            return true;
+        }
+
+        const auto features = curl_version_info(CURLVERSION_NOW)->features;
+        for(const auto encoding : encodings) {
+            const char *name = nullptr;
+            switch(encoding) {
+                case Encoding::GZIP:
+                    name = (features & CURL_VERSION_LIBZ) ? "gzip" : nullptr;
                     break;
-                case RequestType::PATCH:
-                    headers_ = curl_slist_append(headers_, "Transfer-Encoding: chunked");
-                    curl_easy_setopt(*eh_, CURLOPT_CUSTOMREQUEST, "PATCH");
+                case Encoding::DEFLATE:
+                    name = (features & CURL_VERSION_LIBZ) ? "deflate" : nullptr;
                     break;
-                case RequestType::DELETE:
-                    curl_easy_setopt(*eh_, CURLOPT_CUSTOMREQUEST, "DELETE");
+                case Encoding::BR:
+#ifdef CURL_VERSION_BROTLI
+                    name = (features & CURL_VERSION_BROTLI) ? "br" : nullptr;
+#endif
                     break;
-                case RequestType::POST_MIME:
-                    InitMime();
-                    curl_easy_setopt(*eh_, CURLOPT_MIMEPOST, mime_);
+                case Encoding::ZSTD:
+#ifdef CURL_VERSION_ZSTD
+                    name = (features & CURL_VERSION_ZSTD) ? "zstd" : nullptr;
+#endif
                     break;
-                default:
-                    throw Exception("Unsupported request type" + std::to_string(static_cast<int>(request_type_)));
+            }
+
+            if (name) {
+                if (!value.empty()) {
+                    value += ", ";
+                }
+                value += name;
             }
         }
 
-        EasyHandle::ptr_t eh_;
-        RequestType request_type_ = RequestType::INVALID;
-        completion_fn_t completion_;
-        std::unique_ptr<DataHandlerBase> default_out_handler_;
-        std::unique_ptr<DataHandlerBase> default_in_handler_;
-        headers_t headers_ = nullptr;
-        std::string default_data_buffer_;
-        std::shared_ptr<FILE> fp_;
-        curl_mime *mime_ = {};
-    };
+        return !value.empty();
+    }
 
-#if RESTINCURL_ENABLE_ASYNC
+    /*! Get the scheme, host and port from an URL, like "https://example.com:443"
+     *
+     * Used to group requests to the same server. User-info, path and query are left out,
+     * and the result is in lower case.
+     */
+    inline std::string GetHostKey(const std::string& url) {
+        auto begin = url.find("://");
+        begin = (begin == std::string::npos) ? 0 : begin + 3;
+        auto end = url.find_first_of("/?#", begin);
+        if (end == std::string::npos) {
+            end = url.size();
+        }
+        const auto at = url.find('@', begin);
+        const auto host_begin = ((at != std::string::npos) && (at < end)) ? at + 1 : begin;
 
-    class Signaler {
-        enum FdUsage { FD_READ = 0, FD_WRITE = 1};
+        std::string key;
+        key.reserve((begin - 0) + (end - host_begin));
+        auto lower = [](char ch) {
+            return static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+        };
+        std::transform(url.begin(), url.begin() + begin, std::back_inserter(key), lower);
+        std::transform(url.begin() + host_begin, url.begin() + end, std::back_inserter(key), lower);
+        return key;
+    }
+
+    /*! Get the path, query and fragment from an URL.
+     *
+     * This is what remains after the part returned by `GetHostKey()`.
+     */
+    inline std::string GetUrlPath(const std::string& url) {
+        auto begin = url.find("://");
+        begin = (begin == std::string::npos) ? 0 : begin + 3;
+        const auto path = url.find_first_of("/?#", begin);
+        return (path == std::string::npos) ? std::string{} : url.substr(path);
+    }
 
+    /*! In-memory cache for HTTP responses.
+     *
+     * This is a private cache, as described in RFC 9111, for GET requests.
+     * It is sharded on the cache-key, and each shard is a LRU list bounded by
+     * `CacheOptions::max_bytes / CacheOptions::shards` bytes.
+     *
+     * Entries are immutable and shared. When a stale entry is confirmed by the server,
+     * it is replaced by a new entry that shares the body with the old one.
+     *
+     * See `Client::EnableCache()`
+     */
+    class ResponseCache {
     public:
-        using pipefd_t = std::array<int, 2>;
+        struct Entry {
+            std::string key; // Method and URL
+
+            // Names (lower case) and values of the request headers listed in `Vary`
+            std::vector<std::pair<std::string, std::string>> vary;
+
+            std::shared_ptr<const std::string> body;
+            std::map<std::string, std::string> headers;
+            long http_code = 200;
+            std::string etag;
+            std::string last_modified;
+            std::chrono::seconds lifetime = {};
+            std::chrono::steady_clock::time_point expires;
+        };
+        using entry_ptr_t = std::shared_ptr<const Entry>;
 
-        Signaler() {
-            auto status = pipe(pipefd_.data());
-            if (status) {
-                throw SystemException("pipe", status);
+        // Gets the value of a request-header. Used to match `Vary`
+        using header_fn_t = std::function<bool (const std::string& name, std::string& value)>;
+
+        ResponseCache(const CacheOptions& options, Metrics& metrics)
+        : metrics_{metrics}, shards_(std::max<size_t>(1, options.shards))
+        , share_bodies_{options.share_bodies}
+        {
+            max_shard_bytes_ = options.max_bytes / shards_.size();
+        }
+
+        Metrics& GetMetrics() noexcept { return metrics_; }
+
+        /*! Check if the bodies are returned in `Result::shared_body`. See `CacheOptions::share_bodies` */
+        bool SharesBodies() const noexcept { return share_bodies_; }
+
+        static std::string MakeKey(const char *method, const std::string& url) {
+            std::string key;
+            key.reserve(url.size() + 8);
+            key = method;
+            key += ' ';
+            key += url;
+            return key;
+        }
+
+        /*! Find an entry, fresh or stale, that matches the request */
+        entry_ptr_t Find(const std::string& key, const header_fn_t& getHeader) {
+            auto& shard = GetShard(key);
+            lock_t lock(shard.mutex);
+            auto it = shard.index.find(key);
+            if (it == shard.index.end()) {
+                return {};
             }
-            for(auto fd : pipefd_) {
-                int flags = 0;
-                if (-1 == (flags = fcntl(fd, F_GETFL, 0)))
-                    flags = 0;
-                fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+            for(auto& pos : it->second) {
+                if (Matches(**pos, getHeader)) {
+                    shard.lru.splice(shard.lru.begin(), shard.lru, pos);
+                    return *pos;
+                }
             }
+            return {};
         }
 
-        ~Signaler() {
-            for(auto fd : pipefd_) {
-                close(fd);
+        /*! Add an entry, replacing the entry for the same key and `Vary` values */
+        void Store(entry_ptr_t entry) {
+            assert(entry);
+            const auto size = GetSize(*entry);
+            if (size > max_shard_bytes_) {
+                return;
+            }
+
+            auto& shard = GetShard(entry->key);
+            lock_t lock(shard.mutex);
+            auto& variants = shard.index[entry->key];
+            for(auto it = variants.begin(); it != variants.end(); ++it) {
+                if ((**it)->vary == entry->vary) {
+                    shard.bytes -= GetSize(***it);
+                    shard.lru.erase(*it);
+                    variants.erase(it);
+                    break;
+                }
+            }
+
+            shard.lru.push_front(std::move(entry));
+            variants.push_back(shard.lru.begin());
+            shard.bytes += size;
+
+            while(shard.bytes > max_shard_bytes_) {
+                auto& victim = shard.lru.back();
+                auto& list = shard.index[victim->key];
+                list.erase(std::find(list.begin(), list.end(), std::prev(shard.lru.end())));
+                if (list.empty()) {
+                    shard.index.erase(victim->key);
+                }
+                shard.bytes -= GetSize(*victim);
+                shard.lru.pop_back();
             }
         }
 
-        void Signal() {
-            char byte = {};
-            RESTINCURL_LOG_TRACE("Signal: Signaling!");
-            if (write(pipefd_[FD_WRITE], &byte, 1) != 1) {
-                throw SystemException("write pipe", errno);
+        /*! Remove all the entries */
+        void Clear() {
+            for(auto& shard : shards_) {
+                lock_t lock(shard.mutex);
+                shard.lru.clear();
+                shard.index.clear();
+                shard.bytes = 0;
             }
         }
 
-        int GetReadFd() { return pipefd_[FD_READ]; }
+        /*! Get the freshness lifetime of a response from its `Cache-Control` header
+         *
+         * \param value The value of the header
+         * \param lifetime Receives the lifetime, from `max-age`. 0 for `no-cache`.
+         * \returns false if the response must not be stored (`no-store`).
+         */
+        static bool ParseCacheControl(const std::string& value, std::chrono::seconds& lifetime) {
+            lifetime = {};
+            bool no_cache = false;
+            size_t pos = 0;
+            while(pos < value.size()) {
+                auto end = value.find(',', pos);
+                if (end == std::string::npos) {
+                    end = value.size();
+                }
 
-        bool WasSignalled() {
-            bool rval = false;
-            char byte = {};
-            while(read(pipefd_[FD_READ], &byte, 1) > 0) {
-                RESTINCURL_LOG_TRACE("Signal: Was signalled");
-                rval = true;
+                std::string directive;
+                for(auto i = pos; i < end; ++i) {
+                    const auto ch = static_cast<unsigned char>(value[i]);
+                    if (!std::isspace(ch)) {
+                        directive += static_cast<char>(std::tolower(ch));
+                    }
+                }
+                pos = end + 1;
+
+                if (directive == "no-store") {
+                    return false;
+                }
+                if (directive == "no-cache") {
+                    no_cache = true;
+                } else if (directive.compare(0, 8, "max-age=") == 0) {
+                    lifetime = std::chrono::seconds(std::strtol(directive.c_str() + 8, nullptr, 10));
+                }
             }
 
-            return rval;
+            if (no_cache) {
+                lifetime = {};
+            }
+            return true;
         }
 
     private:
-        pipefd_t pipefd_;
-    };
-    
-    /*! Thread support for the TLS layer used by libcurl.
-     * 
-     * Some TLS libraries require that you supply callback functions
-     * to deal with thread synchronization.
-     * 
-     * See https://curl.haxx.se/libcurl/c/threadsafe.html
-     * 
-     * You can deal with this yourself, or in the case
-     * that RESTinCurl support your TLS library, you can use
-     * this class.
-     * 
-     * Currently supported libraries:
-     * 
-     *  - Opeenssl (only required for OpenSSL <= 1.0.2) 
-     *      define `RESTINCURL_WITH_OPENSSL_THREADS`
-     * 
-     * The class is written so that you can use it in your code, and
-     * it will only do something when the appropriate define is set.
-     * 
-     * This class is only available when `RESTINCURL_ENABLE_ASYNC` is nonzero.
+        struct Shard {
+            std::mutex mutex;
+            std::list<entry_ptr_t> lru;
+            std::unordered_map<std::string, std::vector<std::list<entry_ptr_t>::iterator>> index;
+            size_t bytes = 0;
+        };
+
+        Shard& GetShard(const std::string& key) {
+            return shards_[std::hash<std::string>{}(key) % shards_.size()];
+        }
+
+        static size_t GetSize(const Entry& entry) noexcept {
+            return (entry.body ? entry.body->size() : 0) + entry.key.size() + sizeof(Entry);
+        }
+
+        static bool Matches(const Entry& entry, const header_fn_t& getHeader) {
+            std::string value;
+            for(const auto& v : entry.vary) {
+                if (!getHeader(v.first, value)) {
+                    value.clear();
+                }
+                if (value != v.second) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        Metrics& metrics_;
+        std::vector<Shard> shards_;
+        bool share_bodies_ = false;
+        size_t max_shard_bytes_ = {};
+    };
+
+    class HeaderList;
+
+    /*! Settings and state shared by a Client and the requests it makes. */
+    class ClientContext {
+        // The most recent response-times from one host
+        struct LatencyWindow {
+            std::array<uint32_t, 128> samples;
+            size_t count = 0;
+            size_t next = 0;
+        };
+
+    public:
+        /*! Minimum number of samples before we trust a percentile. */
+        static constexpr size_t min_latency_samples = 20;
+        Metrics& GetMetrics() noexcept {
+            return metrics_;
+        }
+
+        /*! Set the default for `RequestBuilder::AcceptCompressed()` */
+        void SetAcceptEncoding(std::initializer_list<Encoding> encodings) {
+            std::string value;
+            const auto enable = ::restincurl::GetAcceptEncoding(encodings, value);
+            lock_t lock(mutex_);
+            accept_encoding_ = std::move(value);
+            have_accept_encoding_ = enable;
+        }
+
+        /*! Get the default value for `CURLOPT_ACCEPT_ENCODING`
+         *
+         * \returns false if there is no default
+         */
+        bool GetAcceptEncoding(std::string& value) const {
+            lock_t lock(mutex_);
+            value = accept_encoding_;
+            return have_accept_encoding_;
+        }
+
+        /*! Limit the extra load from hedged requests.
+         *
+         * \param ratio Hedged copies we may send for each hedged request, on average.
+         * \param burst Hedged copies we may send in a burst.
+         *
+         * The default is 0.1 and 10; at most 10% extra load over time.
+         * See `RequestBuilder::Hedge()`
+         */
+        void SetHedgeBudget(const double ratio, const double burst = 10.0) {
+            lock_t lock(mutex_);
+            hedge_ratio_ = std::max(0.0, ratio);
+            hedge_burst_ = std::max(0.0, burst);
+            hedge_tokens_ = std::min(hedge_tokens_, hedge_burst_);
+        }
+
+        /*! Enable a circuit breaker for each host.
+         *
+         * See `Client::SetCircuitBreaker()`
+         */
+        void SetCircuitBreaker(const CircuitBreakerPolicy& policy) {
+            auto ptr = std::make_shared<const CircuitBreakerPolicy>(policy);
+            lock_t lock(mutex_);
+            circuit_breaker_ = std::move(ptr);
+        }
+
+        /*! Disable the circuit breaker */
+        void DisableCircuitBreaker() {
+            lock_t lock(mutex_);
+            circuit_breaker_.reset();
+        }
+
+        /*! Get the circuit breaker policy, or nullptr if it is disabled. */
+        std::shared_ptr<const CircuitBreakerPolicy> GetCircuitBreaker() const {
+            lock_t lock(mutex_);
+            return circuit_breaker_;
+        }
+
+        /*! Enable the response cache. See `Client::EnableCache()` */
+        void EnableCache(const CacheOptions& options) {
+            auto cache = std::make_shared<ResponseCache>(options, metrics_);
+            lock_t lock(mutex_);
+            cache_ = std::move(cache);
+        }
+
+        /*! Disable the response cache and drop its content. */
+        void DisableCache() {
+            lock_t lock(mutex_);
+            cache_.reset();
+        }
+
+        /*! Get the response cache, or nullptr if it is disabled */
+        std::shared_ptr<ResponseCache> GetCache() const {
+            lock_t lock(mutex_);
+            return cache_;
+        }
+
+        /*! Replace the default headers. See `Client::SetDefaultHeaders()` */
+        void SetDefaultHeaders(std::shared_ptr<const HeaderList> headers) {
+            lock_t lock(mutex_);
+            default_headers_.swap(headers);
+        }
+
+        /*! Get the default headers, or nullptr if there are none */
+        std::shared_ptr<const HeaderList> GetDefaultHeaders() const {
+            lock_t lock(mutex_);
+            return default_headers_;
+        }
+
+        using rate_limits_t = std::vector<std::pair<std::string, RateLimit>>;
+
+        /*! Set or replace the rate limit for a host or URL prefix.
+         *
+         * See `Client::SetRateLimit()`
+         */
+        void SetRateLimit(const std::string& prefix, const RateLimit& limit) {
+            lock_t lock(mutex_);
+            auto it = std::find_if(rate_limits_.begin(), rate_limits_.end(), [&](const auto& v) {
+                return v.first == prefix;
+            });
+            if (it != rate_limits_.end()) {
+                it->second = limit;
+            } else {
+                rate_limits_.emplace_back(prefix, limit);
+            }
+            ++rate_limits_version_;
+        }
+
+        /*! Remove the rate limit for a host or URL prefix */
+        void RemoveRateLimit(const std::string& prefix) {
+            lock_t lock(mutex_);
+            rate_limits_.erase(std::remove_if(rate_limits_.begin(), rate_limits_.end(), [&](const auto& v) {
+                return v.first == prefix;
+            }), rate_limits_.end());
+            ++rate_limits_version_;
+        }
+
+        /*! Get a copy of the rate limits if they changed after `version`.
+         *
+         * \returns false if `version` is current.
+         */
+        bool GetRateLimits(unsigned& version, rate_limits_t& limits) const {
+            if (version == rate_limits_version_) {
+                return false;
+            }
+            lock_t lock(mutex_);
+            version = rate_limits_version_;
+            limits = rate_limits_;
+            return true;
+        }
+
+        // Called for each request that may be hedged
+        void AddHedgeBudget() {
+            lock_t lock(mutex_);
+            hedge_tokens_ = std::min(hedge_burst_, hedge_tokens_ + hedge_ratio_);
+        }
+
+        // Called before a hedged copy is sent
+        bool SpendHedgeBudget() {
+            lock_t lock(mutex_);
+            if (hedge_tokens_ < 1.0) {
+                return false;
+            }
+            hedge_tokens_ -= 1.0;
+            return true;
+        }
+
+        /*! Record the response-time for a request to a host */
+        void RecordLatency(const std::string& hostKey, const std::chrono::milliseconds latency) {
+            lock_t lock(mutex_);
+            auto& window = latency_[hostKey];
+            window.samples[window.next] = static_cast<uint32_t>(std::max<std::chrono::milliseconds::rep>(0, latency.count()));
+            window.next = (window.next + 1) % window.samples.size();
+            window.count = std::min(window.count + 1, window.samples.size());
+        }
+
+        /*! Get a percentile of the recent response-times for a host
+         *
+         * \param hostKey Host, as returned by `GetHostKey()`
+         * \param percentile 0.0 - 1.0. For example 0.95 for p95.
+         * \param latency Receives the response time
+         * \returns false if we don't have at least `min_latency_samples` for the host.
+         */
+        bool GetLatencyPercentile(const std::string& hostKey, const double percentile,
+                                  std::chrono::milliseconds& latency) const {
+            std::array<uint32_t, 128> samples;
+            size_t count = 0;
+            {
+                lock_t lock(mutex_);
+                auto it = latency_.find(hostKey);
+                if ((it == latency_.end()) || (it->second.count < min_latency_samples)) {
+                    return false;
+                }
+                count = it->second.count;
+                std::copy(it->second.samples.begin(), it->second.samples.begin() + count, samples.begin());
+            }
+
+            const auto pct = std::max(0.0, std::min(1.0, percentile));
+            const auto nth = std::min(count - 1, static_cast<size_t>(pct * count));
+            std::nth_element(samples.begin(), samples.begin() + nth, samples.begin() + count);
+            latency = std::chrono::milliseconds(samples[nth]);
+            return true;
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        Metrics metrics_;
+        std::string accept_encoding_;
+        bool have_accept_encoding_ = false;
+        double hedge_ratio_ = 0.1;
+        double hedge_burst_ = 10.0;
+        double hedge_tokens_ = 10.0;
+        std::map<std::string, LatencyWindow> latency_;
+        std::shared_ptr<const CircuitBreakerPolicy> circuit_breaker_;
+        rate_limits_t rate_limits_;
+        std::atomic<unsigned> rate_limits_version_{0};
+        std::shared_ptr<ResponseCache> cache_;
+        std::shared_ptr<const HeaderList> default_headers_;
+    };
+
+    /*! Base class for RESTinCurl exceptions */
+    class Exception : public std::runtime_error {
+    public:
+        Exception(const std::string& msg) : runtime_error(msg) {}
+    };
+
+    /*! Exception thrown when some system function, like `pipe()` failed. */
+    class SystemException : public Exception {
+    public:
+        SystemException(const std::string& msg, const int e) : Exception(msg + " " + strerror(e)), err_{e} {}
+
+        int getErrorCode() const noexcept { return err_; }
+
+    private:
+        const int err_;
+    };
+
+    /*! Exception thrown when a curl library method failed. */
+    class CurlException : public Exception {
+    public:
+        CurlException(const std::string msg, const CURLcode err)
+            : Exception(msg + '(' + std::to_string(err) + "): " + curl_easy_strerror(err))
+            , err_{err}
+            {}
+
+         CurlException(const std::string msg, const CURLMcode err)
+            : Exception(msg + '(' + std::to_string(err) + "): " + curl_multi_strerror(err))
+            , err_{err}
+            {}
+
+        int getErrorCode() const noexcept { return err_; }
+
+    private:
+        const int err_;
+    };
+
+    /*! A value for a part of an URL: a string or an integer.
+     *
+     * Used by `Url` and `RouteTemplate`, so that values can be given without
+     * converting them to `std::string` first.
      */
-    class TlsLocker 
-    {
+    class UrlArg {
     public:
-        
-#ifdef RESTINCURL_WITH_OPENSSL_THREADS 
-    static void opensslLockCb(int mode, int type, char *, int) {
-        if(mode & CRYPTO_LOCK) {
-           lock();
+        UrlArg(const std::string& value) noexcept
+        : data_{value.data()}, size_{value.size()} {}
+
+        UrlArg(const char *value) noexcept
+        : data_{value}, size_{std::strlen(value)} {}
+
+        template <typename T, typename = std::enable_if_t<std::is_integral<T>::value
+            && !std::is_same<T, bool>::value && !std::is_same<T, char>::value>>
+        UrlArg(const T value) noexcept {
+            using unsigned_t = std::make_unsigned_t<T>;
+            const bool negative = value < 0;
+            auto v = negative ? static_cast<unsigned_t>(0 - static_cast<unsigned_t>(value))
+                              : static_cast<unsigned_t>(value);
+            auto end = number_ + sizeof(number_);
+            auto p = end;
+            do {
+                *--p = static_cast<char>('0' + (v % 10));
+                v /= 10;
+            } while(v);
+            if (negative) {
+                *--p = '-';
+            }
+            number_begin_ = static_cast<uint8_t>(p - number_);
+            size_ = static_cast<size_t>(end - p);
         }
-        else {
-           unlock();
+
+        const char *Data() const noexcept {
+            return data_ ? data_ : number_ + number_begin_;
         }
-    }
-    
-    static unsigned long getThreadId(void) {
-        return reinterpret_cast<unsigned long>(::this_thread::get_id());
-    }
-    
-    /*! Enable the built-in support. */
-    static void tlsLockInit() {
-        CRYPTO_set_id_callback((unsigned long (*)())getThreadId);
-        CRYPTO_set_locking_callback((void (*)())opensslLockCb);
-    }
-    
-    /*! Free up resources used when finished using TLS. */
-    static void tlsLockKill() {
-        CRYPTO_set_locking_callback(NULL);
-    }
-    
-#else
-    /*! Enable the built-in support. */
-    static void tlsLOckInit() {
-        ; // Do nothing
-    }
-    
-    /*! Free up resources used when finished using TLS. */
-    static void tlsLockKill() {
-        ; // Do nothing
-    }
-#endif
 
+        size_t Size() const noexcept { return size_; }
 
-    
+    private:
+        const char *data_ = {};
+        size_t size_ = 0;
+        uint8_t number_begin_ = 0;
+        char number_[24] = {};
+    };
+
+    /*! Percent-encoding of the parts of an URL, as described in RFC 3986 */
+    class UrlEncoder {
+    public:
+        enum class Component {
+            /*! One segment in the path. '/' is encoded. */
+            PATH_SEGMENT,
+
+            /*! A key or value in the query. Only unreserved characters are left as they are. */
+            QUERY
+        };
+
+        /*! Append the value to out, percent-encoded for the component.
+         *
+         * Most values have nothing that needs to be encoded. We look for the first
+         * character that does with a table-lookup, and append the rest in one go.
+         * Otherwise, the exact size is calculated first, so out grows once.
+         */
+        static void Append(std::string& out, const UrlArg& value, const Component component) {
+            const auto mask = (component == Component::QUERY) ? QUERY_OK : PATH_OK;
+            const auto& table = GetTable();
+            const auto data = reinterpret_cast<const unsigned char *>(value.Data());
+            const auto len = value.Size();
+
+            size_t i = 0;
+            while((i < len) && (table[data[i]] & mask)) {
+                ++i;
+            }
+            if (i == len) {
+                out.append(value.Data(), len);
+                return;
+            }
+
+            size_t extra = 0;
+            for(auto j = i; j < len; ++j) {
+                if (!(table[data[j]] & mask)) {
+                    extra += 2;
+                }
+            }
+
+            static const char hex[] = "0123456789ABCDEF";
+            const auto start = out.size();
+            out.resize(start + len + extra);
+            auto dst = &out[start];
+            std::memcpy(dst, data, i);
+            dst += i;
+            for(; i < len; ++i) {
+                const auto ch = data[i];
+                if (table[ch] & mask) {
+                    *dst++ = static_cast<char>(ch);
+                } else {
+                    *dst++ = '%';
+                    *dst++ = hex[ch >> 4];
+                    *dst++ = hex[ch & 0x0f];
+                }
+            }
+        }
+
+        static std::string Encode(const UrlArg& value, const Component component) {
+            std::string out;
+            out.reserve(value.Size());
+            Append(out, value, component);
+            return out;
+        }
 
     private:
-        static void lock() {
-            mutex_.lock();
+        enum : uint8_t { PATH_OK = 1, QUERY_OK = 2 };
+
+        static const std::array<uint8_t, 256>& GetTable() noexcept {
+            static const auto table = MakeTable();
+            return table;
         }
-        
-        static void unlock() {
-            mutex_.unlock();
+
+        static std::array<uint8_t, 256> MakeTable() noexcept {
+            std::array<uint8_t, 256> table = {};
+            for(int ch = 0; ch < 256; ++ch) {
+                if (std::isalnum(ch) && (ch < 128)) {
+                    table[ch] = PATH_OK | QUERY_OK;
+                }
+            }
+            for(auto ch : "-._~") {
+                table[static_cast<unsigned char>(ch)] = PATH_OK | QUERY_OK;
+            }
+            // sub-delims, ':' and '@' are allowed in a path segment
+            for(auto ch : "!$&'()*+,;=:@") {
+                table[static_cast<unsigned char>(ch)] |= PATH_OK;
+            }
+            table[0] = 0;
+            return table;
         }
-        
-        static std::mutex mutex_;
     };
-    
-    class Worker {
-        class WorkerThread {
-        public:
-            WorkerThread(std::function<void ()> && fn)
-            : thread_{std::move(fn)} {}
 
-            ~WorkerThread() {
-                if (thread_.get_id() == std::this_thread::get_id()) {
-                    // Allow the thread to finish exiting the lambda
-                    thread_.detach();
+    /*! A route, like "/users/{id}/orders", with named parameters in curly braces.
+     *
+     * The route is parsed once, when the instance is constructed, so it is
+     * meant to be kept, for example as a static const. Use it with `Url::Route()`.
+     * The literal parts are used as they are. The parameter values are
+     * percent-encoded as path segments.
+     */
+    class RouteTemplate {
+    public:
+        /*! \throws Exception if a '{' is not closed */
+        explicit RouteTemplate(const std::string& route) {
+            size_t pos = 0;
+            while(true) {
+                const auto begin = route.find('{', pos);
+                if (begin == std::string::npos) {
+                    literals_.emplace_back(route.substr(pos));
+                    break;
+                }
+                const auto end = route.find('}', begin);
+                if (end == std::string::npos) {
+                    throw Exception{"Unterminated parameter in route: " + route};
+                }
+                literals_.emplace_back(route.substr(pos, begin - pos));
+                names_.emplace_back(route.substr(begin + 1, end - begin - 1));
+                pos = end + 1;
+            }
+            for(const auto& literal : literals_) {
+                literal_size_ += literal.size();
+            }
+        }
+
+        /*! Names of the parameters, in order */
+        const std::vector<std::string>& GetNames() const noexcept { return names_; }
+
+        /*! Append the route to out, with the values for the parameters.
+         *
+         * \throws Exception if the number of values don't match the parameters
+         */
+        void Expand(std::string& out, const UrlArg *values, const size_t count) const {
+            if (count != names_.size()) {
+                throw Exception{"Wrong number of values for route"};
+            }
+            auto size = out.size() + literal_size_;
+            for(size_t i = 0; i < count; ++i) {
+                size += values[i].Size();
+            }
+            out.reserve(size);
+            for(size_t i = 0; i < count; ++i) {
+                out += literals_[i];
+                UrlEncoder::Append(out, values[i], UrlEncoder::Component::PATH_SEGMENT);
+            }
+            out += literals_.back();
+        }
+
+    private:
+        std::vector<std::string> literals_;
+        std::vector<std::string> names_;
+        size_t literal_size_ = 0;
+    };
+
+    /*! Build an URL with correctly encoded path segments and query arguments.
+     *
+     * Example:
+     * \code
+     * static const RouteTemplate orders{"/users/{id}/orders"};
+     *
+     * Url url{"https://api.example.com/v1"};
+     * url.Route(orders, 42).Query("status", "in transit").Query("limit", 10);
+     * // https://api.example.com/v1/users/42/orders?status=in%20transit&limit=10
+     * \endcode
+     *
+     * Everything is appended to one buffer, which is reserved up front.
+     * An `Url` can be given where a `std::string` url is expected, like in
+     * `RequestBuilder::Get()`.
+     */
+    class Url {
+    public:
+        /*! Constructor
+         *
+         * \param base The start of the URL, like "https://api.example.com/v1".
+         *      It is used as it is.
+         * \param reserve Bytes to reserve for the complete URL
+         */
+        explicit Url(std::string base, const size_t reserve = 256)
+        : url_{std::move(base)}
+        , have_query_{url_.find('?') != std::string::npos}
+        {
+            url_.reserve(std::max(reserve, url_.size()));
+        }
+
+        /*! Append one path segment. A '/' is added before it, if needed.
+         *
+         * \throws Exception if a query argument is already added
+         */
+        Url& Path(const UrlArg& segment) {
+            AssertNoQuery();
+            if (url_.empty() || (url_.back() != '/')) {
+                url_ += '/';
+            }
+            UrlEncoder::Append(url_, segment, UrlEncoder::Component::PATH_SEGMENT);
+            return *this;
+        }
+
+        /*! Append a route, with the values for its parameters.
+         *
+         * \throws Exception if the number of values don't match the parameters in the route,
+         *      or if a query argument is already added
+         */
+        template <typename... Args>
+        Url& Route(const RouteTemplate& route, const Args&... values) {
+            AssertNoQuery();
+            if (!url_.empty() && (url_.back() == '/')) {
+                url_.pop_back();
+            }
+            const std::array<UrlArg, sizeof...(Args)> args = {{UrlArg(values)...}};
+            route.Expand(url_, args.data(), args.size());
+            return *this;
+        }
+
+        /*! Append a query argument. Both key and value are percent-encoded. */
+        Url& Query(const UrlArg& key, const UrlArg& value) {
+            AppendQuery(url_, have_query_, key, value);
+            return *this;
+        }
+
+        const std::string& Str() const noexcept { return url_; }
+
+        operator const std::string& () const noexcept { return url_; }
+
+        /*! Append a query argument to an url.
+         *
+         * \param url The url
+         * \param haveQuery True if the url already has a '?'. Set to true.
+         * \param key The key
+         * \param value The value
+         */
+        static void AppendQuery(std::string& url, bool& haveQuery, const UrlArg& key, const UrlArg& value) {
+            url.reserve(url.size() + key.Size() + value.Size() + 2);
+            url += haveQuery ? '&' : '?';
+            haveQuery = true;
+            UrlEncoder::Append(url, key, UrlEncoder::Component::QUERY);
+            url += '=';
+            UrlEncoder::Append(url, value, UrlEncoder::Component::QUERY);
+        }
+
+    private:
+        void AssertNoQuery() const {
+            if (have_query_) {
+                throw Exception{"The path can not be changed after the query"};
+            }
+        }
+
+        std::string url_;
+        bool have_query_ = false;
+    };
+
+    /*! A small thread-local cache of memory blocks of one size.
+     *
+     * Used for objects that are created and deleted over and over
+     * again by the same thread, like `RequestBuilder`.
+     */
+    template <size_t Size, size_t MaxBlocks = 8>
+    class BlockCache {
+    public:
+        static void *Allocate() {
+            auto& cache = Instance();
+            if (cache.count_) {
+                return cache.blocks_[--cache.count_];
+            }
+            return ::operator new(Size);
+        }
+
+        static void Free(void *block) noexcept {
+            auto& cache = Instance();
+            if (cache.count_ < MaxBlocks) {
+                cache.blocks_[cache.count_++] = block;
+                return;
+            }
+            ::operator delete(block);
+        }
+
+    private:
+        BlockCache() = default;
+
+        ~BlockCache() {
+            while(count_) {
+                ::operator delete(blocks_[--count_]);
+            }
+        }
+
+        static BlockCache& Instance() noexcept {
+            static thread_local BlockCache cache;
+            return cache;
+        }
+
+        void *blocks_[MaxBlocks] = {};
+        size_t count_ = 0;
+    };
+
+    /*! An immutable list of HTTP headers that can be shared by many requests.
+     *
+     * libcurl only reads the header-list during a transfer, so any number of
+     * requests can use the same list at the same time.
+     */
+    class HeaderList {
+    public:
+        using ptr_t = std::shared_ptr<const HeaderList>;
+
+        HeaderList() = default;
+
+        /*! Take ownership of a curl_slist */
+        explicit HeaderList(curl_slist *list) noexcept
+        : list_{list} {}
+
+        /*! Create a list from header-lines, like "Accept: application/json" */
+        HeaderList(std::initializer_list<std::string> lines) {
+            for(const auto& line : lines) {
+                auto list = curl_slist_append(list_, line.c_str());
+                if (!list) {
+                    throw Exception{"curl_slist_append() failed"};
+                }
+                list_ = list;
+            }
+        }
+
+        HeaderList(const HeaderList&) = delete;
+        HeaderList& operator = (const HeaderList&) = delete;
+
+        ~HeaderList() {
+            if (list_) {
+                curl_slist_free_all(list_);
+            }
+        }
+
+        curl_slist *Get() const noexcept { return list_; }
+
+        bool Empty() const noexcept { return list_ == nullptr; }
+
+        /*! Check if two header-lines have the same (case-insensitive) name */
+        static bool SameName(const char *a, const char *b) noexcept {
+            for(; *a && (*a != ':') && (*b != ':'); ++a, ++b) {
+                if (std::tolower(static_cast<unsigned char>(*a))
+                    != std::tolower(static_cast<unsigned char>(*b))) {
+                    return false;
+                }
+            }
+            return (*a == ':') && (*b == ':');
+        }
+
+        /*! Check if the list has a header with the same name as line */
+        bool HasName(const char *line) const noexcept {
+            for(auto h = list_; h; h = h->next) {
+                if (SameName(h->data, line)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /*! Make a list with the lines from top, followed by the lines from bottom
+         * that are not overridden by a header with the same name in top.
+         */
+        static ptr_t Merge(const HeaderList& top, const HeaderList& bottom) {
+            curl_slist *list = {};
+            auto append = [&list](const char *line) {
+                auto l = curl_slist_append(list, line);
+                if (!l) {
+                    if (list) {
+                        curl_slist_free_all(list);
+                    }
+                    throw Exception{"curl_slist_append() failed"};
+                }
+                list = l;
+            };
+            for(auto h = top.list_; h; h = h->next) {
+                append(h->data);
+            }
+            for(auto h = bottom.list_; h; h = h->next) {
+                if (!top.HasName(h->data)) {
+                    append(h->data);
+                }
+            }
+            return std::make_shared<HeaderList>(list);
+        }
+
+    private:
+        curl_slist *list_ = {};
+    };
+
+    class EasyHandle {
+    public:
+        using ptr_t = std::unique_ptr<EasyHandle>;
+        using handle_t = decltype(curl_easy_init());
+
+        EasyHandle() {
+            RESTINCURL_LOG("EasyHandle created: " << handle_);
+        }
+
+        /*! Take ownership of an existing curl easy handle */
+        explicit EasyHandle(handle_t handle)
+        : handle_{handle}
+        {
+            if (!handle_) {
+                throw Exception("Invalid (null) easy-handle");
+            }
+            RESTINCURL_LOG("EasyHandle adopted: " << handle_);
+        }
+
+        /*! Create a new EasyHandle with a copy of all the options set on this one.
+         *
+         * Note that pointers given to curl (like header lists and callback data)
+         * are copied as is. The caller must make sure they outlive the copy.
+         */
+        ptr_t Duplicate() const {
+            assert(handle_);
+            auto h = curl_easy_duphandle(handle_);
+            if (!h) {
+                throw Exception("curl_easy_duphandle() failed");
+            }
+            return std::make_unique<EasyHandle>(h);
+        }
+
+        ~EasyHandle() {
+            Close();
+        }
+
+        void Close() {
+            if (handle_) {
+                RESTINCURL_LOG("Cleaning easy-handle " << handle_);
+                curl_easy_cleanup(handle_);
+                handle_ = nullptr;
+            }
+        }
+
+        operator handle_t () const noexcept { return handle_; }
+
+    private:
+        handle_t handle_ = curl_easy_init();
+    };
+
+    /*! Curl option wrapper class
+     * 
+     * This is just a thin C++ wrapper over Curl's `curl_easy_setopt()` method.
+     */
+    class Options {
+    public:
+        Options(EasyHandle& eh) : eh_{eh} {}
+
+        /*! Set an option 
+         * 
+         * \param opt CURLoption enum to change
+         * \param value Value to set
+         */
+        template <typename T>
+        Options& Set(const CURLoption& opt, const T& value) {
+            const auto ret = curl_easy_setopt(eh_, opt, value);
+            if (ret) {
+                throw CurlException(
+                    std::string("Setting option ") + std::to_string(opt), ret);
+            }
+            return *this;
+        }
+
+        /*! Set an option 
+         * 
+         * \param opt CURLoption enum to change
+         * \param value String value to set
+         */
+        Options& Set(const CURLoption& opt, const std::string& value) {
+            return Set(opt, value.c_str());
+        }
+
+    private:
+        EasyHandle& eh_;
+    };
+
+    /*! Abstract base class for Data Handlers
+     * 
+     * Data handlers are used to handle libcurl's callback requirements
+     * for input and output data.
+     */
+    struct DataHandlerBase {
+        virtual ~DataHandlerBase() = default;
+    };
+
+    /*! Template implementation for input data to curl during a request.
+     * 
+     * This handler deals with the data received from the HTTP server
+     * during a request. This implementation will typically use
+     * T=std::string and just store the received data in a string. For 
+     * json/XML payloads that's probably all you need. But if you receive
+     * binary data, you may want to use a container like std::vector or std::deque in stead.
+     */
+    template <typename T>
+    struct InDataHandler : public DataHandlerBase{
+        InDataHandler(T& data) : data_{data} {
+            RESTINCURL_LOG_TRACE("InDataHandler address: " << this);
+        }
+
+        static size_t write_callback(char *ptr, size_t size, size_t nitems, void *userdata) {
+            assert(userdata);
+            auto self = reinterpret_cast<InDataHandler *>(userdata);
+            const auto bytes = size * nitems;
+            if (bytes > 0) {
+                std::copy(ptr, ptr + bytes, std::back_inserter(self->data_));
+            }
+            return bytes;
+        }
+
+        T& data_;
+    };
+
+     /*! Template implementation for output data to curl during a request.
+     * 
+     * This handler deals with the data sent to the HTTP server
+     * during a request (POST, PATCH etc). This implementation will typically use
+     * T=std::string and just store the data in a string. For 
+     * json/XML payloads that's probably all you need. But if you send
+     * binary data, you may want to use a container like std::vector or std::deque in stead.
+     */
+    template <typename T>
+    struct OutDataHandler : public DataHandlerBase {
+        OutDataHandler() = default;
+        OutDataHandler(const T& v) : data_{v} {}
+        OutDataHandler(T&& v) : data_{std::move(v)} {}
+
+        static size_t read_callback(char *bufptr, size_t size, size_t nitems, void *userdata) {
+            assert(userdata);
+            OutDataHandler *self = reinterpret_cast<OutDataHandler *>(userdata);
+            const auto bytes = size * nitems;
+            auto out_bytes = std::min<size_t>(bytes, (self->data_.size() - self->sendt_bytes_));
+            std::copy(self->data_.cbegin() + self->sendt_bytes_,
+                      self->data_.cbegin() + (self->sendt_bytes_ + out_bytes),
+                      bufptr);
+            self->sendt_bytes_ += out_bytes;
+
+            RESTINCURL_LOG_TRACE("Sent " << out_bytes << " of total " << self->data_.size() << " bytes.");
+            return out_bytes;
+        }
+
+        static int seek_callback(void *userdata, curl_off_t offset, int origin) {
+            assert(userdata);
+            OutDataHandler *self = reinterpret_cast<OutDataHandler *>(userdata);
+            if ((origin != SEEK_SET) || (offset < 0)
+                || (static_cast<size_t>(offset) > self->data_.size())) {
+                return CURL_SEEKFUNC_CANTSEEK;
+            }
+            self->sendt_bytes_ = static_cast<size_t>(offset);
+            return CURL_SEEKFUNC_OK;
+        }
+
+        T data_;
+        size_t sendt_bytes_ = 0;
+    };
+
+    /*! Compressing wrapper for outbound data.
+     *
+     * Wraps any curl compatible read handler (a Data Handler, a file, or your
+     * own producer), and compresses the data as libcurl asks for it. The
+     * compressed data is written directly into libcurl's buffer, so the
+     * payload is never held in memory in full.
+     *
+     * Used by `RequestBuilder::CompressBody()`.
+     *
+     * gzip and deflate require `RESTINCURL_WITH_ZLIB`, and zstd requires
+     * `RESTINCURL_WITH_ZSTD`.
+     */
+    class BodyCompressor : public DataHandlerBase {
+    public:
+        using read_fn_t = size_t (*)(char *, size_t, size_t, void *);
+        using seek_fn_t = int (*)(void *, curl_off_t, int);
+
+        /*!
+         * \param encoding Compression to use.
+         * \param level Compression level. -1 uses the default level for the algorithm.
+         * \param source Read handler for the uncompressed data
+         * \param sourceData userdata for the read handler
+         * \param sourceSeek Optional seek handler for the source. Required to rewind.
+         *
+         * \throws Exception if the encoding is not supported.
+         */
+        BodyCompressor(const Encoding encoding, const int level,
+                       read_fn_t source, void *sourceData, seek_fn_t sourceSeek = nullptr)
+        : encoding_{encoding}, source_{source}, source_data_{sourceData}, source_seek_{sourceSeek}
+        {
+            assert(source_);
+#if !defined(RESTINCURL_WITH_ZLIB) && !defined(RESTINCURL_WITH_ZSTD)
+            (void)level;
+#endif
+            switch(encoding_) {
+#ifdef RESTINCURL_WITH_ZLIB
+                case Encoding::GZIP:
+                case Encoding::DEFLATE:
+                    // windowBits 15 + 16 gives a gzip header and trailer
+                    if (deflateInit2(&zs_, level < 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED,
+                                     encoding_ == Encoding::GZIP ? (15 + 16) : 15,
+                                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                        throw Exception{"deflateInit2() failed"};
+                    }
+                    break;
+#endif
+#ifdef RESTINCURL_WITH_ZSTD
+                case Encoding::ZSTD:
+                    if ((zctx_ = ZSTD_createCCtx()) == nullptr) {
+                        throw Exception{"ZSTD_createCCtx() failed"};
+                    }
+                    ZSTD_CCtx_setParameter(zctx_, ZSTD_c_compressionLevel,
+                                           level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+                    break;
+#endif
+                default:
+                    throw Exception{std::string{"Unsupported body encoding: "} + GetName(encoding_)};
+            }
+        }
+
+        ~BodyCompressor() {
+#ifdef RESTINCURL_WITH_ZLIB
+            if ((encoding_ == Encoding::GZIP) || (encoding_ == Encoding::DEFLATE)) {
+                deflateEnd(&zs_);
+            }
+#endif
+#ifdef RESTINCURL_WITH_ZSTD
+            if (zctx_) {
+                ZSTD_freeCCtx(zctx_);
+            }
+#endif
+        }
+
+        BodyCompressor(const BodyCompressor&) = delete;
+        BodyCompressor& operator = (const BodyCompressor&) = delete;
+
+        /*! Check if an encoding is compiled in */
+        static bool IsSupported(const Encoding encoding) noexcept {
+            switch(encoding) {
+                case Encoding::GZIP:
+                case Encoding::DEFLATE:
+#ifdef RESTINCURL_WITH_ZLIB
+                    return true;
+#else
+                    return false;
+#endif
+                case Encoding::ZSTD:
+#ifdef RESTINCURL_WITH_ZSTD
+                    return true;
+#else
+                    return false;
+#endif
+                default:
+                    return false;
+            }
+        }
+
+        /*! Get the HTTP content-coding name for an encoding */
+        static const char *GetName(const Encoding encoding) noexcept {
+            switch(encoding) {
+                case Encoding::GZIP:
+                    return "gzip";
+                case Encoding::DEFLATE:
+                    return "deflate";
+                case Encoding::BR:
+                    return "br";
+                case Encoding::ZSTD:
+                    return "zstd";
+            }
+            return "unknown";
+        }
+
+        static size_t read_callback(char *bufptr, size_t size, size_t nitems, void *userdata) {
+            assert(userdata);
+            auto self = reinterpret_cast<BodyCompressor *>(userdata);
+            return self->Read(bufptr, size * nitems);
+        }
+
+        /*! Rewind to the start of the data.
+         *
+         * The compressed stream can only be restarted from the beginning.
+         */
+        static int seek_callback(void *userdata, curl_off_t offset, int origin) {
+            assert(userdata);
+            auto self = reinterpret_cast<BodyCompressor *>(userdata);
+            if ((origin != SEEK_SET) || (offset != 0) || !self->source_seek_) {
+                return CURL_SEEKFUNC_CANTSEEK;
+            }
+
+            const auto rval = self->source_seek_(self->source_data_, 0, SEEK_SET);
+            if (rval != CURL_SEEKFUNC_OK) {
+                return rval;
+            }
+
+            switch(self->encoding_) {
+#ifdef RESTINCURL_WITH_ZLIB
+                case Encoding::GZIP:
+                case Encoding::DEFLATE:
+                    if (deflateReset(&self->zs_) != Z_OK) {
+                        return CURL_SEEKFUNC_FAIL;
+                    }
+                    break;
+#endif
+#ifdef RESTINCURL_WITH_ZSTD
+                case Encoding::ZSTD:
+                    if (ZSTD_isError(ZSTD_CCtx_reset(self->zctx_, ZSTD_reset_session_only))) {
+                        return CURL_SEEKFUNC_FAIL;
+                    }
+                    break;
+#endif
+                default:
+                    return CURL_SEEKFUNC_FAIL;
+            }
+
+            self->in_pos_ = self->in_len_ = 0;
+            self->eof_ = self->done_ = false;
+            return CURL_SEEKFUNC_OK;
+        }
+
+        /*! Uncompressed bytes read from the source */
+        uint64_t GetBytesIn() const noexcept { return bytes_in_; }
+
+        /*! Compressed bytes returned to libcurl */
+        uint64_t GetBytesOut() const noexcept { return bytes_out_; }
+
+    private:
+        size_t Read(char *dst, const size_t len) {
+            size_t produced = 0;
+
+            // Returning 0 tells libcurl that we are done, so keep going
+            // until we have some output or the compressed stream is finished.
+            while (!done_ && (produced == 0)) {
+                if ((in_pos_ == in_len_) && !eof_) {
+                    const auto bytes = source_(input_.data(), 1, input_.size(), source_data_);
+                    if ((bytes == CURL_READFUNC_ABORT) || (bytes == CURL_READFUNC_PAUSE)) {
+                        return bytes;
+                    }
+                    assert(bytes <= input_.size());
+                    in_pos_ = 0;
+                    in_len_ = bytes;
+                    eof_ = bytes == 0;
+                    bytes_in_ += bytes;
+                }
+
+                const auto rval = Compress(dst + produced, len - produced);
+                if (rval < 0) {
+                    RESTINCURL_LOG("BodyCompressor: Compression failed");
+                    return CURL_READFUNC_ABORT;
+                }
+                produced += static_cast<size_t>(rval);
+            }
+
+            bytes_out_ += produced;
+            return produced;
+        }
+
+        // Compress what we have in input_ to dst. Returns the bytes written, or -1 on error.
+        long Compress(char *dst, const size_t len) {
+#if !defined(RESTINCURL_WITH_ZLIB) && !defined(RESTINCURL_WITH_ZSTD)
+            (void)dst;
+            (void)len;
+#endif
+            switch(encoding_) {
+#ifdef RESTINCURL_WITH_ZLIB
+                case Encoding::GZIP:
+                case Encoding::DEFLATE: {
+                    zs_.next_in = reinterpret_cast<Bytef *>(input_.data() + in_pos_);
+                    zs_.avail_in = static_cast<uInt>(in_len_ - in_pos_);
+                    zs_.next_out = reinterpret_cast<Bytef *>(dst);
+                    zs_.avail_out = static_cast<uInt>(len);
+                    const auto rval = deflate(&zs_, eof_ ? Z_FINISH : Z_NO_FLUSH);
+                    if (rval == Z_STREAM_END) {
+                        done_ = true;
+                    } else if ((rval != Z_OK) && (rval != Z_BUF_ERROR)) {
+                        return -1;
+                    }
+                    in_pos_ = in_len_ - zs_.avail_in;
+                    return static_cast<long>(len - zs_.avail_out);
+                }
+#endif
+#ifdef RESTINCURL_WITH_ZSTD
+                case Encoding::ZSTD: {
+                    ZSTD_inBuffer in = {input_.data() + in_pos_, in_len_ - in_pos_, 0};
+                    ZSTD_outBuffer out = {dst, len, 0};
+                    const auto remaining = ZSTD_compressStream2(zctx_, &out, &in,
+                                                                eof_ ? ZSTD_e_end : ZSTD_e_continue);
+                    if (ZSTD_isError(remaining)) {
+                        return -1;
+                    }
+                    if (eof_ && (remaining == 0)) {
+                        done_ = true;
+                    }
+                    in_pos_ += in.pos;
+                    return static_cast<long>(out.pos);
+                }
+#endif
+                default:
+                    return -1;
+            }
+        }
+
+        const Encoding encoding_;
+        read_fn_t source_ = {};
+        void *source_data_ = {};
+        seek_fn_t source_seek_ = {};
+        std::array<char, 1024 * 16> input_;
+        size_t in_pos_ = 0;
+        size_t in_len_ = 0;
+        bool eof_ = false;
+        bool done_ = false;
+        uint64_t bytes_in_ = 0;
+        uint64_t bytes_out_ = 0;
+#ifdef RESTINCURL_WITH_ZLIB
+        z_stream zs_ = {};
+#endif
+#ifdef RESTINCURL_WITH_ZSTD
+        ZSTD_CCtx *zctx_ = {};
+#endif
+    };
+
+#if LIBCURL_VERSION_NUM >= 0x073900
+    /*! Per-thread cache of warm connections for synchronous requests.
+     *
+     * A synchronous request (`RequestBuilder::ExecuteSynchronous()`, or any request
+     * when `RESTINCURL_ENABLE_ASYNC` is 0) is performed by the calling thread.
+     * While it runs, its easy-handle is attached to a curl share-handle for the
+     * request's scheme, host and port (see `GetHostKey()`). The share-handle keeps
+     * the connections, DNS lookups and TLS sessions after the transfer, so the next
+     * request to the same host on the same thread can reuse them, even if it uses
+     * another easy-handle.
+     *
+     * Each thread keeps at most `RESTINCURL_SYNC_CACHE_SIZE` hosts. When it is full,
+     * the least recently used host is dropped. Hosts that have not been used for
+     * `RESTINCURL_SYNC_CACHE_IDLE_SEC` seconds are dropped the next time the
+     * thread makes a synchronous request, or when the thread exits.
+     *
+     * This is used automatically. It requires libcurl 7.57.0 or newer.
+     */
+    class SyncConnectionCache {
+    public:
+        /*! Attaches an easy-handle to the cache for the duration of one transfer */
+        class Scope {
+        public:
+            Scope(EasyHandle& eh, const std::string& hostKey)
+            : eh_{eh}
+            {
+                if (RESTINCURL_SYNC_CACHE_SIZE > 0) {
+                    if (auto share = Instance().Get(hostKey)) {
+                        attached_ = curl_easy_setopt(eh_, CURLOPT_SHARE, share) == CURLE_OK;
+                    }
+                }
+            }
+
+            ~Scope() {
+                if (attached_) {
+                    curl_easy_setopt(eh_, CURLOPT_SHARE, static_cast<CURLSH *>(nullptr));
+                }
+            }
+
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+
+        private:
+            EasyHandle& eh_;
+            bool attached_ = false;
+        };
+
+        SyncConnectionCache(const SyncConnectionCache&) = delete;
+        SyncConnectionCache& operator=(const SyncConnectionCache&) = delete;
+
+        ~SyncConnectionCache() {
+            Clear();
+        }
+
+        /*! The cache for the current thread */
+        static SyncConnectionCache& Instance() {
+            static thread_local SyncConnectionCache cache;
+            return cache;
+        }
+
+        /*! Number of hosts in the cache */
+        size_t GetSize() const noexcept { return entries_.size(); }
+
+        /*! Close all the cached connections */
+        void Clear() noexcept {
+            for(auto& entry : entries_) {
+                curl_share_cleanup(entry.share);
+            }
+            entries_.clear();
+        }
+
+    private:
+        struct Entry {
+            std::string host;
+            CURLSH *share = {};
+            std::chrono::steady_clock::time_point used;
+        };
+
+        SyncConnectionCache() = default;
+
+        CURLSH *Get(const std::string& hostKey) {
+            const auto now = std::chrono::steady_clock::now();
+            Expire(now);
+
+            // Most recently used first
+            auto it = std::find_if(entries_.begin(), entries_.end(), [&](const Entry& e) {
+                return e.host == hostKey;
+            });
+            if (it != entries_.end()) {
+                it->used = now;
+                entries_.splice(entries_.begin(), entries_, it);
+                return it->share;
+            }
+
+            auto share = curl_share_init();
+            if (!share) {
+                return nullptr;
+            }
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+            while (entries_.size() >= static_cast<size_t>(RESTINCURL_SYNC_CACHE_SIZE)) {
+                RESTINCURL_LOG_TRACE("Dropping warm connections to " << entries_.back().host);
+                curl_share_cleanup(entries_.back().share);
+                entries_.pop_back();
+            }
+            entries_.push_front({hostKey, share, now});
+            return share;
+        }
+
+        void Expire(const std::chrono::steady_clock::time_point now) noexcept {
+            const auto expires = now - std::chrono::seconds(RESTINCURL_SYNC_CACHE_IDLE_SEC);
+            while (!entries_.empty() && (entries_.back().used < expires)) {
+                RESTINCURL_LOG_TRACE("Closing idle connections to " << entries_.back().host);
+                curl_share_cleanup(entries_.back().share);
+                entries_.pop_back();
+            }
+        }
+
+        std::list<Entry> entries_;
+    };
+#endif
+
+    class RequestPool;
+    class Request;
+
+#if RESTINCURL_ENABLE_ASYNC
+    class Worker;
+
+    /*! State shared by an asynchronous request and its `RequestHandle` */
+    struct CancelState {
+        /*! Lets a handle reach the worker, as long as the worker exists */
+        struct Link {
+            std::mutex mutex;
+            Worker *worker = {};
+        };
+
+        std::atomic<bool> cancelled{false};
+        std::shared_ptr<Link> link;
+
+        // The request, while it is owned by the worker. Set under the worker's mutex.
+        Request *request = {};
+    };
+#endif
+
+    class Request {
+    public:
+        /*! Deleter that gives the request back to its pool, if it came from one. */
+        struct Recycler {
+            Recycler() = default;
+            Recycler(std::default_delete<Request>) noexcept {}
+            explicit Recycler(std::shared_ptr<RequestPool> pool) noexcept
+            : pool_{std::move(pool)} {}
+
+            inline void operator()(Request *req) const noexcept;
+
+        private:
+            std::shared_ptr<RequestPool> pool_;
+        };
+
+        using ptr_t = std::unique_ptr<Request, Recycler>;
+        using queue_t = std::list<ptr_t>;
+        using deadline_index_t = std::multimap<std::chrono::steady_clock::time_point, Request *>;
+
+        /*! State shared by a hedged request and its copies. See `RequestBuilder::Hedge()` */
+        struct HedgeState {
+            Request *leader = {};
+            std::chrono::milliseconds after = {};
+            unsigned max_extra = 1;
+            unsigned sent = 0;
+            std::string host;
+            std::chrono::steady_clock::time_point started;
+            std::vector<EasyHandle::handle_t> running;
+
+            // The worker's timer for the next copy, while it is armed
+            std::multimap<std::chrono::steady_clock::time_point, std::function<void ()>>::iterator timer;
+            bool timer_armed = false;
+        };
+
+        Request()
+        : eh_{std::make_unique<EasyHandle>()}
+        {
+        }
+
+        Request(EasyHandle::ptr_t&& eh)
+        : eh_{std::move(eh)}
+        {
+        }
+
+        ~Request() {
+#if RESTINCURL_ENABLE_ASYNC
+            if (cancel_ && cancel_->request) {
+                cancel_->request = nullptr;
+            }
+#endif
+            UnlinkHeaders();
+            if (headers_) {
+                curl_slist_free_all(headers_);
+            }
+        }
+
+        void Prepare(const RequestType rq, completion_fn_t completion) {
+            request_type_ = rq;
+            SetRequestType();
+            completion_ = std::move(completion);
+        }
+
+        void OpenSourceFile(const std::string& path) {
+            assert(!fp_);
+            auto fp = fopen(path.c_str(), "rb");
+            if (!fp) {
+                const auto e = errno;
+                throw SystemException{std::string{"Unable to open file "} + path, e};
+            }
+
+            fp_= std::shared_ptr<FILE>(fp, std::fclose);
+        }
+
+        FILE *GetSourceFp() {
+            assert(fp_);
+            return fp_.get();
+        }
+
+        // Synchronous execution.
+        void Execute() {
+            if (ServeFromCache()) {
+                return;
+            }
+
+            while(true) {
+                if (!ApplyDeadline(std::chrono::steady_clock::now())) {
+                    Fail(Error::DEADLINE_EXCEEDED, "The deadline passed before the request was sent");
+                    return;
+                }
+                CURLcode result;
+                {
+#if LIBCURL_VERSION_NUM >= 0x073900
+                    SyncConnectionCache::Scope warm{*eh_, GetHostKey()};
+#endif
+                    result = curl_easy_perform(*eh_);
+                }
+                std::chrono::milliseconds delay;
+                if (PrepareRetry(result, delay)) {
+                    std::this_thread::sleep_for(delay);
+                    continue;
+                }
+                CallCompletion(result);
+                return;
+            }
+        }
+
+        /*! Retry the request, if it failed and the retry-policy allows it.
+         *
+         * \param cc The result of the last attempt
+         * \param delay Receives the delay before the next attempt
+         * \returns true if the request is prepared for another attempt.
+         */
+        bool PrepareRetry(const CURLcode cc, std::chrono::milliseconds& delay) {
+            if (!retry_ || (attempts_ >= retry_->max_attempts)) {
+                return false;
+            }
+
+            long http_code = {};
+            if (cc == CURLE_OK) {
+                curl_easy_getinfo(*eh_, CURLINFO_RESPONSE_CODE, &http_code);
+            }
+            if (!IsRetryable(cc, http_code)) {
+                return false;
+            }
+
+            if (body_delivered_) {
+                RESTINCURL_LOG("Cannot retry: Data was already passed to the data handler");
+                return false;
+            }
+
+            delay = GetRetryDelay();
+#if LIBCURL_VERSION_NUM >= 0x074200
+            if (retry_->honor_retry_after) {
+                curl_off_t retry_after = {};
+                if ((curl_easy_getinfo(*eh_, CURLINFO_RETRY_AFTER, &retry_after) == CURLE_OK)
+                    && (retry_after > 0)) {
+                    const auto wanted = std::chrono::seconds(retry_after);
+                    if (wanted > retry_->max_delay) {
+                        RESTINCURL_LOG("Cannot retry: Retry-After is too long: " << retry_after);
+                        return false;
+                    }
+                    delay = wanted;
+                }
+            }
+#endif
+
+            if (have_deadline_ && (std::chrono::steady_clock::now() + delay >= deadline_)) {
+                RESTINCURL_LOG("Cannot retry: The deadline will pass before the next attempt");
+                return false;
+            }
+
+            if (!Rewind()) {
+                RESTINCURL_LOG("Cannot retry: Unable to rewind the data to send");
+                return false;
+            }
+
+            default_data_buffer_.clear();
+            response_headers_.clear();
+            bytes_received_ = 0;
+            status_checked_ = false;
+            if (hedge_) {
+                // Forget about the previous attempt. Pending hedge-timers hold a weak reference.
+                auto state = std::make_shared<HedgeState>();
+                state->leader = this;
+                state->after = hedge_->after;
+                state->max_extra = hedge_->max_extra;
+                state->host = hedge_->host;
+                hedge_ = std::move(state);
+            }
+            discard_body_ = false;
+            ++attempts_;
+
+            RESTINCURL_LOG("Retrying request in " << delay.count()
+                << " ms. Attempt #" << attempts_ << ". curl code=" << cc
+                << ", http code=" << http_code);
+            return true;
+        }
+
+        void SetRetryPolicy(const RetryPolicy& policy) {
+            retry_ = std::make_unique<RetryPolicy>(policy);
+        }
+
+        unsigned GetAttempts() const noexcept { return attempts_; }
+
+        /*! Allow the request to be hedged.
+         *
+         * \param after Delay before a copy is sent. 0 means the p95 response-time for the host.
+         * \param maxExtra Max number of copies
+         * \param hostKey Host, from `GetHostKey()`
+         */
+        void SetHedge(const std::chrono::milliseconds after, const unsigned maxExtra,
+                      std::string hostKey) {
+            hedge_ = std::make_shared<HedgeState>();
+            hedge_->leader = this;
+            hedge_->after = after;
+            hedge_->max_extra = maxExtra;
+            hedge_->host = std::move(hostKey);
+        }
+
+        const std::shared_ptr<HedgeState>& GetHedge() const noexcept { return hedge_; }
+
+        /*! Create a copy of the request, to be sent in parallel with it.
+         *
+         * The copy shares the hedge-state and header-list with this request,
+         * and buffers the response-body until we know which transfer won.
+         */
+        ptr_t CreateHedgeCopy() {
+            assert(hedge_);
+            assert(!hedge_copy_);
+            auto copy = std::make_unique<Request>(eh_->Duplicate());
+            copy->hedge_ = hedge_;
+            copy->hedge_copy_ = true;
+            copy->request_type_ = request_type_;
+            copy->StoreInDefaultBuffer();
+            if (store_headers_) {
+                copy->StoreHeaders();
+            }
+            return copy;
+        }
+
+        /*! Take over the result from the hedged copy that won. */
+        void AdoptHedgeWinner(Request& winner) {
+            assert(winner.hedge_copy_);
+            std::swap(eh_, winner.eh_);
+            std::swap(default_data_buffer_, winner.default_data_buffer_);
+            std::swap(response_headers_, winner.response_headers_);
+            std::swap(bytes_received_, winner.bytes_received_);
+
+            // The handle still points to the copy, in case it is used again for a retry.
+            curl_easy_setopt(*eh_, CURLOPT_WRITEDATA, this);
+            if (store_headers_) {
+                curl_easy_setopt(*eh_, CURLOPT_HEADERDATA, this);
+            }
+        }
+
+        void Complete(CURLcode cc, const CURLMSG& /*msg*/) {
+            CallCompletion(cc);
+        }
+
+        /*! Use the response cache for this request.
+         *
+         * \param cache The cache
+         * \param key Cache-key, from `ResponseCache::MakeKey()`
+         */
+        void SetCache(std::shared_ptr<ResponseCache> cache, std::string key) {
+            cache_ = std::move(cache);
+            cache_key_ = std::move(key);
+        }
+
+        /*! Look up the request in the response cache.
+         *
+         * If a fresh response is found, the request is completed, and the method returns true.
+         * If a stale response is found, conditional headers are added to the
+         * request, so that the server can confirm that it is still current.
+         */
+        bool ServeFromCache() {
+            if (!cache_ || cache_checked_) {
+                return false;
+            }
+            cache_checked_ = true;
+
+            std::string value;
+            if (GetRequestHeader("cache-control", value)
+                && (value.find("no-store") != std::string::npos)) {
+                cache_.reset();
+                return false;
+            }
+
+            auto& metrics = cache_->GetMetrics();
+            auto entry = cache_->Find(cache_key_, [this](const std::string& name, std::string& value) {
+                return GetRequestHeader(name, value);
+            });
+
+            if (entry && (entry->expires > std::chrono::steady_clock::now())) {
+                ++metrics.cache_hits;
+                RESTINCURL_LOG("Serving " << cache_key_ << " from the cache");
+                CompleteFromCache(*entry);
+                return true;
+            }
+
+            if (entry && (!entry->etag.empty() || !entry->last_modified.empty())) {
+                RESTINCURL_LOG("Revalidating cached " << cache_key_);
+                if (!entry->etag.empty()) {
+                    AddHeader(("If-None-Match: " + entry->etag).c_str());
+                }
+                if (!entry->last_modified.empty()) {
+                    AddHeader(("If-Modified-Since: " + entry->last_modified).c_str());
+                }
+                LinkHeaders();
+                stale_entry_ = std::move(entry);
+                return false;
+            }
+
+            ++metrics.cache_misses;
+            return false;
+        }
+
+        /*! Get the value of a header we send (case insensitive) */
+        bool GetRequestHeader(const std::string& name, std::string& value) const {
+            bool found = false;
+            ForEachHeader([&](const char *line) {
+                if (found) {
+                    return;
+                }
+                size_t i = 0;
+                for(; i < name.size(); ++i) {
+                    if (std::tolower(static_cast<unsigned char>(line[i]))
+                        != std::tolower(static_cast<unsigned char>(name[i]))) {
+                        break;
+                    }
+                }
+                if ((i == name.size()) && (line[i] == ':')) {
+                    line += i + 1;
+                    while(*line == ' ') {
+                        ++line;
+                    }
+                    value = line;
+                    found = true;
+                }
+            });
+            return found;
+        }
+
+        /*! Key for coalescing identical requests. Empty if the request can not be coalesced. */
+        const std::string& GetCoalesceKey() const noexcept { return coalesce_key_; }
+
+        void SetCoalesceKey(std::string key) {
+            coalesce_key_ = std::move(key);
+        }
+
+        /*! Attach an identical request, that will get the same result as this one. */
+        void AddFollower(ptr_t follower) {
+            assert(follower);
+            follower->GetEasyHandle().Close(); // It will never be sent
+            followers_.push_back(std::move(follower));
+        }
+
+        /*! Set a function that is called once, just before the completion callback. */
+        void SetBeforeCompletion(std::function<void (Request&)> fn) {
+            before_completion_ = std::move(fn);
+        }
+
+        /*! Priority when the queue is full. See `QueueOverflow::DROP_LOWEST_PRIORITY` */
+        void SetPriority(const int priority) noexcept {
+            priority_ = priority;
+        }
+
+        int GetPriority() const noexcept { return priority_; }
+
+        /*! Set the deadline for the request.
+         *
+         * \param deadline When the request must be completed
+         * \param timeoutMs The request-timeout set with `CURLOPT_TIMEOUT_MS`, or -1
+         */
+        void SetDeadline(const std::chrono::steady_clock::time_point deadline, const long timeoutMs) {
+            deadline_ = deadline;
+            timeout_ms_ = timeoutMs;
+            have_deadline_ = true;
+        }
+
+        bool HaveDeadline() const noexcept { return have_deadline_; }
+        std::chrono::steady_clock::time_point GetDeadline() const noexcept { return deadline_; }
+        long GetTimeoutMs() const noexcept { return timeout_ms_; }
+
+        /*! Pass the time that remains until the deadline to libcurl as `CURLOPT_TIMEOUT_MS`.
+         *
+         * The request-timeout is used if it is shorter.
+         *
+         * \returns false if the deadline has passed.
+         */
+        bool ApplyDeadline(const std::chrono::steady_clock::time_point now) {
+            if (!have_deadline_) {
+                return true;
+            }
+
+            const auto remains = std::chrono::duration_cast<std::chrono::milliseconds>(deadline_ - now).count();
+            if (remains <= 0) {
+                return false;
+            }
+
+            auto timeout = static_cast<long>(std::min<decltype(remains)>(remains, std::numeric_limits<long>::max()));
+            if (timeout_ms_ > 0) {
+                timeout = std::min(timeout, timeout_ms_);
+            }
+            curl_easy_setopt(*eh_, CURLOPT_TIMEOUT_MS, timeout);
+            return true;
+        }
+
+#if RESTINCURL_ENABLE_ASYNC
+        /*! Let a `RequestHandle` cancel this request */
+        void SetCancelState(std::shared_ptr<CancelState> state) {
+            cancel_ = std::move(state);
+        }
+
+        const std::shared_ptr<CancelState>& GetCancelState() const noexcept { return cancel_; }
+
+        bool IsCancelled() const noexcept {
+            return cancel_ && cancel_->cancelled;
+        }
+
+        bool IsCancelDelivered() const noexcept { return cancel_delivered_; }
+
+        /*! Call the completion callback with the result for a cancelled request.
+         *
+         * This is only done once. Any coalesced requests are not affected; they
+         * get the result when the transfer finishes.
+         *
+         * \returns true if this call delivered the result.
+         */
+        bool CompleteCancelled() {
+            if (cancel_delivered_) {
+                return false;
+            }
+            cancel_delivered_ = true;
+
+            auto completion = std::move(completion_);
+            if (completion) {
+                Result result(CURLE_ABORTED_BY_CALLBACK, Error::CANCELLED, "Cancelled");
+                result.attempts = attempts_;
+                completion(result);
+            }
+            return true;
+        }
+
+        // The position in the worker's queue is protected by the worker's mutex
+        void SetQueuePos(queue_t::iterator pos, const std::chrono::steady_clock::time_point when) noexcept {
+            queue_pos_ = pos;
+            queued_at_ = when;
+            queued_ = true;
+        }
+
+        /*! When the request was added to the queue */
+        std::chrono::steady_clock::time_point GetQueuedAt() const noexcept { return queued_at_; }
+
+        void ClearQueuePos() noexcept {
+            queued_ = false;
+        }
+
+        bool IsQueued() const noexcept { return queued_; }
+        queue_t::iterator GetQueuePos() const noexcept { return queue_pos_; }
+
+        // The position in the worker's index of queued requests with a deadline
+        void SetDeadlinePos(deadline_index_t::iterator pos) noexcept {
+            deadline_pos_ = pos;
+            deadline_indexed_ = true;
+        }
+
+        void ClearDeadlinePos() noexcept {
+            deadline_indexed_ = false;
+        }
+
+        bool IsDeadlineIndexed() const noexcept { return deadline_indexed_; }
+        deadline_index_t::iterator GetDeadlinePos() const noexcept { return deadline_pos_; }
+#endif
+
+        bool HasFollowers() const noexcept { return !followers_.empty(); }
+
+        /*! Complete the request with an error detected by us, without sending it. */
+        void Fail(const Error error, const std::string& explanation) {
+            error_ = error;
+            error_msg_ = explanation;
+            CallCompletion(CURLE_ABORTED_BY_CALLBACK);
+        }
+
+        void SetUrl(std::string url) {
+            url_ = std::move(url);
+        }
+
+        const std::string& GetUrl() const noexcept { return url_; }
+
+        /*! Get the host the request is for, as returned by `GetHostKey()` */
+        const std::string& GetHostKey() {
+            if (host_key_.empty()) {
+                host_key_ = ::restincurl::GetHostKey(url_);
+            }
+            return host_key_;
+        }
+
+        EasyHandle& GetEasyHandle() noexcept { assert(eh_); return *eh_; }
+        RequestType GetRequestType() noexcept { return request_type_; }
+
+        void SetDefaultInHandler(std::unique_ptr<DataHandlerBase> ptr) {
+            default_in_handler_ = std::move(ptr);
+        }
+
+        void SetDefaultOutHandler(std::unique_ptr<DataHandlerBase> ptr) {
+            default_out_handler_ = std::move(ptr);
+        }
+
+        /*! Use the request's own handler for a string to send */
+        OutDataHandler<std::string>& SetStringOutData(std::string data) {
+            string_out_handler_.data_ = std::move(data);
+            string_out_handler_.sendt_bytes_ = 0;
+            return string_out_handler_;
+        }
+
+        /*! Take the url-buffer, to be reused. */
+        std::string ReleaseUrl() noexcept {
+            auto url = std::move(url_);
+            url.clear();
+            return url;
+        }
+
+        using headers_t = curl_slist *;
+
+        /*! Get the headers that belong to this request only.
+         *
+         * Use `AddHeader()` to add headers.
+         */
+        headers_t GetHeaders() const noexcept {
+            return headers_;
+        }
+
+        /*! Add a header-line for this request only */
+        void AddHeader(const char *line) {
+            assert(line);
+            const auto linked = headers_linked_;
+            UnlinkHeaders();
+            auto list = curl_slist_append(headers_, line);
+            if (!list) {
+                throw Exception{"curl_slist_append() failed"};
+            }
+            headers_ = list;
+            if (!headers_tail_) {
+                headers_tail_ = headers_;
+            }
+            while(headers_tail_->next) {
+                headers_tail_ = headers_tail_->next;
+            }
+            if (linked) {
+                LinkHeaders();
+            }
+        }
+
+        /*! Use a shared list of headers, in addition to the request's own headers
+         *
+         * The shared list is not copied. The requests own headers are linked in front of it.
+         */
+        void SetSharedHeaders(HeaderList::ptr_t headers) {
+            const auto linked = headers_linked_;
+            UnlinkHeaders();
+            shared_headers_ = std::move(headers);
+            if (linked) {
+                LinkHeaders();
+            }
+        }
+
+        const HeaderList::ptr_t& GetSharedHeaders() const noexcept { return shared_headers_; }
+
+        /*! Add default headers below the request's own headers.
+         *
+         * The defaults are shared, unless the request has a header with the same
+         * name as one of them. Then the other defaults are copied to the request.
+         */
+        void SetDefaultHeaders(const HeaderList::ptr_t& defaults) {
+            assert(!shared_headers_);
+            if (!defaults || defaults->Empty()) {
+                return;
+            }
+            bool overridden = false;
+            for(auto h = headers_; h && !overridden; h = h->next) {
+                overridden = defaults->HasName(h->data);
+            }
+            if (!overridden) {
+                SetSharedHeaders(defaults);
+                return;
+            }
+            std::vector<const char *> lines;
+            for(auto h = defaults->Get(); h; h = h->next) {
+                bool found = false;
+                for(auto o = headers_; o && !found; o = o->next) {
+                    found = HeaderList::SameName(o->data, h->data);
+                }
+                if (!found) {
+                    lines.push_back(h->data);
+                }
+            }
+            for(auto line : lines) {
+                AddHeader(line);
+            }
+        }
+
+        /*! Give the combined header-list to libcurl.
+         *
+         * The last of our own headers is linked to the first of the shared headers.
+         */
+        void LinkHeaders() {
+            curl_slist *shared = shared_headers_ ? shared_headers_->Get() : nullptr;
+            if (headers_tail_) {
+                headers_tail_->next = shared;
+            }
+            headers_linked_ = true;
+            curl_easy_setopt(*eh_, CURLOPT_HTTPHEADER, headers_ ? headers_ : shared);
+        }
+
+        /*! Detach our own headers from the shared list, so that they can be changed or freed */
+        void UnlinkHeaders() noexcept {
+            if (headers_tail_) {
+                headers_tail_->next = nullptr;
+            }
+            headers_linked_ = false;
+        }
+
+        bool HaveHeaders() const noexcept {
+            return headers_ || (shared_headers_ && !shared_headers_->Empty());
+        }
+
+        /*! Call fn(const char *line) for each header-line, own headers first. */
+        template <typename T>
+        void ForEachHeader(const T& fn) const {
+            for(auto h = headers_; h; h = (h == headers_tail_) ? nullptr : h->next) {
+                fn(h->data);
+            }
+            if (shared_headers_) {
+                for(auto h = shared_headers_->Get(); h; h = h->next) {
+                    fn(h->data);
+                }
+            }
+        }
+
+        std::string& getDefaultInBuffer() {
+            return default_data_buffer_;
+        }
+
+        /*! Store incoming data in the default buffer, returned in `Result::body` */
+        void StoreInDefaultBuffer() {
+            SetWriteHandler(default_buffer_callback, &default_data_buffer_);
+            default_buffer_ = true;
+        }
+
+        using io_fn_t = size_t (*)(char *, size_t, size_t, void *);
+
+        /*! Set the handler for incoming data.
+         *
+         * libcurl calls the handler trough the request, so that we can
+         * count the bytes.
+         */
+        void SetWriteHandler(io_fn_t fn, void *userdata) {
+            assert(fn);
+            write_fn_ = fn;
+            write_data_ = userdata;
+            curl_easy_setopt(*eh_, CURLOPT_WRITEFUNCTION, write_callback);
+            curl_easy_setopt(*eh_, CURLOPT_WRITEDATA, this);
+        }
+
+        using seek_fn_t = int (*)(void *, curl_off_t, int);
+
+        /*! Set the handler for outgoing data.
+         *
+         * \param fn Read handler
+         * \param userdata Data for the read handler and the seek handler
+         * \param seek Optional seek handler. Without it, the data
+         *      cannot be sent again (for a retry, or after a redirect).
+         */
+        void SetReadHandler(io_fn_t fn, void *userdata, seek_fn_t seek = nullptr) {
+            assert(fn);
+            read_fn_ = fn;
+            read_data_ = userdata;
+            seek_fn_ = seek;
+            curl_easy_setopt(*eh_, CURLOPT_READFUNCTION, read_fn_);
+            curl_easy_setopt(*eh_, CURLOPT_READDATA, read_data_);
+            curl_easy_setopt(*eh_, CURLOPT_SEEKFUNCTION, seek_fn_);
+            curl_easy_setopt(*eh_, CURLOPT_SEEKDATA, seek_fn_ ? read_data_ : nullptr);
+        }
+
+        io_fn_t GetReadFunction() const noexcept { return read_fn_; }
+        void *GetReadData() const noexcept { return read_data_; }
+
+        /*! Compress the outgoing data
+         *
+         * Wraps the current read handler in a BodyCompressor.
+         */
+        void CompressBody(const Encoding encoding, const int level) {
+            assert(read_fn_);
+            auto compressor = std::make_unique<BodyCompressor>(encoding, level, read_fn_, read_data_, seek_fn_);
+            SetReadHandler(BodyCompressor::read_callback, compressor.get(),
+                           seek_fn_ ? BodyCompressor::seek_callback : nullptr);
+            compressor_ = std::move(compressor);
+        }
+
+        /*! Store the response headers, so they can be returned in the Result */
+        void StoreHeaders() {
+            curl_easy_setopt(*eh_, CURLOPT_HEADERFUNCTION, header_callback);
+            curl_easy_setopt(*eh_, CURLOPT_HEADERDATA, this);
+            store_headers_ = true;
+        }
+
+        bool IsStoringHeaders() const noexcept { return store_headers_; }
+
+        /*! Give away the easy-handle. The request can not be used after this. */
+        EasyHandle::ptr_t ReleaseEasyHandle() noexcept {
+            UnlinkHeaders();
+            return std::move(eh_);
+        }
+
+        const std::map<std::string, std::string>& GetResponseHeaders() const noexcept {
+            return response_headers_;
+        }
+
+        /*! Get the value of a header in the last response
+         *
+         * \param name Header name, in lower case
+         * \param value Receives the value
+         *
+         * With libcurl older than 7.83.0, this only works if `StoreHeaders()` was called.
+         */
+        bool GetResponseHeader(const char *name, std::string& value) const {
+#if LIBCURL_VERSION_NUM >= 0x075300
+            struct curl_header *header = nullptr;
+            if ((curl_easy_header(*eh_, name, 0, CURLH_HEADER, -1, &header) == CURLHE_OK) && header) {
+                value = header->value;
+                return true;
+            }
+#else
+            auto it = response_headers_.find(name);
+            if (it != response_headers_.end()) {
+                value = it->second;
+                return true;
+            }
+#endif
+            return false;
+        }
+
+        // Set when the request got a token from the rate limiter while it was queued
+        void SetRateAdmitted(const bool admitted) noexcept { rate_admitted_ = admitted; }
+        bool IsRateAdmitted() const noexcept { return rate_admitted_; }
+
+        // Returns true the first time the request is parked by the rate limiter
+        bool MarkRateLimited() noexcept {
+            const auto first = !rate_limited_;
+            rate_limited_ = true;
+            return first;
+        }
+
+        void InitMime() {
+            if (!mime_) {
+                mime_ = curl_mime_init(*eh_);
+            }
+        }
+
+        void AddFileAsMimeData(const std::string& path,
+                               const std::string& name,
+                               const std::string& remoteName,
+                               const std::string& mimeType) {
+
+            InitMime();
+            assert(mime_);
+            auto * part = curl_mime_addpart(mime_);
+            curl_mime_filedata(part, path.c_str());
+            curl_mime_name(part, name.empty() ? "file" :name.c_str());
+
+            if (!remoteName.empty()) {
+                curl_mime_filename(part, remoteName.c_str());
+            }
+
+            if (!mimeType.empty()) {
+                curl_mime_type(part, mimeType.c_str());
+            }
+        }
+
+    private:
+        static size_t default_buffer_callback(char *ptr, size_t size, size_t nitems, void *userdata) {
+            assert(userdata);
+            const auto bytes = size * nitems;
+            reinterpret_cast<std::string *>(userdata)->append(ptr, bytes);
+            return bytes;
+        }
+
+        static size_t write_callback(char *ptr, size_t size, size_t nitems, void *userdata) {
+            assert(userdata);
+            auto self = reinterpret_cast<Request *>(userdata);
+            assert(self->write_fn_);
+
+            if (self->hedge_ && !self->default_buffer_) {
+                // We don't know yet if this transfer wins, so keep the data until we do.
+                const auto bytes = size * nitems;
+                self->default_data_buffer_.append(ptr, bytes);
+                self->bytes_received_ += bytes;
+                return bytes;
+            }
+
+            if (self->retry_ && !self->default_buffer_) {
+                // Don't pass the body from a response we will retry to the data handler.
+                if (!self->status_checked_) {
+                    self->status_checked_ = true;
+                    long http_code = {};
+                    curl_easy_getinfo(*self->eh_, CURLINFO_RESPONSE_CODE, &http_code);
+                    self->discard_body_ = (self->attempts_ < self->retry_->max_attempts)
+                        && self->IsRetryable(CURLE_OK, http_code);
+                }
+                if (self->discard_body_) {
+                    // Keep it until we know that the request is retried
+                    const auto bytes = size * nitems;
+                    self->default_data_buffer_.append(ptr, bytes);
+                    self->bytes_received_ += bytes;
+                    return bytes;
+                }
+                self->body_delivered_ = true;
+            }
+
+            const auto bytes = self->write_fn_(ptr, size, nitems, self->write_data_);
+            self->bytes_received_ += bytes;
+            return bytes;
+        }
+
+        bool IsRetryable(const CURLcode cc, const long httpCode) const noexcept {
+            assert(retry_);
+            if (!retry_->retry_non_idempotent && !IsIdempotent() && (cc != CURLE_COULDNT_CONNECT)) {
+                return false;
+            }
+            if (cc != CURLE_OK) {
+                const auto& codes = retry_->curl_codes;
+                return std::find(codes.begin(), codes.end(), cc) != codes.end();
+            }
+            const auto& codes = retry_->http_codes;
+            return std::find(codes.begin(), codes.end(), httpCode) != codes.end();
+        }
+
+        bool IsIdempotent() const noexcept {
+            switch(request_type_) {
+                case RequestType::POST:
+                case RequestType::PATCH:
+                case RequestType::POST_MIME:
+                    return false;
+                default:
+                    return true;
+            }
+        }
+
+        std::chrono::milliseconds GetRetryDelay() const {
+            assert(retry_);
+            assert(attempts_ >= 1);
+            static thread_local std::mt19937 rnd{std::random_device{}()};
+
+            auto delay = static_cast<double>(retry_->initial_delay.count());
+            for(auto i = 1U; i < attempts_; ++i) {
+                delay *= retry_->multiplier;
+            }
+            delay = std::min(delay, static_cast<double>(retry_->max_delay.count()));
+            const auto jitter = std::max(0.0, std::min(1.0, retry_->jitter));
+            std::uniform_real_distribution<double> dist(1.0 - jitter, 1.0);
+            return std::chrono::milliseconds(static_cast<long long>(delay * dist(rnd)));
+        }
+
+        // Rewind the data we send, so it can be sent again
+        bool Rewind() {
+            if (!read_fn_) {
+                return true; // Nothing to send
+            }
+            if (!seek_fn_) {
+                return false;
+            }
+            return seek_fn_(read_data_, 0, SEEK_SET) == CURL_SEEKFUNC_OK;
+        }
+
+        static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+            assert(userdata);
+            auto self = reinterpret_cast<Request *>(userdata);
+            const auto bytes = size * nitems;
+            const auto end = buffer + bytes;
+
+            // A new status-line means that we follow a redirect or got a "100 Continue".
+            // Only keep the headers from the last response.
+            if ((bytes > 5) && (strncmp(buffer, "HTTP/", 5) == 0)) {
+                self->response_headers_.clear();
+                return bytes;
+            }
+
+            auto colon = std::find(buffer, end, ':');
+            if (colon == end) {
+                return bytes; // Empty line after the headers, or garbage
+            }
+
+            std::string name;
+            name.reserve(colon - buffer);
+            std::transform(buffer, colon, std::back_inserter(name), [](char ch) {
+                return static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+            });
+
+            auto vbegin = colon + 1;
+            auto vend = end;
+            while ((vbegin < vend) && std::isspace(static_cast<unsigned char>(*vbegin))) {
+                ++vbegin;
+            }
+            while ((vend > vbegin) && std::isspace(static_cast<unsigned char>(vend[-1]))) {
+                --vend;
+            }
+
+            auto& value = self->response_headers_[name];
+            if (!value.empty()) {
+                // Repeated headers are folded into a comma separated list (RFC 7230, 3.2.2)
+                value += ", ";
+            }
+            value.append(vbegin, vend);
+            return bytes;
+        }
+
+        void CompleteFromCache(const ResponseCache::Entry& entry) {
+            Result result(CURLE_OK);
+            result.http_response_code = entry.http_code;
+            SetCachedBody(entry, result);
+            result.bytes_received = static_cast<curl_off_t>(entry.body ? entry.body->size() : 0);
+            result.attempts = attempts_;
+            result.from_cache = true;
+            if (store_headers_) {
+                result.headers = entry.headers;
+            }
+            Deliver(result);
+        }
+
+        // Call the completion callbacks for the request and any requests coalesced with it
+        void Deliver(Result& result) {
+            if (before_completion_) {
+                before_completion_(*this);
+                before_completion_ = nullptr;
+            }
+
+            if (followers_.empty()) {
+                if (completion_) {
+                    completion_(result);
+                }
+                return;
+            }
+
+            // Everyone gets the same body buffer
+            if (!result.body.empty()) {
+                result.shared_body = std::make_shared<const std::string>(std::move(result.body));
+                result.body.clear();
+            }
+
+            std::exception_ptr eptr;
+            try {
+                if (completion_) {
+                    completion_(result);
+                }
+            } catch(...) {
+                eptr = std::current_exception();
+            }
+
+            for(auto& follower : followers_) {
+                try {
+                    if (follower->completion_) {
+                        follower->completion_(result);
+                    }
+                } catch(const std::exception& ex) {
+                    RESTINCURL_LOG("Completion for coalesced request threw: " << ex.what());
+                }
+            }
+            followers_.clear();
+
+            if (eptr) {
+                std::rethrow_exception(eptr);
+            }
+        }
+
+        // Update the cache from the response, and serve the cached body if the server confirmed it.
+        void UpdateCache(const CURLcode cc, Result& result) {
+            assert(cache_);
+            auto& metrics = cache_->GetMetrics();
+            const auto httpCode = result.http_response_code;
+            if (cc != CURLE_OK) {
+                return;
+            }
+
+            std::string value;
+            std::chrono::seconds lifetime = {};
+            const bool have_cache_control = GetResponseHeader("cache-control", value);
+            const bool cacheable = have_cache_control
+                && ResponseCache::ParseCacheControl(value, lifetime);
+
+            if ((httpCode == 304) && stale_entry_) {
+                ++metrics.cache_revalidations;
+                RESTINCURL_LOG("Cached " << cache_key_ << " is still current");
+                // The new entry shares the body with the old one
+                auto entry = std::make_shared<ResponseCache::Entry>(*stale_entry_);
+                if (cacheable) {
+                    entry->lifetime = lifetime;
+                }
+                // Without Cache-Control, the response is fresh for as long as it was before
+                entry->expires = std::chrono::steady_clock::now() + entry->lifetime;
+                if (cacheable || !have_cache_control) {
+                    cache_->Store(entry);
+                }
+
+                result.http_response_code = entry->http_code;
+                SetCachedBody(*entry, result);
+                result.bytes_received = static_cast<curl_off_t>(entry->body ? entry->body->size() : 0);
+                result.from_cache = true;
+                result.headers = entry->headers;
+                return;
+            }
+
+            if (stale_entry_) {
+                ++metrics.cache_misses;
+            }
+
+            if ((httpCode != 200) || !cacheable) {
+                return;
+            }
+
+            auto entry = std::make_shared<ResponseCache::Entry>();
+            entry->key = cache_key_;
+            if (GetResponseHeader("vary", value)) {
+                size_t pos = 0;
+                while(pos < value.size()) {
+                    auto end = value.find(',', pos);
+                    if (end == std::string::npos) {
+                        end = value.size();
+                    }
+                    std::string name;
+                    for(auto i = pos; i < end; ++i) {
+                        const auto ch = static_cast<unsigned char>(value[i]);
+                        if (!std::isspace(ch)) {
+                            name += static_cast<char>(std::tolower(ch));
+                        }
+                    }
+                    pos = end + 1;
+                    if (name == "*") {
+                        return; // Can never be matched
+                    }
+                    std::string request_value;
+                    GetRequestHeader(name, request_value);
+                    entry->vary.emplace_back(std::move(name), std::move(request_value));
+                }
+            }
+
+            GetResponseHeader("etag", entry->etag);
+            GetResponseHeader("last-modified", entry->last_modified);
+            if ((lifetime.count() <= 0) && entry->etag.empty() && entry->last_modified.empty()) {
+                return; // Can't be used, and can't be revalidated
+            }
+
+            entry->http_code = httpCode;
+            entry->lifetime = lifetime;
+            entry->expires = std::chrono::steady_clock::now() + lifetime;
+            entry->headers = response_headers_;
+            if (cache_->SharesBodies()) {
+                entry->body = std::make_shared<const std::string>(std::move(default_data_buffer_));
+                default_data_buffer_.clear();
+                result.shared_body = entry->body;
+            } else {
+                // The body is moved to the result later
+                entry->body = std::make_shared<const std::string>(default_data_buffer_);
+            }
+            cache_->Store(std::move(entry));
+        }
+
+        void SetCachedBody(const ResponseCache::Entry& entry, Result& result) const {
+            if (!entry.body) {
+                return;
+            }
+            if (cache_->SharesBodies()) {
+                result.shared_body = entry.body;
+            } else {
+                result.body = *entry.body;
+            }
+        }
+
+        void CallCompletion(CURLcode cc) {
+            if (!default_buffer_ && !default_data_buffer_.empty()) {
+                // Pass the body we held back to the data handler. It is from the winning
+                // transfer of a hedged request, or from a response that was not retried.
+                if (write_fn_(&default_data_buffer_[0], 1, default_data_buffer_.size(), write_data_)
+                    != default_data_buffer_.size() && (cc == CURLE_OK)) {
+                    cc = CURLE_WRITE_ERROR;
+                }
+                default_data_buffer_.clear();
+            }
+
+            Result result(cc);
+            if (error_ != Error::NONE) {
+                result = Result(cc, error_, error_msg_);
+            }
+
+            curl_easy_getinfo (*eh_, CURLINFO_RESPONSE_CODE,
+                               &result.http_response_code);
+            curl_easy_getinfo (*eh_, CURLINFO_SIZE_DOWNLOAD_T,
+                               &result.wire_bytes_received);
+            result.bytes_received = bytes_received_;
+            result.attempts = attempts_;
+            RESTINCURL_LOG("Complete: http code: " << result.http_response_code);
+
+            if (cache_) {
+                UpdateCache(cc, result);
+            }
+
+            if (completion_ || !followers_.empty()) {
+                if (!default_data_buffer_.empty()) {
+                    result.body = std::move(default_data_buffer_);
+                }
+                if (!result.from_cache) {
+                    result.headers = std::move(response_headers_);
+                }
+            }
+            Deliver(result);
+        }
+
+        void SetRequestType() {
+            switch(request_type_) {
+                case RequestType::GET:
+                    curl_easy_setopt(*eh_, CURLOPT_HTTPGET, 1L);
+                    break;
+                case RequestType::PUT:
+                    AddHeader("Transfer-Encoding: chunked");
+                    curl_easy_setopt(*eh_, CURLOPT_UPLOAD, 1L);
+                    break;
+                case RequestType::POST:
+                    AddHeader("Transfer-Encoding: chunked");
+                    curl_easy_setopt(*eh_, CURLOPT_UPLOAD, 0L);
+                    curl_easy_setopt(*eh_, CURLOPT_POST, 1L);
+                    break;
+                case RequestType::HEAD:
+                    curl_easy_setopt(*eh_, CURLOPT_NOBODY, 1L);
+                    break;
+                case RequestType::OPTIONS:
+                    curl_easy_setopt(*eh_, CURLOPT_CUSTOMREQUEST, "OPTIONS");
+                    break;
+                case RequestType::PATCH:
+                    AddHeader("Transfer-Encoding: chunked");
+                    curl_easy_setopt(*eh_, CURLOPT_CUSTOMREQUEST, "PATCH");
+                    break;
+                case RequestType::DELETE:
+                    curl_easy_setopt(*eh_, CURLOPT_CUSTOMREQUEST, "DELETE");
+                    break;
+                case RequestType::POST_MIME:
+                    InitMime();
+                    curl_easy_setopt(*eh_, CURLOPT_MIMEPOST, mime_);
+                    break;
+                default:
+                    throw Exception("Unsupported request type" + std::to_string(static_cast<int>(request_type_)));
+            }
+        }
+
+        EasyHandle::ptr_t eh_;
+        RequestType request_type_ = RequestType::INVALID;
+        completion_fn_t completion_;
+        std::unique_ptr<DataHandlerBase> default_out_handler_;
+        OutDataHandler<std::string> string_out_handler_;
+        std::unique_ptr<DataHandlerBase> default_in_handler_;
+        headers_t headers_ = nullptr;
+        headers_t headers_tail_ = nullptr;
+        bool headers_linked_ = false;
+        HeaderList::ptr_t shared_headers_;
+        std::string default_data_buffer_;
+        std::shared_ptr<FILE> fp_;
+        curl_mime *mime_ = {};
+        std::map<std::string, std::string> response_headers_;
+        io_fn_t write_fn_ = {};
+        void *write_data_ = {};
+        io_fn_t read_fn_ = {};
+        void *read_data_ = {};
+        seek_fn_t seek_fn_ = {};
+        std::unique_ptr<BodyCompressor> compressor_;
+        std::unique_ptr<RetryPolicy> retry_;
+        unsigned attempts_ = 1;
+        bool default_buffer_ = false;
+        bool status_checked_ = false;
+        bool discard_body_ = false;
+        bool body_delivered_ = false;
+        bool store_headers_ = false;
+        bool hedge_copy_ = false;
+        bool rate_admitted_ = false;
+        bool rate_limited_ = false;
+        std::shared_ptr<HedgeState> hedge_;
+        std::string url_;
+        std::string host_key_;
+        std::shared_ptr<ResponseCache> cache_;
+        std::string cache_key_;
+        ResponseCache::entry_ptr_t stale_entry_;
+        bool cache_checked_ = false;
+        std::string coalesce_key_;
+        std::vector<ptr_t> followers_;
+        std::function<void (Request&)> before_completion_;
+        Error error_ = Error::NONE;
+        std::string error_msg_;
+        curl_off_t bytes_received_ = {};
+        std::chrono::steady_clock::time_point deadline_;
+        long timeout_ms_ = -1;
+        bool have_deadline_ = false;
+        int priority_ = 0;
+#if RESTINCURL_ENABLE_ASYNC
+        std::shared_ptr<CancelState> cancel_;
+        queue_t::iterator queue_pos_;
+        std::chrono::steady_clock::time_point queued_at_;
+        deadline_index_t::iterator deadline_pos_;
+        bool queued_ = false;
+        bool deadline_indexed_ = false;
+        bool cancel_delivered_ = false;
+#endif
+    };
+
+    /*! Recycles requests and their easy-handles.
+     *
+     * A request from the pool is constructed in a memory block that an earlier
+     * request used, with that request's easy-handle. So a typical request neither
+     * allocates memory for the `Request` and `EasyHandle`, nor initializes a new
+     * easy-handle with `curl_easy_init()`.
+     *
+     * When a request from the pool is deleted, its easy-handle is reset with
+     * `curl_easy_reset()`, its cookies are dropped, and both are put back in the pool,
+     * up to `RESTINCURL_REQUEST_POOL_SIZE` of them.
+     *
+     * Each Worker (or Client in synchronous mode) has one pool. It is thread-safe.
+     */
+    class RequestPool : public std::enable_shared_from_this<RequestPool> {
+        struct Slot {
+            void *block = {};
+            EasyHandle::ptr_t eh;
+            std::string url; // Buffer with some capacity
+        };
+
+    public:
+        explicit RequestPool(const size_t maxSize = RESTINCURL_REQUEST_POOL_SIZE)
+        : max_size_{maxSize}
+        {
+            free_.reserve(max_size_);
+        }
+
+        RequestPool(const RequestPool&) = delete;
+        RequestPool& operator = (const RequestPool&) = delete;
+
+        ~RequestPool() {
+            for(auto& slot : free_) {
+                ::operator delete(slot.block);
+            }
+        }
+
+        /*! Get a new request from the pool. */
+        Request::ptr_t Create() {
+            Slot slot;
+            {
+                lock_t lock(mutex_);
+                if (!free_.empty()) {
+                    slot = std::move(free_.back());
+                    free_.pop_back();
+                }
+            }
+
+            if (!slot.block) {
+                slot.block = ::operator new(sizeof(Request));
+            }
+
+            Request *req = {};
+            try {
+                if (!slot.eh) {
+                    slot.eh = std::make_unique<EasyHandle>();
+                }
+                req = new (slot.block) Request(std::move(slot.eh));
+                req->SetUrl(std::move(slot.url));
+            } catch(...) {
+                ::operator delete(slot.block);
+                throw;
+            }
+            return Request::ptr_t{req, Request::Recycler{shared_from_this()}};
+        }
+
+        /*! Destroy the request, and keep its memory and easy-handle for later. */
+        void Recycle(Request *req) noexcept {
+            Slot slot;
+            slot.eh = req->ReleaseEasyHandle();
+            slot.url = req->ReleaseUrl();
+            req->~Request();
+            slot.block = req;
+
+            if (slot.eh && !*slot.eh) {
+                slot.eh.reset(); // Closed
+            }
+            if (slot.eh) {
+                curl_easy_reset(*slot.eh);
+                // The cookie-engine is not reset by curl_easy_reset()
+                curl_easy_setopt(*slot.eh, CURLOPT_COOKIELIST, "ALL");
+            }
+
+            {
+                lock_t lock(mutex_);
+                if (free_.size() < max_size_) {
+                    free_.push_back(std::move(slot));
+                    return;
+                }
+            }
+            ::operator delete(slot.block);
+        }
+
+        /*! Number of requests that are ready for reuse */
+        size_t GetSize() const {
+            lock_t lock(mutex_);
+            return free_.size();
+        }
+
+    private:
+        const size_t max_size_;
+        mutable std::mutex mutex_;
+        std::vector<Slot> free_;
+    };
+
+    void Request::Recycler::operator()(Request *req) const noexcept {
+        if (pool_) {
+            pool_->Recycle(req);
+        } else {
+            delete req;
+        }
+    }
+
+    /*! Runs a batch of requests concurrently on the calling thread.
+     *
+     * This is the engine behind `Client::PerformAll()`. Like the `Worker`, it uses a
+     * libcurl multi-handle, but it is driven by the calling thread with `curl_multi_wait()`.
+     * It does not need a worker-thread, and is also available when
+     * `RESTINCURL_ENABLE_ASYNC` is 0.
+     *
+     * At most `RESTINCURL_MAX_CONNECTIONS` requests run at the same time. The others wait in
+     * a FIFO queue. Requests are completed like in the `Worker`: fresh responses are served
+     * from the response cache, requests that pass their deadline fail with
+     * `Error::DEADLINE_EXCEEDED`, and failed requests are retried according to their
+     * `RetryPolicy`. The completion-callback for each request is called once, from the
+     * calling thread.
+     *
+     * The multi-handle, and with it libcurl's connection-cache, is kept between
+     * calls to `Perform()`.
+     */
+    class MultiPerformer {
+    public:
+        using clock_t = std::chrono::steady_clock;
+
+        MultiPerformer()
+        : handle_{curl_multi_init()}
+        {
+            if (!handle_) {
+                throw Exception("curl_multi_init() failed");
+            }
+            curl_multi_setopt(handle_, CURLMOPT_MAXCONNECTS, RESTINCURL_MAX_CONNECTIONS);
+        }
+
+        ~MultiPerformer() {
+            curl_multi_cleanup(handle_);
+        }
+
+        MultiPerformer(const MultiPerformer&) = delete;
+        MultiPerformer& operator=(const MultiPerformer&) = delete;
+
+        /*! Perform the requests, and return when they are all completed.
+         *
+         * \param requests Requests that are built, see `RequestBuilder::Build()`
+         * \param timeout Max time to spend. Requests that are not finished by then
+         *      fail with `Error::DEADLINE_EXCEEDED`.
+         * \returns true if all the requests finished before the timeout.
+         */
+        bool Perform(std::vector<Request::ptr_t> requests, const std::chrono::milliseconds timeout) {
+            const auto until = clock_t::now() + timeout;
+            Batch batch{handle_};
+            for(auto& req : requests) {
+                batch.queue.push_back(std::move(req));
+            }
+
+            while(true) {
+                auto now = clock_t::now();
+
+                // Retries go back in the queue when their delay expires
+                while (!batch.retries.empty() && (batch.retries.begin()->first <= now)) {
+                    batch.queue.push_back(std::move(batch.retries.begin()->second));
+                    batch.retries.erase(batch.retries.begin());
+                }
+
+                if (now >= until) {
+                    break;
+                }
+
+                Dequeue(batch, now);
+                if (batch.ongoing.empty() && batch.queue.empty() && batch.retries.empty()) {
+                    return true;
+                }
+
+                int transfers_running = 0;
+                const auto mc = curl_multi_perform(handle_, &transfers_running);
+                if (mc != CURLM_OK) {
+                    throw CurlException("curl_multi_perform", mc);
+                }
+                ProcessFinished(batch);
+
+                if (batch.ongoing.empty() && batch.retries.empty()) {
+                    // Done, or finished requests left free slots for the queue
+                    continue;
+                }
+                if (!batch.queue.empty() && (batch.ongoing.size() < RESTINCURL_MAX_CONNECTIONS)) {
+                    continue;
+                }
+
+                now = clock_t::now();
+                auto wake = until;
+                if (!batch.retries.empty()) {
+                    wake = std::min(wake, batch.retries.begin()->first);
+                }
+                const auto wait = std::max<long>(0, static_cast<long>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() + 1));
+
+                if (batch.ongoing.empty()) {
+                    // Only retries are pending
+                    std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+                    continue;
+                }
+
+                const auto wmc = curl_multi_wait(handle_, nullptr, 0,
+                    static_cast<int>(std::min<long>(wait, 1000)), nullptr);
+                if (wmc != CURLM_OK) {
+                    throw CurlException("curl_multi_wait", wmc);
+                }
+            }
+
+            RESTINCURL_LOG("MultiPerformer: Timed out with " << batch.ongoing.size()
+                << " ongoing and " << (batch.queue.size() + batch.retries.size())
+                << " waiting requests");
+            std::vector<Request::ptr_t> unfinished;
+            for(auto& it : batch.ongoing) {
+                curl_multi_remove_handle(handle_, it.first);
+                unfinished.push_back(std::move(it.second));
+            }
+            batch.ongoing.clear();
+            for(auto& req : batch.queue) {
+                unfinished.push_back(std::move(req));
+            }
+            for(auto& it : batch.retries) {
+                unfinished.push_back(std::move(it.second));
+            }
+            for(auto& req : unfinished) {
+                try {
+                    req->Fail(Error::DEADLINE_EXCEEDED, "PerformAll() timed out");
+                } catch(const std::exception& ex) {
+                    RESTINCURL_LOG("Fail threw: " << ex.what());
+                }
+            }
+            return false;
+        }
+
+    private:
+        struct Batch {
+            explicit Batch(decltype(curl_multi_init()) multi) : multi_{multi} {}
+
+            // Don't leave easy-handles in the multi-handle if we are unwinding
+            ~Batch() {
+                for(auto& it : ongoing) {
+                    curl_multi_remove_handle(multi_, it.first);
+                }
+            }
+
+            std::deque<Request::ptr_t> queue;
+            std::multimap<clock_t::time_point, Request::ptr_t> retries;
+            std::map<EasyHandle::handle_t, Request::ptr_t> ongoing;
+
+        private:
+            decltype(curl_multi_init()) multi_;
+        };
+
+        void Dequeue(Batch& batch, const clock_t::time_point now) {
+            while (!batch.queue.empty() && (batch.ongoing.size() < RESTINCURL_MAX_CONNECTIONS)) {
+                auto req = std::move(batch.queue.front());
+                batch.queue.pop_front();
+
+                try {
+                    if (req->ServeFromCache()) {
+                        continue;
+                    }
+                    if (!req->ApplyDeadline(now)) {
+                        req->Fail(Error::DEADLINE_EXCEEDED, "The deadline passed before the request was sent");
+                        continue;
+                    }
+                } catch(const std::exception& ex) {
+                    RESTINCURL_LOG("Completion threw: " << ex.what());
+                    continue;
+                }
+
+                EasyHandle::handle_t eh = req->GetEasyHandle();
+                const auto mc = curl_multi_add_handle(handle_, eh);
+                if (mc != CURLM_OK) {
+                    // Fail this request, and let the rest of the batch run
+                    RESTINCURL_LOG("curl_multi_add_handle failed: " << curl_multi_strerror(mc));
+                    try {
+                        req->Complete(CURLE_FAILED_INIT, CURLMSG_DONE);
+                    } catch(const std::exception& ex) {
+                        RESTINCURL_LOG("Complete threw: " << ex.what());
+                    }
+                    continue;
+                }
+                batch.ongoing[eh] = std::move(req);
+            }
+        }
+
+        void ProcessFinished(Batch& batch) {
+            int msgs_in_queue = 0;
+            while(auto m = curl_multi_info_read(handle_, &msgs_in_queue)) {
+                if (m->msg != CURLMSG_DONE) {
+                    continue;
+                }
+                auto it = batch.ongoing.find(m->easy_handle);
+                if (it == batch.ongoing.end()) {
+                    RESTINCURL_LOG("Failed to find easy_handle in ongoing!");
+                    assert(false);
+                    continue;
+                }
+                // The easy-handle can be reused, see RequestPool
+                curl_multi_remove_handle(handle_, m->easy_handle);
+                auto req = std::move(it->second);
+                batch.ongoing.erase(it);
+
+                std::chrono::milliseconds delay;
+                if (req->PrepareRetry(m->data.result, delay)) {
+                    batch.retries.emplace(clock_t::now() + delay, std::move(req));
+                    continue;
+                }
+
+                try {
+                    req->Complete(m->data.result, m->msg);
+                } catch(const std::exception& ex) {
+                    RESTINCURL_LOG("Complete threw: " << ex.what());
+                }
+            }
+        }
+
+        decltype(curl_multi_init()) handle_;
+    };
+
+#if RESTINCURL_ENABLE_ASYNC
+
+    class Signaler {
+        enum FdUsage { FD_READ = 0, FD_WRITE = 1};
+
+    public:
+        using pipefd_t = std::array<int, 2>;
+
+        Signaler() {
+            auto status = pipe(pipefd_.data());
+            if (status) {
+                throw SystemException("pipe", status);
+            }
+            for(auto fd : pipefd_) {
+                int flags = 0;
+                if (-1 == (flags = fcntl(fd, F_GETFL, 0)))
+                    flags = 0;
+                fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            }
+        }
+
+        ~Signaler() {
+            for(auto fd : pipefd_) {
+                close(fd);
+            }
+        }
+
+        void Signal() {
+            char byte = {};
+            RESTINCURL_LOG_TRACE("Signal: Signaling!");
+            if (write(pipefd_[FD_WRITE], &byte, 1) != 1) {
+                throw SystemException("write pipe", errno);
+            }
+        }
+
+        int GetReadFd() { return pipefd_[FD_READ]; }
+
+        bool WasSignalled() {
+            bool rval = false;
+            char byte = {};
+            while(read(pipefd_[FD_READ], &byte, 1) > 0) {
+                RESTINCURL_LOG_TRACE("Signal: Was signalled");
+                rval = true;
+            }
+
+            return rval;
+        }
+
+    private:
+        pipefd_t pipefd_;
+    };
+    
+    /*! Interface for the event-loops that use libcurl's multi-socket API.
+     *
+     * Used by the worker-thread. Not thread-safe.
+     */
+    class SocketPoller {
+    public:
+        struct Event {
+            int fd = -1;
+            int events = 0; // CURL_CSELECT_*
+        };
+
+        virtual ~SocketPoller() = default;
+
+        /*! Watch a socket for the events libcurl asked for (CURL_POLL_*) */
+        virtual void Watch(int fd, int what) = 0;
+
+        /*! Stop watching a socket */
+        virtual void Unwatch(int fd) = 0;
+
+        /*! Wait for events, or until timeoutMs expires. Returns the number of events */
+        virtual size_t Wait(long timeoutMs, std::vector<Event>& events) = 0;
+
+        virtual WorkerBackend GetBackend() const noexcept = 0;
+    };
+
+#ifdef __linux__
+    /*! Event-loop with epoll. See `WorkerBackend::EPOLL` */
+    class EpollPoller : public SocketPoller {
+    public:
+        EpollPoller()
+        : fd_{epoll_create1(EPOLL_CLOEXEC)}
+        {
+            if (fd_ < 0) {
+                throw SystemException("epoll_create1", errno);
+            }
+        }
+
+        ~EpollPoller() {
+            close(fd_);
+        }
+
+        void Watch(const int fd, const int what) override {
+            epoll_event ev = {};
+            ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0u) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0u);
+            ev.data.fd = fd;
+            const auto added = watched_.insert(fd).second;
+            if (epoll_ctl(fd_, added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev)) {
+                const auto err = errno;
+                if (added) {
+                    watched_.erase(fd);
+                }
+                throw SystemException("epoll_ctl", err);
+            }
+        }
+
+        void Unwatch(const int fd) override {
+            if (watched_.erase(fd)) {
+                epoll_ctl(fd_, EPOLL_CTL_DEL, fd, nullptr);
+            }
+        }
+
+        size_t Wait(const long timeoutMs, std::vector<Event>& events) override {
+            const auto num = epoll_wait(fd_, buffer_.data(), static_cast<int>(buffer_.size()),
+                                        static_cast<int>(std::min<long>(timeoutMs, INT_MAX)));
+            if (num < 0) {
+                if (errno == EINTR) {
+                    return 0;
+                }
+                throw SystemException("epoll_wait", errno);
+            }
+            for(int i = 0; i < num; ++i) {
+                const auto& ev = buffer_[static_cast<size_t>(i)];
+                events.push_back({ev.data.fd,
+                    ((ev.events & EPOLLIN) ? CURL_CSELECT_IN : 0)
+                    | ((ev.events & EPOLLOUT) ? CURL_CSELECT_OUT : 0)
+                    | ((ev.events & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR : 0)});
+            }
+            return static_cast<size_t>(num);
+        }
+
+        WorkerBackend GetBackend() const noexcept override {
+            return WorkerBackend::EPOLL;
+        }
+
+    private:
+        const int fd_;
+        std::unordered_set<int> watched_;
+        std::array<epoll_event, 128> buffer_;
+    };
+#endif
+
+#ifdef RESTINCURL_HAVE_IO_URING
+    /*! Event-loop with io_uring. See `WorkerBackend::IO_URING`
+     *
+     * The rings are set up with the io_uring system calls directly.
+     * Each socket has a multishot poll. When libcurl changes what it waits
+     * for, the poll is removed and a new one is added. These requests are
+     * queued, and submitted with the next `Wait()`, in the same system call.
+     *
+     * Each poll has a generation number in its user-data, so that completions
+     * from a poll that was replaced are ignored.
+     */
+    class IoUringPoller : public SocketPoller {
+        // user_data for requests that we don't need to see the completion for
+        static constexpr uint64_t IGNORE_TAG = 0xffffffffULL;
+
+        struct Watched {
+            uint32_t mask = 0;
+            uint32_t generation = 0;
+        };
+
+    public:
+        /*! Returns nullptr if io_uring, or a feature we need, is not available */
+        static std::unique_ptr<SocketPoller> Create(const unsigned entries = 256) {
+            try {
+                std::unique_ptr<IoUringPoller> poller{new IoUringPoller{entries}};
+                if (poller->Probe()) {
+                    return std::unique_ptr<SocketPoller>{std::move(poller)};
+                }
+                RESTINCURL_LOG("io_uring: Multishot poll is not supported");
+            } catch(const std::exception& ex) {
+                RESTINCURL_LOG("io_uring: " << ex.what());
+            }
+            return {};
+        }
+
+        ~IoUringPoller() {
+            if (sqes_) {
+                munmap(sqes_, sqes_size_);
+            }
+            if (cq_ptr_ && (cq_ptr_ != sq_ptr_)) {
+                munmap(cq_ptr_, cq_size_);
+            }
+            if (sq_ptr_) {
+                munmap(sq_ptr_, sq_size_);
+            }
+            if (fd_ >= 0) {
+                close(fd_);
+            }
+        }
+
+        void Watch(const int fd, const int what) override {
+            const uint32_t mask = ((what & CURL_POLL_IN) ? POLLIN : 0u) | ((what & CURL_POLL_OUT) ? POLLOUT : 0u);
+            auto& w = watched_[fd];
+            if (w.mask == mask) {
+                return;
+            }
+            if (w.mask) {
+                PushRemove(MakeUserData(fd, w.generation));
+            }
+            w.mask = mask;
+            w.generation = NextGeneration();
+            PushPoll(fd, w);
+        }
+
+        void Unwatch(const int fd) override {
+            auto it = watched_.find(fd);
+            if (it != watched_.end()) {
+                PushRemove(MakeUserData(fd, it->second.generation));
+                watched_.erase(it);
+            }
+        }
+
+        size_t Wait(const long timeoutMs, std::vector<Event>& events) override {
+            __kernel_timespec ts = {};
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+            io_uring_getevents_arg arg = {};
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+            if (!HaveCompletions()) {
+                const auto rval = Enter(to_submit_, timeoutMs ? 1 : 0,
+                    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+                if ((rval < 0) && (errno != ETIME) && (errno != EINTR) && (errno != EBUSY)) {
+                    throw SystemException("io_uring_enter", errno);
+                }
+            } else if (to_submit_) {
+                Submit();
+            }
+
+            return Reap(events);
+        }
+
+        WorkerBackend GetBackend() const noexcept override {
+            return WorkerBackend::IO_URING;
+        }
+
+    private:
+        explicit IoUringPoller(const unsigned entries) {
+            io_uring_params params = {};
+            fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            if (fd_ < 0) {
+                throw SystemException("io_uring_setup", errno);
+            }
+            if (!(params.features & IORING_FEAT_EXT_ARG)) {
+                throw Exception("io_uring: IORING_FEAT_EXT_ARG is not supported");
+            }
+
+            sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) {
+                sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+            }
+
+            sq_ptr_ = Map(sq_size_, IORING_OFF_SQ_RING);
+            cq_ptr_ = single_mmap ? sq_ptr_ : Map(cq_size_, IORING_OFF_CQ_RING);
+            sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = static_cast<io_uring_sqe *>(Map(sqes_size_, IORING_OFF_SQES));
+
+            auto sq = static_cast<char *>(sq_ptr_);
+            sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+            sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            sq_entries_ = params.sq_entries;
+            sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+            auto cq = static_cast<char *>(cq_ptr_);
+            cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        }
+
+        void *Map(const size_t size, const off_t offset) {
+            auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+            if (ptr == MAP_FAILED) {
+                throw SystemException("io_uring mmap", errno);
+            }
+            return ptr;
+        }
+
+        // Check that multishot poll works (Linux 5.13)
+        bool Probe() {
+            std::array<int, 2> fds;
+            if (pipe(fds.data())) {
+                return false;
+            }
+            Watch(fds[0], CURL_POLL_IN);
+            const auto generation = watched_[fds[0]].generation;
+            std::vector<Event> events;
+            bool ok = true;
+            // The second event must come from the same poll
+            for(int i = 0; ok && (i < 2); ++i) {
+                ok = (write(fds[1], "x", 1) == 1) && (Wait(1000, events) == 1)
+                    && (events.back().events == CURL_CSELECT_IN)
+                    && (watched_[fds[0]].generation == generation);
+                char byte = {};
+                ok = ok && (read(fds[0], &byte, 1) == 1);
+            }
+            Unwatch(fds[0]);
+            Submit();
+            close(fds[0]);
+            close(fds[1]);
+            return ok;
+        }
+
+        uint32_t NextGeneration() noexcept {
+            if (++generation_ == 0) {
+                ++generation_;
+            }
+            return generation_;
+        }
+
+        static uint64_t MakeUserData(const int fd, const uint32_t generation) noexcept {
+            return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+        }
+
+        int Enter(const unsigned toSubmit, const unsigned minComplete, const unsigned flags,
+                  const void *arg, const size_t argSize) {
+            const auto rval = static_cast<int>(syscall(__NR_io_uring_enter, fd_, toSubmit, minComplete, flags, arg, argSize));
+            if (rval > 0) {
+                to_submit_ -= std::min<unsigned>(to_submit_, static_cast<unsigned>(rval));
+            }
+            return rval;
+        }
+
+        void Submit() {
+            while (to_submit_) {
+                if (Enter(to_submit_, 0, 0, nullptr, 0) < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw SystemException("io_uring_enter", errno);
+                }
+            }
+        }
+
+        io_uring_sqe& GetSqe() {
+            auto tail = *sq_tail_;
+            if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+                Submit();
+            }
+            const auto index = tail & sq_mask_;
+            auto& sqe = sqes_[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sq_array_[index] = index;
+            __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+            ++to_submit_;
+            return sqe;
+        }
+
+        void PushPoll(const int fd, const Watched& w) {
+            auto& sqe = GetSqe();
+            sqe.opcode = IORING_OP_POLL_ADD;
+            sqe.fd = fd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            sqe.poll32_events = (w.mask << 16) | (w.mask >> 16);
+#else
+            sqe.poll32_events = w.mask;
+#endif
+            sqe.len = IORING_POLL_ADD_MULTI;
+            sqe.user_data = MakeUserData(fd, w.generation);
+        }
+
+        void PushRemove(const uint64_t userData) {
+            auto& sqe = GetSqe();
+            sqe.opcode = IORING_OP_POLL_REMOVE;
+            sqe.fd = -1;
+            sqe.addr = userData;
+            sqe.user_data = IGNORE_TAG;
+        }
+
+        bool HaveCompletions() const noexcept {
+            return *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        }
+
+        size_t Reap(std::vector<Event>& events) {
+            size_t count = 0;
+            auto head = *cq_head_;
+            const auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for(; head != tail; ++head) {
+                const auto& cqe = cqes_[head & cq_mask_];
+                if ((cqe.user_data & IGNORE_TAG) == IGNORE_TAG) {
+                    continue;
+                }
+                const auto fd = static_cast<int>(cqe.user_data & IGNORE_TAG);
+                const auto generation = static_cast<uint32_t>(cqe.user_data >> 32);
+                auto it = watched_.find(fd);
+                if ((it == watched_.end()) || (it->second.generation != generation)) {
+                    continue; // From a poll we have replaced
+                }
+
+                if (cqe.res < 0) {
+                    if (cqe.res != -ECANCELED) {
+                        RESTINCURL_LOG("io_uring: Poll failed for " << fd << ": " << strerror(-cqe.res));
+                        events.push_back({fd, CURL_CSELECT_ERR});
+                        ++count;
+                    }
+                } else {
+                    const auto res = static_cast<uint32_t>(cqe.res);
+                    events.push_back({fd,
+                        ((res & POLLIN) ? CURL_CSELECT_IN : 0)
+                        | ((res & POLLOUT) ? CURL_CSELECT_OUT : 0)
+                        | ((res & (POLLERR | POLLHUP)) ? CURL_CSELECT_ERR : 0)});
+                    ++count;
+                }
+
+                if (!(cqe.flags & IORING_CQE_F_MORE) && (cqe.res != -ECANCELED)) {
+                    // The kernel ended the multishot poll. Add a new one.
+                    it->second.generation = NextGeneration();
+                    PushPoll(fd, it->second);
+                }
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            return count;
+        }
+
+        int fd_ = -1;
+        void *sq_ptr_ = {};
+        void *cq_ptr_ = {};
+        size_t sq_size_ = 0;
+        size_t cq_size_ = 0;
+        io_uring_sqe *sqes_ = {};
+        size_t sqes_size_ = 0;
+        unsigned *sq_head_ = {};
+        unsigned *sq_tail_ = {};
+        unsigned *sq_array_ = {};
+        unsigned sq_mask_ = 0;
+        unsigned sq_entries_ = 0;
+        unsigned *cq_head_ = {};
+        unsigned *cq_tail_ = {};
+        unsigned cq_mask_ = 0;
+        io_uring_cqe *cqes_ = {};
+        unsigned to_submit_ = 0;
+        uint32_t generation_ = 0;
+        std::unordered_map<int, Watched> watched_;
+    };
+#endif
+
+    /*! Thread support for the TLS layer used by libcurl.
+     * 
+     * Some TLS libraries require that you supply callback functions
+     * to deal with thread synchronization.
+     * 
+     * See https://curl.haxx.se/libcurl/c/threadsafe.html
+     * 
+     * You can deal with this yourself, or in the case
+     * that RESTinCurl support your TLS library, you can use
+     * this class.
+     * 
+     * Currently supported libraries:
+     * 
+     *  - Opeenssl (only required for OpenSSL <= 1.0.2) 
+     *      define `RESTINCURL_WITH_OPENSSL_THREADS`
+     * 
+     * The class is written so that you can use it in your code, and
+     * it will only do something when the appropriate define is set.
+     * 
+     * This class is only available when `RESTINCURL_ENABLE_ASYNC` is nonzero.
+     */
+    class TlsLocker 
+    {
+    public:
+        
+#ifdef RESTINCURL_WITH_OPENSSL_THREADS 
+    static void opensslLockCb(int mode, int type, char *, int) {
+        if(mode & CRYPTO_LOCK) {
+           lock();
+        }
+        else {
+           unlock();
+        }
+    }
+    
+    static unsigned long getThreadId(void) {
+        return reinterpret_cast<unsigned long>(::this_thread::get_id());
+    }
+    
+    /*! Enable the built-in support. */
+    static void tlsLockInit() {
+        CRYPTO_set_id_callback((unsigned long (*)())getThreadId);
+        CRYPTO_set_locking_callback((void (*)())opensslLockCb);
+    }
+    
+    /*! Free up resources used when finished using TLS. */
+    static void tlsLockKill() {
+        CRYPTO_set_locking_callback(NULL);
+    }
+    
+#else
+    /*! Enable the built-in support. */
+    static void tlsLOckInit() {
+        ; // Do nothing
+    }
+    
+    /*! Free up resources used when finished using TLS. */
+    static void tlsLockKill() {
+        ; // Do nothing
+    }
+#endif
+
+
+    
+
+    private:
+        static void lock() {
+            mutex_.lock();
+        }
+        
+        static void unlock() {
+            mutex_.unlock();
+        }
+        
+        static std::mutex mutex_;
+    };
+    
+    class Worker {
+        // Circuit breaker state for one host
+        struct Circuit {
+            CircuitState state = CircuitState::CLOSED;
+            unsigned consecutive_failures = 0;
+            std::vector<bool> outcomes; // Ring-buffer with the recent results. true is failure.
+            size_t next = 0;
+            size_t count = 0;
+            size_t failures = 0;
+            unsigned probes = 0;
+            std::chrono::steady_clock::time_point open_until;
+        };
+
+        // Token bucket for a host or URL prefix
+        struct RateBucket {
+            std::string path; // Prefix for the path, if any
+            RateLimit limit;
+            double tokens = 0;
+            std::chrono::steady_clock::time_point updated;
+            std::chrono::steady_clock::time_point paused_until;
+            std::deque<Request::ptr_t> waiting;
+            bool timer_armed = false;
+        };
+        using rate_bucket_ptr_t = std::shared_ptr<RateBucket>;
+        using timers_t = std::multimap<std::chrono::steady_clock::time_point, std::function<void ()>>;
+
+#ifdef RESTINCURL_ENABLE_ASIO
+        class AsioLoop;
+#endif
+
+        class WorkerThread {
+        public:
+            WorkerThread(std::function<void ()> && fn)
+            : thread_{std::move(fn)} {}
+
+            ~WorkerThread() {
+                if (thread_.get_id() == std::this_thread::get_id()) {
+                    // Allow the thread to finish exiting the lambda
+                    thread_.detach();
+                }
+            }
+
+            void Join() const {
+                std::call_once(joined_, [this] {
+                    const_cast<WorkerThread *>(this)->thread_.join();
+                });
+            }
+
+            bool Joinable() const {
+                return thread_.joinable();
+            }
+
+            operator thread_t& () { return thread_; }
+
+            bool IsCurrent() const noexcept {
+                return thread_.get_id() == std::this_thread::get_id();
+            }
+
+        private:
+            thread_t thread_;
+            mutable std::once_flag joined_;
+        };
+
+    public:
+        Worker(std::shared_ptr<ClientContext> context = std::make_shared<ClientContext>())
+        : context_{std::move(context)}
+        {
+            assert(context_);
+            cancel_link_->worker = this;
+        }
+
+#ifdef RESTINCURL_ENABLE_ASIO
+        /*! Perform the transfers on `ioc`, instead of on a worker-thread.
+         *
+         * See `Client::Client(boost::asio::io_context&, bool)`
+         */
+        Worker(std::shared_ptr<ClientContext> context, boost::asio::io_context& ioc)
+        : context_{std::move(context)}
+        {
+            assert(context_);
+            cancel_link_->worker = this;
+            asio_ = std::make_shared<AsioLoop>(*this, ioc);
+        }
+#endif
+
+        ~Worker() {
+            {
+                lock_t lock(cancel_link_->mutex);
+                cancel_link_->worker = nullptr;
+            }
+#ifdef RESTINCURL_ENABLE_ASIO
+            if (asio_) {
+                asio_->Stop();
+            }
+#endif
+            if (thread_ && thread_->Joinable()) {
+                Close();
+                Join();
+            }
+        }
+
+        void PrepareThread() {
+            // Must only be called when the mutex_ is acquired!
+            assert(!mutex_.try_lock());
+            if (abort_ || done_) {
+                return;
+            }
+#ifdef RESTINCURL_ENABLE_ASIO
+            if (asio_) {
+                // The io_context performs the transfers
+                return;
+            }
+#endif
+            if (!thread_) {
+                thread_ = std::make_shared<WorkerThread>([&] {
+                    try {
+                        RESTINCURL_LOG("Starting thread " << std::this_thread::get_id());
+                        Init();
+                        RunLoop();
+                        Clean();
+                    } catch (const std::exception& ex) {
+                        RESTINCURL_LOG("Worker: " << ex.what());
+                    }
+                    RESTINCURL_LOG("Exiting thread " << std::this_thread::get_id());
+
+                    lock_t lock(mutex_);
+                    thread_.reset();
+                });
+            }
+            assert(!abort_);
+            assert(!done_);
+        }
+
+        static std::unique_ptr<Worker> Create() {
+            return std::make_unique<Worker>();
+        }
+
+        void Enqueue(Request::ptr_t req) {
+            RESTINCURL_LOG_TRACE("Queuing request ");
+            Request::ptr_t dropped;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                PrepareThread();
+
+                const auto until = std::chrono::steady_clock::now() + queue_policy_.block_timeout;
+                while(true) {
+                    if (!req->GetCoalesceKey().empty()) {
+                        auto it = coalesced_.find(req->GetCoalesceKey());
+                        if (it != coalesced_.end()) {
+                            RESTINCURL_LOG_TRACE("Coalescing request with " << req->GetCoalesceKey());
+                            ++context_->GetMetrics().coalesced_requests;
+                            if (const auto& state = req->GetCancelState()) {
+                                state->request = req.get();
+                            }
+                            it->second->AddFollower(std::move(req));
+                            return;
+                        }
+                    }
+
+                    if (!queue_policy_.max_size || (queue_.size() < queue_policy_.max_size)) {
+                        break;
+                    }
+
+                    if (!MakeRoom(lock, *req, until, dropped)) {
+                        ++context_->GetMetrics().queue_rejections;
+                        lock.unlock();
+                        RESTINCURL_LOG("Rejecting request: The queue is full");
+                        FailQueueFull(*req);
+                        return;
+                    }
+                    if (dropped) {
+                        break;
+                    }
+                    // There may be an identical request to coalesce with now
+                }
+
+                if (const auto& state = req->GetCancelState()) {
+                    state->request = req.get();
+                }
+
+                if (!req->GetCoalesceKey().empty()) {
+                    coalesced_[req->GetCoalesceKey()] = req.get();
+                    req->SetBeforeCompletion([this](Request& leader) {
+                        lock_t lock(mutex_);
+                        auto it = coalesced_.find(leader.GetCoalesceKey());
+                        assert((it != coalesced_.end()) && (it->second == &leader));
+                        coalesced_.erase(it);
+                    });
+                }
+
+                AddToQueue(std::move(req));
+            }
+            Signal();
+
+            if (dropped) {
+                RESTINCURL_LOG("Dropped a queued request: The queue is full");
+                FailQueueFull(*dropped);
+            }
+        }
+
+        /*! Set the limit for the queue. See `QueuePolicy` */
+        void SetQueuePolicy(const QueuePolicy& policy) {
+            {
+                lock_t lock(mutex_);
+                queue_policy_ = policy;
+            }
+            queue_space_.notify_all();
+        }
+
+        QueuePolicy GetQueuePolicy() const {
+            lock_t lock(mutex_);
+            return queue_policy_;
+        }
+
+        /*! Shed requests that wait too long in the queue. See `LoadShedder` */
+        void SetLoadShedding(const LoadSheddingPolicy& policy) {
+            lock_t lock(mutex_);
+            shedding_policy_ = std::make_unique<LoadSheddingPolicy>(policy);
+            shedding_changed_ = true;
+        }
+
+        void DisableLoadShedding() {
+            lock_t lock(mutex_);
+            shedding_policy_.reset();
+            shedding_changed_ = true;
+        }
+
+        /*! Get the number of requests waiting in the queue */
+        size_t GetQueueSize() const {
+            lock_t lock(mutex_);
+            return queue_.size();
+        }
+
+        /*! Cancel a request. See `RequestHandle::Cancel()`
+         *
+         * The request is completed by the worker-thread.
+         */
+        void Cancel(std::shared_ptr<CancelState> state) {
+            {
+                lock_t lock(mutex_);
+                cancels_.push_back(std::move(state));
+            }
+            Signal();
+        }
+
+        /*! Select how the worker-thread waits for network events.
+         *
+         * Takes effect the next time the worker-thread starts. If the backend
+         * is not available, the worker falls back to epoll, and then to select().
+         */
+        void SetBackend(const WorkerBackend backend) {
+            lock_t lock(mutex_);
+            backend_ = backend;
+        }
+
+        /*! The backend that the worker-thread uses, or will try to use */
+        WorkerBackend GetBackend() const {
+            lock_t lock(mutex_);
+            return active_backend_;
+        }
+
+        /*! Link for the `CancelState` of requests executed by this worker */
+        const std::shared_ptr<CancelState::Link>& GetCancelLink() const noexcept {
+            return cancel_link_;
+        }
+
+        void Join() const {
+            decltype(thread_) thd;
+
+            {
+                lock_t lock(mutex_);
+                if (thread_ && thread_->Joinable()) {
+                    thd = thread_;
+                }
+            }
+
+            if (thd) {
+                thd->Join();
+            }
+        }
+
+        // Let the current transfers complete, then quit
+        void CloseWhenFinished() {
+            {
+                lock_t lock(mutex_);
+                close_pending_ = true;
+            }
+            Signal();
+        }
+
+        // Shut down now. Abort all transfers
+        void Close() {
+            {
+                lock_t lock(mutex_);
+                abort_ = true;
+            }
+            queue_space_.notify_all();
+            Signal();
+        }
+
+        // Check if the run loop has finished.
+        bool IsDone() const {
+            lock_t lock(mutex_);
+            return done_;
+        }
+
+        bool HaveThread() const noexcept {
+            lock_t lock(mutex_);
+            if (thread_) {
+                return true;
+            }
+            return false;
+        }
+
+        size_t GetNumActiveRequests() const {
+            lock_t lock(mutex_);
+            return ongoing_.size();
+        }
+
+        ClientContext& GetContext() noexcept {
+            return *context_;
+        }
+
+        /*! Pool for the requests that are made for this worker */
+        RequestPool& GetRequestPool() noexcept {
+            return *pool_;
+        }
+
+    private:
+        void Signal() {
+#ifdef RESTINCURL_ENABLE_ASIO
+            if (asio_) {
+                asio_->Kick();
+                return;
+            }
+#endif
+            signal_.Signal();
+        }
+
+        // True if called from the thread that performs the transfers
+        bool IsWorkerContext() const noexcept {
+#ifdef RESTINCURL_ENABLE_ASIO
+            if (asio_) {
+                return asio_->RunningInThisThread();
+            }
+#endif
+            return thread_ && thread_->IsCurrent();
+        }
+
+        // Must be called with mutex_ held
+        void AddToQueue(Request::ptr_t req, const bool front = false) {
+            auto& r = *req;
+            r.SetQueuePos(queue_.insert(front ? queue_.begin() : queue_.end(), std::move(req)),
+                          std::chrono::steady_clock::now());
+            if (r.HaveDeadline()) {
+                r.SetDeadlinePos(queue_deadlines_.emplace(r.GetDeadline(), &r));
+            }
+        }
+
+        // The request has been moved out of the queue. Must be called with mutex_ held.
+        void Unqueued(Request& req) noexcept {
+            req.ClearQueuePos();
+            if (req.IsDeadlineIndexed()) {
+                queue_deadlines_.erase(req.GetDeadlinePos());
+                req.ClearDeadlinePos();
+            }
+            if (blocked_producers_) {
+                queue_space_.notify_one();
+            }
+        }
+
+        // Apply the overflow policy when the queue is full. Must be called with mutex_ held.
+        //
+        // Returns false if the new request must be rejected. If a queued request is
+        // dropped, it's returned in `dropped`. If neither, we waited for room and the
+        // caller must check again.
+        bool MakeRoom(std::unique_lock<std::mutex>& lock, const Request& req,
+                      const std::chrono::steady_clock::time_point until, Request::ptr_t& dropped) {
+            assert(!queue_.empty());
+            switch(queue_policy_.overflow) {
+                case QueueOverflow::REJECT:
+                    return false;
+
+                case QueueOverflow::BLOCK: {
+                    if (abort_ || IsWorkerContext()) {
+                        return false;
+                    }
+                    ++blocked_producers_;
+                    const auto have_room = queue_space_.wait_until(lock, until, [this] {
+                        return abort_ || !queue_policy_.max_size || (queue_.size() < queue_policy_.max_size);
+                    });
+                    --blocked_producers_;
+                    return have_room && !abort_;
+                }
+
+                case QueueOverflow::DROP_OLDEST:
+                    dropped = RemoveFromQueue(*queue_.front());
+                    break;
+
+                case QueueOverflow::DROP_LOWEST_PRIORITY: {
+                    auto lowest = queue_.begin();
+                    for(auto it = std::next(lowest); it != queue_.end(); ++it) {
+                        if ((*it)->GetPriority() < (*lowest)->GetPriority()) {
+                            lowest = it;
+                        }
+                    }
+                    if ((*lowest)->GetPriority() >= req.GetPriority()) {
+                        return false;
+                    }
+                    dropped = RemoveFromQueue(**lowest);
+                } break;
+            }
+
+            // It will be completed and deleted by the caller, not by the worker-thread
+            if (const auto& state = dropped->GetCancelState()) {
+                state->request = nullptr;
+            }
+            ++context_->GetMetrics().queue_drops;
+            return true;
+        }
+
+        void FailQueueFull(Request& req) {
+            try {
+                req.Fail(Error::QUEUE_FULL, "The queue is full");
+            } catch(const std::exception& ex) {
+                RESTINCURL_LOG("Fail threw: " << ex.what());
+            }
+        }
+
+        // Must be called with mutex_ held
+        Request::ptr_t RemoveFromQueue(Request& req) {
+            assert(req.IsQueued());
+            const auto pos = req.GetQueuePos();
+            auto ptr = std::move(*pos);
+            queue_.erase(pos);
+            Unqueued(req);
+            return ptr;
+        }
+
+        void FailDeadline(Request& req) {
+            ++context_->GetMetrics().deadlines_exceeded;
+            try {
+                req.Fail(Error::DEADLINE_EXCEEDED, "The deadline passed before the request was sent");
+            } catch(const std::exception& ex) {
+                RESTINCURL_LOG("Fail threw: " << ex.what());
+            }
+        }
+
+        // Drop the queued requests whose deadline has passed
+        void ExpireQueued() {
+            std::vector<Request::ptr_t> expired;
+            {
+                lock_t lock(mutex_);
+                const auto now = std::chrono::steady_clock::now();
+                while(!queue_deadlines_.empty() && (queue_deadlines_.begin()->first <= now)) {
+                    expired.push_back(RemoveFromQueue(*queue_deadlines_.begin()->second));
+                }
+            }
+
+            for(auto& req : expired) {
+                RESTINCURL_LOG_TRACE("The deadline passed for a queued request");
+                FailDeadline(*req);
+            }
+        }
+
+        // Disconnect a cancelled request from the coalescing, if nobody else waits for it.
+        // Must be called with mutex_ held.
+        bool ReleaseCancelled(Request& req) {
+            if (req.HasFollowers()) {
+                return false; // The transfer still has a purpose
+            }
+            if (!req.GetCoalesceKey().empty()) {
+                auto it = coalesced_.find(req.GetCoalesceKey());
+                if ((it != coalesced_.end()) && (it->second == &req)) {
+                    coalesced_.erase(it);
+                }
+                req.SetBeforeCompletion({});
+            }
+            return true;
+        }
+
+        void DeliverCancelled(Request& req) {
+            if (req.IsCancelDelivered()) {
+                return;
+            }
+            // Count it first, so the completion callback sees the updated stats
+            ++context_->GetMetrics().cancelled_requests;
+            try {
+                req.CompleteCancelled();
+            } catch(const std::exception& ex) {
+                RESTINCURL_LOG("Completion for cancelled request threw: " << ex.what());
+            }
+        }
+
+        // Take a cancelled request out of the multi-handle, with any hedged copies of it
+        Request::ptr_t DetachOngoing(Request& req) {
+            Request::ptr_t detached;
+            if (const auto& hedge = req.GetHedge()) {
+                for(const auto eh : hedge->running) {
+                    curl_multi_remove_handle(handle_, eh);
+                    auto it = ongoing_.find(eh);
+                    assert(it != ongoing_.end());
+                    if (it->second.get() == &req) {
+                        detached = std::move(it->second);
+                    }
+                    ongoing_.erase(it);
+                }
+                hedge->running.clear();
+                CancelHedgeTimer(*hedge);
+                auto idle = idle_hedge_leaders_.find(&req);
+                if (idle != idle_hedge_leaders_.end()) {
+                    detached = std::move(idle->second);
+                    idle_hedge_leaders_.erase(idle);
+                }
+                return detached;
+            }
+
+            auto it = ongoing_.find(req.GetEasyHandle());
+            if ((it != ongoing_.end()) && (it->second.get() == &req)) {
+                curl_multi_remove_handle(handle_, it->first);
+                detached = std::move(it->second);
+                ongoing_.erase(it);
+            }
+            return detached;
+        }
+
+        // Complete the requests cancelled since the last time.
+        //
+        // A request in the queue or in the multi-handle is removed right away.
+        // A request waiting for the rate limiter or a retry is removed when it
+        // gets back to the queue; only its completion callback is called now.
+        void ProcessCancellations() {
+            decltype(cancels_) cancels;
+            std::vector<std::pair<Request *, bool /* release */>> victims;
+            std::vector<Request::ptr_t> unqueued;
+            {
+                lock_t lock(mutex_);
+                if (cancels_.empty()) {
+                    return;
+                }
+                cancels.swap(cancels_);
+                for(const auto& state : cancels) {
+                    auto req = state->request;
+                    if (!req) {
+                        continue; // Already completed, or not yet queued
+                    }
+                    const auto release = ReleaseCancelled(*req);
+                    if (release && req->IsQueued()) {
+                        unqueued.push_back(RemoveFromQueue(*req));
+                        continue;
+                    }
+                    victims.emplace_back(req, release);
+                }
+            }
+
+            for(auto& req : unqueued) {
+                RESTINCURL_LOG_TRACE("Cancelled queued request");
+                DeliverCancelled(*req);
+            }
+            unqueued.clear();
+
+            for(const auto& victim : victims) {
+                auto& req = *victim.first;
+                Request::ptr_t detached;
+                if (victim.second) {
+                    detached = DetachOngoing(req);
+                }
+                RESTINCURL_LOG_TRACE("Cancelled " << (detached ? "ongoing" : "waiting") << " request");
+                DeliverCancelled(req);
+            }
+        }
+
+        void Dequeue() {
+            ProcessCancellations();
+
+            decltype(queue_) tmp;
+            bool queue_drained = true;
+
+            {
+                lock_t lock(mutex_);
+                if ((queue_.size() + ongoing_.size()) <= RESTINCURL_MAX_CONNECTIONS) {
+                    tmp.splice(tmp.end(), queue_);
+                    pending_entries_in_queue_ = false;
+                } else {
+                    auto remains = std::min<size_t>(RESTINCURL_MAX_CONNECTIONS - ongoing_.size(), queue_.size());
+                    if (remains) {
+                        auto it = queue_.begin();
+                        RESTINCURL_LOG_TRACE("Adding only " << remains << " of " << queue_.size()
+                            << " requests from queue: << RESTINCURL_MAX_CONNECTIONS=" << RESTINCURL_MAX_CONNECTIONS);
+                        while(remains--) {
+                            assert(it != queue_.end());
+                            ++it;
+                        }
+                        tmp.splice(tmp.end(), queue_, queue_.begin(), it);
+                    } else {
+                        assert(ongoing_.size() == RESTINCURL_MAX_CONNECTIONS);
+                        RESTINCURL_LOG_TRACE("Adding no entries from queue: RESTINCURL_MAX_CONNECTIONS="
+                            << RESTINCURL_MAX_CONNECTIONS);
+                    }
+                    pending_entries_in_queue_ = true;
+                }
+                for(auto& req : tmp) {
+                    Unqueued(*req);
+                }
+                queue_drained = queue_.empty();
+
+                if (shedding_changed_) {
+                    shedder_.reset();
+                    if (shedding_policy_) {
+                        shedder_ = std::make_unique<LoadShedder>(*shedding_policy_);
+                    }
+                    shedding_changed_ = false;
+                }
+            }
+
+            const auto breaker = context_->GetCircuitBreaker();
+            const auto now = std::chrono::steady_clock::now();
+            UpdateRateLimits();
+            for(auto& req: tmp) {
+                assert(req);
+                if (req->IsCancelled()) {
+                    bool release = false;
+                    {
+                        lock_t lock(mutex_);
+                        release = ReleaseCancelled(*req);
+                    }
+                    DeliverCancelled(*req);
+                    if (release) {
+                        continue;
+                    }
+                }
+
+                if (req->ServeFromCache()) {
+                    continue;
+                }
+
+                if (shedder_ && shedder_->ShouldShed(now, now - req->GetQueuedAt(), queue_drained)) {
+                    RESTINCURL_LOG_TRACE("Shedding request: It waited too long in the queue");
+                    ++context_->GetMetrics().requests_shed;
+                    try {
+                        req->Fail(Error::OVERLOADED, "Shed by the load shedder");
+                    } catch(const std::exception& ex) {
+                        RESTINCURL_LOG("Fail threw: " << ex.what());
+                    }
+                    continue;
+                }
+
+                if (!req->ApplyDeadline(now)) {
+                    FailDeadline(*req);
+                    continue;
+                }
+
+                if (req->IsRateAdmitted()) {
+                    req->SetRateAdmitted(false);
+                } else if (!AdmitByRate(req)) {
+                    continue; // Parked in the rate limiter
+                }
+
+                if (breaker && !AdmitByCircuit(*breaker, *req)) {
+                    ++context_->GetMetrics().circuit_rejections;
+                    try {
+                        req->Fail(Error::CIRCUIT_OPEN, "Circuit breaker is open for " + req->GetHostKey());
+                    } catch(const std::exception& ex) {
+                        RESTINCURL_LOG("Fail threw: " << ex.what());
+                    }
+                    continue;
+                }
+
+                const auto& eh = req->GetEasyHandle();
+                RESTINCURL_LOG_TRACE("Adding request: " << eh);
+                if (const auto& hedge = req->GetHedge()) {
+                    hedge->started = std::chrono::steady_clock::now();
+                    hedge->running.assign(1, eh);
+                    context_->AddHedgeBudget();
+                    ScheduleHedge(hedge);
+                }
+                ongoing_[eh] = std::move(req);
+                const auto mc = curl_multi_add_handle(handle_, eh);
+                if (mc != CURLM_OK) {
+                    throw CurlException("curl_multi_add_handle", mc);
+                }
+            }
+        }
+
+        // Put the request back in the queue when the delay expires.
+        void ScheduleRetry(Request::ptr_t req, const std::chrono::milliseconds delay) {
+            auto holder = std::make_shared<Request::ptr_t>(std::move(req));
+            ScheduleTimer(std::chrono::steady_clock::now() + delay, [this, holder] {
+                lock_t lock(mutex_);
+                AddToQueue(std::move(*holder), true);
+                pending_entries_in_queue_ = true;
+            });
+        }
+
+        void SetCircuitState(const CircuitBreakerPolicy& policy, const std::string& host,
+                             Circuit& circuit, const CircuitState state) {
+            const auto from = circuit.state;
+            if (from == state) {
+                return;
+            }
+
+            RESTINCURL_LOG("Circuit breaker for " << host << " changed state from "
+                << static_cast<int>(from) << " to " << static_cast<int>(state));
+            circuit.state = state;
+            circuit.probes = 0;
+            if (state == CircuitState::OPEN) {
+                circuit.open_until = std::chrono::steady_clock::now() + policy.open_time;
+                ++context_->GetMetrics().circuits_opened;
+            } else if (state == CircuitState::CLOSED) {
+                circuit.consecutive_failures = 0;
+                circuit.next = circuit.count = circuit.failures = 0;
+            }
+
+            if (policy.on_state_change) {
+                try {
+                    policy.on_state_change(host, from, state);
+                } catch(const std::exception& ex) {
+                    RESTINCURL_LOG("Circuit breaker callback threw: " << ex.what());
+                }
+            }
+        }
+
+        // Check if the circuit breaker lets the request through
+        bool AdmitByCircuit(const CircuitBreakerPolicy& policy, Request& req) {
+            auto it = circuits_.find(req.GetHostKey());
+            if (it == circuits_.end()) {
+                return true; // No failures yet
+            }
+
+            auto& circuit = it->second;
+            if ((circuit.state == CircuitState::OPEN)
+                && (circuit.open_until <= std::chrono::steady_clock::now())) {
+                SetCircuitState(policy, it->first, circuit, CircuitState::HALF_OPEN);
+            }
+
+            switch(circuit.state) {
+                case CircuitState::CLOSED:
+                    return true;
+                case CircuitState::OPEN:
+                    return false;
+                case CircuitState::HALF_OPEN:
+                    if (circuit.probes < std::max(1U, policy.half_open_probes)) {
+                        ++circuit.probes;
+                        RESTINCURL_LOG("Sending probe #" << circuit.probes << " to " << it->first);
+                        return true;
+                    }
+                    return false;
+            }
+            return true;
+        }
+
+        // Update the circuit breaker with the result of a transfer
+        void RecordCircuitOutcome(Request& req, const CURLcode cc) {
+            const auto breaker = context_->GetCircuitBreaker();
+            if (!breaker) {
+                return;
+            }
+            const auto& policy = *breaker;
+
+            long http_code = {};
+            if (cc == CURLE_OK) {
+                curl_easy_getinfo(req.GetEasyHandle(), CURLINFO_RESPONSE_CODE, &http_code);
+            }
+            const bool failed = (cc != CURLE_OK) || (http_code >= 500);
+
+            auto it = circuits_.find(req.GetHostKey());
+            if (it == circuits_.end()) {
+                if (!failed) {
+                    return; // Don't track healthy hosts until something goes wrong
+                }
+                it = circuits_.emplace(req.GetHostKey(), Circuit{}).first;
+            }
+            auto& circuit = it->second;
+
+            switch(circuit.state) {
+                case CircuitState::OPEN:
+                    return; // Sent before the circuit opened
+                case CircuitState::HALF_OPEN:
+                    SetCircuitState(policy, it->first, circuit,
+                                    failed ? CircuitState::OPEN : CircuitState::CLOSED);
+                    return;
+                case CircuitState::CLOSED:
+                    break;
+            }
+
+            circuit.consecutive_failures = failed ? circuit.consecutive_failures + 1 : 0;
+            if (policy.window) {
+                if (circuit.outcomes.size() != policy.window) {
+                    circuit.outcomes.assign(policy.window, false);
+                    circuit.next = circuit.count = circuit.failures = 0;
+                }
+                if (circuit.count == circuit.outcomes.size()) {
+                    circuit.failures -= circuit.outcomes[circuit.next] ? 1 : 0;
+                } else {
+                    ++circuit.count;
+                }
+                circuit.outcomes[circuit.next] = failed;
+                circuit.failures += failed ? 1 : 0;
+                circuit.next = (circuit.next + 1) % circuit.outcomes.size();
+            }
+
+            const bool too_many_in_a_row = policy.consecutive_failures
+                && (circuit.consecutive_failures >= policy.consecutive_failures);
+            const bool too_high_rate = (policy.failure_rate > 0.0) && policy.window
+                && (circuit.count == policy.window)
+                && (static_cast<double>(circuit.failures) / circuit.count >= policy.failure_rate);
+
+            if (too_many_in_a_row || too_high_rate) {
+                SetCircuitState(policy, it->first, circuit, CircuitState::OPEN);
+            } else if (!circuit.failures && !circuit.consecutive_failures) {
+                circuits_.erase(it); // Healthy again
+            }
+        }
+
+        // Rebuild the rate buckets if the limits changed
+        void UpdateRateLimits() {
+            ClientContext::rate_limits_t limits;
+            if (!context_->GetRateLimits(rate_limits_version_, limits)) {
+                return;
+            }
+
+            // Requests waiting for the old buckets get a new chance
+            {
+                lock_t lock(mutex_);
+                for(auto& host : rate_buckets_) {
+                    for(auto& bucket : host.second) {
+                        for(auto it = bucket->waiting.rbegin(); it != bucket->waiting.rend(); ++it) {
+                            AddToQueue(std::move(*it), true);
+                        }
+                        bucket->waiting.clear();
+                    }
+                }
+                pending_entries_in_queue_ = pending_entries_in_queue_ || !rate_buckets_.empty();
+            }
+            rate_buckets_.clear();
+
+            const auto now = std::chrono::steady_clock::now();
+            for(const auto& limit : limits) {
+                auto bucket = std::make_shared<RateBucket>();
+                bucket->path = GetUrlPath(limit.first);
+                bucket->limit = limit.second;
+                bucket->limit.burst = std::max(1.0, bucket->limit.burst);
+                bucket->tokens = bucket->limit.burst;
+                bucket->updated = now;
+                auto& buckets = rate_buckets_[GetHostKey(limit.first)];
+                buckets.push_back(std::move(bucket));
+                // The longest prefix must match first
+                std::stable_sort(buckets.begin(), buckets.end(), [](const auto& a, const auto& b) {
+                    return a->path.size() > b->path.size();
+                });
+            }
+        }
+
+        rate_bucket_ptr_t FindRateBucket(Request& req) {
+            if (rate_buckets_.empty()) {
+                return {};
+            }
+            auto it = rate_buckets_.find(req.GetHostKey());
+            if (it == rate_buckets_.end()) {
+                return {};
+            }
+
+            const auto& url = req.GetUrl();
+            auto begin = url.find("://");
+            begin = (begin == std::string::npos) ? 0 : begin + 3;
+            const auto path = url.find_first_of("/?#", begin);
+            for(const auto& bucket : it->second) {
+                if (bucket->path.empty()
+                    || ((path != std::string::npos)
+                        && (url.compare(path, bucket->path.size(), bucket->path) == 0))) {
+                    return bucket;
+                }
+            }
+            return {};
+        }
+
+        static void RefillRateBucket(RateBucket& bucket, const std::chrono::steady_clock::time_point now) {
+            const std::chrono::duration<double> elapsed = now - bucket.updated;
+            bucket.updated = now;
+            if (now < bucket.paused_until) {
+                return;
+            }
+            bucket.tokens = std::min(bucket.limit.burst,
+                bucket.tokens + (elapsed.count() * bucket.limit.requests_per_second));
+        }
+
+        // Take a token, if one is available now, and no other request waits for it
+        static bool TakeRateToken(RateBucket& bucket) {
+            const auto now = std::chrono::steady_clock::now();
+            RefillRateBucket(bucket, now);
+            if (bucket.waiting.empty() && (now >= bucket.paused_until) && (bucket.tokens >= 1.0)) {
+                bucket.tokens -= 1.0;
+                return true;
+            }
+            return false;
+        }
+
+        // Check if the rate limit lets the request through. If not, it is parked in the bucket.
+        bool AdmitByRate(Request::ptr_t& req) {
+            auto bucket = FindRateBucket(*req);
+            if (!bucket || TakeRateToken(*bucket)) {
+                return true;
+            }
+
+            if (req->MarkRateLimited()) {
+                // Count requests, not the times a retried request had to wait
+                ++context_->GetMetrics().rate_limited;
+            }
+            bucket->waiting.push_back(std::move(req));
+            ArmRateTimer(bucket);
+            return false;
+        }
+
+        void ArmRateTimer(const rate_bucket_ptr_t& bucket) {
+            if (bucket->timer_armed || bucket->waiting.empty()) {
+                return;
+            }
+
+            auto when = bucket->updated;
+            if (bucket->tokens < 1.0) {
+                const auto rate = std::max(bucket->limit.requests_per_second, 0.001);
+                when += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>((1.0 - bucket->tokens) / rate));
+            }
+            when = std::max(when, bucket->paused_until);
+
+            // The bucket may be replaced by UpdateRateLimits() before the timer fires
+            std::weak_ptr<RateBucket> weak = bucket;
+            bucket->timer_armed = true;
+            ScheduleTimer(when, [this, weak] {
+                if (auto bucket = weak.lock()) {
+                    bucket->timer_armed = false;
+                    ReleaseRateLimited(bucket);
+                }
+            });
+        }
+
+        // Move requests that have got tokens back to the queue
+        void ReleaseRateLimited(const rate_bucket_ptr_t& bucket) {
+            RefillRateBucket(*bucket, std::chrono::steady_clock::now());
+            std::vector<Request::ptr_t> ready;
+            while(!bucket->waiting.empty() && (bucket->tokens >= 1.0)) {
+                bucket->tokens -= 1.0;
+                auto& req = bucket->waiting.front();
+                req->SetRateAdmitted(true);
+                ready.push_back(std::move(req));
+                bucket->waiting.pop_front();
+            }
+
+            if (!ready.empty()) {
+                lock_t lock(mutex_);
+                for(auto it = ready.rbegin(); it != ready.rend(); ++it) {
+                    AddToQueue(std::move(*it), true);
+                }
+                pending_entries_in_queue_ = true;
+            }
+
+            ArmRateTimer(bucket);
+        }
+
+        // Adjust the rate limit from what the server tells us.
+        void LearnRateLimit(Request& req, const CURLcode cc) {
+            auto bucket = FindRateBucket(req);
+            if (!bucket || (cc != CURLE_OK)) {
+                return;
+            }
+
+            long http_code = {};
+            curl_easy_getinfo(req.GetEasyHandle(), CURLINFO_RESPONSE_CODE, &http_code);
+            const auto now = std::chrono::steady_clock::now();
+            auto pause = std::chrono::seconds{};
+            bool exhausted = (http_code == 429);
+
+            std::string value;
+            if (req.GetResponseHeader("x-ratelimit-remaining", value)) {
+                const auto remaining = std::strtod(value.c_str(), nullptr);
+                RefillRateBucket(*bucket, now);
+                bucket->tokens = std::min(bucket->tokens, remaining);
+                exhausted = exhausted || (remaining < 1.0);
+            }
+
+            if (exhausted && req.GetResponseHeader("x-ratelimit-reset", value)) {
+                auto reset = std::strtoll(value.c_str(), nullptr, 10);
+                if (reset > 1000000000LL) {
+                    // Unix time, rather than seconds from now
+                    reset -= static_cast<long long>(time(nullptr));
+                }
+                pause = std::chrono::seconds(std::max(0LL, reset));
+            }
+
+#if LIBCURL_VERSION_NUM >= 0x074200
+            if ((http_code == 429) || (http_code == 503)) {
+                curl_off_t retry_after = {};
+                if ((curl_easy_getinfo(req.GetEasyHandle(), CURLINFO_RETRY_AFTER, &retry_after) == CURLE_OK)
+                    && (retry_after > 0)) {
+                    pause = std::max(pause, std::chrono::seconds(retry_after));
+                    exhausted = true;
+                }
+            }
+#endif
+
+            if (exhausted) {
+                bucket->tokens = std::min(bucket->tokens, 0.0);
+                if (pause.count() > 0) {
+                    RESTINCURL_LOG("Rate limit for " << req.GetHostKey() << " paused for "
+                        << pause.count() << " seconds, as told by the server");
+                    bucket->paused_until = std::max(bucket->paused_until, now + pause);
+                }
+            }
+        }
+
+        // Send a copy of the request if it is still running after the hedge-delay
+        void ScheduleHedge(const std::shared_ptr<Request::HedgeState>& hedge) {
+            auto delay = hedge->after;
+            if ((delay.count() <= 0)
+                && !context_->GetLatencyPercentile(hedge->host, 0.95, delay)) {
+                return; // We don't know enough about the host yet
+            }
+
+            assert(!hedge->timer_armed);
+            std::weak_ptr<Request::HedgeState> weak = hedge;
+            hedge->timer = ScheduleTimer(std::chrono::steady_clock::now() + delay, [this, weak] {
+                if (auto hedge = weak.lock()) {
+                    hedge->timer_armed = false;
+                    SendHedge(hedge);
+                }
+            });
+            hedge->timer_armed = true;
+        }
+
+        // The request is done, or starts over. Don't let the timer keep the worker busy.
+        void CancelHedgeTimer(Request::HedgeState& hedge) {
+            if (hedge.timer_armed) {
+                timers_.erase(hedge.timer);
+                hedge.timer_armed = false;
+            }
+        }
+
+        void SendHedge(const std::shared_ptr<Request::HedgeState>& hedge) {
+            if (hedge->running.empty() || (hedge->sent >= hedge->max_extra)) {
+                return;
+            }
+
+            {
+                lock_t lock(mutex_);
+                if (!queue_.empty() && (ongoing_.size() >= RESTINCURL_MAX_CONNECTIONS)) {
+                    // Don't take a slot from a request that has not been sent at all
+                    RESTINCURL_LOG_TRACE("Not hedging: The queue is full");
+                    return;
+                }
+            }
+
+            assert(hedge->leader);
+            auto bucket = FindRateBucket(*hedge->leader);
+            if (bucket && !TakeRateToken(*bucket)) {
+                RESTINCURL_LOG_TRACE("Not hedging: The rate limit is reached");
+                return;
+            }
+
+            auto& metrics = context_->GetMetrics();
+            if (!context_->SpendHedgeBudget()) {
+                RESTINCURL_LOG_TRACE("Not hedging: No budget");
+                ++metrics.hedges_over_budget;
+                return;
+            }
+
+            assert(hedge->leader);
+            auto copy = hedge->leader->CreateHedgeCopy();
+            const auto& eh = copy->GetEasyHandle();
+            RESTINCURL_LOG("Hedging request " << (EasyHandle::handle_t)hedge->leader->GetEasyHandle()
+                << " with " << (EasyHandle::handle_t)eh);
+            const auto mc = curl_multi_add_handle(handle_, eh);
+            if (mc != CURLM_OK) {
+                RESTINCURL_LOG("Not hedging: curl_multi_add_handle failed: " << mc);
+                return;
+            }
+            hedge->running.push_back(eh);
+            ongoing_[eh] = std::move(copy);
+
+            if (++hedge->sent == 1) {
+                ++metrics.hedged_requests;
+            }
+            ++metrics.hedges_sent;
+
+            if (hedge->sent < hedge->max_extra) {
+                ScheduleHedge(hedge);
+            }
+        }
+
+        // A transfer that is part of a hedged request is done.
+        void FinishHedged(std::map<EasyHandle::handle_t, Request::ptr_t>::iterator it, const CURLcode cc, const CURLMSG msg) {
+            auto hedge = it->second->GetHedge();
+            assert(hedge);
+            const auto eh = it->first;
+            curl_multi_remove_handle(handle_, eh);
+            hedge->running.erase(std::remove(hedge->running.begin(), hedge->running.end(), eh),
+                                 hedge->running.end());
+            auto req = std::move(it->second);
+            ongoing_.erase(it);
+
+            long http_code = {};
+            if (cc == CURLE_OK) {
+                curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &http_code);
+            }
+            const bool success = (cc == CURLE_OK) && (http_code < 500);
+
+            if (!success && !hedge->running.empty()) {
+                RESTINCURL_LOG("Hedged transfer " << eh << " failed. Waiting for the others.");
+                if (req.get() == hedge->leader) {
+                    idle_hedge_leaders_[hedge->leader] = std::move(req);
+                }
+                return;
+            }
+
+            // This transfer won. Cancel the others.
+            Request::ptr_t leader;
+            if (req.get() == hedge->leader) {
+                leader = std::move(req);
+            } else {
+                auto idle = idle_hedge_leaders_.find(hedge->leader);
+                if (idle != idle_hedge_leaders_.end()) {
+                    leader = std::move(idle->second);
+                    idle_hedge_leaders_.erase(idle);
+                }
+            }
+            for(const auto other : hedge->running) {
+                curl_multi_remove_handle(handle_, other);
+                auto o = ongoing_.find(other);
+                assert(o != ongoing_.end());
+                if (o->second.get() == hedge->leader) {
+                    leader = std::move(o->second);
+                }
+                ongoing_.erase(o);
+            }
+            hedge->running.clear();
+            CancelHedgeTimer(*hedge);
+            assert(leader);
+
+            if (req) {
+                RESTINCURL_LOG("Hedged copy " << eh << " won");
+                ++context_->GetMetrics().hedges_won;
+                leader->AdoptHedgeWinner(*req);
+                req.reset();
+            }
+
+            if (success) {
+                context_->RecordLatency(hedge->host, std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - hedge->started));
+            }
+            RecordCircuitOutcome(*leader, cc);
+            LearnRateLimit(*leader, cc);
+
+            std::chrono::milliseconds delay;
+            if (leader->PrepareRetry(cc, delay)) {
+                ScheduleRetry(std::move(leader), delay);
+                return;
+            }
+
+            try {
+                leader->Complete(cc, msg);
+            } catch(const std::exception& ex) {
+                RESTINCURL_LOG("Complete threw: " << ex.what());
+            }
+            leader->GetEasyHandle().Close();
+        }
+
+        // Deliver the results of the finished transfers
+        void ProcessMessages() {
+            int numLeft = {};
+            while (auto m = curl_multi_info_read(handle_, &numLeft)) {
+                assert(m);
+                auto it = ongoing_.find(m->easy_handle);
+                if (it != ongoing_.end()) {
+                    RESTINCURL_LOG("Finishing request with easy-handle: "
+                        << (EasyHandle::handle_t)it->second->GetEasyHandle()
+                        << "; with result: " << m->data.result << " expl: '" << curl_easy_strerror(m->data.result)
+                        << "'; with msg: " << m->msg);
+
+                    const auto& hedge = it->second->GetHedge();
+                    if (hedge && (m->msg == CURLMSG_DONE)) {
+                        if (hedge->sent) {
+                            FinishHedged(it, m->data.result, m->msg);
+                            continue;
+                        }
+                        CancelHedgeTimer(*hedge);
+                        if (m->data.result == CURLE_OK) {
+                            context_->RecordLatency(hedge->host,
+                                std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    std::chrono::steady_clock::now() - hedge->started));
+                        }
+                    }
+
+                    if (m->msg == CURLMSG_DONE) {
+                        RecordCircuitOutcome(*it->second, m->data.result);
+                        LearnRateLimit(*it->second, m->data.result);
+                    }
+
+                    std::chrono::milliseconds delay;
+                    if ((m->msg == CURLMSG_DONE)
+                        && it->second->PrepareRetry(m->data.result, delay)) {
+                        curl_multi_remove_handle(handle_, m->easy_handle);
+                        ScheduleRetry(std::move(it->second), delay);
+                        ongoing_.erase(it);
+                        continue;
+                    }
+
+                    try {
+                        it->second->Complete(m->data.result, m->msg);
+                    } catch(const std::exception& ex) {
+                        RESTINCURL_LOG("Complete threw: " << ex.what());
+                    }
+                    if (m->msg == CURLMSG_DONE) {
+                        // The easy-handle can be reused, see RequestPool
+                        curl_multi_remove_handle(handle_, m->easy_handle);
+                    } else {
+                        it->second->GetEasyHandle().Close();
+                    }
+                    ongoing_.erase(it);
+                } else {
+                    RESTINCURL_LOG("Failed to find easy_handle in ongoing!");
+                    assert(false);
+                }
+            }
+        }
+
+        // Timers are only used from the worker-thread
+        timers_t::iterator ScheduleTimer(const std::chrono::steady_clock::time_point when,
+                                         std::function<void ()> fn) {
+            return timers_.emplace(when, std::move(fn));
+        }
+
+        void ProcessTimers() {
+            const auto now = std::chrono::steady_clock::now();
+            while(!timers_.empty() && (timers_.begin()->first <= now)) {
+                auto fn = std::move(timers_.begin()->second);
+                timers_.erase(timers_.begin());
+                fn();
+            }
+        }
+
+#ifdef RESTINCURL_ENABLE_ASIO
+        /* Performs the worker's transfers on an io_context.
+         *
+         * libcurl tells us which sockets to watch, and when it wants to be called back,
+         * through CURLMOPT_SOCKETFUNCTION and CURLMOPT_TIMERFUNCTION. The sockets are
+         * watched with Asio descriptors, and all the handlers run on a strand, so
+         * that the state that belongs to the worker-thread in the thread-based
+         * worker is only used by one thread at the time.
+         *
+         * The handlers also hold `mutex_` while they run. It is never contended
+         * between them, but `Stop()`, that is called from the thread that deletes
+         * the client, takes it to wait for a running handler, and to keep the
+         * handlers out while it tears down the multi-handle.
+         */
+        class AsioLoop : public std::enable_shared_from_this<AsioLoop> {
+            using clock_t = std::chrono::steady_clock;
+            using error_code_t = boost::system::error_code;
+
+            struct Socket {
+                Socket(boost::asio::io_context& ioc, const curl_socket_t s)
+                : sd{ioc, s}, fd{s} {}
+
+                boost::asio::posix::stream_descriptor sd;
+                curl_socket_t fd;
+                int what = 0; // CURL_POLL_*. 0 when curl is done with the socket.
+                bool reading = false;
+                bool writing = false;
+            };
+            using socket_ptr_t = std::shared_ptr<Socket>;
+
+        public:
+            AsioLoop(Worker& worker, boost::asio::io_context& ioc)
+            : worker_{&worker}
+            , ioc_{ioc}
+            , strand_{boost::asio::make_strand(ioc)}
+            , curl_timer_{ioc}
+            , timer_{ioc}
+            {}
+
+            // Schedule a call to Pump(). Thread-safe.
+            void Kick() {
+                if (!kick_pending_.exchange(true)) {
+                    boost::asio::post(strand_, [self = shared_from_this()] {
+                        self->kick_pending_ = false;
+                        lock_t lock(self->mutex_);
+                        self->Pump();
+                    });
+                }
+            }
+
+            bool RunningInThisThread() const noexcept {
+                return ioc_.get_executor().running_in_this_thread();
+            }
+
+            // Called by the worker's destructor, on the thread that deletes the client
+            void Stop() {
+                // A completion-callback must not delete the client; it would wait for itself here
+                assert(!strand_.running_in_this_thread());
+                lock_t lock(mutex_);
+                if (!worker_) {
+                    return;
+                }
+                auto& w = *worker_;
+                if (w.handle_) {
+                    for(auto& it : w.ongoing_) {
+                        curl_multi_remove_handle(w.handle_, it.first);
+                    }
+                    w.Clean();
+                }
+                worker_ = nullptr;
+                curl_timer_.cancel();
+                timer_.cancel();
+                for(auto& it : sockets_) {
+                    it.second->what = 0;
+                    it.second->sd.release();
+                }
+                sockets_.clear();
+            }
+
+        private:
+            static int socket_callback(CURL * /*easy*/, curl_socket_t s, int what,
+                                       void *userp, void * /*socketp*/) {
+                try {
+                    static_cast<AsioLoop *>(userp)->OnSocketChange(s, what);
+                } catch(const std::exception& ex) {
+                    RESTINCURL_LOG("AsioLoop: Failed to watch socket " << s << ": " << ex.what());
+                    return -1;
+                }
+                return 0;
+            }
+
+            static int timer_callback(CURLM * /*multi*/, long timeoutMs, void *userp) {
+                static_cast<AsioLoop *>(userp)->OnCurlTimerChange(timeoutMs);
+                return 0;
+            }
+
+            void OnSocketChange(const curl_socket_t s, const int what) {
+                if (what == CURL_POLL_REMOVE) {
+                    auto it = sockets_.find(s);
+                    if (it != sockets_.end()) {
+                        it->second->what = 0;
+                        // curl owns the socket, and closes it
+                        it->second->sd.release();
+                        sockets_.erase(it);
+                    }
+                    return;
+                }
+
+                auto& sock = sockets_[s];
+                if (!sock) {
+                    sock = std::make_shared<Socket>(ioc_, s);
+                }
+                sock->what = what;
+                Watch(sock);
+            }
+
+            void OnCurlTimerChange(const long timeoutMs) {
+                curl_timer_.cancel();
+                if (timeoutMs < 0) {
+                    return;
+                }
+                curl_timer_.expires_after(std::chrono::milliseconds(timeoutMs));
+                curl_timer_.async_wait(boost::asio::bind_executor(strand_,
+                    [self = shared_from_this()](const error_code_t& ec) {
+                        if (!ec) {
+                            lock_t lock(self->mutex_);
+                            self->Action(CURL_SOCKET_TIMEOUT, 0);
+                        }
+                    }));
+            }
+
+            void Watch(const socket_ptr_t& sock) {
+                using sd_t = boost::asio::posix::stream_descriptor;
+                if ((sock->what & CURL_POLL_IN) && !sock->reading) {
+                    sock->reading = true;
+                    sock->sd.async_wait(sd_t::wait_read, boost::asio::bind_executor(strand_,
+                        [self = shared_from_this(), sock](const error_code_t& ec) {
+                            lock_t lock(self->mutex_);
+                            sock->reading = false;
+                            self->OnReady(sock, ec, CURL_POLL_IN, CURL_CSELECT_IN);
+                        }));
+                }
+                if ((sock->what & CURL_POLL_OUT) && !sock->writing) {
+                    sock->writing = true;
+                    sock->sd.async_wait(sd_t::wait_write, boost::asio::bind_executor(strand_,
+                        [self = shared_from_this(), sock](const error_code_t& ec) {
+                            lock_t lock(self->mutex_);
+                            sock->writing = false;
+                            self->OnReady(sock, ec, CURL_POLL_OUT, CURL_CSELECT_OUT);
+                        }));
+                }
+            }
+
+            void OnReady(const socket_ptr_t& sock, const error_code_t& ec, const int poll, const int select) {
+                if (!worker_ || (ec == boost::asio::error::operation_aborted) || !(sock->what & poll)) {
+                    return;
+                }
+                Action(sock->fd, ec ? CURL_CSELECT_ERR : select);
+                if (sock->what & poll) {
+                    Watch(sock);
+                }
+            }
+
+            // Let curl work on a socket, or on its timeouts, and deliver the results
+            void Action(const curl_socket_t s, const int events) {
+                if (!worker_) {
+                    return;
+                }
+                try {
+                    int running = 0;
+                    const auto mc = curl_multi_socket_action(worker_->handle_, s, events, &running);
+                    if (mc != CURLM_OK) {
+                        throw CurlException("curl_multi_socket_action", mc);
+                    }
+                    worker_->ProcessMessages();
+                    Schedule();
+                } catch(const std::exception& ex) {
+                    RESTINCURL_LOG("Worker: " << ex.what());
+                }
+            }
+
+            // Do what the worker-thread does between the transfers
+            void Pump() {
+                if (!worker_) {
+                    return;
+                }
+                auto& w = *worker_;
+                try {
+                    if (!w.handle_) {
+                        w.Init();
+                        curl_multi_setopt(w.handle_, CURLMOPT_SOCKETFUNCTION, socket_callback);
+                        curl_multi_setopt(w.handle_, CURLMOPT_SOCKETDATA, this);
+                        curl_multi_setopt(w.handle_, CURLMOPT_TIMERFUNCTION, timer_callback);
+                        curl_multi_setopt(w.handle_, CURLMOPT_TIMERDATA, this);
+                    }
+
+                    bool abort = false;
+                    {
+                        lock_t lock(w.mutex_);
+                        abort = w.abort_;
+                    }
+                    if (abort) {
+                        Abort();
+                        return;
+                    }
+
+                    w.ExpireQueued();
+                    w.ProcessTimers();
+                    w.Dequeue();
+                    Schedule();
+                } catch(const std::exception& ex) {
+                    RESTINCURL_LOG("Worker: " << ex.what());
+                }
+            }
+
+            // Arm a timer for the worker's own timers and the queue-deadlines
+            void Schedule() {
+                auto& w = *worker_;
+                auto when = clock_t::time_point::max();
+                if (!w.timers_.empty()) {
+                    when = w.timers_.begin()->first;
+                }
+
+                bool kick = false;
+                {
+                    lock_t lock(w.mutex_);
+                    if (!w.queue_deadlines_.empty()) {
+                        when = std::min(when, w.queue_deadlines_.begin()->first);
+                    }
+                    // Requests that were completed, failed or shed left free slots
+                    kick = w.pending_entries_in_queue_ && (w.ongoing_.size() < RESTINCURL_MAX_CONNECTIONS);
+                    if (w.close_pending_ && w.ongoing_.empty() && w.queue_.empty() && w.timers_.empty()) {
+                        w.done_ = true;
+                    }
+                }
+
+                if (kick) {
+                    Kick();
+                }
+
+                if ((when == clock_t::time_point::max()) && (timer_when_ != when)) {
+                    // The timers were cancelled. Don't keep the io_context busy.
+                    timer_when_ = when;
+                    timer_.cancel();
+                } else if ((when != clock_t::time_point::max()) && (when != timer_when_)) {
+                    timer_when_ = when;
+                    timer_.expires_at(when);
+                    timer_.async_wait(boost::asio::bind_executor(strand_,
+                        [self = shared_from_this()](const error_code_t& ec) {
+                            if (!ec) {
+                                lock_t lock(self->mutex_);
+                                self->timer_when_ = clock_t::time_point::max();
+                                self->Pump();
+                            }
+                        }));
+                }
+            }
+
+            // Close() was called
+            void Abort() {
+                auto& w = *worker_;
+                for(auto& it : w.ongoing_) {
+                    curl_multi_remove_handle(w.handle_, it.first);
+                }
+                {
+                    // The leaders are destroyed without being completed
+                    lock_t lock(w.mutex_);
+                    w.coalesced_.clear();
+                }
+                w.ongoing_.clear();
+                curl_timer_.cancel();
+                timer_.cancel();
+
+                lock_t lock(w.mutex_);
+                w.done_ = true;
+            }
+
+            std::mutex mutex_;
+            Worker *worker_; // Protected by mutex_. nullptr when stopped.
+            boost::asio::io_context& ioc_;
+            boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+            boost::asio::steady_timer curl_timer_;
+            boost::asio::steady_timer timer_;
+            clock_t::time_point timer_when_ = clock_t::time_point::max();
+            std::map<curl_socket_t, socket_ptr_t> sockets_;
+            std::atomic<bool> kick_pending_{false};
+        };
+#endif
+
+        void Init() {
+            if ((handle_ = curl_multi_init()) == nullptr) {
+                throw std::runtime_error("curl_multi_init() failed");
+            }
+
+            curl_multi_setopt(handle_, CURLMOPT_MAXCONNECTS, RESTINCURL_MAX_CONNECTIONS);
+        }
+
+        void Clean() {
+            if (handle_) {
+                RESTINCURL_LOG_TRACE("Calling curl_multi_cleanup: " << handle_);
+                curl_multi_cleanup(handle_);
+                handle_ = nullptr;
+            }
+        }
+
+        // Create the event-loop for the selected backend, or the best available fallback
+        std::unique_ptr<SocketPoller> CreatePoller(WorkerBackend backend) {
+#ifdef RESTINCURL_HAVE_IO_URING
+            if (backend == WorkerBackend::IO_URING) {
+                if (auto poller = IoUringPoller::Create()) {
+                    return poller;
+                }
+                RESTINCURL_LOG("io_uring is not available. Falling back to epoll.");
+            }
+#endif
+#ifdef __linux__
+            if (backend != WorkerBackend::SELECT) {
+                try {
+                    return std::make_unique<EpollPoller>();
+                } catch(const std::exception& ex) {
+                    RESTINCURL_LOG("epoll is not available. Falling back to select(): " << ex.what());
+                }
+            }
+#endif
+            return {};
+        }
+
+        void RunLoop() {
+            WorkerBackend backend;
+            {
+                lock_t lock(mutex_);
+                backend = backend_;
+            }
+
+            auto poller = CreatePoller(backend);
+            {
+                lock_t lock(mutex_);
+                active_backend_ = poller ? poller->GetBackend() : WorkerBackend::SELECT;
+            }
+
+            if (!poller) {
+                Run();
+                return;
+            }
+
+            RunSockets(*poller);
+            // curl removes its sockets from the poller
+            Clean();
+        }
+
+        static int socket_callback(CURL * /*easy*/, curl_socket_t s, int what,
+                                   void *userp, void * /*socketp*/) {
+            auto poller = static_cast<SocketPoller *>(userp);
+            try {
+                if (what == CURL_POLL_REMOVE) {
+                    poller->Unwatch(s);
+                } else {
+                    poller->Watch(s, what);
+                }
+            } catch(const std::exception& ex) {
+                RESTINCURL_LOG("Failed to watch socket " << s << ": " << ex.what());
+                return -1;
+            }
+            return 0;
+        }
+
+        static int timer_callback(CURLM * /*multi*/, long timeoutMs, void *userp) {
+            auto& when = *static_cast<std::chrono::steady_clock::time_point *>(userp);
+            when = (timeoutMs < 0)
+                ? std::chrono::steady_clock::time_point::max()
+                : std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+            return 0;
+        }
+
+        // Like Run(), but libcurl tells us which sockets to watch, and we tell
+        // it which sockets are ready (the multi-socket API).
+        void RunSockets(SocketPoller& poller) {
+            auto curl_timeout = std::chrono::steady_clock::time_point::max();
+            curl_multi_setopt(handle_, CURLMOPT_SOCKETFUNCTION, socket_callback);
+            curl_multi_setopt(handle_, CURLMOPT_SOCKETDATA, &poller);
+            curl_multi_setopt(handle_, CURLMOPT_TIMERFUNCTION, timer_callback);
+            curl_multi_setopt(handle_, CURLMOPT_TIMERDATA, &curl_timeout);
+
+            const auto signalfd = signal_.GetReadFd();
+            poller.Watch(signalfd, CURL_POLL_IN);
+
+            int transfers_running = -1;
+            bool do_dequeue = true;
+            auto timeout = GetNextTimeout();
+            auto next_deadline = std::chrono::steady_clock::time_point::max();
+            std::vector<SocketPoller::Event> events;
+
+            auto action = [&](const curl_socket_t fd, const int ev) {
+                int running = 0;
+                const auto mc = curl_multi_socket_action(handle_, fd, ev, &running);
+                if (mc != CURLM_OK) {
+                    throw CurlException("curl_multi_socket_action", mc);
+                }
+            };
+
+            while (EvaluateState(transfers_running, do_dequeue)) {
+
+                if (next_deadline <= std::chrono::steady_clock::now()) {
+                    ExpireQueued();
+                }
+
+                if (!timers_.empty()) {
+                    ProcessTimers();
+                    if (pending_entries_in_queue_) {
+                        do_dequeue = true;
+                    }
+                }
+
+                if (do_dequeue) {
+                    Dequeue();
+                    do_dequeue = false;
+                }
+
+                const bool was_running = transfers_running > 0;
+                if (curl_timeout <= std::chrono::steady_clock::now()) {
+                    curl_timeout = std::chrono::steady_clock::time_point::max();
+                    action(CURL_SOCKET_TIMEOUT, 0);
+                }
+
+                ProcessMessages();
+                // Hedged copies are removed without a call to curl_multi_socket_action()
+                transfers_running = static_cast<int>(ongoing_.size());
+
+                // Shut down the thread if we have been idling too long.
+                if (!was_running && (transfers_running <= 0) && timers_.empty()
+                    && !pending_entries_in_queue_ && ongoing_.empty()) {
+                    if (timeout < std::chrono::steady_clock::now()) {
+                        RESTINCURL_LOG("Idle timeout. Will shut down the worker-thread.");
+                        break;
+                    }
+                } else {
+                    timeout = GetNextTimeout();
+                }
+
+                {
+                    lock_t lock(mutex_);
+                    if (abort_ || (!transfers_running && ongoing_.empty() && queue_.empty()
+                        && timers_.empty() && close_pending_)) {
+                        break;
+                    }
+                    next_deadline = queue_deadlines_.empty()
+                        ? std::chrono::steady_clock::time_point::max()
+                        : queue_deadlines_.begin()->first;
+                }
+
+                const auto now = std::chrono::steady_clock::now();
+                auto wake = std::min(timeout, curl_timeout);
+                if (!timers_.empty()) {
+                    wake = std::min(wake, timers_.begin()->first);
+                }
+                if (next_deadline != std::chrono::steady_clock::time_point::max()) {
+                    wake = std::min(wake, next_deadline + std::chrono::milliseconds(1));
+                }
+                long sleep_duration = std::max<long>(0, static_cast<long>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count()));
+                if ((wake > now) && !sleep_duration) {
+                    sleep_duration = 1; // Don't spin on sub-millisecond timeouts
+                }
+
+                if (pending_entries_in_queue_ && (ongoing_.size() < RESTINCURL_MAX_CONNECTIONS)) {
+                    // Requests that were failed, shed or served from the cache left free slots
+                    sleep_duration = 0;
+                }
+
+                RESTINCURL_LOG_TRACE("Waiting for events for "
+                    << sleep_duration << " ms. " << transfers_running << " active transfers.");
+
+                events.clear();
+                poller.Wait(sleep_duration, events);
+                for(const auto& ev : events) {
+                    if (ev.fd == signalfd) {
+                        // io_uring may report the pipe more than once, and the first read empties it
+                        if (signal_.WasSignalled()) {
+                            do_dequeue = true;
+                        }
+                        continue;
+                    }
+                    action(ev.fd, ev.events);
+                }
+
+                // The last transfer may have finished, and then the loop condition fails
+                ProcessMessages();
+                transfers_running = static_cast<int>(ongoing_.size());
+
+                if (pending_entries_in_queue_) {
+                    do_dequeue = true;
+                }
+            } // loop
+
+            poller.Unwatch(signalfd);
+
+            lock_t lock(mutex_);
+            if (close_pending_ || abort_) {
+                done_ = true;
+            }
+        }
+
+        bool EvaluateState(const bool transfersRunning, const bool doDequeue) const noexcept {
+            lock_t lock(mutex_);
+
+            RESTINCURL_LOG_TRACE("Run loop: transfers_running=" << transfersRunning
+                << ", do_dequeue=" << doDequeue
+                << ", close_pending_=" << close_pending_);
+
+            // Requests may be queued from a completion callback or a timer, so
+            // don't quit until the queue is empty and no timers are pending.
+            return !abort_ && (transfersRunning || !queue_.empty() || !timers_.empty()
+                || !close_pending_);
+        }
+
+        std::chrono::steady_clock::time_point GetNextTimeout() const noexcept {
+            return std::chrono::steady_clock::now()
+                + std::chrono::seconds(RESTINCURL_IDLE_TIMEOUT_SEC);
+        }
+
+        void Run() {
+            int transfers_running = -1;
+            fd_set fdread = {};
+            fd_set fdwrite = {};
+            fd_set fdexcep = {};
+            bool do_dequeue = true;
+            auto timeout = GetNextTimeout();
+            auto next_deadline = std::chrono::steady_clock::time_point::max();
+
+            while (EvaluateState(transfers_running, do_dequeue)) {
+
+                if (next_deadline <= std::chrono::steady_clock::now()) {
+                    ExpireQueued();
+                }
+
+                if (!timers_.empty()) {
+                    ProcessTimers();
+                    if (pending_entries_in_queue_) {
+                        do_dequeue = true;
+                    }
+                }
+
+                if (do_dequeue) {
+                    Dequeue();
+                    do_dequeue = false;
+                }
+
+                /* timeout or readable/writable sockets */
+                const bool initial_ideling = transfers_running == -1;
+                const bool was_running = transfers_running > 0;
+                curl_multi_perform(handle_, &transfers_running);
+                if ((transfers_running == 0) && initial_ideling) {
+                    transfers_running = -1; // Let's ignore close_pending_ until we have seen a request
+                }
+
+                // Shut down the thread if we have been idling too long.
+                // Not if a transfer just finished, as its result is not yet delivered. A retry
+                // that was sent when its timer expired may finish within the same perform.
+                if (!was_running && (transfers_running <= 0) && timers_.empty() && !pending_entries_in_queue_
+                    && ongoing_.empty()) {
+                    if (timeout < std::chrono::steady_clock::now()) {
+                        RESTINCURL_LOG("Idle timeout. Will shut down the worker-thread.");
+                        break;
+                    }
+                } else {
+                    timeout = GetNextTimeout();
+                }
+
+                ProcessMessages();
+
+                {
+                    lock_t lock(mutex_);
+                    // Avoid using select() as a timer when we need to exit anyway
+                    if (abort_ || (!transfers_running && queue_.empty() && timers_.empty()
+                        && close_pending_)) {
+                        break;
+                    }
+                    next_deadline = queue_deadlines_.empty()
+                        ? std::chrono::steady_clock::time_point::max()
+                        : queue_deadlines_.begin()->first;
+                }
+
+                auto next_timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    timeout - std::chrono::steady_clock::now());
+                long sleep_duration = std::max<long>(1, next_timeout.count());
+                /* extract sleep_duration value */
+
+
+                FD_ZERO(&fdread);
+                FD_ZERO(&fdwrite);
+                FD_ZERO(&fdexcep);
+
+                int maxfd = -1;
+                if (transfers_running > 0) {
+                    curl_multi_timeout(handle_, &sleep_duration);
+                    if (sleep_duration < 0) {
+                        sleep_duration = 1000;
+                    }
+
+                    /* get file descriptors from the transfers */
+                    const auto mc = curl_multi_fdset(handle_, &fdread, &fdwrite, &fdexcep, &maxfd);
+                    RESTINCURL_LOG_TRACE("maxfd: " << maxfd);
+                    if (mc != CURLM_OK) {
+                        throw CurlException("curl_multi_fdset", mc);
+                    }
+
+                    if (maxfd == -1) {
+                        // Curl want's us to revisit soon
+                        sleep_duration = 50;
+                    }
+                } // active transfers
+
+                if (!timers_.empty()) {
+                    const auto until_timer = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        timers_.begin()->first - std::chrono::steady_clock::now());
+                    sleep_duration = std::max<long>(0, std::min<long>(sleep_duration, until_timer.count()));
+                }
+
+                if (next_deadline != std::chrono::steady_clock::time_point::max()) {
+                    const auto until_deadline = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        next_deadline - std::chrono::steady_clock::now());
+                    sleep_duration = std::max<long>(0, std::min<long>(sleep_duration, until_deadline.count() + 1));
+                }
+
+                if (pending_entries_in_queue_ && (ongoing_.size() < RESTINCURL_MAX_CONNECTIONS)) {
+                    // Requests that were failed, shed or served from the cache left free slots
+                    sleep_duration = 0;
+                }
+
+                struct timeval tv = {};
+                tv.tv_sec = sleep_duration / 1000;
+                tv.tv_usec = (sleep_duration % 1000) * 1000;
+
+                const auto signalfd = signal_.GetReadFd();
+
+                RESTINCURL_LOG_TRACE("Calling select() with timeout of "
+                    << sleep_duration
+                    << " ms. Next timeout in " << next_timeout.count() << " ms. "
+                    << transfers_running << " active transfers.");
+
+                FD_SET(signalfd, &fdread);
+                maxfd = std::max(signalfd,  maxfd) + 1;
+
+                const auto rval = select(maxfd, &fdread, &fdwrite, &fdexcep, &tv);
+                RESTINCURL_LOG_TRACE("select(" << maxfd << ") returned: " << rval);
+
+                if (rval > 0) {
+                    if (FD_ISSET(signalfd, &fdread)) {
+                        RESTINCURL_LOG_TRACE("FD_ISSET was true: ");
+                        do_dequeue = signal_.WasSignalled();
+                    }
+
+                }
+                if (pending_entries_in_queue_) {
+                    do_dequeue = true;
+                }
+            } // loop
+
+
+            lock_t lock(mutex_);
+            if (close_pending_ || abort_) {
+                done_ = true;
+            }
+        }
+
+        bool close_pending_ {false};
+        bool abort_ {false};
+        bool done_ {false};
+        bool pending_entries_in_queue_ = false;
+        decltype(curl_multi_init()) handle_ = {};
+        mutable std::mutex mutex_;
+        std::shared_ptr<WorkerThread> thread_;
+        Request::queue_t queue_;
+        QueuePolicy queue_policy_; // Protected by mutex_
+        std::condition_variable queue_space_; // Signalled when a request leaves the queue
+        unsigned blocked_producers_ = 0; // Protected by mutex_
+        Request::deadline_index_t queue_deadlines_; // Queued requests with a deadline. Protected by mutex_
+        std::unique_ptr<LoadSheddingPolicy> shedding_policy_; // Protected by mutex_
+        bool shedding_changed_ = false; // Protected by mutex_
+        std::unique_ptr<LoadShedder> shedder_;
+        std::vector<std::shared_ptr<CancelState>> cancels_; // Protected by mutex_
+        std::map<EasyHandle::handle_t, Request::ptr_t> ongoing_;
+        timers_t timers_;
+        std::map<Request *, Request::ptr_t> idle_hedge_leaders_;
+        std::map<std::string, Circuit> circuits_;
+        /* The requests that others can be coalesced with, by their key. Protected by mutex_
+         *
+         * A leader is owned by `queue_`, `ongoing_` or a hedge, and stays here until it is
+         * completed (its before-completion hook removes it), or it is cancelled with no
+         * followers (`ReleaseCancelled()`). A cancelled leader with followers keeps running
+         * for them. Any other path that destroys a leader must remove it from here first.
+         */
+        std::unordered_map<std::string, Request *> coalesced_;
+        std::unordered_map<std::string, std::vector<rate_bucket_ptr_t>> rate_buckets_;
+        unsigned rate_limits_version_ = 0;
+        Signaler signal_;
+        std::shared_ptr<ClientContext> context_;
+        std::shared_ptr<RequestPool> pool_ = std::make_shared<RequestPool>();
+        std::shared_ptr<CancelState::Link> cancel_link_ = std::make_shared<CancelState::Link>();
+        WorkerBackend backend_ = WorkerBackend::RESTINCURL_WORKER_BACKEND; // Protected by mutex_
+        WorkerBackend active_backend_ = WorkerBackend::RESTINCURL_WORKER_BACKEND; // Protected by mutex_
+#ifdef RESTINCURL_ENABLE_ASIO
+        std::shared_ptr<AsioLoop> asio_;
+#endif
+    };
+
+    /*! Handle to a request that is executed asynchronously.
+     *
+     * Returned by `RequestBuilder::Execute()`. The handle can be copied, and
+     * it may outlive both the request and the client.
+     */
+    class RequestHandle {
+    public:
+        RequestHandle() = default;
+
+        explicit RequestHandle(std::shared_ptr<CancelState> state)
+        : state_{std::move(state)} {}
+
+        /*! Cancel the request.
+         *
+         * This method is thread-safe, and returns immediately. The worker-thread
+         * then calls the completion callback with a `Result` where `error` is
+         * `Error::CANCELLED` and `curl_code` is `CURLE_ABORTED_BY_CALLBACK`.
+         *
+         * A request that is still queued is removed from the queue. A request
+         * that is in progress is removed from libcurl, and the connection
+         * is closed. If the request is shared with coalesced requests,
+         * the transfer continues for them.
+         *
+         * Has no effect if the request already completed, or was cancelled before.
+         */
+        void Cancel() {
+            if (!state_ || state_->cancelled.exchange(true)) {
+                return;
+            }
+
+            assert(state_->link);
+            auto& link = *state_->link;
+            lock_t lock(link.mutex);
+            if (link.worker) {
+                link.worker->Cancel(state_);
+            }
+        }
+
+        /*! Check if `Cancel()` was called */
+        bool IsCancelled() const noexcept {
+            return state_ && state_->cancelled;
+        }
+
+        /*! Check if the handle refers to a request */
+        explicit operator bool () const noexcept {
+            return static_cast<bool>(state_);
+        }
+
+    private:
+        std::shared_ptr<CancelState> state_;
+    };
+#endif // RESTINCURL_ENABLE_ASYNC
+
+    /*! Download of a resource to a local file.
+     *
+     * This is the engine behind `RequestBuilder::DownloadToFile()`.
+     *
+     * In asynchronous mode, the resource is first probed with a HEAD request. If the
+     * server supports byte ranges, the download is split in segments that are
+     * fetched in parallel by the worker-thread (within the normal limit of
+     * `RESTINCURL_MAX_CONNECTIONS`). Each segment is written directly to its
+     * offset in the pre-allocated output file. A failed segment is retried on
+     * its own, starting from the last byte it received. If the server don't
+     * support ranges, the resource is fetched as a single stream.
+     *
+     * A failed single stream is resumed from the last byte written, if the server
+     * gave us a validator (a strong `ETag` or `Last-Modified`) for the resource.
+     * Resumed requests use `If-Range`, so if the resource changed in the
+     * meantime, the server sends the whole new version and we start over from
+     * the beginning of the file.
+     *
+     * All the requests are made from copies of the easy-handle prepared by the
+     * RequestBuilder, so headers, authentication, timeouts and other options
+     * apply to all of them.
+     */
+    class FileDownload : public std::enable_shared_from_this<FileDownload> {
+        struct Segment {
+            FileDownload *owner = {};
+            curl_off_t begin = {};
+            curl_off_t end = -1; // Inclusive. -1 if the length is unknown
+            curl_off_t written = {};
+            unsigned retries = {};
+            curl_off_t resumed_at = {}; // Bytes we already had when the request was made
+            EasyHandle::handle_t handle = {};
+            bool ranged = false; // We asked for a byte range
+            bool checked = false; // The HTTP response code is validated
+            bool discard = false; // Not the response we wanted
+            bool refused = false; // Asked for a range, but got the full resource
+            int io_error = 0;
+#if RESTINCURL_ENABLE_ASYNC
+            RequestHandle request; // Lets us stop the transfer if another segment fails
+#endif
+        };
+
+    public:
+        using ptr_t = std::shared_ptr<FileDownload>;
+
+        FileDownload(Request::ptr_t tmpl,
+                     const std::string& path,
+                     const DownloadOptions& options,
+                     completion_fn_t completion,
+                     Metrics *metrics
+#if RESTINCURL_ENABLE_ASYNC
+                     , Worker *worker
+#endif
+                     )
+        : tmpl_{std::move(tmpl)}, path_{path}, options_(options)
+        , completion_{std::move(completion)}, metrics_{metrics}
+#if RESTINCURL_ENABLE_ASYNC
+        , worker_{worker}
+#endif
+        {
+            assert(tmpl_);
+        }
+
+        ~FileDownload() {
+            if (fd_ >= 0) {
+                close(fd_);
+            }
+        }
+
+        /*! Start the download.
+         *
+         * \throws SystemException if the output file cannot be opened.
+         */
+        void Start() {
+            fd_ = open(path_.c_str(), O_WRONLY | O_CREAT, 0644);
+            if (fd_ < 0) {
+                const auto e = errno;
+                throw SystemException{std::string{"Unable to open file "} + path_, e};
+            }
+
+#if RESTINCURL_ENABLE_ASYNC
+            if (worker_ && (options_.segments > 1)) {
+                Probe();
+                return;
+            }
+#endif
+            StartSingle();
+        }
+
+    private:
+        static size_t noop_write_callback(char *, size_t size, size_t nitems, void *) {
+            return size * nitems;
+        }
+
+        static size_t write_callback(char *ptr, size_t size, size_t nitems, void *userdata) {
+            assert(userdata);
+            auto seg = reinterpret_cast<Segment *>(userdata);
+            const auto bytes = size * nitems;
+
+            if (!seg->checked) {
+                seg->checked = true;
+                long code = {};
+                curl_easy_getinfo(seg->handle, CURLINFO_RESPONSE_CODE, &code);
+                if (seg->ranged && (code == 200)) {
+                    if (seg->end < 0) {
+                        // Single stream. The resource changed, so start over.
+                        RESTINCURL_LOG("Download: The resource changed. Restarting from the beginning.");
+                        if (ftruncate(seg->owner->fd_, 0) != 0) {
+                            seg->io_error = errno;
+                            return 0;
+                        }
+                        seg->ranged = false;
+                        seg->written = 0;
+                        seg->resumed_at = 0;
+                    } else {
+                        RESTINCURL_LOG("Download: The server ignored our byte-range");
+                        seg->refused = true;
+                        return 0; // Abort the transfer
+                    }
+                }
+                seg->discard = code != (seg->ranged ? 206 : 200);
+                if (!seg->discard && seg->resumed_at && seg->owner->metrics_) {
+                    ++seg->owner->metrics_->downloads_resumed;
+                    seg->owner->metrics_->download_bytes_saved += seg->resumed_at;
                 }
             }
 
-            void Join() const {
-                std::call_once(joined_, [this] {
-                    const_cast<WorkerThread *>(this)->thread_.join();
-                });
+            if (seg->discard) {
+                return bytes;
             }
 
-            bool Joinable() const {
-                return thread_.joinable();
+            if ((seg->end >= 0) && (seg->begin + seg->written + static_cast<curl_off_t>(bytes) > seg->end + 1)) {
+                RESTINCURL_LOG("Download: The server sent more data than we asked for");
+                seg->refused = true;
+                return 0;
             }
 
-            operator thread_t& () { return thread_; }
+            auto remaining = bytes;
+            while (remaining) {
+                const auto rval = pwrite(seg->owner->fd_, ptr, remaining, seg->begin + seg->written);
+                if (rval < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    seg->io_error = errno;
+                    return 0;
+                }
+                ptr += rval;
+                remaining -= rval;
+                seg->written += rval;
+            }
 
-        private:
-            thread_t thread_;
-            mutable std::once_flag joined_;
-        };
+            return bytes;
+        }
 
-    public:
-        Worker() = default;
+        Request::ptr_t MakeRequest(const RequestType type, Segment *seg) {
+            auto req = std::make_unique<Request>(tmpl_->GetEasyHandle().Duplicate());
+            auto& eh = req->GetEasyHandle();
 
-        ~Worker() {
-            if (thread_ && thread_->Joinable()) {
-                Close();
-                Join();
-            }
-        }
+            // The byte-ranges count the bytes of the resource, not of a compressed representation
+            curl_easy_setopt(eh, CURLOPT_ACCEPT_ENCODING, nullptr);
 
-        void PrepareThread() {
-            // Must only be called when the mutex_ is acquired!
-            assert(!mutex_.try_lock());
-            if (abort_ || done_) {
-                return;
+            // The deadline is for the whole download
+            if (tmpl_->HaveDeadline()) {
+                req->SetDeadline(tmpl_->GetDeadline(), tmpl_->GetTimeoutMs());
             }
-            if (!thread_) {
-                thread_ = std::make_shared<WorkerThread>([&] {
-                    try {
-                        RESTINCURL_LOG("Starting thread " << std::this_thread::get_id());
-                        Init();
-                        Run();
-                        Clean();
-                    } catch (const std::exception& ex) {
-                        RESTINCURL_LOG("Worker: " << ex.what());
+
+            if (seg) {
+                seg->owner = this;
+                seg->handle = eh;
+                seg->checked = seg->discard = seg->refused = false;
+                seg->resumed_at = seg->written;
+                curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, write_callback);
+                curl_easy_setopt(eh, CURLOPT_WRITEDATA, seg);
+                if (seg->ranged) {
+                    auto range = std::to_string(seg->begin + seg->written) + '-';
+                    if (seg->end >= 0) {
+                        range += std::to_string(seg->end);
                     }
-                    RESTINCURL_LOG("Exiting thread " << std::this_thread::get_id());
+                    curl_easy_setopt(eh, CURLOPT_RANGE, range.c_str());
+                    if (!validator_.empty()) {
+                        // Share the template's headers, with If-Range added
+                        tmpl_->ForEachHeader([&req](const char *line) {
+                            req->AddHeader(line);
+                        });
+                        req->AddHeader(("If-Range: " + validator_).c_str());
+                        req->LinkHeaders();
+                    }
+                }
+                if (seg->end < 0) {
+                    req->StoreHeaders(); // Get the validator
+                }
+            } else {
+                curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, noop_write_callback);
+                req->StoreHeaders();
+            }
 
-                    lock_t lock(mutex_);
-                    thread_.reset();
-                });
+#if RESTINCURL_ENABLE_ASYNC
+            if (seg && worker_) {
+                auto state = std::make_shared<CancelState>();
+                state->link = worker_->GetCancelLink();
+                req->SetCancelState(state);
+                seg->request = RequestHandle{std::move(state)};
             }
-            assert(!abort_);
-            assert(!done_);
-        }
+#endif
 
-        static std::unique_ptr<Worker> Create() {
-            return std::make_unique<Worker>();
+            auto self = shared_from_this();
+            req->Prepare(type, [self, seg](const Result& result) {
+                self->OnDone(seg, result);
+            });
+            return req;
         }
 
-        void Enqueue(Request::ptr_t req) {
-            RESTINCURL_LOG_TRACE("Queuing request ");
-            lock_t lock(mutex_);
-            PrepareThread();
-            queue_.push_back(std::move(req));
-            Signal();
+        void Submit(Request::ptr_t req) {
+            ++outstanding_;
+#if RESTINCURL_ENABLE_ASYNC
+            if (worker_) {
+                worker_->Enqueue(std::move(req));
+                return;
+            }
+#endif
+            req->Execute();
         }
 
-        void Join() const {
-            decltype(thread_) thd;
+#if RESTINCURL_ENABLE_ASYNC
+        void Probe() {
+            Submit(MakeRequest(RequestType::HEAD, nullptr));
+        }
 
-            {
-                lock_t lock(mutex_);
-                if (thread_ && thread_->Joinable()) {
-                    thd = thread_;
+        void OnProbe(const Result& result) {
+            curl_off_t length = -1;
+            bool ranges = false;
+
+            if (result.isOk()) {
+                SetValidator(result.headers);
+                auto it = result.headers.find("accept-ranges");
+                ranges = (it != result.headers.end()) && (it->second.find("bytes") != std::string::npos);
+                it = result.headers.find("content-length");
+                if (it != result.headers.end()) {
+                    length = strtoll(it->second.c_str(), nullptr, 10);
                 }
             }
 
-            if (thd) {
-                thd->Join();
+            const auto min_size = static_cast<curl_off_t>(std::max<size_t>(options_.min_segment_size, 1));
+            if (!ranges || (length < (min_size * 2))) {
+                RESTINCURL_LOG("Download: Using a single stream for " << path_);
+                StartSingle();
+                return;
             }
-        }
 
-        // Let the current transfers complete, then quit
-        void CloseWhenFinished() {
-            {
-                lock_t lock(mutex_);
-                close_pending_ = true;
+            if (!Allocate(length)) {
+                return;
             }
-            Signal();
-        }
 
-        // Shut down now. Abort all transfers
-        void Close() {
-            {
-                lock_t lock(mutex_);
-                abort_ = true;
+            const auto num = static_cast<size_t>(std::min<curl_off_t>(options_.segments, length / min_size));
+            const auto seg_size = length / num;
+            RESTINCURL_LOG("Download: Fetching " << length << " bytes in " << num << " segments to " << path_);
+
+            segments_.resize(num);
+            curl_off_t offset = 0;
+            for(auto& seg : segments_) {
+                seg.begin = offset;
+                seg.end = (&seg == &segments_.back()) ? (length - 1) : (offset + seg_size - 1);
+                seg.ranged = true;
+                offset = seg.end + 1;
             }
-            Signal();
-        }
 
-        // Check if the run loop has finished.
-        bool IsDone() const {
-            lock_t lock(mutex_);
-            return done_;
+            for(auto& seg : segments_) {
+                Submit(MakeRequest(RequestType::GET, &seg));
+            }
         }
 
-        bool HaveThread() const noexcept {
-            lock_t lock(mutex_);
-            if (thread_) {
-                return true;
+        bool Allocate(const curl_off_t length) {
+            if (posix_fallocate(fd_, 0, length) != 0) {
+                // Not supported by all file-systems. Just set the size.
+                if (ftruncate(fd_, length) != 0) {
+                    Fail(errno);
+                    return false;
+                }
             }
-            return false;
+            return true;
         }
+#endif
 
-        size_t GetNumActiveRequests() const {
-            lock_t lock(mutex_);
-            return ongoing_.size();
+        void StartSingle() {
+            single_started_ = true;
+            if (ftruncate(fd_, 0) != 0) {
+                Fail(errno);
+                return;
+            }
+            single_ = {};
+            Submit(MakeRequest(RequestType::GET, &single_));
         }
 
-    private:
-        void Signal() {
-            signal_.Signal();
-        }
+        void OnDone(Segment *seg, const Result& result) {
+            assert(outstanding_ > 0);
+            --outstanding_;
 
-        void Dequeue() {
-            decltype(queue_) tmp;
+            if (finished_) {
+                return;
+            }
 
-            {
-                lock_t lock(mutex_);
-                if ((queue_.size() + ongoing_.size()) <= RESTINCURL_MAX_CONNECTIONS) {
-                    tmp = std::move(queue_);
-                    pending_entries_in_queue_ = false;
-                } else {
-                    auto remains = std::min<size_t>(RESTINCURL_MAX_CONNECTIONS - ongoing_.size(), queue_.size());
-                    if (remains) {
-                        auto it = queue_.begin();
-                        RESTINCURL_LOG_TRACE("Adding only " << remains << " of " << queue_.size()
-                            << " requests from queue: << RESTINCURL_MAX_CONNECTIONS=" << RESTINCURL_MAX_CONNECTIONS);
-                        while(remains--) {
-                            assert(it != queue_.end());
-                            tmp.push_back(std::move(*it));
-                            ++it;
-                        }
-                        queue_.erase(queue_.begin(), it);
+            if (!seg) {
+#if RESTINCURL_ENABLE_ASYNC
+                OnProbe(result);
+#endif
+                return;
+            }
+
+            const bool complete = (seg->end < 0) || ((seg->begin + seg->written) == (seg->end + 1));
+            const bool ok = (result.curl_code == CURLE_OK) && !seg->discard && complete;
+
+            if ((seg->end < 0) && !seg->discard && !seg->ranged) {
+                // We got (some of) a full response to a single stream request.
+                SetValidator(result.headers);
+            }
+
+            if (ok) {
+                last_ok_ = result;
+            } else if (failed_) {
+                // Stopped because another segment failed
+            } else if (seg->io_error) {
+                // The other segments may still be writing to the file.
+                // Stop them, and complete when they are all done.
+                failed_ = true;
+                error_ = MakeWriteError(seg->io_error);
+                CancelSegments();
+            } else if (seg->refused) {
+                ranges_refused_ = true;
+            } else if (IsRetryable(result) && (seg->retries < options_.max_retries)) {
+                ++seg->retries;
+                RESTINCURL_LOG("Download: Retrying segment at offset " << seg->begin
+                    << " (attempt " << seg->retries << ")");
+                if (seg == &single_) {
+                    if (seg->written && !validator_.empty()) {
+                        seg->ranged = true; // Resume
                     } else {
-                        assert(ongoing_.size() == RESTINCURL_MAX_CONNECTIONS);
-                        RESTINCURL_LOG_TRACE("Adding no entries from queue: RESTINCURL_MAX_CONNECTIONS="
-                            << RESTINCURL_MAX_CONNECTIONS);
+                        if (ftruncate(fd_, 0) != 0) {
+                            Fail(errno);
+                            return;
+                        }
+                        seg->written = 0;
+                        seg->ranged = false;
                     }
-                    pending_entries_in_queue_ = true;
                 }
+                Submit(MakeRequest(RequestType::GET, seg));
+            } else {
+                failed_ = true;
+                error_ = result;
             }
 
-            for(auto& req: tmp) {
-                assert(req);
-                const auto& eh = req->GetEasyHandle();
-                RESTINCURL_LOG_TRACE("Adding request: " << eh);
-                ongoing_[eh] = std::move(req);
-                const auto mc = curl_multi_add_handle(handle_, eh);
-                if (mc != CURLM_OK) {
-                    throw CurlException("curl_multi_add_handle", mc);
-                }
+            if (outstanding_ || finished_) {
+                return;
             }
-        }
 
-        void Init() {
-            if ((handle_ = curl_multi_init()) == nullptr) {
-                throw std::runtime_error("curl_multi_init() failed");
+            if (failed_) {
+                Finish(error_);
+            } else if (ranges_refused_ && !single_started_) {
+                StartSingle();
+            } else {
+                Finish(last_ok_);
             }
-
-            curl_multi_setopt(handle_, CURLMOPT_MAXCONNECTS, RESTINCURL_MAX_CONNECTIONS);
         }
 
-        void Clean() {
-            if (handle_) {
-                RESTINCURL_LOG_TRACE("Calling curl_multi_cleanup: " << handle_);
-                curl_multi_cleanup(handle_);
-                handle_ = nullptr;
+        // Use a strong validator for If-Range, if the server gave us one.
+        void SetValidator(const std::map<std::string, std::string>& headers) {
+            validator_.clear();
+            auto it = headers.find("etag");
+            if ((it != headers.end()) && (it->second.compare(0, 2, "W/") != 0)) {
+                validator_ = it->second;
+                return;
+            }
+            it = headers.find("last-modified");
+            if (it != headers.end()) {
+                validator_ = it->second;
             }
         }
 
-        bool EvaluateState(const bool transfersRunning, const bool doDequeue) const noexcept {
-            lock_t lock(mutex_);
-
-            RESTINCURL_LOG_TRACE("Run loop: transfers_running=" << transfersRunning
-                << ", do_dequeue=" << doDequeue
-                << ", close_pending_=" << close_pending_);
-
-            return !abort_ && (transfersRunning || !close_pending_);
+        static bool IsRetryable(const Result& result) noexcept {
+            if (result.curl_code != CURLE_OK) {
+                return true;
+            }
+            return (result.http_response_code >= 500) || (result.http_response_code == 408);
         }
 
-        auto GetNextTimeout() const noexcept {
-            return std::chrono::steady_clock::now()
-                + std::chrono::seconds(RESTINCURL_IDLE_TIMEOUT_SEC);
+        Result MakeWriteError(const int err) const {
+            Result result(CURLE_WRITE_ERROR);
+            result.msg = std::string{"Failed to write to "} + path_ + ": " + strerror(err);
+            return result;
         }
 
-        void Run() {
-            int transfers_running = -1;
-            fd_set fdread = {};
-            fd_set fdwrite = {};
-            fd_set fdexcep = {};
-            bool do_dequeue = true;
-            auto timeout = GetNextTimeout();
-
-            while (EvaluateState(transfers_running, do_dequeue)) {
-
-                if (do_dequeue) {
-                    Dequeue();
-                    do_dequeue = false;
-                }
-
-                /* timeout or readable/writable sockets */
-                const bool initial_ideling = transfers_running == -1;
-                curl_multi_perform(handle_, &transfers_running);
-                if ((transfers_running == 0) && initial_ideling) {
-                    transfers_running = -1; // Let's ignore close_pending_ until we have seen a request
-                }
-
-                // Shut down the thread if we have been idling too long
-                if (transfers_running <= 0) {
-                    if (timeout < std::chrono::steady_clock::now()) {
-                        RESTINCURL_LOG("Idle timeout. Will shut down the worker-thread.");
-                        break;
-                    }
-                } else {
-                    timeout = GetNextTimeout();
-                }
-
-                int numLeft = {};
-                while (auto m = curl_multi_info_read(handle_, &numLeft)) {
-                    assert(m);
-                    auto it = ongoing_.find(m->easy_handle);
-                    if (it != ongoing_.end()) {
-                        RESTINCURL_LOG("Finishing request with easy-handle: "
-                            << (EasyHandle::handle_t)it->second->GetEasyHandle()
-                            << "; with result: " << m->data.result << " expl: '" << curl_easy_strerror(m->data.result)
-                            << "'; with msg: " << m->msg);
-
-                        try {
-                            it->second->Complete(m->data.result, m->msg);
-                        } catch(const std::exception& ex) {
-                            RESTINCURL_LOG("Complete threw: " << ex.what());
-                        }
-                        if (m->msg == CURLMSG_DONE) {
-                            curl_multi_remove_handle(handle_, m->easy_handle);
-                        }
-                        it->second->GetEasyHandle().Close();
-                        ongoing_.erase(it);
-                    } else {
-                        RESTINCURL_LOG("Failed to find easy_handle in ongoing!");
-                        assert(false);
-                    }
-                }
-
-                {
-                    lock_t lock(mutex_);
-                    // Avoid using select() as a timer when we need to exit anyway
-                    if (abort_ || (!transfers_running && close_pending_)) {
-                        break;
-                    }
-                }
-
-                auto next_timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    timeout - std::chrono::steady_clock::now());
-                long sleep_duration = std::max<long>(1, next_timeout.count());
-                /* extract sleep_duration value */
+        void Fail(const int err) {
+            Finish(MakeWriteError(err));
+        }
 
+        void CancelSegments() {
+#if RESTINCURL_ENABLE_ASYNC
+            for(auto& seg : segments_) {
+                seg.request.Cancel();
+            }
+#endif
+        }
 
-                FD_ZERO(&fdread);
-                FD_ZERO(&fdwrite);
-                FD_ZERO(&fdexcep);
+        void Finish(const Result& result) {
+            assert(!finished_);
+            finished_ = true;
+            if (fd_ >= 0) {
+                close(fd_);
+                fd_ = -1;
+            }
 
-                int maxfd = -1;
-                if (transfers_running > 0) {
-                    curl_multi_timeout(handle_, &sleep_duration);
-                    if (sleep_duration < 0) {
-                        sleep_duration = 1000;
-                    }
+            RESTINCURL_LOG("Download of " << path_ << " finished with: " << result.msg);
+            if (completion_) {
+                completion_(result);
+            }
+        }
 
-                    /* get file descriptors from the transfers */
-                    const auto mc = curl_multi_fdset(handle_, &fdread, &fdwrite, &fdexcep, &maxfd);
-                    RESTINCURL_LOG_TRACE("maxfd: " << maxfd);
-                    if (mc != CURLM_OK) {
-                        throw CurlException("curl_multi_fdset", mc);
-                    }
+        Request::ptr_t tmpl_;
+        const std::string path_;
+        const DownloadOptions options_;
+        completion_fn_t completion_;
+        Metrics *metrics_ = {};
+#if RESTINCURL_ENABLE_ASYNC
+        Worker *worker_ = {};
+#endif
+        int fd_ = -1;
+        std::string validator_;
+        std::vector<Segment> segments_;
+        Segment single_;
+        size_t outstanding_ = 0;
+        bool single_started_ = false;
+        bool ranges_refused_ = false;
+        bool failed_ = false;
+        bool finished_ = false;
+        Result last_ok_;
+        Result error_;
+    };
 
-                    if (maxfd == -1) {
-                        // Curl want's us to revisit soon
-                        sleep_duration = 50;
-                    }
-                } // active transfers
+  
+    /*! A prepared request, used to create many similar requests cheaply.
+     *
+     * Create it with `RequestBuilder::MakeTemplate()`, and use it with
+     * `Client::Build(const RequestTemplate&)`. Each request gets a copy of the
+     * template's easy-handle, made with `curl_easy_duphandle()`, so the options
+     * are not set again, and it shares the template's header-list rather than
+     * copying it. Only the URL, the body and the completion callback are set
+     * for each request.
+     *
+     * A template can not be changed after it is made, and can be used from any thread.
+     */
+    class RequestTemplate {
+    public:
+        using ptr_t = std::shared_ptr<const RequestTemplate>;
 
-                struct timeval tv = {};
-                tv.tv_sec = sleep_duration / 1000;
-                tv.tv_usec = (sleep_duration % 1000) * 1000;
+        RequestTemplate(EasyHandle::ptr_t eh, const RequestType requestType, std::string url,
+                        HeaderList::ptr_t headers, const bool storeHeaders)
+        : eh_{std::move(eh)}, request_type_{requestType}, url_{std::move(url)}
+        , headers_{std::move(headers)}, store_headers_{storeHeaders}
+        {
+            assert(eh_);
+        }
 
-                const auto signalfd = signal_.GetReadFd();
+        /*! Create a new request from the template
+         *
+         * \param defaults The client's default headers. They are merged with the
+         *      template's headers the first time they are seen, and the merged list
+         *      is shared by the requests.
+         */
+        Request::ptr_t CreateRequest(const HeaderList::ptr_t& defaults = {}) const {
+            EasyHandle::ptr_t eh;
+            HeaderList::ptr_t headers;
+            {
+                // libcurl does not promise that an easy-handle can be read from several threads
+                std::lock_guard<std::mutex> lock{mutex_};
+                eh = eh_->Duplicate();
+                headers = GetMergedHeaders(defaults);
+            }
+            auto req = std::make_unique<Request>(std::move(eh));
+            if (headers) {
+                req->SetSharedHeaders(std::move(headers));
+            }
+            if (store_headers_) {
+                req->StoreHeaders();
+            }
+            return req;
+        }
 
-                RESTINCURL_LOG_TRACE("Calling select() with timeout of "
-                    << sleep_duration
-                    << " ms. Next timeout in " << next_timeout.count() << " ms. "
-                    << transfers_running << " active transfers.");
+        RequestType GetRequestType() const noexcept { return request_type_; }
+        const std::string& GetUrl() const noexcept { return url_; }
+        const HeaderList::ptr_t& GetHeaders() const noexcept { return headers_; }
 
-                FD_SET(signalfd, &fdread);
-                maxfd = std::max(signalfd,  maxfd) + 1;
+        void SetRetryPolicy(const RetryPolicy& policy) {
+            retry_ = std::make_unique<RetryPolicy>(policy);
+        }
 
-                const auto rval = select(maxfd, &fdread, &fdwrite, &fdexcep, &tv);
-                RESTINCURL_LOG_TRACE("select(" << maxfd << ") returned: " << rval);
+        const RetryPolicy *GetRetryPolicy() const noexcept { return retry_.get(); }
 
-                if (rval > 0) {
-                    if (FD_ISSET(signalfd, &fdread)) {
-                        RESTINCURL_LOG_TRACE("FD_ISSET was true: ");
-                        do_dequeue = signal_.WasSignalled();
-                    }
+        void SetCoalesce(std::vector<std::string> keyHeaders) {
+            coalesce_ = true;
+            coalesce_headers_ = std::move(keyHeaders);
+        }
 
-                }
-                if (pending_entries_in_queue_) {
-                    do_dequeue = true;
-                }
-            } // loop
+        bool GetCoalesce() const noexcept { return coalesce_; }
+        const std::vector<std::string>& GetCoalesceHeaders() const noexcept { return coalesce_headers_; }
 
+        void SetHedge(const std::chrono::milliseconds after, const unsigned maxExtra) noexcept {
+            hedge_after_ = after;
+            hedge_max_extra_ = maxExtra;
+        }
 
-            lock_t lock(mutex_);
-            if (close_pending_ || abort_) {
-                done_ = true;
+        std::chrono::milliseconds GetHedgeAfter() const noexcept { return hedge_after_; }
+        unsigned GetHedgeMaxExtra() const noexcept { return hedge_max_extra_; }
+
+    private:
+        // Must be called with mutex_ locked
+        HeaderList::ptr_t GetMergedHeaders(const HeaderList::ptr_t& defaults) const {
+            if (!defaults) {
+                return headers_;
+            }
+            if (!headers_) {
+                return defaults;
             }
+            if (defaults != defaults_) {
+                merged_ = HeaderList::Merge(*headers_, *defaults);
+                defaults_ = defaults;
+            }
+            return merged_;
         }
 
-        bool close_pending_ {false};
-        bool abort_ {false};
-        bool done_ {false};
-        bool pending_entries_in_queue_ = false;
-        decltype(curl_multi_init()) handle_ = {};
+        EasyHandle::ptr_t eh_;
         mutable std::mutex mutex_;
-        std::shared_ptr<WorkerThread> thread_;
-        std::deque<Request::ptr_t> queue_;
-        std::map<EasyHandle::handle_t, Request::ptr_t> ongoing_;
-        Signaler signal_;
+        mutable HeaderList::ptr_t defaults_;
+        mutable HeaderList::ptr_t merged_;
+        const RequestType request_type_;
+        const std::string url_;
+        const HeaderList::ptr_t headers_;
+        const bool store_headers_;
+        std::unique_ptr<RetryPolicy> retry_;
+        bool coalesce_ = false;
+        std::vector<std::string> coalesce_headers_;
+        std::chrono::milliseconds hedge_after_ = {};
+        unsigned hedge_max_extra_ = 0;
     };
-#endif // RESTINCURL_ENABLE_ASYNC
 
-  
+    class Client;
+
     /*! Convenient interface to build requests.
      * 
      * Even if this is a light-weight wrapper around libcurl, we have a 
@@ -1115,12 +7173,27 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
      * convenience-methods for the most common use-cases. 
      */
     class RequestBuilder {
+        friend class Client;
+
         // noop handler for incoming data
         static size_t write_callback(char *ptr, size_t size, size_t nitems, void *userdata) {
             const auto bytes = size * nitems;
             return bytes;
         }
 
+        static size_t file_read_callback(char *ptr, size_t size, size_t nitems, void *userdata) {
+            assert(userdata);
+            return fread(ptr, size, nitems, reinterpret_cast<FILE *>(userdata));
+        }
+
+        static int file_seek_callback(void *userdata, curl_off_t offset, int origin) {
+            assert(userdata);
+            if (fseeko(reinterpret_cast<FILE *>(userdata), static_cast<off_t>(offset), origin) != 0) {
+                return CURL_SEEKFUNC_CANTSEEK;
+            }
+            return CURL_SEEKFUNC_OK;
+        }
+
         static int debug_callback(CURL *handle, curl_infotype type,
              char *data, size_t size,
              void *userp) {
@@ -1160,18 +7233,44 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
 
     public:
         using ptr_t = std::unique_ptr<RequestBuilder>;
-        RequestBuilder(
-#if RESTINCURL_ENABLE_ASYNC
-            Worker& worker
-#endif
-        )
-        : request_{std::make_unique<Request>()}
-        , options_{std::make_unique<class Options>(request_->GetEasyHandle())}
 #if RESTINCURL_ENABLE_ASYNC
+        RequestBuilder(Worker& worker)
+        : request_{worker.GetRequestPool().Create()}
+        , url_{request_->ReleaseUrl()}
+        , context_{&worker.GetContext()}
         , worker_(&worker)
-#endif
         {}
 
+        /*! Create a request from a template. See `RequestTemplate`. */
+        RequestBuilder(Worker& worker, const RequestTemplate& tmpl)
+        : request_{tmpl.CreateRequest(worker.GetContext().GetDefaultHeaders())}
+        , context_{&worker.GetContext()}
+        , worker_(&worker)
+        {
+            ApplyTemplate(tmpl);
+        }
+#else
+        explicit RequestBuilder(ClientContext *context = nullptr)
+        : request_{std::make_unique<Request>()}
+        , context_{context}
+        {}
+
+        /*! Create a request from a pool. See `RequestPool`. */
+        RequestBuilder(ClientContext *context, RequestPool& pool)
+        : request_{pool.Create()}
+        , url_{request_->ReleaseUrl()}
+        , context_{context}
+        {}
+
+        /*! Create a request from a template. See `RequestTemplate`. */
+        RequestBuilder(ClientContext *context, const RequestTemplate& tmpl)
+        : request_{tmpl.CreateRequest(context ? context->GetDefaultHeaders() : HeaderList::ptr_t{})}
+        , context_{context}
+        {
+            ApplyTemplate(tmpl);
+        }
+#endif
+
         RequestBuilder(const RequestBuilder&) = delete;
         RequestBuilder(RequestBuilder&&) = default;
         RequestBuilder& operator=(const RequestBuilder&) = delete;
@@ -1180,6 +7279,22 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
         ~RequestBuilder() {
         }
 
+        // Builders are typically made and deleted in a loop by the same thread
+        static void *operator new(const size_t size) {
+            if (size == sizeof(RequestBuilder)) {
+                return BlockCache<sizeof(RequestBuilder)>::Allocate();
+            }
+            return ::operator new(size);
+        }
+
+        static void operator delete(void *block, const size_t size) noexcept {
+            if (size == sizeof(RequestBuilder)) {
+                BlockCache<sizeof(RequestBuilder)>::Free(block);
+                return;
+            }
+            ::operator delete(block);
+        }
+
     protected:
         RequestBuilder& Prepare(RequestType rt, const std::string& url) {
             assert(request_type_ == RequestType::INVALID);
@@ -1189,7 +7304,51 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
             return *this;
         }
 
+        void ApplyTemplate(const RequestTemplate& tmpl) {
+            request_type_ = tmpl.GetRequestType();
+            url_ = tmpl.GetUrl();
+            if (auto retry = tmpl.GetRetryPolicy()) {
+                retry_ = std::make_unique<RetryPolicy>(*retry);
+            }
+            coalesce_ = tmpl.GetCoalesce();
+            coalesce_headers_ = tmpl.GetCoalesceHeaders();
+            hedge_after_ = tmpl.GetHedgeAfter();
+            hedge_max_extra_ = tmpl.GetHedgeMaxExtra();
+
+            // Already set on the template's easy-handle
+            request_timeout_ = -1;
+            connect_timeout_ = -1;
+            have_accept_encoding_ = true;
+            have_default_headers_ = true;
+        }
+
     public:
+        /*! Add a query argument to the URL.
+         *
+         * \param key The key
+         * \param value The value. A string or an integer.
+         *
+         * Both key and value are percent-encoded. See also `Url`.
+         */
+        RequestBuilder& Query(const UrlArg& key, const UrlArg& value) {
+            assert(!is_built_);
+            bool have_query = url_.find('?') != std::string::npos;
+            Url::AppendQuery(url_, have_query, key, value);
+            return *this;
+        }
+
+        /*! Set the URL for a request made from a template.
+         *
+         * \param url Url to call. Must be a complete URL, starting with
+         *      "http://" or "https://"
+         */
+        RequestBuilder& Url(const std::string& url) {
+            assert(!is_built_);
+            assert(request_type_ != RequestType::INVALID);
+            url_ = url;
+            return *this;
+        }
+
         bool CanSendFile() const noexcept {
             return request_type_ == RequestType::POST
                     || request_type_ == RequestType::PUT;
@@ -1256,7 +7415,7 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
         RequestBuilder& Header(const char *value) {
             assert(value);
             assert(!is_built_);
-            request_->GetHeaders() = curl_slist_append(request_->GetHeaders(), value);
+            request_->AddHeader(value);
             return *this;
         }
 
@@ -1306,7 +7465,7 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
         template <typename T>
         RequestBuilder& Option(const CURLoption& opt, const T& value) {
             assert(!is_built_);
-            options_->Set(opt, value);
+            SetOption(opt, value);
             return *this;
         }
 
@@ -1346,6 +7505,67 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
             return *this;
         }
 
+        /*! Set a deadline for the request, counted from when it is executed.
+         *
+         * Unlike `RequestTimeout()`, the time the request waits in the queue counts.
+         * If the deadline passes before the request is sent, it is removed from the
+         * queue, and completed with `Error::DEADLINE_EXCEEDED`. When it is sent, the
+         * time that remains is passed to libcurl as the timeout (or the request-timeout,
+         * if that is shorter). Retries are only done if they can start before the deadline.
+         *
+         * \param budget The time from `Execute()` until the request must be completed.
+         */
+        RequestBuilder& Deadline(const std::chrono::milliseconds budget) {
+            assert(!is_built_);
+            deadline_budget_ = budget;
+            have_deadline_ = true;
+            return *this;
+        }
+
+        /*! Set an absolute deadline for the request.
+         *
+         * Use this to give a group of requests the same deadline.
+         * See `Deadline(std::chrono::milliseconds)`.
+         */
+        RequestBuilder& Deadline(const std::chrono::steady_clock::time_point deadline) {
+            assert(!is_built_);
+            deadline_ = deadline;
+            deadline_budget_ = std::chrono::milliseconds{-1};
+            have_deadline_ = true;
+            return *this;
+        }
+
+        /*! Set the priority of the request.
+         *
+         * The priority is only used to select a request to drop when the queue is full.
+         * See `QueueOverflow::DROP_LOWEST_PRIORITY`.
+         *
+         * \param priority Higher values are more important. The default is 0.
+         */
+        RequestBuilder& Priority(const int priority) {
+            assert(!is_built_);
+            assert(request_);
+            request_->SetPriority(priority);
+            return *this;
+        }
+
+        /*! Abort the transfer if it is too slow for too long.
+         *
+         * This frees the connection from a stalled transfer, rather than
+         * waiting for the request-timeout. The request fails with
+         * `CURLE_OPERATION_TIMEDOUT`.
+         *
+         * Sets `CURLOPT_LOW_SPEED_LIMIT` and `CURLOPT_LOW_SPEED_TIME`.
+         *
+         * \param bytesPerSecond The average transfer speed that is too slow.
+         * \param period How long the speed must stay below the limit.
+         */
+        RequestBuilder& LowSpeedLimit(const long bytesPerSecond, const std::chrono::seconds period) {
+            Option(CURLOPT_LOW_SPEED_LIMIT, bytesPerSecond);
+            Option(CURLOPT_LOW_SPEED_TIME, static_cast<long>(period.count()));
+            return *this;
+        }
+
         /*! Send a file
          *
          *  \param path Full path to the file to send.
@@ -1368,9 +7588,8 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
                 throw SystemException{std::string{"Unable to stat file "} + path, e};
             }
 
-            // set where to read from (on Windows you need to use READFUNCTION too)
-            options_->Set(CURLOPT_READDATA, request_->GetSourceFp());
-            options_->Set(CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(st.st_size));
+            request_->SetReadHandler(file_read_callback, request_->GetSourceFp(), file_seek_callback);
+            SetOption(CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(st.st_size));
             have_data_out_ = true;
             return *this;
         }
@@ -1421,9 +7640,8 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
                 throw SystemException{std::string{"Unable to stat file "} + path, e};
             }
 
-            // set where to read from (on Windows you need to use READFUNCTION too)
-            options_->Set(CURLOPT_READDATA, request_->GetSourceFp());
-            options_->Set(CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(st.st_size));
+            request_->SetReadHandler(file_read_callback, request_->GetSourceFp(), file_seek_callback);
+            SetOption(CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(st.st_size));
             have_data_out_ = true;
             return *this;
         }
@@ -1441,8 +7659,7 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
         template <typename T>
         RequestBuilder& SendData(OutDataHandler<T>& dh) {
             assert(!is_built_);
-            options_->Set(CURLOPT_READFUNCTION, dh.read_callback);
-            options_->Set(CURLOPT_READDATA, &dh);
+            request_->SetReadHandler(dh.read_callback, &dh, dh.seek_callback);
             have_data_out_ = true;
             return *this;
         }
@@ -1457,10 +7674,7 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
         template <typename T>
         RequestBuilder& SendData(T data) {
             assert(!is_built_);
-            auto handler = std::make_unique<OutDataHandler<T>>(std::move(data));
-            auto& handler_ref = *handler;
-            request_->SetDefaultOutHandler(std::move(handler));
-            return SendData(handler_ref);
+            return SendData(MakeOutHandler(std::move(data)));
         }
 
         /*! Specify Data Handler for inbound data
@@ -1476,8 +7690,7 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
         template <typename T>
         RequestBuilder& StoreData(InDataHandler<T>& dh) {
             assert(!is_built_);
-            options_->Set(CURLOPT_WRITEFUNCTION, dh.write_callback);
-            options_->Set(CURLOPT_WRITEDATA, &dh);
+            request_->SetWriteHandler(dh.write_callback, &dh);
             have_data_in_ = true;
             return *this;
         }
@@ -1499,6 +7712,49 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
             return StoreData(handler_ref);
         }
 
+        /*! Store the HTTP headers from the response in `Result::headers` */
+        RequestBuilder& StoreHeaders() {
+            assert(!is_built_);
+            request_->StoreHeaders();
+            return *this;
+        }
+
+        /*! Download the resource to a local file.
+         *
+         * \param path Path to the file to write. If the file exists, it is overwritten.
+         * \param options Options for the download.
+         *
+         * In asynchronous mode, large resources are fetched as several byte-ranges
+         * in parallel if the server supports that. See `FileDownload`. With
+         * `ExecuteSynchronous()`, the resource is always fetched as a single stream.
+         *
+         * The completion callback is called once, when the whole file is
+         * written, or the download failed. `Result::body` will be empty.
+         *
+         * The resource is not requested compressed, even with `AcceptCompressed()`
+         * or `Client::AcceptCompressed()`, so that the byte-ranges for the segments
+         * and for resuming match the file.
+         *
+         * A deadline (see `Deadline()`) applies to the whole download: every
+         * request that is made for it, including retries, must finish before it.
+         *
+         * This can only be used with GET requests.
+         *
+         * \throws Exception if the method is called for a non-GET request.
+         */
+        RequestBuilder& DownloadToFile(const std::string& path,
+                                       const DownloadOptions& options = {}) {
+            assert(!is_built_);
+            assert(!have_data_in_);
+            if (request_type_ != RequestType::GET) {
+                throw Exception{"DownloadToFile requires a GET request"};
+            }
+            download_path_ = path;
+            download_options_ = options;
+            have_data_in_ = true;
+            return *this;
+        }
+
         /*! Do not process incoming data
          *
          * The response body will be read from the network, but
@@ -1506,11 +7762,34 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
          * inspection.
          */
         RequestBuilder& IgnoreIncomingData() {
-            options_->Set(CURLOPT_WRITEFUNCTION, write_callback);
+            request_->SetWriteHandler(write_callback, nullptr);
             have_data_in_ = true;
             return *this;
         }
 
+        /*! Ask the server for a compressed response.
+         *
+         * \param encodings The encodings to accept, for example
+         *      `{Encoding::GZIP, Encoding::BR, Encoding::ZSTD}`. An empty list
+         *      means all the encodings supported by libcurl.
+         *
+         * libcurl decompresses the data as it arrives, so data handlers and
+         * `Result::body` get the decompressed payload, one chunk at the time.
+         * The size on the wire is reported in `Result::wire_bytes_received`.
+         *
+         * Encodings that libcurl can not decode are ignored.
+         * This overrides the default set with `Client::AcceptCompressed()`.
+         */
+        RequestBuilder& AcceptCompressed(std::initializer_list<Encoding> encodings = {}) {
+            assert(!is_built_);
+            std::string value;
+            if (GetAcceptEncoding(encodings, value)) {
+                SetOption(CURLOPT_ACCEPT_ENCODING, value);
+            }
+            have_accept_encoding_ = true;
+            return *this;
+        }
+
         /*! Specify a callback that will be called when the request is complete (or failed).
          * 
          * \param fn Callback to be called
@@ -1548,8 +7827,8 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
             assert(!is_built_);
 
             if (!name.empty() && !passwd.empty()) {
-                options_->Set(CURLOPT_USERNAME, name.c_str());
-                options_->Set(CURLOPT_PASSWORD, passwd.c_str());
+                SetOption(CURLOPT_USERNAME, name.c_str());
+                SetOption(CURLOPT_PASSWORD, passwd.c_str());
             }
 
             return *this;
@@ -1562,12 +7841,131 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
          * You probably don't need to call this directly.
          */
         RequestBuilder& SetReadHandler(size_t (*handler)(char *, size_t , size_t , void *), void *userdata) {
-            options_->Set(CURLOPT_READFUNCTION, handler);
-            options_->Set(CURLOPT_READDATA, userdata);
+            request_->SetReadHandler(handler, userdata);
             have_data_out_ = true;
             return *this;
         }
 
+        /*! Compress the data we send.
+         *
+         * \param encoding Compression algorithm. GZIP, DEFLATE or ZSTD.
+         * \param level Compression level. -1 uses the default level for the algorithm.
+         *
+         * The data from the source you specified with `SendData()`, `SendFile()`
+         * or `SetReadHandler()` is compressed on the fly, as libcurl sends it.
+         * The `Content-Encoding` header is set for you, and the body is sent
+         * chunked, as the compressed size is unknown until we are done.
+         *
+         * Only use this if you know that the server accepts the encoding.
+         *
+         * gzip and deflate require `RESTINCURL_WITH_ZLIB`, and zstd requires
+         * `RESTINCURL_WITH_ZSTD`.
+         *
+         * \throws Exception if the encoding is not supported.
+         */
+        RequestBuilder& CompressBody(const Encoding encoding = Encoding::GZIP, const int level = -1) {
+            assert(!is_built_);
+            if (!BodyCompressor::IsSupported(encoding)) {
+                throw Exception{std::string{"Unsupported body encoding: "} + BodyCompressor::GetName(encoding)};
+            }
+            compress_body_ = true;
+            body_encoding_ = encoding;
+            body_compression_level_ = level;
+            return *this;
+        }
+
+        /*! Retry the request if it fails.
+         *
+         * \param policy Decides what failures to retry, and how long to wait between the attempts.
+         *
+         * A request is retried if libcurl returns one of the errors in `RetryPolicy::curl_codes`,
+         * or the server returns one of the status codes in `RetryPolicy::http_codes`. The
+         * delay grows exponentially with each attempt, with random jitter, unless the server
+         * tells us how long to wait with a `Retry-After` header.
+         *
+         * In asynchronous mode the retry is scheduled on the worker-thread's timer,
+         * and the worker is free to process other requests in the mean time. In
+         * synchronous mode, the calling thread sleeps until the next attempt.
+         *
+         * The request reuses its curl handle (and connection, if it is still open). The data to
+         * send is rewound, so the data-source must be seekable: data from `SendData()`
+         * and `SendFile()` is, data from `SetReadHandler()` is not, and the request
+         * is not retried in that case. Likewise, if some of the body of a failed
+         * response was already passed to your own data-handler, the request is not retried.
+         * The body of a response that looks retryable is held back until the retry is
+         * sent, so if we give up, your data-handler gets the body of the last response.
+         *
+         * POST and PATCH requests are only retried if the connection could not be made,
+         * unless `RetryPolicy::retry_non_idempotent` is set.
+         *
+         * The completion callback is called once, when the request succeeded or we gave up.
+         * The number of attempts is reported in `Result::attempts`.
+         *
+         * This has no effect on `DownloadToFile()`, which has its own retry logic.
+         */
+        RequestBuilder& Retry(const RetryPolicy& policy = {}) {
+            assert(!is_built_);
+            retry_ = std::make_unique<RetryPolicy>(policy);
+            return *this;
+        }
+
+        /*! Coalesce identical requests that are in flight at the same time.
+         *
+         * \param keyHeaders Names of request-headers that must have the same values
+         *      for two requests to be identical. Method and URL are always compared.
+         *
+         * If an identical request is already queued or running in the worker-thread, this
+         * request is attached to it, rather than sent. When that request finishes, every
+         * caller gets the same `Result`, with the body in one shared buffer
+         * (`Result::shared_body`).
+         *
+         * This only applies to asynchronous GET and HEAD requests that use the
+         * default body buffer. Others are sent as normal.
+         *
+         * \throws Exception for other methods than GET and HEAD.
+         */
+        RequestBuilder& Coalesce(std::initializer_list<std::string> keyHeaders = {}) {
+            assert(!is_built_);
+            if ((request_type_ != RequestType::GET) && (request_type_ != RequestType::HEAD)) {
+                throw Exception{"Coalesce requires a GET or HEAD request"};
+            }
+            coalesce_ = true;
+            coalesce_headers_.assign(keyHeaders.begin(), keyHeaders.end());
+            return *this;
+        }
+
+        /*! Send a copy of the request if the response is slow.
+         *
+         * \param after Delay before a copy is sent. If 0, the p95 response-time for
+         *      the host is used, once we have seen enough responses from it.
+         * \param maxExtra Max number of copies to send.
+         *
+         * The first transfer that completes successfully (a response with a status code
+         * below 500) wins. The others are removed from the worker and cancelled, and the
+         * completion callback is called once, with the result from the winner.
+         *
+         * As we don't know which transfer will win, the response-body is buffered
+         * until the winner is known, and then passed to the data handler in one go.
+         *
+         * Hedged copies are only sent in asynchronous mode, and only while the
+         * client-wide hedge budget allows it. See `ClientContext::SetHedgeBudget()`.
+         * The numbers are reported in `Stats`.
+         *
+         * Only use this for idempotent requests without a body, as
+         * the server may get the request more than once.
+         *
+         * \throws Exception for POST and PATCH requests.
+         */
+        RequestBuilder& Hedge(const std::chrono::milliseconds after, const unsigned maxExtra = 1) {
+            assert(!is_built_);
+            if ((request_type_ == RequestType::POST) || (request_type_ == RequestType::PATCH)) {
+                throw Exception{"Hedge requires an idempotent request"};
+            }
+            hedge_after_ = after;
+            hedge_max_extra_ = maxExtra;
+            return *this;
+        }
+
         /*! Set a Curl compatible write handler. 
          * 
          * \param handler Curl C API write handler
@@ -1575,45 +7973,180 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
          * You probably don't need to call this directly.
          */
         RequestBuilder& SetWriteHandler(size_t (*handler)(char *, size_t , size_t , void *), void *userdata) {
-            options_->Set(CURLOPT_WRITEFUNCTION,handler);
-            options_->Set(CURLOPT_WRITEDATA, userdata);
+            request_->SetWriteHandler(handler, userdata);
             have_data_in_ = true;
             return *this;
         }
 
         void Build() {
             if (!is_built_) {
+                if (!have_default_headers_ && context_) {
+                    request_->SetDefaultHeaders(context_->GetDefaultHeaders());
+                    have_default_headers_ = true;
+                }
+
                 // Set up Data Handlers
+                const bool default_body = !have_data_in_;
                 if (!have_data_in_) {
                     // Use a default std::string. We expect json anyway...
-                    this->StoreData(request_->getDefaultInBuffer());
+                    request_->StoreInDefaultBuffer();
+                    have_data_in_ = true;
+
+                    // Only responses that end up in the default buffer are cached
+                    if (context_ && (request_type_ == RequestType::GET)) {
+                        if (auto cache = context_->GetCache()) {
+                            request_->SetCache(std::move(cache), ResponseCache::MakeKey("GET", url_));
+#if LIBCURL_VERSION_NUM < 0x075300
+                            request_->StoreHeaders(); // We need Cache-Control, ETag etc.
+#endif
+                        }
+                    }
                 }
 
                 if (have_data_out_) {
-                    options_->Set(CURLOPT_UPLOAD, 1L);
+                    SetOption(CURLOPT_UPLOAD, 1L);
+                }
+
+                if (compress_body_) {
+                    if (!have_data_out_ || !request_->GetReadFunction()) {
+                        throw Exception{"CompressBody requires data to send"};
+                    }
+                    request_->CompressBody(body_encoding_, body_compression_level_);
+                    SetOption(CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(-1));
+                    Header((std::string{"Content-Encoding: "} + BodyCompressor::GetName(body_encoding_)).c_str());
+                }
+
+                if (retry_) {
+                    request_->SetRetryPolicy(*retry_);
+                }
+
+                if (coalesce_ && !have_data_out_ && default_body) {
+                    auto key = ResponseCache::MakeKey(request_type_ == RequestType::GET ? "GET" : "HEAD", url_);
+                    std::string value;
+                    for(const auto& name : coalesce_headers_) {
+                        key += '\n';
+                        key += name;
+                        key += ": ";
+                        if (request_->GetRequestHeader(name, value)) {
+                            key += value;
+                        }
+                    }
+                    request_->SetCoalesceKey(std::move(key));
+                }
+
+                if (hedge_max_extra_) {
+                    if (have_data_out_) {
+                        throw Exception{"Hedge can not be used for requests with a body"};
+                    }
+                    request_->SetHedge(hedge_after_, hedge_max_extra_, ::restincurl::GetHostKey(url_));
+                }
+
+                if (request_timeout_ >= 0) {
+                    SetOption(CURLOPT_TIMEOUT_MS, request_timeout_);
+                }
+
+                if (connect_timeout_ >= 0) {
+                    SetOption(CURLOPT_CONNECTTIMEOUT_MS, connect_timeout_);
+                }
+
+                if (have_deadline_) {
+                    if (deadline_budget_.count() >= 0) {
+                        deadline_ = std::chrono::steady_clock::now() + deadline_budget_;
+                    }
+                    request_->SetDeadline(deadline_, request_timeout_);
+                }
+
+                if (!have_accept_encoding_ && context_) {
+                    std::string encoding;
+                    if (context_->GetAcceptEncoding(encoding)) {
+                        SetOption(CURLOPT_ACCEPT_ENCODING, encoding);
+                    }
+                }
+
+                // Set headers
+                if (request_->HaveHeaders()) {
+                    request_->LinkHeaders();
                 }
 
-                if (request_timeout_ >= 0) {
-                    options_->Set(CURLOPT_TIMEOUT_MS, request_timeout_);
-                }
+                // The url is final. Query arguments are encoded as they are added, see `Url`.
+                SetOption(CURLOPT_URL, url_);
+                RESTINCURL_LOG("Preparing connect to: " << url_);
+                request_->SetUrl(std::move(url_));
+
+                // Prepare request
+                request_->Prepare(request_type_, std::move(completion_));
+                is_built_ = true;
+            }
+        }
+
+        /*! Make a template from the request defined so far.
+         *
+         * The template has the request-type, URL, options, headers and the
+         * retry, hedge and coalesce settings from the builder. Use it with
+         * `Client::Build(const RequestTemplate&)` to make many similar requests
+         * without setting all the options and headers for each of them.
+         *
+         * The builder can not be used after this.
+         *
+         * \throws Exception if data to send or receive, a completion callback
+         *      or a download is set, as these belong to each request.
+         */
+        RequestTemplate::ptr_t MakeTemplate() {
+            assert(!is_built_);
+            if (have_data_in_ || have_data_out_ || compress_body_ || completion_
+                    || !download_path_.empty() || (request_type_ == RequestType::POST_MIME)) {
+                throw Exception{"A template can not have data, a completion or a download"};
+            }
+            if (request_type_ == RequestType::INVALID) {
+                throw Exception{"A template must have a request-type"};
+            }
+
+            if (request_timeout_ >= 0) {
+                SetOption(CURLOPT_TIMEOUT_MS, request_timeout_);
+            }
 
-                if (connect_timeout_ >= 0) {
-                    options_->Set(CURLOPT_CONNECTTIMEOUT_MS, connect_timeout_);
-                }
+            if (connect_timeout_ >= 0) {
+                SetOption(CURLOPT_CONNECTTIMEOUT_MS, connect_timeout_);
+            }
 
-                // Set headers
-                if (request_->GetHeaders()) {
-                    options_->Set(CURLOPT_HTTPHEADER, request_->GetHeaders());
+            if (!have_accept_encoding_ && context_) {
+                std::string encoding;
+                if (context_->GetAcceptEncoding(encoding)) {
+                    SetOption(CURLOPT_ACCEPT_ENCODING, encoding);
                 }
+            }
 
-                // TODO: Prepare the final url (we want nice, correctly encoded request arguments)
-                options_->Set(CURLOPT_URL, url_);
-                RESTINCURL_LOG("Preparing connect to: " << url_);
+            // One immutable list with all the headers, shared by the requests
+            HeaderList::ptr_t headers;
+            if (request_->HaveHeaders()) {
+                curl_slist *list = {};
+                request_->ForEachHeader([&list](const char *line) {
+                    auto l = curl_slist_append(list, line);
+                    if (!l) {
+                        if (list) {
+                            curl_slist_free_all(list);
+                        }
+                        throw Exception{"curl_slist_append() failed"};
+                    }
+                    list = l;
+                });
+                headers = std::make_shared<HeaderList>(list);
+            }
 
-                // Prepare request
-                request_->Prepare(request_type_, std::move(completion_));
-                is_built_ = true;
+            const bool store_headers = request_->IsStoringHeaders();
+            auto tmpl = std::make_shared<RequestTemplate>(
+                request_->ReleaseEasyHandle(), request_type_, std::move(url_),
+                std::move(headers), store_headers);
+            if (retry_) {
+                tmpl->SetRetryPolicy(*retry_);
+            }
+            if (coalesce_) {
+                tmpl->SetCoalesce(std::move(coalesce_headers_));
             }
+            tmpl->SetHedge(hedge_after_, hedge_max_extra_);
+            request_.reset();
+            is_built_ = true;
+            return tmpl;
         }
 
         /*! Execute the request synchronously
@@ -1626,6 +8159,10 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
          * This method is available even when `RESTINCURL_ENABLE_ASYNC` is enabled ( != 0).
          */
         void ExecuteSynchronous() {
+            if (!download_path_.empty()) {
+                StartDownload(false);
+                return;
+            }
             Build();
             request_->Execute();
         }
@@ -1639,59 +8176,63 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
          * 
          * The method returns immediately.
          * 
+         * \returns A handle that can cancel the request. Downloads to a file
+         *      (`DownloadToFile()`) return an empty handle.
+         *
          * \throws restincurl::Exception derived exceptions on error
          * 
          * This method is only available when `RESTINCURL_ENABLE_ASYNC` is nonzero.
          */
-        void Execute() {
+        RequestHandle Execute() {
+            if (!download_path_.empty()) {
+                StartDownload(true);
+                return {};
+            }
+            auto handle = PrepareHandle();
             Build();
             assert(worker_);
             worker_->Enqueue(std::move(request_));
+            return handle;
         }
 
 #if __cplusplus >= 202002L
         /**
-         * @brief Coroutine-compatible awaitable execute.
+         * @brief Coroutine-compatible awaitable execute that can be cancelled.
          *
-         * Returns an awaitable object that you can `co_await` inside a C++20 coroutine.
-         * When you `co_await` it, the request is enqueued on the RESTinCurl worker thread,
-         * your coroutine is suspended, and then resumed once the HTTP operation completes.
+         * Like `CoExecute()`, but a stop-request on `token` cancels the request
+         * with `RequestHandle::Cancel()`. The coroutine is then resumed with a
+         * Result where `error` is `Error::CANCELLED`.
          *
-         * Example usage:
          * @code
+         * std::stop_source stop;
          * auto result = co_await client.Build()
          *                         ->Get("https://example.com")
-         *                         .Option(CURLOPT_FOLLOWLOCATION, 1L)
-         *                         .CoExecute();
+         *                         .CoExecute(stop.get_token());
          * @endcode
-         *
-         * @note This overload only participates on rvalues (temporaries).
-         *       If you have a named RequestBuilder, use the `&` overload below or
-         *       simply call `std::move(builder).CoExecute()`.
-         *
-         * @returns An awaiter type with:
-         *   - await_ready() == false
-         *   - await_suspend(): enqueues the request and stores the coroutine handle
-         *   - await_resume(): returns the completed Result
-         *
-         * @throws Any exceptions thrown by the underlying builder setup (e.g. invalid options)
-         *         will be propagated immediately; network-level errors should be surfaced
-         *         via the Result object in your completion callback.
          */
-        auto CoExecute() && {
+        auto CoExecute(std::stop_token token) && {
 
             assert(!HaveCompletion());
             if (HaveCompletion()) {
                 throw Exception{"Cannot use CoExecute with a completion callback"};
             }
 
+            struct OnStop {
+                RequestHandle handle;
+                void operator()() {
+                    handle.Cancel();
+                }
+            };
+
             struct Awaiter {
                 RequestBuilder  builder_;
+                std::stop_token token_;
                 std::optional<Result> result_;
                 std::coroutine_handle<> handle_;
+                std::optional<std::stop_callback<OnStop>> on_stop_;
 
-                explicit Awaiter(RequestBuilder&& b)
-                    : builder_(std::move(b))
+                Awaiter(RequestBuilder&& b, std::stop_token token)
+                    : builder_(std::move(b)), token_(std::move(token))
                 {}
 
                 bool await_ready() const noexcept {
@@ -1699,8 +8240,13 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
                     return false;
                 }
 
-                void await_suspend(std::coroutine_handle<> h) noexcept {
+                void await_suspend(std::coroutine_handle<> h) {
                     handle_ = h;
+                    if (token_.stop_possible()) {
+                        // Must be in place before Execute(), as the completion
+                        // may resume (and destroy) us before it returns.
+                        on_stop_.emplace(token_, OnStop{builder_.PrepareHandle()});
+                    }
                     // install our callback, then Execute() to start
                     builder_.WithCompletion(
                                 [this](const Result& r) {
@@ -1716,7 +8262,39 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
                 }
             };
 
-            return Awaiter{std::move(*this)};
+            return Awaiter{std::move(*this), std::move(token)};
+        }
+
+        /**
+         * @brief Coroutine-compatible awaitable execute.
+         *
+         * Returns an awaitable object that you can `co_await` inside a C++20 coroutine.
+         * When you `co_await` it, the request is enqueued on the RESTinCurl worker thread,
+         * your coroutine is suspended, and then resumed once the HTTP operation completes.
+         *
+         * Example usage:
+         * @code
+         * auto result = co_await client.Build()
+         *                         ->Get("https://example.com")
+         *                         .Option(CURLOPT_FOLLOWLOCATION, 1L)
+         *                         .CoExecute();
+         * @endcode
+         *
+         * @note This overload only participates on rvalues (temporaries).
+         *       If you have a named RequestBuilder, use the `&` overload below or
+         *       simply call `std::move(builder).CoExecute()`.
+         *
+         * @returns An awaiter type with:
+         *   - await_ready() == false
+         *   - await_suspend(): enqueues the request and stores the coroutine handle
+         *   - await_resume(): returns the completed Result
+         *
+         * @throws Any exceptions thrown by the underlying builder setup (e.g. invalid options)
+         *         will be propagated immediately; network-level errors should be surfaced
+         *         via the Result object in your completion callback.
+         */
+        auto CoExecute() && {
+            return std::move(*this).CoExecute(std::stop_token{});
         }
 
         /**
@@ -1734,6 +8312,11 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
             return std::move(*this).CoExecute();
         }
 
+        /*! Lvalue overload forwarding to the rvalue `CoExecute(std::stop_token)`. */
+        auto CoExecute(std::stop_token token) & {
+            return std::move(*this).CoExecute(std::move(token));
+        }
+
 #ifdef RESTINCURL_ENABLE_ASIO
         /**
          * @brief Asio‐compatible async execute.
@@ -1770,6 +8353,11 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
          *   - Errors from the HTTP request are propagated through the Asio
          *     completion mechanism (e.g. as exceptions in the returned future,
          *     or as an `error_code` argument in a handler).
+         *   - With Boost.Asio 1.77 or newer: If the handler has an associated cancellation slot (for example
+         *     from `boost::asio::bind_cancellation_slot()` or an awaitable
+         *     operator), an emitted cancellation cancels the request with
+         *     `RequestHandle::Cancel()`. The handler then gets a Result where
+         *     `error` is `Error::CANCELLED`.
          */
         template<typename CompletionToken>
         auto AsioAsyncExecute(CompletionToken&& token) && {
@@ -1792,6 +8380,15 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
                     using HandlerType = std::decay_t<decltype(handler)>;
                     auto ph = std::make_shared<HandlerType>(std::forward<decltype(handler)>(handler));
 
+#if BOOST_ASIO_VERSION >= 101900 // Cancellation slots
+                    auto slot = asio::get_associated_cancellation_slot(*ph);
+                    if (slot.is_connected()) {
+                        slot.assign([handle = builder.PrepareHandle()](asio::cancellation_type) mutable {
+                            handle.Cancel();
+                        });
+                    }
+#endif
+
                     // Install the completion callback
                     builder
                         .WithCompletion(
@@ -1800,6 +8397,9 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
                                 boost::asio::post(
                                     asio::get_associated_executor(*ph),
                                     [ph, r = std::move(r)]() mutable {
+#if BOOST_ASIO_VERSION >= 101900
+                                        asio::get_associated_cancellation_slot(*ph).clear();
+#endif
                                         // invoke the handler with the Result
                                         (*ph)(r);
                                     }
@@ -1833,16 +8433,90 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
 #endif // RESTINCURL_ENABLE_ASYNC
 
     private:
-        std::unique_ptr<Request> request_;
-        std::unique_ptr<class Options> options_;
+#if RESTINCURL_ENABLE_ASYNC
+        // The handle for the request. The state is created the first time.
+        RequestHandle PrepareHandle() {
+            assert(request_);
+            assert(worker_);
+            auto state = request_->GetCancelState();
+            if (!state) {
+                state = std::make_shared<CancelState>();
+                state->link = worker_->GetCancelLink();
+                request_->SetCancelState(state);
+            }
+            return RequestHandle{std::move(state)};
+        }
+#endif
+
+        // Build the request, and take it, for `Client::PerformAll()`
+        Request::ptr_t BuildForBatch() {
+            if (!download_path_.empty()) {
+                throw Exception{"PerformAll() cannot be used with downloads"};
+            }
+            Build();
+            return std::move(request_);
+        }
+
+        void StartDownload(const bool async) {
+#if !RESTINCURL_ENABLE_ASYNC
+            (void)async;
+#endif
+            auto completion = std::move(completion_);
+            Build();
+            auto download = std::make_shared<FileDownload>(
+                std::move(request_), download_path_, download_options_, std::move(completion),
+                context_ ? &context_->GetMetrics() : nullptr
+#if RESTINCURL_ENABLE_ASYNC
+                , async ? worker_ : nullptr
+#endif
+                );
+            download->Start();
+        }
+
+        template <typename T>
+        OutDataHandler<T>& MakeOutHandler(T data) {
+            auto handler = std::make_unique<OutDataHandler<T>>(std::move(data));
+            auto& handler_ref = *handler;
+            request_->SetDefaultOutHandler(std::move(handler));
+            return handler_ref;
+        }
+
+        // Strings use a handler inside the request
+        OutDataHandler<std::string>& MakeOutHandler(std::string data) {
+            return request_->SetStringOutData(std::move(data));
+        }
+
+        template <typename T>
+        void SetOption(const CURLoption opt, const T& value) {
+            class Options options{request_->GetEasyHandle()};
+            options.Set(opt, value);
+        }
+
+        Request::ptr_t request_;
         std::string url_;
         RequestType request_type_ = RequestType::INVALID;
         bool have_data_in_ = false;
         bool have_data_out_ = false;
         bool is_built_ = false;
+        bool have_accept_encoding_ = false;
+        bool have_default_headers_ = false;
+        bool compress_body_ = false;
+        Encoding body_encoding_ = Encoding::GZIP;
+        int body_compression_level_ = -1;
+        std::unique_ptr<RetryPolicy> retry_;
+        bool coalesce_ = false;
+        std::vector<std::string> coalesce_headers_;
+        std::chrono::milliseconds hedge_after_ = {};
+        unsigned hedge_max_extra_ = 0;
         completion_fn_t completion_;
         long request_timeout_ = 10000L; // 10 seconds
         long connect_timeout_ = 3000L; // 1 second
+        std::chrono::steady_clock::time_point deadline_;
+        std::chrono::milliseconds deadline_budget_{-1};
+        bool have_deadline_ = false;
+        std::string download_path_;
+        DownloadOptions download_options_;
+        ClientContext *context_ = {};
 #if RESTINCURL_ENABLE_ASYNC
         Worker *worker_{};
 #endif
@@ -1876,14 +8550,40 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
          * to deal with libcurl's initialization.
          */
         Client(const bool init = true) {
-            if (init) {
-                static std::once_flag flag;
-                std::call_once(flag, [] {
-                    RESTINCURL_LOG("One time initialization of curl.");
-                    curl_global_init(CURL_GLOBAL_DEFAULT);
-                });
-            }
+            InitCurl(init);
+        }
+
+#if RESTINCURL_ENABLE_ASYNC && defined(RESTINCURL_ENABLE_ASIO)
+        /*! Constructor for a client that performs the requests on an Asio io_context
+         *
+         * \param ioc The application's io_context
+         * \param init See above
+         *
+         * Instead of starting a worker-thread, the client registers libcurl's sockets
+         * and timers with `ioc` (through `CURLMOPT_SOCKETFUNCTION` and
+         * `CURLMOPT_TIMERFUNCTION`). The transfers are performed, and the
+         * completion-callbacks are called, by the threads that run `ioc`,
+         * one at the time, on a strand. There is no hand-off between threads,
+         * unless requests are executed from threads that don't run `ioc`.
+         *
+         * Everything else works like with the worker-thread. `HaveWorker()` returns false.
+         * The idle-timeout does not apply; the connections are kept until the client is
+         * deleted.
+         *
+         * Delete the client when `ioc` is stopped, or from a handler running on
+         * `ioc`, but not from a completion-callback. Other threads may keep running
+         * `ioc`: the destructor waits for a handler of the client that is running,
+         * and the requests that are not finished are dropped without their
+         * completion-callbacks being called.
+         *
+         * This constructor is only available when `RESTINCURL_ENABLE_ASIO` is defined.
+         */
+        explicit Client(boost::asio::io_context& ioc, const bool init = true)
+        : worker_{std::make_unique<Worker>(context_, ioc)}
+        {
+            InitCurl(init);
         }
+#endif
 
         /*! Destructor
          * 
@@ -1927,10 +8627,218 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
             return std::make_unique<RequestBuilder>(
 #if RESTINCURL_ENABLE_ASYNC
                 *worker_
+#else
+                context_.get(), *pool_
 #endif
             );
         }
 
+        /*! Create a request from a template
+         *
+         * Set the URL with `RequestBuilder::Url()` if it is not the one
+         * in the template. See `RequestTemplate`.
+         */
+        std::unique_ptr<RequestBuilder> Build(const RequestTemplate& tmpl) {
+            return std::make_unique<RequestBuilder>(
+#if RESTINCURL_ENABLE_ASYNC
+                *worker_
+#else
+                context_.get()
+#endif
+                , tmpl);
+        }
+
+        /*! Ask for compressed responses by default.
+         *
+         * \param encodings The encodings to accept. An empty list
+         *      means all the encodings supported by libcurl.
+         *
+         * This applies to all requests built by this client after the
+         * call. See `RequestBuilder::AcceptCompressed()`.
+         */
+        void AcceptCompressed(std::initializer_list<Encoding> encodings = {}) {
+            context_->SetAcceptEncoding(encodings);
+        }
+
+        /*! Get a snapshot of the statistics for this client. */
+        Stats GetStats() const noexcept {
+            return context_->GetMetrics().GetStats();
+        }
+
+        /*! Limit the extra load from hedged requests.
+         *
+         * See `ClientContext::SetHedgeBudget()` and `RequestBuilder::Hedge()`
+         */
+        void SetHedgeBudget(const double ratio, const double burst = 10.0) {
+            context_->SetHedgeBudget(ratio, burst);
+        }
+
+        /*! Enable a circuit breaker for each host the client talks to.
+         *
+         * When a host fails too often (see `CircuitBreakerPolicy`), the circuit for
+         * that host opens, and requests for it fail immediately when the worker-thread
+         * takes them from the queue, with `Result::error` set to `Error::CIRCUIT_OPEN`.
+         * This way, requests to a dead host don't occupy the connection-slots that
+         * requests to healthy hosts are waiting for.
+         *
+         * After `CircuitBreakerPolicy::open_time`, the circuit becomes half-open, and a
+         * few probe requests are sent. If they succeed, the circuit closes again.
+         *
+         * A failure is a libcurl error, or a HTTP status code of 500 or above.
+         *
+         * Only used in asynchronous mode.
+         */
+        void SetCircuitBreaker(const CircuitBreakerPolicy& policy = {}) {
+            context_->SetCircuitBreaker(policy);
+        }
+
+        /*! Disable the circuit breaker. */
+        void DisableCircuitBreaker() {
+            context_->DisableCircuitBreaker();
+        }
+
+        /*! Limit the rate of requests to a host or URL prefix.
+         *
+         * \param prefix A host, like "https://api.example.com", or an URL prefix,
+         *      like "https://api.example.com/v1/search". When several prefixes
+         *      match a request, the longest one is used.
+         * \param limit The rate limit. A token bucket with `RateLimit::burst` tokens,
+         *      refilled with `RateLimit::requests_per_second`.
+         *
+         * Requests that exceed the limit stay in the worker's queue until a token
+         * is available. The worker sets a timer for that, so the requests to other
+         * hosts are not held up.
+         *
+         * The limiter also listens to the server. When a response has a
+         * `X-RateLimit-Remaining` header, the tokens are reduced to that. When the server
+         * says that we are out of requests (`429 Too Many Requests` or
+         * `X-RateLimit-Remaining: 0`), the bucket is paused for the time given in
+         * `Retry-After` or `X-RateLimit-Reset`.
+         *
+         * Only used in asynchronous mode.
+         */
+        void SetRateLimit(const std::string& prefix, const RateLimit& limit) {
+            context_->SetRateLimit(prefix, limit);
+        }
+
+        /*! Enable the in-memory response cache.
+         *
+         * \param options Size of the cache.
+         *
+         * GET requests that use the default body buffer (`Result::body`) go
+         * through the cache. A response is cached if it is a `200 OK` with a `Cache-Control`
+         * header without `no-store`, and has a `max-age` or a validator (`ETag` or `Last-Modified`).
+         * The cache-key is the URL, and the request-headers named in `Vary`.
+         *
+         * A fresh response is served without asking the server. A stale response is
+         * revalidated with `If-None-Match` / `If-Modified-Since`, and if the server answers
+         * `304 Not Modified`, the cached response is served.
+         *
+         * Responses from the cache are returned in `Result::body`, as usual. With
+         * `CacheOptions::share_bodies`, the cached bodies are instead shared between the
+         * cache and the requests that are served from it, in `Result::shared_body`,
+         * without copying them.
+         *
+         * Hits, misses and revalidations are counted in `Stats`.
+         */
+        void EnableCache(const CacheOptions& options = {}) {
+            context_->EnableCache(options);
+        }
+
+        /*! Disable the response cache, and drop the cached responses. */
+        void DisableCache() {
+            context_->DisableCache();
+        }
+
+        /*! Set headers that are sent with all requests from this client.
+         *
+         * \param headers Header-lines, like "Authorization: Bearer abc". An empty
+         *      list removes the default headers.
+         *
+         * The headers are stored once, in an immutable list that the requests share.
+         * The headers set on a request are sent in addition to the defaults. If a
+         * request has a header with the same name as a default header, the
+         * request's header is used.
+         *
+         * This can be called at any time, for example to rotate a token. The new
+         * defaults are used for requests that are built after the call. Requests
+         * that are already built keep the headers they had.
+         */
+        void SetDefaultHeaders(std::initializer_list<std::string> headers) {
+            SetDefaultHeaders(std::make_shared<HeaderList>(headers));
+        }
+
+        /*! Set the default headers from a prepared list. See above. */
+        void SetDefaultHeaders(HeaderList::ptr_t headers) {
+            if (headers && headers->Empty()) {
+                headers.reset();
+            }
+            context_->SetDefaultHeaders(std::move(headers));
+        }
+
+        /*! Get the current default headers, or nullptr if there are none */
+        HeaderList::ptr_t GetDefaultHeaders() const {
+            return context_->GetDefaultHeaders();
+        }
+
+        /*! Remove a rate limit set with `SetRateLimit()` */
+        void RemoveRateLimit(const std::string& prefix) {
+            context_->RemoveRateLimit(prefix);
+        }
+
+        /*! Perform a batch of requests concurrently on the calling thread, and wait for them.
+         *
+         * \param builders Requests, from `Build()`, that are ready to be executed. Don't call
+         *      `Execute()` or `ExecuteSynchronous()` on them. The builders are left empty.
+         * \param timeout Max time to wait. Requests that are not finished by then fail
+         *      with `Error::DEADLINE_EXCEEDED`.
+         * \returns true if all the requests finished before the timeout.
+         *
+         * The requests run on a libcurl multi-handle that is driven by the calling thread,
+         * so they run concurrently, even when `RESTINCURL_ENABLE_ASYNC` is 0. At most
+         * `RESTINCURL_MAX_CONNECTIONS` requests run at the same time, and the completion-callback
+         * for each request is called once, from the calling thread, before this method returns.
+         * Deadlines, retries and the response cache work like for `Execute()`. The circuit
+         * breaker, rate limits, hedging and coalescing belong to the worker-thread, and
+         * are not used. Downloads to file are not supported.
+         *
+         * The client keeps the multi-handle, and with it the connections, between calls.
+         * If another thread is in `PerformAll()` on the same client, a temporary
+         * multi-handle is used.
+         *
+         * Example
+         * \code
+                std::vector<std::unique_ptr<RequestBuilder>> batch;
+                for(const auto& url : urls) {
+                    batch.push_back(client.Build());
+                    batch.back()->Get(url).WithCompletion([&](const Result& result) {
+                        // Do something
+                    });
+                }
+                client.PerformAll(batch, std::chrono::seconds(30));
+           \endcode
+         */
+        bool PerformAll(std::vector<std::unique_ptr<RequestBuilder>>& builders,
+                        const std::chrono::milliseconds timeout) {
+            std::vector<Request::ptr_t> requests;
+            requests.reserve(builders.size());
+            for(auto& builder : builders) {
+                if (builder) {
+                    requests.push_back(builder->BuildForBatch());
+                }
+            }
+
+            std::unique_lock<std::mutex> lock{performer_mutex_, std::try_to_lock};
+            if (!lock.owns_lock()) {
+                MultiPerformer performer;
+                return performer.Perform(std::move(requests), timeout);
+            }
+            if (!performer_) {
+                performer_ = std::make_unique<MultiPerformer>();
+            }
+            return performer_->Perform(std::move(requests), timeout);
+        }
+
 #if RESTINCURL_ENABLE_ASYNC
         /*! Shut down the event-loop and clean up internal resources when all active and queued requests are done.
          * 
@@ -1978,11 +8886,88 @@ auto async_execute(RequestBuilder builder, CompletionToken&& token)
         size_t GetNumActiveRequests() {
             return worker_->GetNumActiveRequests();
         }
+
+        /*! Get the number of requests waiting in the queue for a connection.
+         *
+         * This method is only available when `RESTINCURL_ENABLE_ASYNC` is nonzero.
+         */
+        size_t GetQueueSize() const {
+            return worker_->GetQueueSize();
+        }
+
+        /*! Limit the number of requests waiting in the queue.
+         *
+         * By default, the queue has no limit. When the queue is full, `Execute()`
+         * may call the completion of the new request, or of a dropped one, before
+         * it returns. See `QueuePolicy`.
+         *
+         * This method is only available when `RESTINCURL_ENABLE_ASYNC` is nonzero.
+         */
+        void SetQueuePolicy(const QueuePolicy& policy) {
+            worker_->SetQueuePolicy(policy);
+        }
+
+        /*! Shed requests when they wait too long in the queue.
+         *
+         * Shed requests fail with `Error::OVERLOADED`. See `LoadShedder`.
+         * Load shedding is disabled by default.
+         *
+         * This method is only available when `RESTINCURL_ENABLE_ASYNC` is nonzero.
+         */
+        void SetLoadShedding(const LoadSheddingPolicy& policy = {}) {
+            worker_->SetLoadShedding(policy);
+        }
+
+        /*! Disable load shedding
+         *
+         * This method is only available when `RESTINCURL_ENABLE_ASYNC` is nonzero.
+         */
+        void DisableLoadShedding() {
+            worker_->DisableLoadShedding();
+        }
+
+        /*! Select how the worker-thread waits for network events.
+         *
+         * See `WorkerBackend`. The default is set by `RESTINCURL_WORKER_BACKEND`.
+         *
+         * This takes effect the next time the worker-thread starts, so
+         * call it before the first request. If the backend is not available
+         * on this system, the worker falls back to epoll, and then to select().
+         * `GetWorkerBackend()` returns the backend in use once the thread has started.
+         *
+         * This method is only available when `RESTINCURL_ENABLE_ASYNC` is nonzero.
+         */
+        void SetWorkerBackend(const WorkerBackend backend) {
+            worker_->SetBackend(backend);
+        }
+
+        /*! Get the backend used by the worker-thread.
+         *
+         * This method is only available when `RESTINCURL_ENABLE_ASYNC` is nonzero.
+         */
+        WorkerBackend GetWorkerBackend() const {
+            return worker_->GetBackend();
+        }
 #endif
 
     private:
+        static void InitCurl(const bool init) {
+            if (init) {
+                static std::once_flag flag;
+                std::call_once(flag, [] {
+                    RESTINCURL_LOG("One time initialization of curl.");
+                    curl_global_init(CURL_GLOBAL_DEFAULT);
+                });
+            }
+        }
+
+        std::shared_ptr<ClientContext> context_ = std::make_shared<ClientContext>();
+        std::mutex performer_mutex_;
+        std::unique_ptr<MultiPerformer> performer_;
 #if RESTINCURL_ENABLE_ASYNC
-        std::unique_ptr<Worker> worker_ = std::make_unique<Worker>();
+        std::unique_ptr<Worker> worker_ = std::make_unique<Worker>(context_);
+#else
+        std::shared_ptr<RequestPool> pool_ = std::make_shared<RequestPool>();
 #endif
     };
 
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+
+/*! A server on localhost that accepts connections, but never answers.
+ *
+ *  Requests to it stay in progress until they time out or are cancelled.
+ *
+ *  The socket is closed in the destructor
+ */
+struct SilentServer {
+
+    SilentServer() {
+        fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if ((fd_ < 0)
+            || (bind(fd_, reinterpret_cast<sockaddr *>(&addr), len) != 0)
+            || (listen(fd_, 64) != 0)
+            || (getsockname(fd_, reinterpret_cast<sockaddr *>(&addr), &len) != 0)) {
+            throw std::runtime_error("Failed to start SilentServer");
+        }
+        port_ = ntohs(addr.sin_port);
+    }
+
+    ~SilentServer() {
+        close(fd_);
+    }
+
+    std::string Url() const {
+        return "http://127.0.0.1:" + std::to_string(port_) + "/silent";
+    }
+
+private:
+    int fd_ = -1;
+    unsigned short port_ = 0;
+};
+
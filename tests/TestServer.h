@@ -0,0 +1,299 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*! A small HTTP/1.1 server on localhost, for tests that need to control the responses.
+ *
+ *  Each request is passed to the handler, on the thread that serves the
+ *  connection, and the response it returns is sent back. Connections are
+ *  kept alive. All the requests are recorded, so that a test can check
+ *  what the client sent.
+ *
+ *  The server is stopped in the destructor.
+ */
+struct TestServer {
+    struct Request {
+        std::string method;
+        std::string target; // The path and the query
+        std::map<std::string, std::string> headers; // The names are in lower case
+        std::string body;
+
+        std::string Header(const std::string& name) const {
+            auto it = headers.find(name);
+            return (it == headers.end()) ? std::string{} : it->second;
+        }
+
+        bool HasHeader(const std::string& name) const {
+            return headers.find(name) != headers.end();
+        }
+    };
+
+    struct Response {
+        int code = 200;
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+
+        // Wait this long before answering
+        std::chrono::milliseconds delay = {};
+
+        // If set, send only this much of the body, and then close the connection
+        bool truncate = false;
+        size_t truncate_at = 0;
+    };
+
+    using handler_t = std::function<Response(const Request&)>;
+
+    explicit TestServer(handler_t handler)
+    : handler_{std::move(handler)}
+    {
+        fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        int one = 1;
+        if ((fd_ < 0)
+            || (setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0)
+            || (bind(fd_, reinterpret_cast<sockaddr *>(&addr), len) != 0)
+            || (listen(fd_, 64) != 0)
+            || (getsockname(fd_, reinterpret_cast<sockaddr *>(&addr), &len) != 0)) {
+            throw std::runtime_error("Failed to start TestServer");
+        }
+        port_ = ntohs(addr.sin_port);
+        acceptor_ = std::thread([this] { Accept(); });
+    }
+
+    ~TestServer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+            for(const auto fd : connections_) {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+        stop_.notify_all();
+        shutdown(fd_, SHUT_RDWR);
+        acceptor_.join();
+        close(fd_);
+        for(auto& thd : threads_) {
+            thd.join();
+        }
+    }
+
+    std::string Url(const std::string& path = "/") const {
+        return "http://127.0.0.1:" + std::to_string(port_) + path;
+    }
+
+    /*! The requests received so far */
+    std::vector<Request> GetRequests() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return requests_;
+    }
+
+    size_t GetNumRequests() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return requests_.size();
+    }
+
+private:
+    void Accept() {
+        while(true) {
+            const int fd = accept(fd_, nullptr, nullptr);
+            const auto err = errno;
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (fd < 0) {
+                if (stopped_ || ((err != EINTR) && (err != ECONNABORTED))) {
+                    return;
+                }
+                continue;
+            }
+            if (stopped_) {
+                close(fd);
+                return;
+            }
+            connections_.push_back(fd);
+            threads_.emplace_back([this, fd] {
+                Serve(fd);
+                std::lock_guard<std::mutex> lock(mutex_);
+                connections_.erase(std::find(connections_.begin(), connections_.end(), fd));
+                close(fd);
+            });
+        }
+    }
+
+    void Serve(const int fd) {
+        std::string buffer;
+        while(true) {
+            Request req;
+            if (!ReadRequest(fd, buffer, req)) {
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                requests_.push_back(req);
+            }
+
+            const auto res = handler_(req);
+            if (res.delay.count()) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (stop_.wait_for(lock, res.delay, [this] { return stopped_; })) {
+                    return;
+                }
+            }
+
+            std::string out = "HTTP/1.1 " + std::to_string(res.code) + " Status\r\n";
+            bool have_length = false;
+            for(const auto& header : res.headers) {
+                out += header.first + ": " + header.second + "\r\n";
+                have_length = have_length || (Lower(header.first) == "content-length");
+            }
+            if (!have_length) {
+                out += "Content-Length: " + std::to_string(res.body.size()) + "\r\n";
+            }
+            out += "\r\n";
+            if (req.method != "HEAD") {
+                out += res.truncate ? res.body.substr(0, res.truncate_at) : res.body;
+            }
+            if (!Write(fd, out) || res.truncate) {
+                return;
+            }
+        }
+    }
+
+    bool ReadRequest(const int fd, std::string& buffer, Request& req) {
+        size_t end = 0;
+        while((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (!Read(fd, buffer)) {
+                return false;
+            }
+        }
+
+        const auto head = buffer.substr(0, end);
+        buffer.erase(0, end + 4);
+
+        auto eol = head.find("\r\n");
+        const auto line = head.substr(0, eol);
+        const auto sp1 = line.find(' ');
+        const auto sp2 = line.find(' ', sp1 + 1);
+        req.method = line.substr(0, sp1);
+        req.target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+
+        while(eol != std::string::npos) {
+            const auto next = head.find("\r\n", eol + 2);
+            const auto header = head.substr(eol + 2, next - eol - 2);
+            const auto colon = header.find(':');
+            if (colon != std::string::npos) {
+                auto value = header.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(' '));
+                req.headers[Lower(header.substr(0, colon))] = value;
+            }
+            eol = next;
+        }
+
+        if (Lower(req.Header("expect")) == "100-continue") {
+            if (!Write(fd, "HTTP/1.1 100 Continue\r\n\r\n")) {
+                return false;
+            }
+        }
+
+        if (Lower(req.Header("transfer-encoding")) == "chunked") {
+            while(true) {
+                size_t eoc = 0;
+                while((eoc = buffer.find("\r\n")) == std::string::npos) {
+                    if (!Read(fd, buffer)) {
+                        return false;
+                    }
+                }
+                const auto size = static_cast<size_t>(strtoul(buffer.c_str(), nullptr, 16));
+                while(buffer.size() < eoc + 2 + size + 2) {
+                    if (!Read(fd, buffer)) {
+                        return false;
+                    }
+                }
+                req.body.append(buffer, eoc + 2, size);
+                buffer.erase(0, eoc + 2 + size + 2);
+                if (!size) {
+                    return true;
+                }
+            }
+        }
+
+        const auto length = static_cast<size_t>(strtoul(req.Header("content-length").c_str(), nullptr, 10));
+        while(buffer.size() < length) {
+            if (!Read(fd, buffer)) {
+                return false;
+            }
+        }
+        req.body = buffer.substr(0, length);
+        buffer.erase(0, length);
+        return true;
+    }
+
+    static bool Read(const int fd, std::string& buffer) {
+        char data[16 * 1024];
+        while(true) {
+            const auto bytes = recv(fd, data, sizeof(data), 0);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes <= 0) {
+                return false;
+            }
+            buffer.append(data, static_cast<size_t>(bytes));
+            return true;
+        }
+    }
+
+    static bool Write(const int fd, const std::string& data) {
+        size_t sent = 0;
+        while(sent < data.size()) {
+            const auto bytes = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes <= 0) {
+                return false;
+            }
+            sent += static_cast<size_t>(bytes);
+        }
+        return true;
+    }
+
+    static std::string Lower(std::string str) {
+        std::transform(str.begin(), str.end(), str.begin(), [](unsigned char ch) {
+            return static_cast<char>(std::tolower(ch));
+        });
+        return str;
+    }
+
+    handler_t handler_;
+    int fd_ = -1;
+    unsigned short port_ = 0;
+    std::thread acceptor_;
+    mutable std::mutex mutex_;
+    std::condition_variable stop_;
+    bool stopped_ = false;
+    std::vector<int> connections_;
+    std::vector<std::thread> threads_;
+    std::vector<Request> requests_;
+};
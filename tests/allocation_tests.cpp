@@ -0,0 +1,217 @@
+
+// Counts the memory allocated while requests are built: by us with operator new,
+// and by libcurl with malloc() (through curl_global_init_mem()).
+// Logging is disabled, as it allocates.
+
+#define RESTINCURL_ENABLE_ASYNC 1
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <new>
+
+#include "restincurl/restincurl.h"
+
+#include "lest/lest.hpp"
+
+using namespace std;
+using namespace restincurl;
+
+namespace {
+atomic<size_t> num_allocations{0};
+atomic<size_t> num_curl_allocations{0};
+
+void *curlMalloc(size_t size) {
+    ++num_curl_allocations;
+    return malloc(size);
+}
+
+void *curlRealloc(void *ptr, size_t size) {
+    ++num_curl_allocations;
+    return realloc(ptr, size);
+}
+
+char *curlStrdup(const char *str) {
+    ++num_curl_allocations;
+    return strdup(str);
+}
+
+void *curlCalloc(size_t nmemb, size_t size) {
+    ++num_curl_allocations;
+    return calloc(nmemb, size);
+}
+
+// The allocations by us and by libcurl while `fn` runs
+template <typename T>
+pair<size_t, size_t> countAllocations(const T& fn) {
+    const auto before = num_allocations.load();
+    const auto curl_before = num_curl_allocations.load();
+    fn();
+    return {num_allocations.load() - before, num_curl_allocations.load() - curl_before};
+}
+}
+
+void *operator new(size_t size) {
+    ++num_allocations;
+    if (auto ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw bad_alloc{};
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+#define STARTCASE(name) { CASE(#name) { \
+    clog << "================================" << endl; \
+    clog << "Test case: " << #name << endl; \
+    clog << "================================" << endl;
+
+#define ENDCASE \
+    clog << "============== ENDCASE =============" << endl; \
+}},
+
+const lest::test specification[] = {
+
+STARTCASE(TestGetIsAllocationFree)
+{
+    restincurl::Client client;
+    const string url = "http://localhost:3001/normal/manyposts";
+    int calls = 0;
+
+    auto build = [&] {
+        auto builder = client.Build();
+        builder->Get(url)
+            .Header("X-Client: restincurl")
+            .WithCompletion([&calls](const Result&) { ++calls; })
+            .Build();
+    };
+
+    // Fill the pools
+    build();
+    build();
+
+    EXPECT(countAllocations(build).first == 0U);
+
+} ENDCASE
+
+STARTCASE(TestPostIsAllocationFree)
+{
+    restincurl::Client client;
+    const string url = "http://localhost:3001/normal/posts";
+
+    auto build = [&](string body) {
+        auto builder = client.Build();
+        builder->Post(url)
+            .Header("Content-Type: application/json")
+            .SendData(move(body))
+            .Build();
+    };
+
+    build("{}");
+    build("{}");
+
+    string body = R"({"title":"A post that is too long for the small string optimization"})";
+    EXPECT(countAllocations([&] { build(move(body)); }).first == 0U);
+
+} ENDCASE
+
+STARTCASE(TestLargeCaptureIsAllocationFree)
+{
+    restincurl::Client client;
+    const string url = "http://localhost:3001/normal/manyposts";
+    int a = 0, b = 0, c = 0, d = 0, e = 0, f = 0;
+
+    auto build = [&] {
+        auto builder = client.Build();
+        builder->Get(url)
+            // 48 bytes of captures. std::function would allocate for this.
+            .WithCompletion([&a, &b, &c, &d, &e, &f](const Result&) {
+                ++a; ++b; ++c; ++d; ++e; ++f;
+            })
+            .Build();
+    };
+
+    build();
+    build();
+
+    EXPECT(countAllocations(build).first == 0U);
+
+} ENDCASE
+
+STARTCASE(TestLibcurlAllocations)
+{
+    restincurl::Client client;
+    const string url = "http://localhost:3001/normal/manyposts";
+
+    auto build = [&](const size_t headers) {
+        auto builder = client.Build();
+        builder->Get(url);
+        for(size_t i = 0; i < headers; ++i) {
+            builder->Header("X-Client: restincurl");
+        }
+        builder->Build();
+    };
+
+    build(0);
+    build(4);
+
+    // libcurl copies the URL, and resets the recycled handle
+    const auto bare = countAllocations([&] { build(0); });
+    EXPECT(bare.first == 0U);
+    EXPECT(bare.second > 0U);
+
+    // Each header line costs libcurl's own list node and copy, and nothing more
+    const auto with_headers = countAllocations([&] { build(4); });
+    EXPECT(with_headers.first == 0U);
+    EXPECT(with_headers.second <= bare.second + 4 * 2);
+
+} ENDCASE
+
+STARTCASE(TestRecycledRequestsAreReset)
+{
+    restincurl::Client client;
+
+    // The easy-handle from the POST is reused for the GET
+    for(int i = 0; i < 2; ++i) {
+        promise<Result> post;
+        client.Build()->Post("http://localhost:3001/normal/posts")
+            .WithJson(R"({"id":1})")
+            .WithCompletion([&](const Result& result) {
+                post.set_value(result);
+            })
+            .Execute();
+        EXPECT(post.get_future().get().http_response_code == 201);
+
+        promise<Result> get;
+        client.Build()->Get("http://localhost:3001/normal/manyposts")
+            .WithCompletion([&](const Result& result) {
+                get.set_value(result);
+            })
+            .Execute();
+        const auto result = get.get_future().get();
+        EXPECT(result.http_response_code == 200);
+        EXPECT(result.body.size() > 100U);
+    }
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    // Before the client initializes libcurl
+    curl_global_init_mem(CURL_GLOBAL_DEFAULT, curlMalloc, free, curlRealloc, curlStrdup, curlCalloc);
+    const auto rval = lest::run( specification, argc, argv );
+    curl_global_cleanup();
+    return rval;
+}
@@ -0,0 +1,236 @@
+
+#define RESTINCURL_MAX_CONNECTIONS 4
+#define RESTINCURL_ENABLE_ASYNC 1
+#define RESTINCURL_ENABLE_ASIO 1
+#define RESTINCURL_ENABLE_DEFAULT_LOGGER 1
+#define RESTINCURL_LOG_VERBOSE_ENABLE 1
+
+// Boost 1.74 needs <utility> for std::exchange in asio/awaitable.hpp
+#include <utility>
+#include <boost/asio.hpp>
+
+#include "restincurl/restincurl.h"
+
+#include "SilentServer.h"
+#include "TestServer.h"
+
+#include "lest/lest.hpp"
+
+using namespace std;
+using namespace restincurl;
+
+#define STARTCASE(name) { CASE(#name) { \
+    clog << "================================" << endl; \
+    clog << "Test case: " << #name << endl; \
+    clog << "================================" << endl;
+
+#define ENDCASE \
+    clog << "============== ENDCASE =============" << endl; \
+}},
+
+
+const lest::test specification[] = {
+
+STARTCASE(TestAsioClient)
+{
+    boost::asio::io_context ioc;
+    restincurl::Client client{ioc};
+
+    const auto io_thread = std::this_thread::get_id();
+    int callbacks = 0;
+    for(int i = 0; i < 10; ++i) {
+        client.Build()->Get("http://localhost:3001/normal/manyposts?delay=0.2")
+            .AcceptJson()
+            .WithCompletion([&](const Result& result) {
+                EXPECT(result.curl_code == CURLE_OK);
+                EXPECT(result.http_response_code == 200);
+                EXPECT(!result.body.empty());
+                EXPECT(std::this_thread::get_id() == io_thread);
+                ++callbacks;
+            })
+            .Execute();
+    }
+
+    // The requests are performed by the thread that runs the io_context
+    EXPECT(!client.HaveWorker());
+    const auto start = std::chrono::steady_clock::now();
+    ioc.run();
+
+    EXPECT(callbacks == 10);
+    EXPECT(!client.HaveWorker());
+    // Four at the time
+    EXPECT(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(2000));
+
+} ENDCASE
+
+STARTCASE(TestAsioRequestFromCompletion)
+{
+    boost::asio::io_context ioc;
+    restincurl::Client client{ioc};
+
+    std::vector<std::string> bodies;
+    client.Build()->Get("http://localhost:3001/normal/manyposts")
+        .WithCompletion([&](const Result& result) {
+            bodies.push_back(result.body);
+            client.Build()->Post("http://localhost:3001/normal/posts")
+                .SendData(std::string{R"({"title":"hi"})"})
+                .WithCompletion([&](const Result& result) {
+                    EXPECT(result.http_response_code == 201);
+                    bodies.push_back(result.body);
+                })
+                .Execute();
+        })
+        .Execute();
+
+    ioc.run();
+    EXPECT(bodies.size() == 2U);
+    EXPECT(bodies[1] == R"({"title":"hi"})");
+
+} ENDCASE
+
+STARTCASE(TestAsioCancelAndDeadline)
+{
+    boost::asio::io_context ioc;
+    restincurl::Client client{ioc};
+    SilentServer silent;
+
+    std::vector<Error> errors;
+    auto handle = client.Build()->Get(silent.Url())
+        .WithCompletion([&](const Result& result) {
+            errors.push_back(result.error);
+        })
+        .Execute();
+
+    client.Build()->Get(silent.Url())
+        .Deadline(std::chrono::milliseconds(200))
+        .WithCompletion([&](const Result& result) {
+            errors.push_back(result.error);
+        })
+        .Execute();
+
+    boost::asio::steady_timer timer{ioc, std::chrono::milliseconds(100)};
+    timer.async_wait([&](const boost::system::error_code&) {
+        handle.Cancel();
+    });
+
+    const auto start = std::chrono::steady_clock::now();
+    ioc.run();
+
+    EXPECT(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(3000));
+    EXPECT(errors.size() == 2U);
+    EXPECT(errors[0] == Error::CANCELLED);
+    EXPECT(errors[1] == Error::NONE);
+    EXPECT(client.GetNumActiveRequests() == 0U);
+
+} ENDCASE
+
+STARTCASE(TestAsioRequestFromOtherThread)
+{
+    boost::asio::io_context ioc;
+    auto work = boost::asio::make_work_guard(ioc);
+    std::thread io_thread{[&] { ioc.run(); }};
+
+    {
+        restincurl::Client client{ioc};
+        std::promise<Result> promise;
+        client.Build()->Get("http://localhost:3001/normal/manyposts")
+            .WithCompletion([&](const Result& result) {
+                promise.set_value(result);
+            })
+            .Execute();
+
+        const auto result = promise.get_future().get();
+        EXPECT(result.http_response_code == 200);
+
+        // Let the io_context run out of work, and delete the client after it stopped
+        boost::asio::post(ioc, [&] {
+            work.reset();
+        });
+        io_thread.join();
+    }
+
+} ENDCASE
+
+STARTCASE(TestAsioDeleteWhileRunning)
+{
+    TestServer server{[](const TestServer::Request&) {
+        TestServer::Response res;
+        res.body = "OK";
+        res.delay = std::chrono::milliseconds(20);
+        return res;
+    }};
+
+    boost::asio::io_context ioc;
+    auto work = boost::asio::make_work_guard(ioc);
+    std::vector<std::thread> io_threads;
+    for(int i = 0; i < 4; ++i) {
+        io_threads.emplace_back([&] { ioc.run(); });
+    }
+
+    auto client = std::make_unique<restincurl::Client>(ioc);
+    std::atomic<int> completed{0};
+    std::promise<void> some_done;
+    for(int i = 0; i < 50; ++i) {
+        client->Build()->Get(server.Url("/get"))
+            .WithCompletion([&](const Result& result) {
+                EXPECT(result.http_response_code == 200);
+                if (++completed == 5) {
+                    some_done.set_value();
+                }
+            })
+            .Execute();
+    }
+    some_done.get_future().wait();
+
+    // Delete the client from a handler, while the other threads run its handlers
+    std::promise<void> deleted;
+    boost::asio::post(ioc, [&] {
+        client.reset();
+        deleted.set_value();
+    });
+    deleted.get_future().wait();
+    const auto completed_when_deleted = completed.load();
+
+    work.reset();
+    for(auto& thd : io_threads) {
+        thd.join();
+    }
+
+    // The requests that were not finished are dropped without their completions
+    EXPECT(completed.load() == completed_when_deleted);
+    EXPECT(completed_when_deleted < 50);
+
+} ENDCASE
+
+STARTCASE(TestAsioHedgeTimerIsCancelled)
+{
+    TestServer server{[](const TestServer::Request&) {
+        return TestServer::Response{};
+    }};
+
+    boost::asio::io_context ioc;
+    restincurl::Client client{ioc};
+
+    bool callback_called = false;
+    client.Build()->Get(server.Url("/fast"))
+        .Hedge(std::chrono::milliseconds(3000))
+        .WithCompletion([&](const Result& result) {
+            EXPECT(result.http_response_code == 200);
+            callback_called = true;
+        })
+        .Execute();
+
+    // The timer for the copy that was never needed must not keep run() going
+    const auto start = std::chrono::steady_clock::now();
+    ioc.run();
+    EXPECT(callback_called);
+    EXPECT(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(2000));
+
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    return lest::run( specification, argc, argv );
+}
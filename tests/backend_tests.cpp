@@ -0,0 +1,110 @@
+// The worker-thread backends. Built with io_uring support on Linux, unlike the other tests.
+
+#define RESTINCURL_ENABLE_ASYNC 1
+#define RESTINCURL_ENABLE_DEFAULT_LOGGER 1
+#define RESTINCURL_LOG_VERBOSE_ENABLE 1
+#ifdef __linux__
+#   define RESTINCURL_WITH_IO_URING 1
+#endif
+
+#include <atomic>
+#include <chrono>
+
+#include "restincurl/restincurl.h"
+
+#include "TestServer.h"
+
+#include "lest/lest.hpp"
+
+using namespace std;
+using namespace restincurl;
+
+#define STARTCASE(name) { CASE(#name) { \
+    clog << "================================" << endl; \
+    clog << "Test case: " << #name << endl; \
+    clog << "================================" << endl;
+
+#define ENDCASE \
+    clog << "============== ENDCASE =============" << endl; \
+}},
+
+namespace {
+
+// Whether `used` is the backend that `backend` should end up as
+bool isExpectedBackend(const WorkerBackend backend, const WorkerBackend used) {
+#ifdef __linux__
+    switch(backend) {
+        case WorkerBackend::SELECT:
+            return used == WorkerBackend::SELECT;
+        case WorkerBackend::EPOLL:
+            return used == WorkerBackend::EPOLL;
+        case WorkerBackend::IO_URING:
+#   ifdef RESTINCURL_HAVE_IO_URING
+            // The kernel may not support it, or may not allow it
+            return (used == WorkerBackend::IO_URING) || (used == WorkerBackend::EPOLL);
+#   else
+            return used == WorkerBackend::EPOLL;
+#   endif
+    }
+    return false;
+#else
+    (void)backend;
+    return used == WorkerBackend::SELECT;
+#endif
+}
+
+} // anon ns
+
+const lest::test specification[] = {
+
+STARTCASE(TestWorkerBackends)
+{
+    TestServer server{[](const TestServer::Request& req) {
+        TestServer::Response res;
+        res.body = "OK";
+        if (req.target == "/slow") {
+            res.delay = chrono::milliseconds(200);
+        }
+        return res;
+    }};
+
+    for(const auto backend : {WorkerBackend::SELECT, WorkerBackend::EPOLL, WorkerBackend::IO_URING}) {
+        restincurl::Client client;
+        client.SetWorkerBackend(backend);
+
+        atomic<int> callbacks{0};
+        for(int i = 0; i < 10; ++i) {
+            client.Build()->Get(server.Url("/slow"))
+                .WithCompletion([&](const Result& result) {
+                    EXPECT(result.http_response_code == 200);
+                    // Requests queued from a completion must wake up the worker
+                    client.Build()->Get(server.Url("/fast"))
+                        .WithCompletion([&](const Result& result) {
+                            EXPECT(result.http_response_code == 200);
+                            EXPECT(result.body == "OK");
+                            ++callbacks;
+                        })
+                        .Execute();
+                })
+                .Execute();
+        }
+
+        const auto start = chrono::steady_clock::now();
+        client.CloseWhenFinished();
+        client.WaitForFinish();
+        EXPECT(callbacks == 10);
+        EXPECT(chrono::steady_clock::now() - start < chrono::milliseconds(3000));
+
+        // io_uring falls back to epoll if it is not available, and all fall back to select() elsewhere
+        EXPECT(isExpectedBackend(backend, client.GetWorkerBackend()));
+    }
+
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    RESTINCURL_LOG("Running tests in thread " << std::this_thread::get_id());
+    return lest::run( specification, argc, argv );
+}
@@ -2,6 +2,8 @@
 #define RESTINCURL_ENABLE_ASYNC 1
 #define RESTINCURL_ENABLE_ASIO 1
 
+// Boost 1.74 needs <utility> for std::exchange in asio/awaitable.hpp
+#include <utility>
 #include <boost/asio.hpp>
 
 #include "restincurl/restincurl.h"
@@ -10,6 +10,8 @@
 #include "restincurl/restincurl.h"
 
 #include "TmpFile.h"
+#include "SilentServer.h"
+#include "TestServer.h"
 
 #include "lest/lest.hpp"
 
@@ -25,6 +27,135 @@ using namespace restincurl;
     clog << "============== ENDCASE =============" << endl; \
 }},
 
+namespace {
+
+// Content that is different at every offset, so misplaced bytes are detected
+std::string makeContent(const size_t size) {
+    std::string content(size, '\0');
+    for(size_t i = 0; i < size; ++i) {
+        content[i] = static_cast<char>((i * 7) + (i >> 8));
+    }
+    return content;
+}
+
+std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+// Serve `content` like a static file, with support for byte-ranges and If-Range
+TestServer::Response serveFile(const TestServer::Request& req, const std::string& content,
+                               const std::string& etag) {
+    TestServer::Response res;
+    res.headers = {{"Accept-Ranges", "bytes"}, {"ETag", etag}};
+
+    const auto range = req.Header("range");
+    const bool current = !req.HasHeader("if-range") || (req.Header("if-range") == etag);
+    if (range.compare(0, 6, "bytes=") || !current) {
+        res.body = content;
+        return res;
+    }
+
+    const auto first = static_cast<size_t>(strtoull(range.c_str() + 6, nullptr, 10));
+    const auto dash = range.find('-');
+    if (first >= content.size()) {
+        res.code = 416;
+        res.headers.emplace_back("Content-Range", "bytes */" + std::to_string(content.size()));
+        return res;
+    }
+    auto last = content.size() - 1;
+    if (dash + 1 < range.size()) {
+        last = std::min<size_t>(last, strtoull(range.c_str() + dash + 1, nullptr, 10));
+    }
+    res.code = 206;
+    res.body = content.substr(first, last - first + 1);
+    res.headers.emplace_back("Content-Range", "bytes " + std::to_string(first) + "-"
+        + std::to_string(last) + "/" + std::to_string(content.size()));
+    return res;
+}
+
+#ifdef RESTINCURL_WITH_ZLIB
+// Decompress gzip (windowBits 15 + 16) or zlib (15) data
+std::string inflateBody(const std::string& data, const int windowBits) {
+    z_stream zs = {};
+    if (inflateInit2(&zs, windowBits) != Z_OK) {
+        return {};
+    }
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+
+    std::string out;
+    char buffer[16 * 1024];
+    auto rval = Z_OK;
+    while(rval == Z_OK) {
+        zs.next_out = reinterpret_cast<Bytef *>(buffer);
+        zs.avail_out = sizeof(buffer);
+        rval = inflate(&zs, Z_NO_FLUSH);
+        out.append(buffer, sizeof(buffer) - zs.avail_out);
+    }
+    inflateEnd(&zs);
+    return (rval == Z_STREAM_END) ? out : std::string{};
+}
+
+std::string gzipBody(const std::string& data) {
+    z_stream zs = {};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return {};
+    }
+    std::string out(deflateBound(&zs, static_cast<uLong>(data.size())), '\0');
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+    zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    zs.avail_out = static_cast<uInt>(out.size());
+    const auto rval = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return (rval == Z_STREAM_END) ? out : std::string{};
+}
+#endif
+
+#ifdef RESTINCURL_WITH_ZSTD
+std::string zstdDecompress(const std::string& data) {
+    auto ctx = ZSTD_createDCtx();
+    ZSTD_inBuffer in = {data.data(), data.size(), 0};
+
+    std::string out;
+    char buffer[16 * 1024];
+    size_t rval = 0;
+    ZSTD_outBuffer chunk = {};
+    do {
+        chunk = {buffer, sizeof(buffer), 0};
+        rval = ZSTD_decompressStream(ctx, &chunk, &in);
+        if (ZSTD_isError(rval)) {
+            break;
+        }
+        out.append(buffer, chunk.pos);
+    } while((in.pos < in.size) || (chunk.pos == chunk.size));
+    ZSTD_freeDCtx(ctx);
+    return (rval == 0) ? out : std::string{};
+}
+#endif
+
+// Decompress the body of a request, as the server would
+std::string decompressBody(const TestServer::Request& req) {
+    const auto encoding = req.Header("content-encoding");
+#ifdef RESTINCURL_WITH_ZLIB
+    if (encoding == "gzip") {
+        return inflateBody(req.body, 15 + 16);
+    }
+    if (encoding == "deflate") {
+        return inflateBody(req.body, 15);
+    }
+#endif
+#ifdef RESTINCURL_WITH_ZSTD
+    if (encoding == "zstd") {
+        return zstdDecompress(req.body);
+    }
+#endif
+    return req.body;
+}
+
+} // anon ns
 
 const lest::test specification[] = {
 
@@ -456,6 +587,1259 @@ STARTCASE(TestUploadMimeNoFile)
     EXPECT(callback_called);
 } ENDCASE
 
+STARTCASE(TestAcceptCompressed)
+{
+    // "restincurl " repeated 100 times, compressed with gzip
+    static const unsigned char gzipped[] = {
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x2b, 0x4a, 0x2d, 0x2e,
+        0xc9, 0xcc, 0x4b, 0x2e, 0x2d, 0xca, 0x51, 0x28, 0x1a, 0x65, 0x8e, 0x32, 0x47, 0x99,
+        0xa3, 0x4c, 0x72, 0x99, 0x00, 0x73, 0x57, 0x6d, 0x63, 0x4c, 0x04, 0x00, 0x00
+    };
+    std::string decoded;
+    for(int i = 0; i < 100; ++i) {
+        decoded += "restincurl ";
+    }
+
+    TestServer server{[&](const TestServer::Request& req) {
+        TestServer::Response res;
+        if (req.Header("accept-encoding").find("gzip") != std::string::npos) {
+            res.headers = {{"Content-Encoding", "gzip"}};
+            res.body.assign(reinterpret_cast<const char *>(gzipped), sizeof(gzipped));
+        } else {
+            res.body = decoded;
+        }
+        return res;
+    }};
+
+    restincurl::Client client;
+
+    bool callback_called = false;
+    client.Build()->Get(server.Url("/encoded"))
+        .AcceptCompressed({Encoding::GZIP, Encoding::BR, Encoding::ZSTD})
+        .StoreHeaders()
+        .WithCompletion([&](const Result& result) {
+            EXPECT(result.curl_code == CURLE_OK);
+            EXPECT(result.http_response_code == 200);
+            EXPECT(result.headers.count("content-encoding") == 1U);
+            EXPECT(result.headers.at("content-encoding") == "gzip");
+            EXPECT(result.body == decoded);
+            EXPECT(result.bytes_received == static_cast<curl_off_t>(decoded.size()));
+            EXPECT(result.wire_bytes_received == static_cast<curl_off_t>(sizeof(gzipped)));
+            callback_called = true;
+        })
+        .Execute();
+
+#if RESTINCURL_ENABLE_ASYNC
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+#endif
+    EXPECT(callback_called);
+
+} ENDCASE
+
+#if defined(RESTINCURL_WITH_ZLIB) || defined(RESTINCURL_WITH_ZSTD)
+STARTCASE(TestCompressBody)
+{
+    std::vector<Encoding> encodings;
+#ifdef RESTINCURL_WITH_ZLIB
+    encodings.push_back(Encoding::GZIP);
+    encodings.push_back(Encoding::DEFLATE);
+#endif
+#ifdef RESTINCURL_WITH_ZSTD
+    encodings.push_back(Encoding::ZSTD);
+#endif
+
+    // Larger than the compressor's input buffer
+    const auto payload = makeContent(200 * 1024);
+
+    // The server decompresses the body, and accepts it only if it is what we sent
+    TestServer server{[&](const TestServer::Request& req) {
+        TestServer::Response res;
+        res.code = (decompressBody(req) == payload) ? 200 : 400;
+        return res;
+    }};
+
+    restincurl::Client client;
+    for(const auto encoding : encodings) {
+        long code = 0;
+        client.Build()->Post(server.Url("/upload"))
+            .SendData(payload)
+            .CompressBody(encoding)
+            .WithCompletion([&](const Result& result) {
+                EXPECT(result.curl_code == CURLE_OK);
+                code = result.http_response_code;
+            })
+            .ExecuteSynchronous();
+
+        EXPECT(code == 200);
+        const auto received = server.GetRequests().back();
+        EXPECT(received.Header("content-encoding") == BodyCompressor::GetName(encoding));
+        EXPECT(received.body.size() < payload.size());
+    }
+} ENDCASE
+#endif
+
+STARTCASE(TestRetryConnectionRefused)
+{
+    restincurl::Client client;
+
+    RetryPolicy policy;
+    policy.max_attempts = 3;
+    policy.initial_delay = std::chrono::milliseconds(10);
+
+    bool callback_called = false;
+    client.Build()->Get("http://localhost:1/nobody-home")
+        .Retry(policy)
+        .WithCompletion([&](const Result& result) {
+            EXPECT(result.curl_code == CURLE_COULDNT_CONNECT);
+            EXPECT(result.attempts == 3U);
+            callback_called = true;
+        })
+        .Execute();
+
+#if RESTINCURL_ENABLE_ASYNC
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+#endif
+    EXPECT(callback_called);
+
+} ENDCASE
+
+STARTCASE(TestRetryAfter)
+{
+    // Busy the first time, and asks us to come back in a second
+    TestServer server{[&](const TestServer::Request&) {
+        TestServer::Response res;
+        if (server.GetNumRequests() == 1) {
+            res.code = 503;
+            res.headers = {{"Retry-After", "1"}};
+            res.body = "busy";
+        } else {
+            res.body = "ok";
+        }
+        return res;
+    }};
+
+    restincurl::Client client;
+
+    RetryPolicy policy;
+    policy.initial_delay = std::chrono::milliseconds(10);
+
+    std::string data;
+    std::promise<Result> done;
+    const auto start = std::chrono::steady_clock::now();
+    client.Build()->Get(server.Url("/busy"))
+        .StoreData(data)
+        .Retry(policy)
+        .WithCompletion([&](const Result& result) {
+            done.set_value(result);
+        })
+        .Execute();
+
+    const auto result = done.get_future().get();
+    EXPECT(result.http_response_code == 200);
+    EXPECT(result.attempts == 2U);
+    EXPECT(data == "ok");
+    EXPECT(server.GetNumRequests() == 2U);
+    EXPECT(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(900));
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+} ENDCASE
+
+STARTCASE(TestRetryGivesUp)
+{
+    TestServer server{[&](const TestServer::Request& req) {
+        TestServer::Response res;
+        res.code = 503;
+        if (req.target == "/later") {
+            res.headers = {{"Retry-After", "60"}};
+        }
+        res.body = "busy #" + std::to_string(server.GetNumRequests());
+        return res;
+    }};
+
+    restincurl::Client client;
+
+    RetryPolicy policy;
+    policy.max_attempts = 3;
+    policy.initial_delay = std::chrono::milliseconds(1);
+    policy.max_delay = std::chrono::milliseconds(1000);
+
+    auto send = [&](const std::string& path, std::string& data) {
+        std::promise<Result> done;
+        client.Build()->Get(server.Url(path))
+            .StoreData(data)
+            .Retry(policy)
+            .WithCompletion([&](const Result& result) {
+                done.set_value(result);
+            })
+            .Execute();
+        return done.get_future().get();
+    };
+
+    // Stops after max_attempts, with the body of the last response
+    std::string data;
+    auto result = send("/busy", data);
+    EXPECT(result.http_response_code == 503);
+    EXPECT(result.attempts == 3U);
+    EXPECT(server.GetNumRequests() == 3U);
+    EXPECT(data == "busy #3");
+
+    // Retry-After is longer than max_delay, so the request is not retried
+    data.clear();
+    result = send("/later", data);
+    EXPECT(result.http_response_code == 503);
+    EXPECT(result.attempts == 1U);
+    EXPECT(server.GetNumRequests() == 4U);
+    EXPECT(data == "busy #4");
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+} ENDCASE
+
+STARTCASE(TestRetryNotIdempotent)
+{
+    TestServer server{[&](const TestServer::Request&) {
+        TestServer::Response res;
+        res.code = 503;
+        return res;
+    }};
+
+    restincurl::Client client;
+
+    RetryPolicy policy;
+    policy.max_attempts = 3;
+    policy.initial_delay = std::chrono::milliseconds(1);
+
+    for(const bool allow : {false, true}) {
+        policy.retry_non_idempotent = allow;
+        const auto before = server.GetNumRequests();
+
+        std::promise<Result> done;
+        client.Build()->Post(server.Url("/orders"))
+            .SendData(std::string{"{\"item\":42}"})
+            .Retry(policy)
+            .WithCompletion([&](const Result& result) {
+                done.set_value(result);
+            })
+            .Execute();
+
+        const auto result = done.get_future().get();
+        EXPECT(result.http_response_code == 503);
+        EXPECT(result.attempts == (allow ? 3U : 1U));
+        EXPECT(server.GetNumRequests() - before == (allow ? 3U : 1U));
+    }
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+} ENDCASE
+
+STARTCASE(TestHedgedRequest)
+{
+    restincurl::Client client;
+
+    int callbacks = 0;
+    client.Build()->Get("http://localhost:3001/normal/manyposts")
+        .AcceptJson()
+        .Hedge(std::chrono::milliseconds(1), 2)
+        .WithCompletion([&](const Result& result) {
+            EXPECT(result.curl_code == CURLE_OK);
+            EXPECT(result.http_response_code == 200);
+            EXPECT(!result.body.empty());
+            ++callbacks;
+        })
+        .Execute();
+
+#if RESTINCURL_ENABLE_ASYNC
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+#endif
+    EXPECT(callbacks == 1);
+
+} ENDCASE
+
+STARTCASE(TestHedgeTimerIsCancelled)
+{
+    TestServer server{[](const TestServer::Request&) {
+        TestServer::Response res;
+        res.body = "fast";
+        return res;
+    }};
+
+    restincurl::Client client;
+
+    std::promise<void> done;
+    client.Build()->Get(server.Url("/fast"))
+        .Hedge(std::chrono::milliseconds(4000))
+        .WithCompletion([&](const Result& result) {
+            EXPECT(result.http_response_code == 200);
+            done.set_value();
+        })
+        .Execute();
+    done.get_future().wait();
+
+    // The timer for the copy that was never needed must not keep the worker running
+    const auto start = std::chrono::steady_clock::now();
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+    EXPECT(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(2000));
+    EXPECT(client.GetStats().hedges_sent == 0U);
+
+} ENDCASE
+
+STARTCASE(TestHedgeRespectsRateLimit)
+{
+    TestServer server{[](const TestServer::Request&) {
+        TestServer::Response res;
+        res.body = "slow";
+        res.delay = std::chrono::milliseconds(300);
+        return res;
+    }};
+
+    restincurl::Client client;
+    client.SetRateLimit(server.Url(), {1.0, 1.0});
+
+    std::promise<Result> done;
+    client.Build()->Get(server.Url("/slow"))
+        .Hedge(std::chrono::milliseconds(20), 2)
+        .WithCompletion([&](const Result& result) {
+            done.set_value(result);
+        })
+        .Execute();
+
+    // The only token is used by the request, so no copies are sent
+    EXPECT(done.get_future().get().http_response_code == 200);
+    EXPECT(server.GetNumRequests() == 1U);
+    EXPECT(client.GetStats().hedges_sent == 0U);
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+} ENDCASE
+
+STARTCASE(TestCircuitBreakerOpens)
+{
+    restincurl::Client client;
+
+    CircuitBreakerPolicy policy;
+    policy.consecutive_failures = 2;
+    policy.open_time = std::chrono::seconds(60);
+    client.SetCircuitBreaker(policy);
+
+    std::vector<Error> errors;
+    for(int i = 0; i < 4; ++i) {
+        std::promise<void> done;
+        client.Build()->Get("http://localhost:1/nobody-home")
+            .WithCompletion([&](const Result& result) {
+                errors.push_back(result.error);
+                done.set_value();
+            })
+            .Execute();
+        done.get_future().wait();
+    }
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+
+    EXPECT(errors.size() == 4U);
+    EXPECT(errors[0] == Error::NONE);
+    EXPECT(errors[1] == Error::NONE);
+    EXPECT(errors[2] == Error::CIRCUIT_OPEN);
+    EXPECT(errors[3] == Error::CIRCUIT_OPEN);
+    EXPECT(client.GetStats().circuits_opened == 1U);
+    EXPECT(client.GetStats().circuit_rejections == 2U);
+
+} ENDCASE
+
+STARTCASE(TestRateLimit)
+{
+    restincurl::Client client;
+    client.SetRateLimit("http://localhost:3001/normal", {20.0, 1.0});
+
+    int callbacks = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < 3; ++i) {
+        client.Build()->Get("http://localhost:3001/normal/manyposts")
+            .WithCompletion([&](const Result& result) {
+                EXPECT(result.curl_code == CURLE_OK);
+                ++callbacks;
+            })
+            .Execute();
+    }
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+
+    // Two of the requests must wait 50 ms each for a token
+    EXPECT(callbacks == 3);
+    EXPECT(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(90));
+    EXPECT(client.GetStats().rate_limited == 2U);
+
+} ENDCASE
+
+STARTCASE(TestRateLimitCountsRequests)
+{
+    // The second request gets 503 the first time, and is retried
+    TestServer server{[&](const TestServer::Request&) {
+        TestServer::Response res;
+        if (server.GetNumRequests() == 2) {
+            res.code = 503;
+        }
+        return res;
+    }};
+
+    restincurl::Client client;
+    client.SetRateLimit(server.Url(), {20.0, 1.0});
+
+    RetryPolicy policy;
+    policy.initial_delay = std::chrono::milliseconds(1);
+
+    std::promise<void> first;
+    std::promise<Result> second;
+    client.Build()->Get(server.Url("/first"))
+        .WithCompletion([&](const Result&) {
+            first.set_value();
+        })
+        .Execute();
+    client.Build()->Get(server.Url("/second"))
+        .Retry(policy)
+        .WithCompletion([&](const Result& result) {
+            second.set_value(result);
+        })
+        .Execute();
+
+    first.get_future().wait();
+    const auto result = second.get_future().get();
+    EXPECT(result.http_response_code == 200);
+    EXPECT(result.attempts == 2U);
+
+    // The second request waited for a token before each attempt, but is counted once
+    EXPECT(client.GetStats().rate_limited == 1U);
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+} ENDCASE
+
+STARTCASE(TestResponseCache)
+{
+    const std::string content = makeContent(4096);
+    TestServer server{[&](const TestServer::Request& req) {
+        TestServer::Response res;
+        if (req.Header("if-none-match") == "\"c1\"") {
+            // No Cache-Control, so the cached entry keeps its lifetime
+            res.code = 304;
+            return res;
+        }
+        res.headers = {{"Cache-Control", req.target == "/stale" ? "max-age=1" : "max-age=60"},
+                       {"ETag", "\"c1\""}};
+        res.body = content;
+        return res;
+    }};
+
+    struct Got {
+        std::string body;
+        bool from_cache = false;
+    };
+    auto fetch = [&](restincurl::Client& client, const std::string& path) {
+        Got got;
+        client.Build()->Get(server.Url(path))
+            .WithCompletion([&](const Result& result) {
+                EXPECT(result.curl_code == CURLE_OK);
+                EXPECT(result.http_response_code == 200);
+                got.body = result.body;
+                got.from_cache = result.from_cache;
+            })
+            .ExecuteSynchronous();
+        return got;
+    };
+
+    {
+        restincurl::Client client;
+        client.EnableCache();
+
+        const auto first = fetch(client, "/fresh");
+        const auto second = fetch(client, "/fresh");
+        EXPECT(!first.from_cache);
+        EXPECT(second.from_cache);
+        EXPECT(first.body == content);
+        EXPECT(second.body == content);
+        EXPECT(server.GetNumRequests() == 1U);
+        EXPECT(client.GetStats().cache_hits == 1U);
+        EXPECT(client.GetStats().cache_misses == 1U);
+    }
+
+    {
+        // When the entry is stale, it's revalidated, and the 304 makes it fresh again
+        restincurl::Client client;
+        client.EnableCache();
+
+        fetch(client, "/stale");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        const auto revalidated = fetch(client, "/stale");
+        const auto again = fetch(client, "/stale");
+        const auto requests = server.GetRequests();
+        EXPECT(requests.size() == 3U);
+        EXPECT(requests.back().Header("if-none-match") == "\"c1\"");
+        EXPECT(revalidated.body == content);
+        EXPECT(again.from_cache);
+        EXPECT(again.body == content);
+        EXPECT(client.GetStats().cache_revalidations == 1U);
+        EXPECT(client.GetStats().cache_hits == 1U);
+    }
+
+    {
+        // The cached body can be shared instead of copied
+        restincurl::Client client;
+        CacheOptions options;
+        options.share_bodies = true;
+        client.EnableCache(options);
+
+        for(int i = 0; i < 2; ++i) {
+            client.Build()->Get(server.Url("/shared"))
+                .WithCompletion([&](const Result& result) {
+                    EXPECT(result.body.empty());
+                    EXPECT(result.shared_body);
+                    EXPECT(result.GetBody() == content);
+                })
+                .ExecuteSynchronous();
+        }
+        EXPECT(client.GetStats().cache_hits == 1U);
+    }
+
+} ENDCASE
+
+STARTCASE(TestCoalescedRequests)
+{
+    // Slow enough that all the requests are queued while the first one is in flight
+    const std::string content = makeContent(2048);
+    TestServer server{[&](const TestServer::Request&) {
+        TestServer::Response res;
+        res.body = content;
+        res.delay = std::chrono::milliseconds(500);
+        return res;
+    }};
+
+    restincurl::Client client;
+
+    std::mutex mutex;
+    std::vector<std::string> bodies;
+    for(int i = 0; i < 5; ++i) {
+        client.Build()->Get(server.Url("/slow"))
+            .AcceptJson()
+            .Coalesce({"Accept"})
+            .WithCompletion([&](const Result& result) {
+                EXPECT(result.curl_code == CURLE_OK);
+                EXPECT(result.http_response_code == 200);
+                lock_t lock(mutex);
+                bodies.push_back(result.GetBody());
+            })
+            .Execute();
+    }
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+
+    EXPECT(bodies.size() == 5U);
+    for(const auto& body : bodies) {
+        EXPECT(body == content);
+    }
+    EXPECT(server.GetNumRequests() == 1U);
+    EXPECT(client.GetStats().coalesced_requests == 4U);
+
+} ENDCASE
+
+STARTCASE(TestRequestTemplate)
+{
+    restincurl::Client client;
+
+    auto tmpl = client.Build()->Get("http://localhost:3001/restricted/posts/1")
+        .AcceptJson()
+        .Header("X-Client", "restincurl")
+        .BasicAuthentication("alice", "12345")
+        .MakeTemplate();
+
+    int callbacks = 0;
+    for(int i = 1; i <= 3; ++i) {
+        client.Build(*tmpl)->Url("http://localhost:3001/restricted/posts/" + std::to_string(i))
+            .WithCompletion([&](const Result& result) {
+                EXPECT(result.curl_code == CURLE_OK);
+                EXPECT(result.http_response_code == 200);
+                EXPECT(!result.body.empty());
+                ++callbacks;
+            })
+            .Execute();
+    }
+
+#if RESTINCURL_ENABLE_ASYNC
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+#endif
+    EXPECT(callbacks == 3);
+
+} ENDCASE
+
+STARTCASE(TestDefaultHeaders)
+{
+    restincurl::Client client;
+    const std::string url = "http://localhost:3001/restricted/posts/1";
+
+    std::mutex mutex;
+    std::map<int, long> codes;
+    auto get = [&](int id, const char *header) {
+        auto builder = client.Build();
+        builder->Get(url);
+        if (header) {
+            builder->Header(header);
+        }
+        builder->WithCompletion([&, id](const Result& result) {
+            EXPECT(result.curl_code == CURLE_OK);
+            lock_t lock(mutex);
+            codes[id] = result.http_response_code;
+        });
+        builder->Execute();
+    };
+
+    client.SetDefaultHeaders({"Accept: application/json", "Authorization: Basic d3Jvbmc6d3Jvbmc="});
+    get(1, nullptr);
+    get(2, "Authorization: Basic YWxpY2U6MTIzNDU=");
+
+    // Rotate the credentials
+    client.SetDefaultHeaders({"Accept: application/json", "Authorization: Basic YWxpY2U6MTIzNDU="});
+    get(3, nullptr);
+
+#if RESTINCURL_ENABLE_ASYNC
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+#endif
+    EXPECT(codes[1] == 401);
+    EXPECT(codes[2] == 200);
+    EXPECT(codes[3] == 200);
+
+} ENDCASE
+
+STARTCASE(TestUrlBuilder)
+{
+    static const RouteTemplate orders{"/users/{id}/orders/{order}"};
+    EXPECT(orders.GetNames().size() == 2U);
+
+    Url url{"https://api.example.com/v1"};
+    url.Route(orders, 42, "a/b c").Query("status", "in transit").Query("limit", -10);
+    EXPECT(url.Str() == "https://api.example.com/v1/users/42/orders/a%2Fb%20c?status=in%20transit&limit=-10");
+
+    Url path{"http://localhost:3001/"};
+    path.Path("normal").Path("manyposts").Query("k&=", "\xC3\xA6");
+    EXPECT(path.Str() == "http://localhost:3001/normal/manyposts?k%26%3D=%C3%A6");
+
+    EXPECT_THROWS_AS(path.Path("more"), Exception);
+    EXPECT_THROWS_AS(url.Route(orders, 1), Exception);
+
+    bool callback_called = false;
+    restincurl::Client client;
+    client.Build()->Get(Url{"http://localhost:3001"}.Path("normal").Path("manyposts"))
+        .Query("page", 1)
+        .WithCompletion([&](const Result& result) {
+            EXPECT(result.curl_code == CURLE_OK);
+            EXPECT(result.http_response_code == 200);
+            callback_called = true;
+        })
+        .Execute();
+
+#if RESTINCURL_ENABLE_ASYNC
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+#endif
+    EXPECT(callback_called);
+
+} ENDCASE
+
+STARTCASE(TestMoveOnlyCompletion)
+{
+    restincurl::Client client;
+
+    // A lambda that owns move-only objects
+    promise<int> code;
+    auto future = code.get_future();
+    auto owned = make_unique<string>("owned");
+    client.Build()->Get("http://localhost:3001/normal/manyposts")
+        .WithCompletion([code = move(code), owned = move(owned)](const Result& result) mutable {
+            EXPECT(*owned == "owned");
+            code.set_value(result.http_response_code);
+        })
+        .Execute();
+    EXPECT(future.get() == 200);
+
+    // std::function is still accepted
+    bool callback_called = false;
+    std::function<void (const Result&)> fn = [&](const Result& result) {
+        EXPECT(result.curl_code == CURLE_OK);
+        callback_called = true;
+    };
+    client.Build()->Get("http://localhost:3001/normal/manyposts")
+        .WithCompletion(fn)
+        .Execute();
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+    EXPECT(callback_called);
+
+} ENDCASE
+
+STARTCASE(TestCancelRequest)
+{
+    restincurl::Client client;
+
+    // The server never answers, so the requests are in progress until they are cancelled
+    SilentServer server;
+    mutex lock;
+    int num_cancelled = 0;
+    promise<void> all_cancelled;
+    vector<RequestHandle> handles;
+    for(int i = 0; i < RESTINCURL_MAX_CONNECTIONS; ++i) {
+        handles.push_back(client.Build()->Get(server.Url())
+            .WithCompletion([&](const Result& result) {
+                EXPECT(result.error == Error::CANCELLED);
+                EXPECT(result.curl_code == CURLE_ABORTED_BY_CALLBACK);
+                lock_guard<mutex> guard(lock);
+                if (++num_cancelled == RESTINCURL_MAX_CONNECTIONS) {
+                    all_cancelled.set_value();
+                }
+            })
+            .Execute());
+    }
+
+    // This one stays in the queue
+    promise<Result> queued;
+    auto handle = client.Build()->Get(server.Url())
+        .WithCompletion([&](const Result& result) {
+            queued.set_value(result);
+        })
+        .Execute();
+    EXPECT(static_cast<bool>(handle));
+    this_thread::sleep_for(chrono::milliseconds(200));
+    EXPECT(client.GetNumActiveRequests() == static_cast<size_t>(RESTINCURL_MAX_CONNECTIONS));
+
+    handle.Cancel();
+    const auto result = queued.get_future().get();
+    EXPECT(handle.IsCancelled());
+    EXPECT(result.error == Error::CANCELLED);
+    EXPECT(result.curl_code == CURLE_ABORTED_BY_CALLBACK);
+
+    for(auto& h : handles) {
+        h.Cancel();
+    }
+    all_cancelled.get_future().get();
+    EXPECT(client.GetStats().cancelled_requests == RESTINCURL_MAX_CONNECTIONS + 1U);
+
+    // Cancelling a completed request does nothing
+    int calls = 0;
+    promise<void> done;
+    auto completed = client.Build()->Get("http://localhost:3001/normal/manyposts")
+        .WithCompletion([&](const Result& result) {
+            EXPECT(result.http_response_code == 200);
+            ++calls;
+            done.set_value();
+        })
+        .Execute();
+    done.get_future().get();
+    completed.Cancel();
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+    EXPECT(calls == 1);
+    EXPECT(client.GetStats().cancelled_requests == RESTINCURL_MAX_CONNECTIONS + 1U);
+
+} ENDCASE
+
+STARTCASE(TestDeadline)
+{
+    restincurl::Client client;
+    SilentServer server;
+
+    // Occupy all the connections
+    vector<RequestHandle> handles;
+    for(int i = 0; i < RESTINCURL_MAX_CONNECTIONS; ++i) {
+        handles.push_back(client.Build()->Get(server.Url())
+            .WithCompletion([](const Result&) {})
+            .Execute());
+    }
+
+    // The deadline passes while it is queued
+    const auto start = chrono::steady_clock::now();
+    promise<Result> queued;
+    client.Build()->Get(server.Url())
+        .Deadline(chrono::milliseconds(200))
+        .WithCompletion([&](const Result& result) {
+            queued.set_value(result);
+        })
+        .Execute();
+    auto result = queued.get_future().get();
+    EXPECT(result.error == Error::DEADLINE_EXCEEDED);
+    EXPECT(chrono::steady_clock::now() - start < chrono::seconds(2));
+    EXPECT(client.GetStats().deadlines_exceeded == 1U);
+
+    for(auto& h : handles) {
+        h.Cancel();
+    }
+
+    // The deadline passes while it is in progress
+    promise<Result> ongoing;
+    client.Build()->Get(server.Url())
+        .Deadline(chrono::steady_clock::now() + chrono::milliseconds(300))
+        .WithCompletion([&](const Result& result) {
+            ongoing.set_value(result);
+        })
+        .Execute();
+    result = ongoing.get_future().get();
+    EXPECT(result.curl_code == CURLE_OPERATION_TIMEDOUT);
+    EXPECT(result.error == Error::NONE);
+
+    // A stalled transfer
+    promise<Result> stalled;
+    client.Build()->Get(server.Url())
+        .LowSpeedLimit(1, chrono::seconds(1))
+        .WithCompletion([&](const Result& result) {
+            stalled.set_value(result);
+        })
+        .Execute();
+    result = stalled.get_future().get();
+    EXPECT(result.curl_code == CURLE_OPERATION_TIMEDOUT);
+
+    // Enough time
+    promise<Result> normal;
+    client.Build()->Get("http://localhost:3001/normal/manyposts")
+        .Deadline(chrono::seconds(5))
+        .WithCompletion([&](const Result& result) {
+            normal.set_value(result);
+        })
+        .Execute();
+    EXPECT(normal.get_future().get().http_response_code == 200);
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+    EXPECT(chrono::steady_clock::now() - start < chrono::seconds(8));
+
+} ENDCASE
+
+STARTCASE(TestQueuePolicy)
+{
+    restincurl::Client client;
+    SilentServer server;
+    multimap<string, RequestHandle> handles;
+    map<string, Error> errors;
+    mutex lock;
+
+    auto execute = [&](const string& name, int priority) {
+        handles.emplace(name, client.Build()->Get(server.Url())
+            .Priority(priority)
+            .WithCompletion([&, name](const Result& result) {
+                lock_guard<mutex> guard(lock);
+                errors[name] = result.error;
+            })
+            .Execute());
+    };
+
+    auto error = [&](const string& name) {
+        lock_guard<mutex> guard(lock);
+        auto it = errors.find(name);
+        return it == errors.end() ? Error::NONE : it->second;
+    };
+
+    // Occupy all the connections
+    for(int i = 0; i < RESTINCURL_MAX_CONNECTIONS; ++i) {
+        execute("active", 0);
+    }
+    while(client.GetNumActiveRequests() < static_cast<size_t>(RESTINCURL_MAX_CONNECTIONS)) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    QueuePolicy policy;
+    policy.max_size = 2;
+    client.SetQueuePolicy(policy);
+    execute("a", 0);
+    execute("b", 0);
+    EXPECT(client.GetQueueSize() == 2U);
+
+    // The new request is rejected right away
+    execute("c", 0);
+    EXPECT(error("c") == Error::QUEUE_FULL);
+    EXPECT(client.GetStats().queue_rejections == 1U);
+
+    policy.overflow = QueueOverflow::DROP_OLDEST;
+    client.SetQueuePolicy(policy);
+    execute("d", 0);
+    EXPECT(error("a") == Error::QUEUE_FULL);
+    EXPECT(error("d") == Error::NONE);
+    EXPECT(client.GetStats().queue_drops == 1U);
+
+    // Queue is "b" and "d"
+    policy.overflow = QueueOverflow::DROP_LOWEST_PRIORITY;
+    client.SetQueuePolicy(policy);
+    execute("e", 1);
+    EXPECT(error("b") == Error::QUEUE_FULL);
+    execute("f", 0);
+    EXPECT(error("f") == Error::QUEUE_FULL);
+    EXPECT(error("d") == Error::NONE);
+
+    // Queue is "d" and "e"
+    policy.overflow = QueueOverflow::BLOCK;
+    policy.block_timeout = chrono::milliseconds(200);
+    client.SetQueuePolicy(policy);
+    auto start = chrono::steady_clock::now();
+    execute("g", 0);
+    EXPECT(chrono::steady_clock::now() - start >= chrono::milliseconds(200));
+    EXPECT(error("g") == Error::QUEUE_FULL);
+
+    // Make room while we wait
+    policy.block_timeout = chrono::seconds(10);
+    client.SetQueuePolicy(policy);
+    auto queued = handles.find("e")->second;
+    thread canceller([queued]() mutable {
+        this_thread::sleep_for(chrono::milliseconds(100));
+        queued.Cancel();
+    });
+    execute("h", 0);
+    canceller.join();
+    EXPECT(error("h") == Error::NONE);
+    EXPECT(client.GetQueueSize() == 2U);
+    EXPECT(client.GetStats().queue_rejections == 3U);
+    EXPECT(client.GetStats().queue_drops == 2U);
+
+    for(auto& h : handles) {
+        h.second.Cancel();
+    }
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+
+} ENDCASE
+
+STARTCASE(TestLoadShedder)
+{
+    using ms = chrono::milliseconds;
+    LoadSheddingPolicy policy;
+    policy.target = ms(10);
+    policy.interval = ms(100);
+    LoadShedder shedder{policy};
+    const auto now = chrono::steady_clock::now();
+
+    EXPECT(!shedder.ShouldShed(now, ms(5), false));
+
+    // Above the target for less than an interval
+    EXPECT(!shedder.ShouldShed(now, ms(50), false));
+    EXPECT(!shedder.ShouldShed(now + ms(50), ms(50), false));
+
+    // Above the target for an interval
+    EXPECT(shedder.ShouldShed(now + ms(100), ms(50), false));
+    EXPECT(shedder.IsShedding());
+
+    // Then shed at interval / sqrt(count)
+    EXPECT(!shedder.ShouldShed(now + ms(150), ms(50), false));
+    EXPECT(shedder.ShouldShed(now + ms(200), ms(50), false));
+    EXPECT(!shedder.ShouldShed(now + ms(260), ms(50), false));
+    EXPECT(shedder.ShouldShed(now + ms(271), ms(50), false));
+
+    // The queue drained
+    EXPECT(!shedder.ShouldShed(now + ms(280), ms(50), true));
+    EXPECT(!shedder.IsShedding());
+    EXPECT(!shedder.ShouldShed(now + ms(290), ms(50), false));
+
+    // Requests are sent normally while the queue is short
+    restincurl::Client client;
+    client.SetLoadShedding(policy);
+    promise<Result> done;
+    client.Build()->Get("http://localhost:3001/normal/manyposts")
+        .WithCompletion([&](const Result& result) {
+            done.set_value(result);
+        })
+        .Execute();
+    EXPECT(done.get_future().get().http_response_code == 200);
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+    EXPECT(client.GetStats().requests_shed == 0U);
+
+} ENDCASE
+
+STARTCASE(TestSyncConnectionCache)
+{
+    restincurl::Client client;
+    restincurl::SyncConnectionCache::Instance().Clear();
+
+    // Count the sockets opened by each request
+    auto open_socket = +[](void *clientp, curlsocktype, curl_sockaddr *addr) -> curl_socket_t {
+        ++*static_cast<int *>(clientp);
+        return socket(addr->family, addr->socktype, addr->protocol);
+    };
+
+    // Keep both builders alive, so the second request does not get the first one's easy-handle
+    int sockets[2] = {};
+    std::vector<std::unique_ptr<RequestBuilder>> builders;
+    for(int i = 0; i < 2; ++i) {
+        builders.push_back(client.Build());
+        builders.back()->Get("http://localhost:3001/normal/manyposts")
+            .Option(CURLOPT_OPENSOCKETFUNCTION, open_socket)
+            .Option(CURLOPT_OPENSOCKETDATA, &sockets[i])
+            .WithCompletion([&](const Result& result) {
+                EXPECT(result.curl_code == CURLE_OK);
+                EXPECT(result.http_response_code == 200);
+            })
+            .ExecuteSynchronous();
+    }
+
+    EXPECT(sockets[0] == 1);
+    EXPECT(sockets[1] == 0);
+    EXPECT(restincurl::SyncConnectionCache::Instance().GetSize() == 1U);
+
+} ENDCASE
+
+STARTCASE(TestPerformAll)
+{
+    restincurl::Client client;
+
+    // The requests run concurrently on the calling thread
+    std::vector<int> codes;
+    std::vector<std::unique_ptr<RequestBuilder>> batch;
+    for(int i = 0; i < 5; ++i) {
+        batch.push_back(client.Build());
+        batch.back()->Get("http://localhost:3001/normal/manyposts?delay=0.5")
+            .WithCompletion([&](const Result& result) {
+                codes.push_back(static_cast<int>(result.http_response_code));
+            });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    EXPECT(client.PerformAll(batch, std::chrono::seconds(10)));
+    EXPECT(codes == std::vector<int>(5, 200));
+    EXPECT(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(2000));
+    EXPECT(!client.HaveWorker());
+
+    // Requests that are not finished by the timeout fail
+    SilentServer silent;
+    std::vector<Error> errors;
+    batch.clear();
+    for(int i = 0; i < 2; ++i) {
+        batch.push_back(client.Build());
+        batch.back()->Get(i ? silent.Url() : "http://localhost:3001/normal/manyposts")
+            .WithCompletion([&](const Result& result) {
+                errors.push_back(result.error);
+            });
+    }
+
+    start = std::chrono::steady_clock::now();
+    EXPECT(!client.PerformAll(batch, std::chrono::milliseconds(300)));
+    EXPECT(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(2000));
+    EXPECT(errors.size() == 2U);
+    EXPECT(errors == (std::vector<Error>{Error::NONE, Error::DEADLINE_EXCEEDED}));
+
+} ENDCASE
+
+STARTCASE(TestDownloadToFile)
+{
+    const auto content = makeContent(256 * 1024 + 17);
+    TestServer server{[&](const TestServer::Request& req) {
+        return serveFile(req, content, "\"v1\"");
+    }};
+
+    restincurl::Client client;
+
+    // The reference: The body of a normal GET request
+    std::string expected;
+    client.Build()->Get(server.Url("/file"))
+        .StoreData(expected)
+        .ExecuteSynchronous();
+    EXPECT(expected == content);
+
+    // A single stream, and then segments fetched in parallel
+    for(const size_t segments : {1, 4}) {
+        TmpFile tmpfile;
+        const auto before = server.GetNumRequests();
+
+        DownloadOptions options;
+        options.segments = segments;
+        options.min_segment_size = 16 * 1024;
+
+        std::promise<Result> done;
+        client.Build()->Get(server.Url("/file"))
+            .Header("X-Client", "restincurl")
+            .DownloadToFile(tmpfile.Name(), options)
+            .WithCompletion([&](const Result& result) {
+                done.set_value(result);
+            })
+            .Execute();
+
+        const auto result = done.get_future().get();
+        EXPECT(result.curl_code == CURLE_OK);
+        EXPECT(result.body.empty());
+        EXPECT(readFile(tmpfile.Name()) == expected);
+
+        size_t ranged = 0;
+        const auto requests = server.GetRequests();
+        for(auto it = requests.begin() + before; it != requests.end(); ++it) {
+            EXPECT(it->Header("x-client") == "restincurl");
+            ranged += it->HasHeader("range") ? 1 : 0;
+        }
+        EXPECT(ranged == ((segments > 1) ? segments : 0U));
+    }
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+} ENDCASE
+
+STARTCASE(TestResumeDownload)
+{
+    const auto original = makeContent(128 * 1024);
+    const auto changed = makeContent(96 * 1024 + 5).substr(5);
+    const size_t cut = 50000;
+
+    // The first response is interrupted. With `change`, the resource is replaced after that.
+    std::atomic<bool> change{false};
+    std::atomic<int> requests{0};
+    TestServer server{[&](const TestServer::Request& req) {
+        const bool first = ++requests == 1;
+        auto res = serveFile(req, (change && !first) ? changed : original,
+                             (change && !first) ? "\"v2\"" : "\"v1\"");
+        if (first) {
+            res.truncate = true;
+            res.truncate_at = cut;
+        }
+        return res;
+    }};
+
+    for(const bool changes : {false, true}) {
+        change = changes;
+        requests = 0;
+        TmpFile tmpfile;
+        restincurl::Client client;
+        const auto before = server.GetNumRequests();
+
+        DownloadOptions options;
+        options.segments = 1;
+
+        std::promise<Result> done;
+        client.Build()->Get(server.Url("/file"))
+            .DownloadToFile(tmpfile.Name(), options)
+            .WithCompletion([&](const Result& result) {
+                done.set_value(result);
+            })
+            .Execute();
+
+        const auto result = done.get_future().get();
+        EXPECT(result.curl_code == CURLE_OK);
+        EXPECT(readFile(tmpfile.Name()) == (changes ? changed : original));
+
+        // The second request continues where the first one was interrupted
+        const auto sent = server.GetRequests();
+        EXPECT(sent.size() == before + 2);
+        EXPECT(!sent[before].HasHeader("range"));
+        EXPECT(sent[before + 1].Header("range") == "bytes=" + std::to_string(cut) + "-");
+        EXPECT(sent[before + 1].Header("if-range") == "\"v1\"");
+
+        const auto stats = client.GetStats();
+        EXPECT(stats.downloads_resumed == (changes ? 0U : 1U));
+        EXPECT(stats.download_bytes_saved == (changes ? 0U : cut));
+
+        client.CloseWhenFinished();
+        client.WaitForFinish();
+    }
+} ENDCASE
+
+STARTCASE(TestDownloadDeadline)
+{
+    const auto content = makeContent(64 * 1024);
+    TestServer server{[&](const TestServer::Request& req) {
+        auto res = serveFile(req, content, "\"v1\"");
+        res.delay = std::chrono::milliseconds(3000);
+        return res;
+    }};
+
+    for(const bool async : {true, false}) {
+        TmpFile tmpfile;
+        restincurl::Client client;
+
+        std::promise<Result> done;
+        const auto start = std::chrono::steady_clock::now();
+        auto builder = client.Build();
+        builder->Get(server.Url("/file"))
+            .DownloadToFile(tmpfile.Name())
+            .Deadline(std::chrono::milliseconds(300))
+            .WithCompletion([&](const Result& result) {
+                done.set_value(result);
+            });
+        if (async) {
+            builder->Execute();
+        } else {
+            builder->ExecuteSynchronous();
+        }
+        const auto result = done.get_future().get();
+
+        // The server would answer after 3 seconds
+        EXPECT(!result.isOk());
+        EXPECT(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(2000));
+
+        client.CloseWhenFinished();
+        client.WaitForFinish();
+    }
+} ENDCASE
+
+#ifdef RESTINCURL_WITH_ZLIB
+STARTCASE(TestResumeDownloadWithCompression)
+{
+    // Text, so that the gzip representation is much smaller than the resource
+    std::string original;
+    for(int i = 0; original.size() < 128 * 1024; ++i) {
+        original += "Line " + std::to_string(i) + " of a file that compresses well\n";
+    }
+    const auto gzipped = gzipBody(original);
+    EXPECT(gzipped.size() < original.size() / 2);
+
+    // The first response is interrupted halfway
+    std::atomic<int> requests{0};
+    TestServer server{[&](const TestServer::Request& req) {
+        const bool first = ++requests == 1;
+        TestServer::Response res;
+        if (req.Header("accept-encoding").find("gzip") != std::string::npos) {
+            res = serveFile(req, gzipped, "\"v1-gzip\"");
+            res.headers.emplace_back("Content-Encoding", "gzip");
+        } else {
+            res = serveFile(req, original, "\"v1\"");
+        }
+        if (first) {
+            res.truncate = true;
+            res.truncate_at = res.body.size() / 2;
+        }
+        return res;
+    }};
+
+    TmpFile tmpfile;
+    restincurl::Client client;
+    client.AcceptCompressed();
+
+    DownloadOptions options;
+    options.segments = 1;
+
+    std::promise<Result> done;
+    client.Build()->Get(server.Url("/file"))
+        .DownloadToFile(tmpfile.Name(), options)
+        .WithCompletion([&](const Result& result) {
+            done.set_value(result);
+        })
+        .Execute();
+
+    const auto result = done.get_future().get();
+    EXPECT(result.curl_code == CURLE_OK);
+    EXPECT(result.http_response_code == 206);
+    EXPECT(readFile(tmpfile.Name()) == original);
+
+    // The byte offsets must be in the resource, so it is not requested compressed
+    const auto sent = server.GetRequests();
+    EXPECT(sent.size() == 2U);
+    for(const auto& req : sent) {
+        EXPECT(!req.HasHeader("accept-encoding"));
+    }
+    EXPECT(sent.back().Header("range") == "bytes=" + std::to_string(original.size() / 2) + "-");
+
+    client.CloseWhenFinished();
+    client.WaitForFinish();
+} ENDCASE
+#endif
 
 }; //lest
 